@@ -1,30 +1,2279 @@
+#include <inttypes.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_idf_lib_helpers.h>
+#if HELPER_TARGET_IS_ESP32
+#include <esp_rom_sys.h>
+#endif
 #include "bq27427.h"
-
-static esp_err_t read_control_word(i2c_dev_t *dev, uint16_t *function, uint16_t *data);
+#ifdef CONFIG_BQ27427_TRACE
+#include "bq27427_trace.h"
+#endif
 
 static const char *TAG = "bq27427";
 
-#define I2C_FREQ_HZ 400000 
+#define I2C_FREQ_HZ 400000
+#define BQ27427_LATEST_RETRIES 4
+#define BUS_RECOVERY_CLOCKS 9
+#define BUS_RECOVERY_HALF_PERIOD_US 5
+#define BUS_SPACING_US 66 // Idle time the gauge needs between packets at 400 kHz
 
 #define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
 #define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
 
-esp_err_t bq27427_init_desc(i2c_dev_t *dev, i2c_port_t port, gpio_num_t sda_gpio, gpio_num_t scl_gpio);
+/*
+ * Location of each snapshot field in the standard command block, indexed by
+ * bit position in bq27427_field_t. Sorted by register address.
+ */
+static const uint8_t snapshot_regs[BQ27427_FIELD_COUNT] = {
+    BQ27427_COMMAND_TEMP,
+    BQ27427_COMMAND_VOLTAGE,
+    BQ27427_COMMAND_FLAGS,
+    BQ27427_COMMAND_NOM_CAPACITY,
+    BQ27427_COMMAND_AVAIL_CAPACITY,
+    BQ27427_COMMAND_REM_CAPACITY,
+    BQ27427_COMMAND_FULL_CAPACITY,
+    BQ27427_COMMAND_AVG_CURRENT,
+    BQ27427_COMMAND_STDBY_CURRENT,
+    BQ27427_COMMAND_MAX_CURRENT,
+    BQ27427_COMMAND_AVG_POWER,
+    BQ27427_COMMAND_SOC,
+    BQ27427_COMMAND_INT_TEMP,
+    BQ27427_COMMAND_SOH,
+    BQ27427_COMMAND_REM_CAP_UNFL,
+    BQ27427_COMMAND_REM_CAP_FIL,
+    BQ27427_COMMAND_FULL_CAP_UNFL,
+    BQ27427_COMMAND_FULL_CAP_FIL,
+    BQ27427_COMMAND_SOC_UNFL,
+};
+
+static inline uint16_t get_le16(const uint8_t *buf)
 {
-    CHECK_ARG(dev);
+    return (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
+}
+
+/*
+ * Latest-value cache. Writers hold the device mutex, so there is one writer at
+ * a time; readers take no lock and retry while seq is odd or has changed.
+ */
+static void latest_begin(bq27427_latest_t *latest)
+{
+    __atomic_store_n(&latest->seq, latest->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void latest_end(bq27427_latest_t *latest)
+{
+    __atomic_store_n(&latest->seq, latest->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Store the fields present in a standard command block image
+static void latest_store(bq27427_t *dev, uint32_t fields, const uint8_t *buf, int64_t stamp)
+{
+    bq27427_latest_t *latest = &dev->latest;
+
+    latest_begin(latest);
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++) {
+        if (!(fields & (1 << i)))
+            continue;
+        uint8_t pos = snapshot_regs[i] - BQ27427_SNAPSHOT_FIRST_REG;
+        memcpy(latest->regs + pos, buf + pos, 2);
+        latest->stamp[i] = stamp;
+    }
+    latest->fields |= fields;
+    latest_end(latest);
+}
+
+// Store a single standard command if it is a snapshot field
+static void latest_store_word(bq27427_t *dev, uint8_t cmd, const uint8_t *word, int64_t stamp)
+{
+    bq27427_latest_t *latest = &dev->latest;
+
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++) {
+        if (snapshot_regs[i] != cmd)
+            continue;
+        latest_begin(latest);
+        memcpy(latest->regs + cmd - BQ27427_SNAPSHOT_FIRST_REG, word, 2);
+        latest->stamp[i] = stamp;
+        latest->fields |= 1 << i;
+        latest_end(latest);
+        return;
+    }
+}
+
+/*
+ * Copy the cache without locking. Gives up after a few attempts rather than
+ * spinning on a writer that may be preempted on this core; the caller then
+ * falls back to the bus, which waits for that writer on the mutex.
+ */
+static bool latest_load(bq27427_t *dev, bq27427_latest_t *copy)
+{
+    bq27427_latest_t *latest = &dev->latest;
+
+    for (int attempt = 0; attempt < BQ27427_LATEST_RETRIES; attempt++) {
+        uint32_t seq = __atomic_load_n(&latest->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(copy, latest, sizeof(bq27427_latest_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&latest->seq, __ATOMIC_RELAXED) == seq)
+            return true;
+    }
+
+    return false;
+}
+
+#ifdef CONFIG_BQ27427_STATS
+static const uint16_t stats_subcommands[BQ27427_STATS_SUBCOMMANDS] = {
+    BQ27427_CONTROL_STATUS, BQ27427_CONTROL_DEVICE_TYPE, BQ27427_CONTROL_FW_VERSION, BQ27427_CONTROL_DM_CODE,
+    BQ27427_CONTROL_PREV_MACWRITE, BQ27427_CONTROL_CHEM_ID, BQ27427_CONTROL_SET_CFGUPDATE, BQ27427_CONTROL_SEALED,
+    BQ27427_CONTROL_PULSE_SOC_INT, BQ27427_CONTROL_CHEM_A, BQ27427_CONTROL_CHEM_B, BQ27427_CONTROL_CHEM_C,
+    BQ27427_CONTROL_RESET, BQ27427_CONTROL_SOFT_RESET, BQ27427_UNSEAL_KEY, BQ27427_STATS_OTHER,
+};
+
+static void stats_reset(bq27427_t *dev)
+{
+    memset(&dev->stats, 0, sizeof(bq27427_stats_t));
+    for (int i = 0; i < BQ27427_STATS_SUBCOMMANDS; i++)
+        dev->stats.subcommands[i].subcommand = stats_subcommands[i];
+    dev->stats.since_us = esp_timer_get_time();
+}
+
+static void stats_record(bq27427_histogram_t *h, int64_t start)
+{
+    int64_t elapsed = esp_timer_get_time() - start;
+    uint32_t us = elapsed < 0 ? 0 : elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+    int bucket = us < 64 ? 0 : 26 - __builtin_clz(us);
+
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+    h->buckets[bucket < BQ27427_STATS_BUCKETS ? bucket : BQ27427_STATS_BUCKETS - 1]++;
+}
+
+static void stats_transfer(bq27427_t *dev, uint8_t cmd, int64_t start, esp_err_t err)
+{
+    stats_record(&dev->stats.commands[cmd / 2 < BQ27427_STATS_COMMANDS ? cmd / 2 : BQ27427_STATS_COMMANDS - 1], start);
+    if (err == ESP_FAIL)
+        dev->stats.nacks++;
+    else if (err == ESP_ERR_TIMEOUT)
+        dev->stats.timeouts++;
+    else if (err != ESP_OK)
+        dev->stats.errors++;
+}
+
+static void stats_subcommand(bq27427_t *dev, uint16_t function, int64_t start)
+{
+    int i = 0;
+
+    while (i < BQ27427_STATS_SUBCOMMANDS - 1 && stats_subcommands[i] != function)
+        i++;
+    stats_record(&dev->stats.subcommands[i].latency, start);
+}
+
+#endif
+
+static esp_err_t take_mutex(bq27427_t *dev)
+{
+#ifdef CONFIG_BQ27427_STATS
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = i2c_dev_take_mutex(&dev->i2c_dev);
+    if (err == ESP_OK)
+        stats_record(&dev->stats.mutex_wait, start);
+    return err;
+#else
+    return i2c_dev_take_mutex(&dev->i2c_dev);
+#endif
+}
+
+#define TAKE_MUTEX(dev) CHECK(take_mutex(dev))
+
+/*
+ * Sequences that span several steps (configuration sessions, image
+ * transfers, seal state changes) hold seq_lock from start to end, and the
+ * device mutex only while a step runs: yield_bus() hands the mutex over
+ * between steps and during gauge-side waits. Single-step calls take only
+ * the mutex, so they wait for at most one step of a sequence.
+ */
+#define TAKE_SEQUENCE(dev) do { \
+        xSemaphoreTake((dev)->seq_lock, portMAX_DELAY); \
+        esp_err_t ____ = take_mutex(dev); \
+        if (____ != ESP_OK) { \
+            xSemaphoreGive((dev)->seq_lock); \
+            return ____; \
+        } \
+    } while (0)
+
+#define GIVE_SEQUENCE(dev) do { \
+        if (!(dev)->bus_lost) \
+            i2c_dev_give_mutex(&(dev)->i2c_dev); \
+        (dev)->bus_lost = false; \
+        xSemaphoreGive((dev)->seq_lock); \
+    } while (0)
+
+#define SEQUENCE_CHECK(dev, X) do { \
+        esp_err_t ___ = X; \
+        if (___ != ESP_OK) { \
+            GIVE_SEQUENCE(dev); \
+            return ___; \
+        } \
+    } while (0)
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+/*
+ * Let other users of the gauge in between two steps of a sequence, sleeping
+ * for delay ticks if the gauge needs time. A waiting task of higher or equal
+ * priority gets the mutex; with none waiting this costs a give and a take.
+ * Caller must hold seq_lock and the mutex, and must not keep pointers into
+ * the data memory cache across the call. If the mutex cannot be taken back,
+ * bus_lost is set: the sequence must end without another transfer, and
+ * GIVE_SEQUENCE() then releases seq_lock alone.
+ */
+static esp_err_t yield_bus(bq27427_t *dev, TickType_t delay)
+{
+    i2c_dev_give_mutex(&dev->i2c_dev);
+    if (delay)
+        vTaskDelay(delay);
+    else
+        taskYIELD();
+    esp_err_t err = take_mutex(dev);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Could not take the bus back in a sequence: %d (%s)", err, esp_err_to_name(err));
+        dev->bus_lost = true;
+    }
+    return err;
+}
+#endif
+
+// Forget everything cached about the gauge. Caller must hold the mutex.
+static void drop_state(bq27427_t *dev)
+{
+    dev->unsealed = false;
+    dev->selected = false;
+#ifdef CONFIG_BQ27427_DM_ACCESS
+    for (int i = 0; i < CONFIG_BQ27427_DM_CACHE_BLOCKS; i++)
+        dev->dm_cache[i].valid = false;
+#endif
+}
+
+// One attempt of a transfer. Caller must hold the mutex.
+static esp_err_t bus_attempt(bq27427_t *dev, uint8_t cmd, void *data, size_t len, bool write)
+{
+#if defined(CONFIG_BQ27427_STATS) || defined(CONFIG_BQ27427_TRACE)
+    int64_t start = esp_timer_get_time();
+#endif
+    esp_err_t err = write
+        ? i2c_dev_write_reg(&dev->i2c_dev, cmd, data, len)
+        : i2c_dev_read_reg(&dev->i2c_dev, cmd, data, len);
+#ifdef CONFIG_BQ27427_STATS
+    stats_transfer(dev, cmd, start, err);
+#endif
+#ifdef CONFIG_BQ27427_TRACE
+    if (dev->trace)
+        bq27427_trace_record(dev->trace, cmd, data, len, write, err, start, esp_timer_get_time() - start);
+#endif
+    return err;
+}
 
-    dev->port = port;
-    dev->addr = BQ27427_I2C_ADDRESS;
-    dev->cfg.sda_io_num = sda_gpio;
-    dev->cfg.scl_io_num = scl_gpio;
+/*
+ * A slave that missed clocks in the middle of a read can hold SDA low until
+ * it sees enough of them. Clock SCL until SDA is released, issue a STOP and
+ * hand the pins back to the I2C controller. Caller must hold the mutex, and
+ * no other device on the port may be in a transfer.
+ */
+static esp_err_t bus_recover(bq27427_t *dev)
+{
 #if HELPER_TARGET_IS_ESP32
-    dev->cfg.master.clk_speed = I2C_FREQ_HZ;
+    gpio_num_t sda = dev->i2c_dev.cfg.sda_io_num;
+    gpio_num_t scl = dev->i2c_dev.cfg.scl_io_num;
+
+    if (gpio_get_level(sda))
+        return ESP_OK;
+    ESP_LOGW(TAG, "SDA held low, clocking SCL");
+    gpio_set_level(sda, 1);
+    gpio_set_level(scl, 1);
+    gpio_set_direction(sda, GPIO_MODE_INPUT_OUTPUT_OD);
+    gpio_set_direction(scl, GPIO_MODE_INPUT_OUTPUT_OD);
+    for (int i = 0; i < BUS_RECOVERY_CLOCKS && !gpio_get_level(sda); i++) {
+        gpio_set_level(scl, 0);
+        esp_rom_delay_us(BUS_RECOVERY_HALF_PERIOD_US);
+        gpio_set_level(scl, 1);
+        esp_rom_delay_us(BUS_RECOVERY_HALF_PERIOD_US);
+    }
+    // STOP: SDA rises while SCL is high
+    gpio_set_level(scl, 0);
+    gpio_set_level(sda, 0);
+    esp_rom_delay_us(BUS_RECOVERY_HALF_PERIOD_US);
+    gpio_set_level(scl, 1);
+    esp_rom_delay_us(BUS_RECOVERY_HALF_PERIOD_US);
+    gpio_set_level(sda, 1);
+    esp_rom_delay_us(BUS_RECOVERY_HALF_PERIOD_US);
+    bool released = gpio_get_level(sda);
+    i2c_set_pin(dev->i2c_dev.port, sda, scl, dev->i2c_dev.cfg.sda_pullup_en, dev->i2c_dev.cfg.scl_pullup_en,
+                I2C_MODE_MASTER);
+#ifdef CONFIG_BQ27427_STATS
+    dev->stats.bus_recoveries++;
+#endif
+
+    return released ? ESP_OK : ESP_FAIL;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
 #endif
-    return i2c_dev_create_mutex(dev);
 }
 
-esp_err_t bq27427_get_device_type(i2c_dev_t *dev, uint16_t *dev_type)
+// While offline, let a call through every probe_interval_ms if CONTROL_DEVICE_TYPE answers
+static esp_err_t bus_probe(bq27427_t *dev)
 {
-    CHECK_ARG(dev);
+    uint8_t cmd[2] = { BQ27427_CONTROL_DEVICE_TYPE, 0 };
+    uint8_t buf[2];
+    int64_t now = esp_timer_get_time();
+
+    if (now < dev->probe_at)
+        return ESP_ERR_INVALID_STATE;
+    dev->probe_at = now + (int64_t)dev->recovery.probe_interval_ms * 1000;
+    if (bus_attempt(dev, BQ27427_COMMAND_CONTROL, cmd, sizeof(cmd), true) != ESP_OK
+            || bus_attempt(dev, BQ27427_COMMAND_CONTROL, buf, sizeof(buf), false) != ESP_OK)
+        return ESP_ERR_INVALID_STATE;
+
+    ESP_LOGI(TAG, "Gauge back online");
+    dev->offline = false;
+    dev->failures = 0;
+    // It may have been reset or replaced while it was away
+    drop_state(dev);
+
+    return ESP_OK;
+}
+
+// Every transfer to the gauge goes through here. Caller must hold the mutex.
+static esp_err_t bus_transfer(bq27427_t *dev, uint8_t cmd, void *data, size_t len, bool write)
+{
+    const bq27427_recovery_t *policy = &dev->recovery;
+    uint32_t backoff = policy->backoff_ms;
+    esp_err_t err;
+
+    if (dev->offline)
+        CHECK(bus_probe(dev));
+    for (int attempt = 0;; attempt++) {
+        err = bus_attempt(dev, cmd, data, len, write);
+        if (err == ESP_OK) {
+            dev->failures = 0;
+            return ESP_OK;
+        }
+        // Only a NACK or a timeout may go away by itself
+        if (err != ESP_FAIL && err != ESP_ERR_TIMEOUT)
+            return err;
+        if (attempt >= policy->retries)
+            break;
+#ifdef CONFIG_BQ27427_STATS
+        dev->stats.retries++;
+#endif
+        if (backoff)
+            vTaskDelay(pdMS_TO_TICKS(backoff));
+        backoff *= 2;
+        if (policy->max_backoff_ms && backoff > policy->max_backoff_ms)
+            backoff = policy->max_backoff_ms;
+    }
+
+    if (policy->offline_after && ++dev->failures >= policy->offline_after) {
+        ESP_LOGW(TAG, "Gauge offline after %u failed transfers", dev->failures);
+        dev->offline = true;
+        dev->probe_at = esp_timer_get_time() + (int64_t)policy->probe_interval_ms * 1000;
+    }
+
+    return err;
+}
+
+static inline esp_err_t bus_read(bq27427_t *dev, uint8_t cmd, void *data, size_t len)
+{
+    return bus_transfer(dev, cmd, data, len, false);
+}
+
+static inline esp_err_t bus_write(bq27427_t *dev, uint8_t cmd, const void *data, size_t len)
+{
+    return bus_transfer(dev, cmd, (void *)data, len, true);
+}
+
+// Idle the bus for the minimum the gauge needs before the next packet
+static inline void bus_spacing(void)
+{
+#if HELPER_TARGET_IS_ESP32
+    esp_rom_delay_us(BUS_SPACING_US);
+#endif
+}
+
+// Standard commands return little-endian words. Caller must hold the mutex.
+static esp_err_t read_word(bq27427_t *dev, uint8_t cmd, uint16_t *data)
+{
+    uint8_t buf[2];
+
+    int64_t stamp = esp_timer_get_time();
+    CHECK(bus_read(dev, cmd, buf, sizeof(buf)));
+    latest_store_word(dev, cmd, buf, stamp);
+    *data = get_le16(buf);
+    return ESP_OK;
+}
+
+// Issue a Control() subcommand and read back its result. Caller must hold the mutex.
+static esp_err_t read_control_word(bq27427_t *dev, uint16_t function, uint16_t *data)
+{
+    uint8_t cmd[2] = { function & 0xff, function >> 8 };
+#ifdef CONFIG_BQ27427_STATS
+    int64_t start = esp_timer_get_time();
+#endif
+
+    CHECK(bus_write(dev, BQ27427_COMMAND_CONTROL, cmd, sizeof(cmd)));
+    bus_spacing();
+    esp_err_t err = read_word(dev, BQ27427_COMMAND_CONTROL, data);
+#ifdef CONFIG_BQ27427_STATS
+    stats_subcommand(dev, function, start);
+#endif
+    return err;
+}
+
+static esp_err_t get_word(bq27427_t *dev, uint8_t cmd, uint16_t *data)
+{
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_word(dev, cmd, data));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+static esp_err_t get_control_word(bq27427_t *dev, uint16_t function, uint16_t *data)
+{
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_control_word(dev, function, data));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+static esp_err_t write_control_word(bq27427_t *dev, uint16_t function)
+{
+    uint8_t cmd[2] = { function & 0xff, function >> 8 };
+#ifdef CONFIG_BQ27427_STATS
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = bus_write(dev, BQ27427_COMMAND_CONTROL, cmd, sizeof(cmd));
+    stats_subcommand(dev, function, start);
+    return err;
+#else
+    return bus_write(dev, BQ27427_COMMAND_CONTROL, cmd, sizeof(cmd));
+#endif
+}
+
+static inline esp_err_t read_byte(bq27427_t *dev, uint8_t cmd, uint8_t *data)
+{
+    return bus_read(dev, cmd, data, 1);
+}
+
+static inline esp_err_t write_byte(bq27427_t *dev, uint8_t cmd, uint8_t data)
+{
+    return bus_write(dev, cmd, &data, 1);
+}
+
+/*
+ * ITPOR is raised when the gauge reloads its data memory defaults, which
+ * invalidates every cached block. It stays set until the gauge is configured,
+ * so only its rising edge drops the cache. Caller must hold the mutex.
+ */
+static void observe_flags(bq27427_t *dev, uint16_t flags)
+{
+    bool itpor = flags & BQ27427_FLAG_ITPOR;
+
+    if (itpor && !dev->itpor) {
+        ESP_LOGD(TAG, "ITPOR set, dropping data memory cache");
+        drop_state(dev);
+    }
+    dev->itpor = itpor;
+}
+
+static esp_err_t read_flags(bq27427_t *dev, uint16_t *flags)
+{
+    CHECK(read_word(dev, BQ27427_COMMAND_FLAGS, flags));
+    observe_flags(dev, *flags);
+
+    return ESP_OK;
+}
 
+static esp_err_t unseal(bq27427_t *dev)
+{
+    // The key has to be written twice in a row
+    CHECK(write_control_word(dev, BQ27427_UNSEAL_KEY));
+    CHECK(write_control_word(dev, BQ27427_UNSEAL_KEY));
+    dev->unsealed = true;
+
+    return ESP_OK;
+}
+
+static esp_err_t seal(bq27427_t *dev)
+{
+    dev->unsealed = false;
+    dev->selected = false;
+
+    return write_control_word(dev, BQ27427_CONTROL_SEALED);
+}
+
+/*
+ * Make data memory accessible. If the gauge had to be unsealed for this
+ * access only, *reseal is set and dm_close() seals it again.
+ * Caller must hold the mutex.
+ */
+static esp_err_t dm_open(bq27427_t *dev, bool *reseal)
+{
+    *reseal = false;
+    if (dev->unsealed)
+        return ESP_OK;
+
+    uint16_t status;
+    CHECK(read_control_word(dev, BQ27427_CONTROL_STATUS, &status));
+    if (!(status & BQ27427_STATUS_SS)) {
+        dev->unsealed = true;
+        return ESP_OK;
+    }
+    CHECK(unseal(dev));
+    *reseal = true;
+
+    return ESP_OK;
+}
+
+#ifdef CONFIG_BQ27427_DM_ACCESS
+static esp_err_t dm_close(bq27427_t *dev, bool reseal, esp_err_t err)
+{
+    // Without the mutex the gauge stays unsealed, as after a failed seal()
+    if (!reseal || dev->bus_lost)
+        return err;
+
+    esp_err_t r = seal(dev);
+    return err != ESP_OK ? err : r;
+}
+
+/*
+ * Make the gauge copy a block into BlockData(). BlockDataControl() and
+ * DataClass() are only written if no block of this session selected them
+ * already. Caller must hold the mutex.
+ */
+static esp_err_t load_block(bq27427_t *dev, uint8_t class_id, uint8_t block)
+{
+    bool enabled = dev->selected;
+
+    dev->selected = false;
+    if (!enabled)
+        CHECK(write_byte(dev, BQ27427_EXTENDED_CONTROL, 0x00));
+    if (!enabled || dev->sel_class != class_id)
+        CHECK(write_byte(dev, BQ27427_EXTENDED_DATACLASS, class_id));
+    CHECK(write_byte(dev, BQ27427_EXTENDED_DATABLOCK, block));
+    dev->sel_class = class_id;
+    dev->sel_block = block;
+    dev->selected = true;
+
+    return ESP_OK;
+}
+
+// Point BlockData() at a block unless it is already selected. Caller must hold the mutex.
+static esp_err_t select_block(bq27427_t *dev, uint8_t class_id, uint8_t block)
+{
+    if (dev->selected && dev->sel_class == class_id && dev->sel_block == block)
+        return ESP_OK;
+
+    return load_block(dev, class_id, block);
+}
+
+static uint8_t block_checksum(const uint8_t *data)
+{
+    uint8_t sum = 0;
+
+    for (int i = 0; i < BQ27427_DM_BLOCK_SIZE; i++)
+        sum += data[i];
+
+    return 0xff - sum;
+}
+
+static bq27427_dm_block_t *cache_lookup(bq27427_t *dev, uint8_t class_id, uint8_t block)
+{
+    for (int i = 0; i < CONFIG_BQ27427_DM_CACHE_BLOCKS; i++) {
+        bq27427_dm_block_t *e = &dev->dm_cache[i];
+        if (e->valid && e->class_id == class_id && e->block == block)
+            return e;
+    }
+
+    return NULL;
+}
+
+// Pick a free entry or the least recently used one
+static bq27427_dm_block_t *cache_victim(bq27427_t *dev)
+{
+    bq27427_dm_block_t *victim = &dev->dm_cache[0];
+
+    for (int i = 0; i < CONFIG_BQ27427_DM_CACHE_BLOCKS; i++) {
+        bq27427_dm_block_t *e = &dev->dm_cache[i];
+        if (!e->valid)
+            return e;
+        if (e->last_used < victim->last_used)
+            victim = e;
+    }
+
+    return victim;
+}
+
+/*
+ * Return a current copy of a data memory block. A cached copy is confirmed
+ * by reading BlockDataCheckSum() alone; otherwise the whole block is read
+ * and verified. Data memory must be open and the mutex held.
+ */
+static esp_err_t dm_get_block(bq27427_t *dev, uint8_t class_id, uint8_t block, bq27427_dm_block_t **out)
+{
+    bq27427_dm_block_t *e = cache_lookup(dev, class_id, block);
+    uint8_t checksum;
+
+    if (e) {
+        // Reload even a selected block, BlockData() is a copy taken at selection
+        CHECK(load_block(dev, class_id, block));
+        CHECK(read_byte(dev, BQ27427_EXTENDED_CHECKSUM, &checksum));
+        if (checksum == e->checksum) {
+            e->last_used = ++dev->dm_stamp;
+            *out = e;
+            return ESP_OK;
+        }
+        ESP_LOGD(TAG, "Cached block %d/%d is stale", class_id, block);
+    } else {
+        CHECK(select_block(dev, class_id, block));
+        e = cache_victim(dev);
+    }
+
+    e->valid = false;
+    CHECK(bus_read(dev, BQ27427_EXTENDED_BLOCKDATA, e->data, BQ27427_DM_BLOCK_SIZE));
+    CHECK(read_byte(dev, BQ27427_EXTENDED_CHECKSUM, &checksum));
+    if (block_checksum(e->data) != checksum) {
+        ESP_LOGE(TAG, "Checksum mismatch in block %d/%d", class_id, block);
+        return ESP_ERR_INVALID_CRC;
+    }
+    e->class_id = class_id;
+    e->block = block;
+    e->checksum = checksum;
+    e->last_used = ++dev->dm_stamp;
+    e->valid = true;
+    *out = e;
+
+    return ESP_OK;
+}
+
+// Caller must hold the mutex
+static esp_err_t read_dm(bq27427_t *dev, uint8_t class_id, uint8_t offset, uint8_t *data, uint8_t len)
+{
+    bq27427_dm_block_t *e;
+    bool reseal;
+
+    CHECK(dm_open(dev, &reseal));
+    esp_err_t err = dm_get_block(dev, class_id, offset / BQ27427_DM_BLOCK_SIZE, &e);
+    if (err == ESP_OK)
+        memcpy(data, e->data + offset % BQ27427_DM_BLOCK_SIZE, len);
+
+    return dm_close(dev, reseal, err);
+}
+
+// Caller must hold the mutex
+static esp_err_t read_dm_checksum(bq27427_t *dev, uint8_t class_id, uint8_t block, uint8_t *checksum)
+{
+    bool reseal;
+
+    CHECK(dm_open(dev, &reseal));
+    // Reload even a selected block: BlockData() is a copy taken at selection
+    esp_err_t err = load_block(dev, class_id, block);
+    if (err == ESP_OK)
+        err = read_byte(dev, BQ27427_EXTENDED_CHECKSUM, checksum);
+
+    return dm_close(dev, reseal, err);
+}
+
+static esp_err_t get_dm_u8(bq27427_t *dev, uint8_t class_id, uint8_t offset, uint8_t *value)
+{
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_dm(dev, class_id, offset, value, 1));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+static esp_err_t get_dm_u16(bq27427_t *dev, uint8_t class_id, uint8_t offset, uint16_t *value)
+{
+    uint8_t buf[2];
+
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_dm(dev, class_id, offset, buf, sizeof(buf)));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    // Data memory is big-endian
+    *value = ((uint16_t)buf[0] << 8) | buf[1];
+
+    return ESP_OK;
+}
+#endif
+
+static esp_err_t get_flag(bq27427_t *dev, uint16_t mask, bool *out)
+{
+    uint16_t flags;
+
+    CHECK(bq27427_get_flags(dev, &flags));
+    *out = flags & mask;
+
+    return ESP_OK;
+}
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+// Poll Flags() until CFGUPMODE reaches the wanted state. Caller must run a sequence.
+static esp_err_t poll_cfgupmode(bq27427_t *dev, bool set)
+{
+    TickType_t start = xTaskGetTickCount();
+    uint32_t timeout = dev->recovery.cfgupmode_timeout_ms ? dev->recovery.cfgupmode_timeout_ms : BQ72441_I2C_TIMEOUT;
+    uint16_t flags;
+
+    for (;;) {
+        CHECK(read_flags(dev, &flags));
+        if (!!(flags & BQ27427_FLAG_CFGUPMODE) == set)
+            return ESP_OK;
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(timeout)) {
+            ESP_LOGE(TAG, "Timeout waiting for CFGUPMODE to %s", set ? "set" : "clear");
+            return ESP_ERR_TIMEOUT;
+        }
+        CHECK(yield_bus(dev, pdMS_TO_TICKS(BQ27427_CFGUPMODE_POLL_MS)));
+    }
+}
+
+static esp_err_t wait_cfgupmode(bq27427_t *dev, bool set)
+{
+#ifdef CONFIG_BQ27427_STATS
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = poll_cfgupmode(dev, set);
+    stats_record(&dev->stats.cfgupmode_wait, start);
+    return err;
+#else
+    return poll_cfgupmode(dev, set);
+#endif
+}
+
+// Caller must hold the mutex
+static esp_err_t enter_config(bq27427_t *dev)
+{
+    uint16_t flags;
+
+    if (dev->cfgupdate)
+        return ESP_OK;
+
+    // Catch a pending ITPOR edge before the unsealed state is recorded
+    CHECK(read_flags(dev, &flags));
+    CHECK(dm_open(dev, &dev->reseal));
+    CHECK(write_control_word(dev, BQ27427_CONTROL_SET_CFGUPDATE));
+    CHECK(wait_cfgupmode(dev, true));
+    dev->cfgupdate = true;
+
+    return ESP_OK;
+}
+
+// Caller must hold the mutex
+static esp_err_t exit_config(bq27427_t *dev)
+{
+    if (!dev->cfgupdate)
+        return ESP_OK;
+    // Left in CFGUPDATE; the next sequence finds dev->cfgupdate still set
+    if (dev->bus_lost)
+        return ESP_ERR_INVALID_STATE;
+
+    CHECK(write_control_word(dev, BQ27427_CONTROL_SOFT_RESET));
+    dev->selected = false;
+    CHECK(wait_cfgupmode(dev, false));
+    dev->cfgupdate = false;
+
+    bool reseal = dev->reseal;
+    dev->reseal = false;
+    return dm_close(dev, reseal, ESP_OK);
+}
+
+/*
+ * Apply the staged items that live in one data memory block. Only runs of
+ * bytes that differ are written, and the block checksum is adjusted by the
+ * difference of each changed byte. Caller must be in CFGUPDATE mode.
+ */
+static esp_err_t config_apply_block(bq27427_t *dev, const bq27427_config_t *cfg, uint8_t class_id, uint8_t block)
+{
+    bq27427_dm_block_t *e;
+    uint8_t data[BQ27427_DM_BLOCK_SIZE];
+
+    CHECK(dm_get_block(dev, class_id, block, &e));
+    memcpy(data, e->data, sizeof(data));
+    for (int i = 0; i < cfg->count; i++) {
+        const bq27427_config_item_t *item = &cfg->items[i];
+        if (item->class_id != class_id || item->offset / BQ27427_DM_BLOCK_SIZE != block)
+            continue;
+        for (int j = 0; j < item->len; j++) {
+            uint8_t *b = &data[item->offset % BQ27427_DM_BLOCK_SIZE + j];
+            *b = (*b & ~item->mask[j]) | (item->value[j] & item->mask[j]);
+        }
+    }
+
+    uint8_t checksum = e->checksum;
+    bool changed = false;
+    for (int start = 0; start < BQ27427_DM_BLOCK_SIZE;) {
+        if (data[start] == e->data[start]) {
+            start++;
+            continue;
+        }
+        int end = start;
+        while (end < BQ27427_DM_BLOCK_SIZE && data[end] != e->data[end]) {
+            checksum -= data[end] - e->data[end];
+            end++;
+        }
+        CHECK(bus_write(dev, BQ27427_EXTENDED_BLOCKDATA + start, data + start, end - start));
+        changed = true;
+        start = end;
+    }
+    if (!changed)
+        return ESP_OK;
+
+    // Writing the checksum commits the block
+    e->valid = false;
+    CHECK(write_byte(dev, BQ27427_EXTENDED_CHECKSUM, checksum));
+    memcpy(e->data, data, sizeof(data));
+    e->checksum = checksum;
+    e->valid = true;
+    ESP_LOGD(TAG, "Block %d/%d updated", class_id, block);
+
+    return ESP_OK;
+}
+
+// True if a staged item differs from its cached block
+static bool config_item_pending(bq27427_t *dev, const bq27427_config_item_t *item)
+{
+    bq27427_dm_block_t *e = cache_lookup(dev, item->class_id, item->offset / BQ27427_DM_BLOCK_SIZE);
+
+    if (!e)
+        return true;
+    for (int j = 0; j < item->len; j++) {
+        uint8_t cur = e->data[item->offset % BQ27427_DM_BLOCK_SIZE + j];
+        if ((cur & item->mask[j]) != (item->value[j] & item->mask[j]))
+            return true;
+    }
+
+    return false;
+}
+
+// CONTROL_CHEM_ID result of a CHEM_A/B/C subcommand
+static uint16_t chem_result(uint16_t subcommand)
+{
+    switch (subcommand) {
+        case BQ27427_CONTROL_CHEM_A:
+            return BQ27427_CHEM_ID_A;
+        case BQ27427_CONTROL_CHEM_B:
+            return BQ27427_CHEM_ID_B;
+        default:
+            return BQ27427_CHEM_ID_C;
+    }
+}
+
+// Caller must hold the mutex
+static esp_err_t config_commit(bq27427_t *dev, const bq27427_config_t *cfg)
+{
+    bool reseal, chem_pending = false;
+
+    // CHEM_ID reads back sealed, so a matching chemistry costs no unseal
+    if (cfg->chem_id) {
+        uint16_t chem_id;
+        CHECK(read_control_word(dev, BQ27427_CONTROL_CHEM_ID, &chem_id));
+        chem_pending = chem_id != chem_result(cfg->chem_id);
+    }
+    if (!chem_pending && !cfg->count)
+        return ESP_OK;
+
+    /*
+     * Refresh the touched blocks before deciding whether a session is
+     * needed at all; if nothing differs, CFGUPDATE and SOFT_RESET are skipped.
+     */
+    CHECK(dm_open(dev, &reseal));
+    bool pending = chem_pending;
+    for (int i = 0; i < cfg->count && !pending; i++) {
+        bq27427_dm_block_t *e;
+        esp_err_t err = dm_get_block(dev, cfg->items[i].class_id, cfg->items[i].offset / BQ27427_DM_BLOCK_SIZE, &e);
+        if (err != ESP_OK)
+            return dm_close(dev, reseal, err);
+        pending = config_item_pending(dev, &cfg->items[i]);
+        if ((err = yield_bus(dev, 0)) != ESP_OK)
+            return dm_close(dev, reseal, err);
+    }
+    if (!pending) {
+        ESP_LOGD(TAG, "Configuration already applied");
+        return dm_close(dev, reseal, ESP_OK);
+    }
+
+    bool own_session = !dev->cfgupdate;
+    if (own_session) {
+        esp_err_t err = enter_config(dev);
+        // enter_config() found the gauge unsealed by dm_open() above
+        dev->reseal = reseal;
+        if (err != ESP_OK)
+            return dm_close(dev, reseal, err);
+    }
+
+    esp_err_t err = ESP_OK;
+    if (chem_pending) {
+        err = write_control_word(dev, cfg->chem_id);
+        // The new profile may come with its own data memory defaults
+        for (int i = 0; i < CONFIG_BQ27427_DM_CACHE_BLOCKS; i++)
+            dev->dm_cache[i].valid = false;
+    }
+
+    // Every block is written once, at its first staged item
+    for (int i = 0; i < cfg->count && err == ESP_OK; i++) {
+        const bq27427_config_item_t *item = &cfg->items[i];
+        uint8_t block = item->offset / BQ27427_DM_BLOCK_SIZE;
+        bool seen = false;
+        for (int j = 0; j < i && !seen; j++)
+            seen = cfg->items[j].class_id == item->class_id && cfg->items[j].offset / BQ27427_DM_BLOCK_SIZE == block;
+        if (seen)
+            continue;
+        err = config_apply_block(dev, cfg, item->class_id, block);
+        if (err == ESP_OK)
+            err = yield_bus(dev, 0);
+    }
+
+    if (own_session) {
+        esp_err_t r = exit_config(dev);
+        if (err == ESP_OK)
+            err = r;
+    }
+
+    return err;
+}
+
+static esp_err_t set_dm(bq27427_t *dev, uint8_t class_id, uint8_t offset, uint16_t value, uint16_t mask, uint8_t len)
+{
+    bq27427_config_t cfg;
+
+    CHECK(bq27427_config_begin(dev, &cfg));
+    CHECK(bq27427_config_set_dm(&cfg, class_id, offset, value, mask, len));
+
+    return bq27427_config_commit(&cfg);
+}
+#endif
+
+/*
+ * Read the registers of all requested fields into buf, which mirrors the
+ * standard command block starting at BQ27427_SNAPSHOT_FIRST_REG. Fields that
+ * are close enough together are fetched by one incremental read.
+ * Caller must hold the mutex.
+ */
+static esp_err_t read_snapshot_block(bq27427_t *dev, uint32_t fields, uint8_t *buf)
+{
+    uint8_t start = 0, end = 0;
+    bool pending = false;
+
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++) {
+        if (!(fields & (1 << i)))
+            continue;
+        uint8_t reg = snapshot_regs[i];
+        if (pending && reg - end <= BQ27427_SNAPSHOT_MAX_GAP) {
+            end = reg + 2;
+            continue;
+        }
+        if (pending)
+            CHECK(bus_read(dev, start, buf + start - BQ27427_SNAPSHOT_FIRST_REG, end - start));
+        start = reg;
+        end = reg + 2;
+        pending = true;
+    }
+    if (pending)
+        CHECK(bus_read(dev, start, buf + start - BQ27427_SNAPSHOT_FIRST_REG, end - start));
+
+    return ESP_OK;
+}
+
+static void decode_snapshot(const uint8_t *buf, uint32_t fields, bq27427_snapshot_t *snapshot)
+{
+#define FIELD(reg) get_le16(buf + (reg) - BQ27427_SNAPSHOT_FIRST_REG)
+
+    snapshot->fields = fields;
+    if (fields & BQ27427_FIELD_TEMP)
+        snapshot->temperature = FIELD(BQ27427_COMMAND_TEMP);
+    if (fields & BQ27427_FIELD_VOLTAGE)
+        snapshot->voltage = FIELD(BQ27427_COMMAND_VOLTAGE);
+    if (fields & BQ27427_FIELD_FLAGS)
+        snapshot->flags = FIELD(BQ27427_COMMAND_FLAGS);
+    if (fields & BQ27427_FIELD_NOM_CAPACITY)
+        snapshot->nom_capacity = FIELD(BQ27427_COMMAND_NOM_CAPACITY);
+    if (fields & BQ27427_FIELD_AVAIL_CAPACITY)
+        snapshot->avail_capacity = FIELD(BQ27427_COMMAND_AVAIL_CAPACITY);
+    if (fields & BQ27427_FIELD_REM_CAPACITY)
+        snapshot->rem_capacity = FIELD(BQ27427_COMMAND_REM_CAPACITY);
+    if (fields & BQ27427_FIELD_FULL_CAPACITY)
+        snapshot->full_capacity = FIELD(BQ27427_COMMAND_FULL_CAPACITY);
+    if (fields & BQ27427_FIELD_AVG_CURRENT)
+        snapshot->avg_current = (int16_t)FIELD(BQ27427_COMMAND_AVG_CURRENT);
+    if (fields & BQ27427_FIELD_STDBY_CURRENT)
+        snapshot->stdby_current = (int16_t)FIELD(BQ27427_COMMAND_STDBY_CURRENT);
+    if (fields & BQ27427_FIELD_MAX_CURRENT)
+        snapshot->max_current = (int16_t)FIELD(BQ27427_COMMAND_MAX_CURRENT);
+    if (fields & BQ27427_FIELD_AVG_POWER)
+        snapshot->avg_power = (int16_t)FIELD(BQ27427_COMMAND_AVG_POWER);
+    if (fields & BQ27427_FIELD_SOC)
+        snapshot->soc = FIELD(BQ27427_COMMAND_SOC);
+    if (fields & BQ27427_FIELD_INT_TEMP)
+        snapshot->int_temperature = FIELD(BQ27427_COMMAND_INT_TEMP);
+    if (fields & BQ27427_FIELD_SOH) {
+        snapshot->soh = buf[BQ27427_COMMAND_SOH - BQ27427_SNAPSHOT_FIRST_REG];
+        snapshot->soh_status = buf[BQ27427_COMMAND_SOH + 1 - BQ27427_SNAPSHOT_FIRST_REG];
+    }
+    if (fields & BQ27427_FIELD_REM_CAP_UNFL)
+        snapshot->rem_cap_unfl = FIELD(BQ27427_COMMAND_REM_CAP_UNFL);
+    if (fields & BQ27427_FIELD_REM_CAP_FIL)
+        snapshot->rem_cap_fil = FIELD(BQ27427_COMMAND_REM_CAP_FIL);
+    if (fields & BQ27427_FIELD_FULL_CAP_UNFL)
+        snapshot->full_cap_unfl = FIELD(BQ27427_COMMAND_FULL_CAP_UNFL);
+    if (fields & BQ27427_FIELD_FULL_CAP_FIL)
+        snapshot->full_cap_fil = FIELD(BQ27427_COMMAND_FULL_CAP_FIL);
+    if (fields & BQ27427_FIELD_SOC_UNFL)
+        snapshot->soc_unfl = FIELD(BQ27427_COMMAND_SOC_UNFL);
+
+#undef FIELD
+}
+
+// Read a snapshot into buf and publish it to the latest-value cache. Caller must hold the mutex.
+static esp_err_t snapshot_read(bq27427_t *dev, uint32_t fields, uint8_t *buf, int64_t *stamp)
+{
+    *stamp = esp_timer_get_time();
+    CHECK(read_snapshot_block(dev, fields, buf));
+    latest_store(dev, fields, buf, *stamp);
+    if (fields & BQ27427_FIELD_FLAGS)
+        observe_flags(dev, get_le16(buf + BQ27427_COMMAND_FLAGS - BQ27427_SNAPSHOT_FIRST_REG));
+
+    return ESP_OK;
+}
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+/*
+ * Subclasses in a data memory image and the number of blocks each spans.
+ * Must fit in BQ27427_IMAGE_MAX_BLOCKS.
+ */
+static const struct {
+    uint8_t class_id;
+    uint8_t blocks;
+} image_classes[] = {
+    { BQ27427_ID_SAFETY, 1 },
+    { BQ27427_ID_CHG_TERMINATION, 1 },
+    { BQ27427_ID_DISCHARGE, 1 },
+    { BQ27427_ID_REGISTERS, 1 },
+    { BQ27427_ID_IT_CFG, 3 },
+    { BQ27427_ID_CURRENT_THRESH, 1 },
+    { BQ27427_ID_STATE, 2 },
+    { BQ27427_ID_R_A_RAM, 1 },
+    { BQ27427_ID_CHEM_DATA, 1 },
+    { BQ27427_ID_CALIB_DATA, 1 },
+    { BQ27427_ID_CC_CAL, 1 },
+    { BQ27427_ID_CURRENT, 1 },
+    { BQ27427_ID_CODES, 1 },
+};
+
+static uint16_t chem_subcommand(uint16_t chem_id)
+{
+    switch (chem_id) {
+        case BQ27427_CHEM_ID_A:
+            return BQ27427_CONTROL_CHEM_A;
+        case BQ27427_CHEM_ID_B:
+            return BQ27427_CONTROL_CHEM_B;
+        case BQ27427_CHEM_ID_C:
+            return BQ27427_CONTROL_CHEM_C;
+        default:
+            return 0;
+    }
+}
+
+static esp_err_t image_check(const bq27427_image_t *image)
+{
+    if (image->magic != BQ27427_IMAGE_MAGIC || image->version != BQ27427_IMAGE_VERSION
+            || image->count > BQ27427_IMAGE_MAX_BLOCKS)
+        return ESP_ERR_INVALID_VERSION;
+    for (int i = 0; i < image->count; i++)
+        if (block_checksum(image->blocks[i].data) != image->blocks[i].checksum)
+            return ESP_ERR_INVALID_CRC;
+
+    return ESP_OK;
+}
+
+// Caller must hold the mutex and have data memory open
+static esp_err_t image_dump(bq27427_t *dev, bq27427_image_t *image)
+{
+    CHECK(read_control_word(dev, BQ27427_CONTROL_DEVICE_TYPE, &image->device_type));
+    CHECK(read_control_word(dev, BQ27427_CONTROL_FW_VERSION, &image->fw_version));
+    CHECK(read_control_word(dev, BQ27427_CONTROL_CHEM_ID, &image->chem_id));
+
+    for (size_t i = 0; i < sizeof(image_classes) / sizeof(image_classes[0]); i++) {
+        for (int block = 0; block < image_classes[i].blocks; block++) {
+            bq27427_image_block_t *b = &image->blocks[image->count++];
+            bq27427_dm_block_t *e;
+
+            CHECK(dm_get_block(dev, image_classes[i].class_id, block, &e));
+            b->class_id = e->class_id;
+            b->block = e->block;
+            b->checksum = e->checksum;
+            memcpy(b->data, e->data, BQ27427_DM_BLOCK_SIZE);
+            CHECK(yield_bus(dev, 0));
+        }
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * Compare an image block with data memory. A different checksum settles it
+ * with a one-byte read; an equal checksum is confirmed against the block
+ * contents unless the caller trusts checksums. Data memory must be open.
+ */
+static esp_err_t image_block_differs(bq27427_t *dev, const bq27427_image_block_t *b, uint32_t flags, bool *differs)
+{
+    bq27427_dm_block_t *e;
+    uint8_t checksum;
+
+    CHECK(select_block(dev, b->class_id, b->block));
+    CHECK(read_byte(dev, BQ27427_EXTENDED_CHECKSUM, &checksum));
+    if (checksum != b->checksum || (flags & BQ27427_IMAGE_TRUST_CHECKSUM)) {
+        *differs = checksum != b->checksum;
+        return ESP_OK;
+    }
+    CHECK(dm_get_block(dev, b->class_id, b->block, &e));
+    *differs = memcmp(e->data, b->data, BQ27427_DM_BLOCK_SIZE) != 0;
+
+    return ESP_OK;
+}
+
+// Write a whole block and its checksum. Caller must be in CFGUPDATE mode.
+static esp_err_t image_write_block(bq27427_t *dev, const bq27427_image_block_t *b)
+{
+    bq27427_dm_block_t *e = cache_lookup(dev, b->class_id, b->block);
+
+    if (e)
+        e->valid = false;
+    else
+        e = cache_victim(dev);
+    CHECK(select_block(dev, b->class_id, b->block));
+    CHECK(bus_write(dev, BQ27427_EXTENDED_BLOCKDATA, b->data, BQ27427_DM_BLOCK_SIZE));
+    CHECK(write_byte(dev, BQ27427_EXTENDED_CHECKSUM, b->checksum));
+
+    e->class_id = b->class_id;
+    e->block = b->block;
+    e->checksum = b->checksum;
+    memcpy(e->data, b->data, BQ27427_DM_BLOCK_SIZE);
+    e->last_used = ++dev->dm_stamp;
+    e->valid = true;
+    ESP_LOGD(TAG, "Block %d/%d written from image", b->class_id, b->block);
+
+    return ESP_OK;
+}
+
+// Caller must run a sequence and have data memory open
+static esp_err_t image_apply(bq27427_t *dev, const bq27427_image_t *image, uint32_t flags, uint8_t *written)
+{
+    uint16_t device_type, chem_id;
+
+    CHECK(read_control_word(dev, BQ27427_CONTROL_DEVICE_TYPE, &device_type));
+    if (device_type != image->device_type)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    // A new chemistry reloads chemistry data, so switch before comparing
+    CHECK(read_control_word(dev, BQ27427_CONTROL_CHEM_ID, &chem_id));
+    if (chem_id != image->chem_id) {
+        uint16_t subcommand = chem_subcommand(image->chem_id);
+        if (!subcommand)
+            return ESP_ERR_NOT_SUPPORTED;
+        CHECK(enter_config(dev));
+        CHECK(write_control_word(dev, subcommand));
+        for (int i = 0; i < CONFIG_BQ27427_DM_CACHE_BLOCKS; i++)
+            dev->dm_cache[i].valid = false;
+    }
+
+    for (int i = 0; i < image->count; i++) {
+        const bq27427_image_block_t *b = &image->blocks[i];
+        bool differs;
+
+        if (b->class_id == BQ27427_ID_CODES && !(flags & BQ27427_IMAGE_APPLY_CODES))
+            continue;
+        CHECK(image_block_differs(dev, b, flags, &differs));
+        if (differs) {
+            CHECK(enter_config(dev));
+            CHECK(image_write_block(dev, b));
+            (*written)++;
+        }
+        CHECK(yield_bus(dev, 0));
+    }
+
+    return ESP_OK;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_init_desc(bq27427_t *dev, i2c_port_t port, gpio_num_t sda_gpio, gpio_num_t scl_gpio)
+{
+    CHECK_ARG(dev);
+
+    memset(dev, 0, sizeof(bq27427_t));
+    dev->i2c_dev.port = port;
+    dev->i2c_dev.addr = BQ27427_I2C_ADDRESS;
+    dev->i2c_dev.cfg.sda_io_num = sda_gpio;
+    dev->i2c_dev.cfg.scl_io_num = scl_gpio;
+#if HELPER_TARGET_IS_ESP32
+    dev->i2c_dev.cfg.master.clk_speed = I2C_FREQ_HZ;
+#endif
+#ifdef CONFIG_BQ27427_STATS
+    stats_reset(dev);
+#endif
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // Both mutexes live in the descriptor, nothing comes from the heap
+    dev->seq_lock = xSemaphoreCreateMutexStatic(&dev->seq_lock_buf);
+    dev->i2c_dev.mutex = xSemaphoreCreateMutexStatic(&dev->bus_lock_buf);
+
+    return ESP_OK;
+#else
+    dev->seq_lock = xSemaphoreCreateMutex();
+    if (!dev->seq_lock)
+        return ESP_ERR_NO_MEM;
+    esp_err_t err = i2c_dev_create_mutex(&dev->i2c_dev);
+    if (err != ESP_OK) {
+        vSemaphoreDelete(dev->seq_lock);
+        dev->seq_lock = NULL;
+    }
+
+    return err;
+#endif
+}
+
+esp_err_t bq27427_free_desc(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+    if (dev->seq_lock)
+        vSemaphoreDelete(dev->seq_lock);
+    dev->seq_lock = NULL;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    if (dev->i2c_dev.mutex)
+        vSemaphoreDelete(dev->i2c_dev.mutex);
+    dev->i2c_dev.mutex = NULL;
+
+    return ESP_OK;
+#else
+    return i2c_dev_delete_mutex(&dev->i2c_dev);
+#endif
+}
+
+esp_err_t bq27427_get_voltage(bq27427_t *dev, uint16_t *voltage)
+{
+    CHECK_ARG(dev && voltage);
+
+    return get_word(dev, BQ27427_COMMAND_VOLTAGE, voltage);
+}
+
+esp_err_t bq27427_get_current(bq27427_t *dev, current_measure type, int16_t *current)
+{
+    CHECK_ARG(dev && current);
+
+    uint8_t cmd;
+    switch (type) {
+        case AVG:
+            cmd = BQ27427_COMMAND_AVG_CURRENT;
+            break;
+        case STBY:
+            cmd = BQ27427_COMMAND_STDBY_CURRENT;
+            break;
+        case MAX:
+            cmd = BQ27427_COMMAND_MAX_CURRENT;
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+
+    return get_word(dev, cmd, (uint16_t *)current);
+}
+
+esp_err_t bq27427_get_capacity(bq27427_t *dev, capacity_measure type, uint16_t *capacity)
+{
+    CHECK_ARG(dev && capacity);
+
+    uint8_t cmd;
+    switch (type) {
+        case REMAIN:
+            cmd = BQ27427_COMMAND_REM_CAPACITY;
+            break;
+        case FULL:
+            cmd = BQ27427_COMMAND_FULL_CAPACITY;
+            break;
+        case AVAIL:
+            cmd = BQ27427_COMMAND_NOM_CAPACITY;
+            break;
+        case AVAIL_FULL:
+            cmd = BQ27427_COMMAND_AVAIL_CAPACITY;
+            break;
+        case REMAIN_F:
+            cmd = BQ27427_COMMAND_REM_CAP_FIL;
+            break;
+        case REMAIN_UF:
+            cmd = BQ27427_COMMAND_REM_CAP_UNFL;
+            break;
+        case FULL_F:
+            cmd = BQ27427_COMMAND_FULL_CAP_FIL;
+            break;
+        case FULL_UF:
+            cmd = BQ27427_COMMAND_FULL_CAP_UNFL;
+            break;
+        case DESIGN:
+            cmd = BQ27427_EXTENDED_CAPACITY;
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+
+    return get_word(dev, cmd, capacity);
+}
+
+esp_err_t bq27427_get_power(bq27427_t *dev, int16_t *power)
+{
+    CHECK_ARG(dev && power);
+
+    return get_word(dev, BQ27427_COMMAND_AVG_POWER, (uint16_t *)power);
+}
+
+esp_err_t bq27427_get_soc(bq27427_t *dev, soc_measure type, uint16_t *soc)
+{
+    CHECK_ARG(dev && soc);
+    CHECK_ARG(type == FILTERED || type == UNFILTERED);
+
+    return get_word(dev, type == FILTERED ? BQ27427_COMMAND_SOC : BQ27427_COMMAND_SOC_UNFL, soc);
+}
+
+esp_err_t bq27427_get_soh(bq27427_t *dev, soh_measure type, uint8_t *soh)
+{
+    CHECK_ARG(dev && soh);
+    CHECK_ARG(type == PERCENT || type == SOH_STAT);
+
+    uint16_t raw;
+    CHECK(get_word(dev, BQ27427_COMMAND_SOH, &raw));
+    *soh = type == PERCENT ? raw & 0xff : raw >> 8;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_temperature(bq27427_t *dev, temp_measure type, uint16_t *temperature)
+{
+    CHECK_ARG(dev && temperature);
+    CHECK_ARG(type == BATTERY || type == INTERNAL_TEMP);
+
+    return get_word(dev, type == BATTERY ? BQ27427_COMMAND_TEMP : BQ27427_COMMAND_INT_TEMP, temperature);
+}
+
+esp_err_t bq27427_read_snapshot(bq27427_t *dev, uint32_t fields, bq27427_snapshot_t *snapshot)
+{
+    CHECK_ARG(dev && snapshot);
+    CHECK_ARG(fields && !(fields & ~BQ27427_FIELD_ALL));
+
+    uint8_t buf[BQ27427_SNAPSHOT_SIZE];
+    int64_t stamp;
+
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, snapshot_read(dev, fields, buf, &stamp));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+    decode_snapshot(buf, fields, snapshot);
+
+    ESP_LOGV(TAG, "Snapshot 0x%05" PRIx32 " read", fields);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_read_bursts(bq27427_t *dev, const bq27427_burst_t *bursts, size_t count, uint8_t *buf)
+{
+    CHECK_ARG(dev && bursts && count && buf);
+    for (size_t i = 0; i < count; i++)
+        CHECK_ARG(bursts[i].len && bursts[i].reg >= BQ27427_SNAPSHOT_FIRST_REG &&
+                  bursts[i].reg + bursts[i].len - 1 <= BQ27427_SNAPSHOT_LAST_REG);
+
+    uint32_t fields = 0;
+    int64_t stamp = esp_timer_get_time();
+
+    TAKE_MUTEX(dev);
+    for (size_t i = 0; i < count; i++) {
+        const bq27427_burst_t *b = &bursts[i];
+        I2C_DEV_CHECK(&dev->i2c_dev, bus_read(dev, b->reg, buf + b->reg - BQ27427_SNAPSHOT_FIRST_REG, b->len));
+        for (int f = 0; f < BQ27427_FIELD_COUNT; f++)
+            if (snapshot_regs[f] >= b->reg && snapshot_regs[f] + 2 <= b->reg + b->len)
+                fields |= 1 << f;
+    }
+    latest_store(dev, fields, buf, stamp);
+    if (fields & BQ27427_FIELD_FLAGS)
+        observe_flags(dev, get_le16(buf + BQ27427_COMMAND_FLAGS - BQ27427_SNAPSHOT_FIRST_REG));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    ESP_LOGV(TAG, "%u bursts read", (unsigned)count);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_read_cached(bq27427_t *dev, uint32_t fields, uint32_t max_age_us, bq27427_snapshot_t *snapshot,
+                              uint32_t *age_us)
+{
+    CHECK_ARG(dev && snapshot);
+    CHECK_ARG(fields && !(fields & ~BQ27427_FIELD_ALL));
+
+    bq27427_latest_t copy;
+    uint32_t stale = fields;
+    int64_t now = esp_timer_get_time();
+
+    if (latest_load(dev, &copy)) {
+        stale = fields & ~copy.fields;
+        for (int i = 0; i < BQ27427_FIELD_COUNT; i++)
+            if ((fields & copy.fields & (1 << i)) && now - copy.stamp[i] >= max_age_us)
+                stale |= 1 << i;
+    }
+
+    if (stale) {
+        uint8_t buf[BQ27427_SNAPSHOT_SIZE];
+        int64_t stamp;
+
+        TAKE_MUTEX(dev);
+        I2C_DEV_CHECK(&dev->i2c_dev, snapshot_read(dev, stale, buf, &stamp));
+        I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+        for (int i = 0; i < BQ27427_FIELD_COUNT; i++) {
+            if (!(stale & (1 << i)))
+                continue;
+            uint8_t pos = snapshot_regs[i] - BQ27427_SNAPSHOT_FIRST_REG;
+            memcpy(copy.regs + pos, buf + pos, 2);
+            copy.stamp[i] = stamp;
+        }
+    }
+    decode_snapshot(copy.regs, fields, snapshot);
+
+    if (age_us) {
+        int64_t oldest = INT64_MAX;
+        for (int i = 0; i < BQ27427_FIELD_COUNT; i++)
+            if ((fields & (1 << i)) && copy.stamp[i] < oldest)
+                oldest = copy.stamp[i];
+        int64_t age = esp_timer_get_time() - oldest;
+        *age_us = age < 0 ? 0 : age > UINT32_MAX ? UINT32_MAX : (uint32_t)age;
+    }
+    ESP_LOGV(TAG, "Cached read 0x%05" PRIx32 ", 0x%05" PRIx32 " from the gauge", fields, stale);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_voltage_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *voltage, uint32_t *age_us)
+{
+    CHECK_ARG(voltage);
+
+    bq27427_snapshot_t snap;
+    CHECK(bq27427_read_cached(dev, BQ27427_FIELD_VOLTAGE, max_age_us, &snap, age_us));
+    *voltage = snap.voltage;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_current_cached(bq27427_t *dev, uint32_t max_age_us, int16_t *current, uint32_t *age_us)
+{
+    CHECK_ARG(current);
+
+    bq27427_snapshot_t snap;
+    CHECK(bq27427_read_cached(dev, BQ27427_FIELD_AVG_CURRENT, max_age_us, &snap, age_us));
+    *current = snap.avg_current;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_power_cached(bq27427_t *dev, uint32_t max_age_us, int16_t *power, uint32_t *age_us)
+{
+    CHECK_ARG(power);
+
+    bq27427_snapshot_t snap;
+    CHECK(bq27427_read_cached(dev, BQ27427_FIELD_AVG_POWER, max_age_us, &snap, age_us));
+    *power = snap.avg_power;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_soc_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *soc, uint32_t *age_us)
+{
+    CHECK_ARG(soc);
+
+    bq27427_snapshot_t snap;
+    CHECK(bq27427_read_cached(dev, BQ27427_FIELD_SOC, max_age_us, &snap, age_us));
+    *soc = snap.soc;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_temperature_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *temperature, uint32_t *age_us)
+{
+    CHECK_ARG(temperature);
+
+    bq27427_snapshot_t snap;
+    CHECK(bq27427_read_cached(dev, BQ27427_FIELD_TEMP, max_age_us, &snap, age_us));
+    *temperature = snap.temperature;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_flags_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *flags, uint32_t *age_us)
+{
+    CHECK_ARG(flags);
+
+    bq27427_snapshot_t snap;
+    CHECK(bq27427_read_cached(dev, BQ27427_FIELD_FLAGS, max_age_us, &snap, age_us));
+    *flags = snap.flags;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_device_type(bq27427_t *dev, uint16_t *dev_type)
+{
+    CHECK_ARG(dev && dev_type);
+
+    return get_control_word(dev, BQ27427_CONTROL_DEVICE_TYPE, dev_type);
+}
+
+esp_err_t bq27427_get_flags(bq27427_t *dev, uint16_t *out)
+{
+    CHECK_ARG(dev && out);
+
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_flags(dev, out));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_status(bq27427_t *dev, uint16_t *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_control_word(dev, BQ27427_CONTROL_STATUS, out);
+}
+
+#ifdef CONFIG_BQ27427_DM_ACCESS
+esp_err_t bq27427_get_design_energy(bq27427_t *dev, uint16_t *energy)
+{
+    CHECK_ARG(dev && energy);
+
+    return get_dm_u16(dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_ENERGY, energy);
+}
+
+esp_err_t bq27427_get_terminate_voltage(bq27427_t *dev, uint16_t *voltage)
+{
+    CHECK_ARG(dev && voltage);
+
+    return get_dm_u16(dev, BQ27427_ID_STATE, BQ27427_DM_TERMINATE_VOLTAGE, voltage);
+}
+
+esp_err_t bq27427_get_discharge_current_threshold(bq27427_t *dev, uint16_t *current)
+{
+    CHECK_ARG(dev && current);
+
+    return get_dm_u16(dev, BQ27427_ID_CURRENT_THRESH, BQ27427_DM_DSG_CURRENT, current);
+}
+
+esp_err_t bq27427_get_sleep_current(bq27427_t *dev, uint16_t *current)
+{
+    CHECK_ARG(dev && current);
+
+    return get_dm_u16(dev, BQ27427_ID_POWER, BQ27427_DM_SLEEP_CURRENT, current);
+}
+
+esp_err_t bq27427_get_taper_voltage(bq27427_t *dev, uint16_t *voltage)
+{
+    CHECK_ARG(dev && voltage);
+
+    return get_dm_u16(dev, BQ27427_ID_STATE, BQ27427_DM_TAPER_VOLTAGE, voltage);
+}
+
+esp_err_t bq27427_get_taper_rate(bq27427_t *dev, uint16_t *rate)
+{
+    CHECK_ARG(dev && rate);
+
+    return get_dm_u16(dev, BQ27427_ID_STATE, BQ27427_DM_TAPER_RATE, rate);
+}
+#endif
+
+#ifdef CONFIG_BQ27427_GPOUT
+esp_err_t bq27427_get_gpout_polarity(bq27427_t *dev, uint8_t *polarity)
+{
+    CHECK_ARG(dev && polarity);
+
+    // OpConfig() mirrors the data memory register without unsealing
+    uint16_t opconfig;
+    CHECK(get_word(dev, BQ27427_EXTENDED_OPCONFIG, &opconfig));
+    *polarity = (opconfig & BQ27427_OPCONFIG_GPIOPOL) ? 1 : 0;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_get_gpout_function(bq27427_t *dev, gpout_function *function)
+{
+    CHECK_ARG(dev && function);
+
+    uint16_t opconfig;
+    CHECK(get_word(dev, BQ27427_EXTENDED_OPCONFIG, &opconfig));
+    *function = (opconfig & BQ27427_OPCONFIG_BATLOWEN) ? BAT_LOW : SOC_INT;
+
+    return ESP_OK;
+}
+#endif
+
+// Plain data memory reads, also used by the scheduler
+#ifdef CONFIG_BQ27427_DM_ACCESS
+esp_err_t bq27427_get_soc1_set_threshold(bq27427_t *dev, uint8_t *threshold)
+{
+    CHECK_ARG(dev && threshold);
+
+    return get_dm_u8(dev, BQ27427_ID_DISCHARGE, BQ27427_DM_SOC1_SET, threshold);
+}
+
+esp_err_t bq27427_get_soc1_clear_threshold(bq27427_t *dev, uint8_t *threshold)
+{
+    CHECK_ARG(dev && threshold);
+
+    return get_dm_u8(dev, BQ27427_ID_DISCHARGE, BQ27427_DM_SOC1_CLEAR, threshold);
+}
+
+esp_err_t bq27427_get_socf_set_threshold(bq27427_t *dev, uint8_t *threshold)
+{
+    CHECK_ARG(dev && threshold);
+
+    return get_dm_u8(dev, BQ27427_ID_DISCHARGE, BQ27427_DM_SOCF_SET, threshold);
+}
+
+esp_err_t bq27427_get_socf_clear_threshold(bq27427_t *dev, uint8_t *threshold)
+{
+    CHECK_ARG(dev && threshold);
+
+    return get_dm_u8(dev, BQ27427_ID_DISCHARGE, BQ27427_DM_SOCF_CLEAR, threshold);
+}
+#endif
+
+esp_err_t bq27427_get_soc_flag(bq27427_t *dev, bool *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_flag(dev, BQ27427_FLAG_SOC1, out);
+}
+
+esp_err_t bq27427_get_socf_flag(bq27427_t *dev, bool *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_flag(dev, BQ27427_FLAG_SOCF, out);
+}
+
+esp_err_t bq27427_get_itpor_flag(bq27427_t *dev, bool *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_flag(dev, BQ27427_FLAG_ITPOR, out);
+}
+
+esp_err_t bq27427_get_fc_flag(bq27427_t *dev, bool *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_flag(dev, BQ27427_FLAG_FC, out);
+}
+
+esp_err_t bq27427_get_chg_flag(bq27427_t *dev, bool *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_flag(dev, BQ27427_FLAG_CHG, out);
+}
+
+esp_err_t bq27427_get_dsg_flag(bq27427_t *dev, bool *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_flag(dev, BQ27427_FLAG_DSG, out);
+}
+
+#ifdef CONFIG_BQ27427_GPOUT
+esp_err_t bq27427_get_soci_delta(bq27427_t *dev, uint8_t *delta)
+{
+    CHECK_ARG(dev && delta);
+
+    return get_dm_u8(dev, BQ27427_ID_STATE, BQ27427_DM_SOCI_DELTA, delta);
+}
+
+esp_err_t bq27427_pulse_gpout(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, write_control_word(dev, BQ27427_CONTROL_PULSE_SOC_INT));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+#endif
+
+esp_err_t bq27427_get_chem_id(bq27427_t *dev, uint16_t *out)
+{
+    CHECK_ARG(dev && out);
+
+    return get_control_word(dev, BQ27427_CONTROL_CHEM_ID, out);
+}
+
+esp_err_t bq27427_read_control(bq27427_t *dev, uint16_t subcommand, uint16_t *out)
+{
+    CHECK_ARG(dev && out);
+
+    switch (subcommand) {
+        case BQ27427_CONTROL_STATUS:
+        case BQ27427_CONTROL_DEVICE_TYPE:
+        case BQ27427_CONTROL_FW_VERSION:
+        case BQ27427_CONTROL_DM_CODE:
+        case BQ27427_CONTROL_PREV_MACWRITE:
+        case BQ27427_CONTROL_CHEM_ID:
+            return get_control_word(dev, subcommand, out);
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+}
+
+esp_err_t bq27427_identify(bq27427_t *dev, bq27427_info_t *info)
+{
+    CHECK_ARG(dev && info);
+
+    static const uint16_t subcommands[] = {
+        BQ27427_CONTROL_FW_VERSION, BQ27427_CONTROL_DM_CODE, BQ27427_CONTROL_CHEM_ID, BQ27427_CONTROL_STATUS,
+    };
+    uint16_t *results[] = { &info->fw_version, &info->dm_code, &info->chem_id, &info->status };
+
+    memset(info, 0, sizeof(bq27427_info_t));
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_control_word(dev, BQ27427_CONTROL_DEVICE_TYPE, &info->device_type));
+    if (info->device_type != BQ27427_DEVICE_ID) {
+        I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+        ESP_LOGD(TAG, "Unknown device type 0x%04x", info->device_type);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    for (size_t i = 0; i < sizeof(subcommands) / sizeof(subcommands[0]); i++) {
+        bus_spacing();
+        I2C_DEV_CHECK(&dev->i2c_dev, read_control_word(dev, subcommands[i], results[i]));
+    }
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    info->sealed = info->status & BQ27427_STATUS_SS;
+    info->initialized = info->status & BQ27427_STATUS_INITCOMP;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_reset(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+    bool reseal;
+
+    // RESET is only accepted while unsealed; the gauge comes back sealed
+    TAKE_SEQUENCE(dev);
+    SEQUENCE_CHECK(dev, dm_open(dev, &reseal));
+    SEQUENCE_CHECK(dev, write_control_word(dev, BQ27427_CONTROL_RESET));
+    drop_state(dev);
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_unseal(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+    TAKE_SEQUENCE(dev);
+    SEQUENCE_CHECK(dev, unseal(dev));
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_seal(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+    TAKE_SEQUENCE(dev);
+    SEQUENCE_CHECK(dev, seal(dev));
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+
+#ifdef CONFIG_BQ27427_DM_ACCESS
+esp_err_t bq27427_read_dm(bq27427_t *dev, uint8_t class_id, uint8_t offset, uint8_t *data, uint8_t len)
+{
+    CHECK_ARG(dev && data && len);
+    CHECK_ARG(offset % BQ27427_DM_BLOCK_SIZE + len <= BQ27427_DM_BLOCK_SIZE);
+
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_dm(dev, class_id, offset, data, len));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_read_dm_checksum(bq27427_t *dev, uint8_t class_id, uint8_t block, uint8_t *checksum)
+{
+    CHECK_ARG(dev && checksum);
+
+    TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, read_dm_checksum(dev, class_id, block, checksum));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_dm_cache_invalidate(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+    TAKE_MUTEX(dev);
+    drop_state(dev);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_dm_cache_save(bq27427_t *dev, bq27427_dm_block_t *blocks)
+{
+    CHECK_ARG(dev && blocks);
+
+    // A sequence may be between two steps with the cache half updated
+    TAKE_SEQUENCE(dev);
+    memcpy(blocks, dev->dm_cache, sizeof(dev->dm_cache));
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_dm_cache_restore(bq27427_t *dev, const bq27427_dm_block_t *blocks)
+{
+    CHECK_ARG(dev && blocks);
+
+    TAKE_SEQUENCE(dev);
+    memcpy(dev->dm_cache, blocks, sizeof(dev->dm_cache));
+    for (int i = 0; i < CONFIG_BQ27427_DM_CACHE_BLOCKS; i++)
+        if (dev->dm_cache[i].valid && dev->dm_cache[i].last_used > dev->dm_stamp)
+            dev->dm_stamp = dev->dm_cache[i].last_used;
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+esp_err_t bq27427_enter_config(bq27427_t *dev, uint8_t userControl)
+{
+    CHECK_ARG(dev);
+
+    TAKE_SEQUENCE(dev);
+    SEQUENCE_CHECK(dev, enter_config(dev));
+    if (userControl)
+        dev->user_config = true;
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_exit_config(bq27427_t *dev, uint8_t userControl)
+{
+    CHECK_ARG(dev);
+
+    TAKE_SEQUENCE(dev);
+    if (userControl)
+        dev->user_config = false;
+    if (!dev->user_config)
+        SEQUENCE_CHECK(dev, exit_config(dev));
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_set_capacity(bq27427_t *dev, uint16_t capacity)
+{
+    CHECK_ARG(dev);
+
+    return set_dm(dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY, capacity, 0xffff, 2);
+}
+
+esp_err_t bq27427_set_design_energy(bq27427_t *dev, uint16_t energy)
+{
+    CHECK_ARG(dev);
+
+    return set_dm(dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_ENERGY, energy, 0xffff, 2);
+}
+
+esp_err_t bq27427_set_terminate_voltage(bq27427_t *dev, uint16_t voltage)
+{
+    CHECK_ARG(dev);
+
+    return set_dm(dev, BQ27427_ID_STATE, BQ27427_DM_TERMINATE_VOLTAGE, voltage, 0xffff, 2);
+}
+
+esp_err_t bq27427_set_discharge_current_threshold(bq27427_t *dev, uint16_t current)
+{
+    CHECK_ARG(dev);
+
+    return set_dm(dev, BQ27427_ID_CURRENT_THRESH, BQ27427_DM_DSG_CURRENT, current, 0xffff, 2);
+}
+
+esp_err_t bq27427_set_taper_voltage(bq27427_t *dev, uint16_t voltage)
+{
+    CHECK_ARG(dev);
+
+    return set_dm(dev, BQ27427_ID_STATE, BQ27427_DM_TAPER_VOLTAGE, voltage, 0xffff, 2);
+}
+
+esp_err_t bq27427_set_taper_rate(bq27427_t *dev, uint16_t rate)
+{
+    CHECK_ARG(dev);
+
+    return set_dm(dev, BQ27427_ID_STATE, BQ27427_DM_TAPER_RATE, rate, 0xffff, 2);
+}
+#endif
+
+#ifdef CONFIG_BQ27427_GPOUT
+esp_err_t bq27427_set_gpout_polarity(bq27427_t *dev, uint8_t activeHigh)
+{
+    CHECK_ARG(dev);
+
+    return set_dm(dev, BQ27427_ID_REGISTERS, BQ27427_DM_OPCONFIG, activeHigh ? BQ27427_OPCONFIG_GPIOPOL : 0,
+                  BQ27427_OPCONFIG_GPIOPOL, 2);
+}
+
+esp_err_t bq27427_set_gpout_function(bq27427_t *dev, gpout_function function)
+{
+    CHECK_ARG(dev);
+    CHECK_ARG(function == SOC_INT || function == BAT_LOW);
+
+    return set_dm(dev, BQ27427_ID_REGISTERS, BQ27427_DM_OPCONFIG, function == BAT_LOW ? BQ27427_OPCONFIG_BATLOWEN : 0,
+                  BQ27427_OPCONFIG_BATLOWEN, 2);
+}
+
+esp_err_t bq27427_set_soc1_thresholds(bq27427_t *dev, uint8_t set, uint8_t clear)
+{
+    bq27427_config_t cfg;
+
+    CHECK(bq27427_config_begin(dev, &cfg));
+    CHECK(bq27427_config_set_soc1_thresholds(&cfg, set, clear));
+
+    return bq27427_config_commit(&cfg);
+}
+
+esp_err_t bq27427_set_socf_thresholds(bq27427_t *dev, uint8_t set, uint8_t clear)
+{
+    bq27427_config_t cfg;
+
+    CHECK(bq27427_config_begin(dev, &cfg));
+    CHECK(bq27427_config_set_socf_thresholds(&cfg, set, clear));
+
+    return bq27427_config_commit(&cfg);
+}
+
+esp_err_t bq27427_set_soci_delta(bq27427_t *dev, uint8_t delta)
+{
+    CHECK_ARG(dev);
+    CHECK_ARG(delta >= 1 && delta <= 100);
+
+    return set_dm(dev, BQ27427_ID_STATE, BQ27427_DM_SOCI_DELTA, delta, 0xff, 1);
+}
+#endif
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+esp_err_t bq27427_set_chem_id(bq27427_t *dev, chemistry_profiles chem_id)
+{
+    bq27427_config_t cfg;
+
+    CHECK(bq27427_config_begin(dev, &cfg));
+    CHECK(bq27427_config_set_chem_id(&cfg, chem_id));
+
+    return bq27427_config_commit(&cfg);
+}
+
+esp_err_t bq27427_config_begin(bq27427_t *dev, bq27427_config_t *cfg)
+{
+    CHECK_ARG(dev && cfg);
+
+    memset(cfg, 0, sizeof(bq27427_config_t));
+    cfg->dev = dev;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_config_set_dm(bq27427_config_t *cfg, uint8_t class_id, uint8_t offset, uint16_t value, uint16_t mask,
+                                uint8_t len)
+{
+    CHECK_ARG(cfg && (len == 1 || len == 2));
+    CHECK_ARG(offset % BQ27427_DM_BLOCK_SIZE + len <= BQ27427_DM_BLOCK_SIZE);
+
+    bq27427_config_item_t *item = NULL;
+    for (int i = 0; i < cfg->count && !item; i++)
+        if (cfg->items[i].class_id == class_id && cfg->items[i].offset == offset && cfg->items[i].len == len)
+            item = &cfg->items[i];
+    if (!item) {
+        if (cfg->count >= CONFIG_BQ27427_CONFIG_MAX_ITEMS)
+            return ESP_ERR_INVALID_SIZE;
+        item = &cfg->items[cfg->count++];
+        item->class_id = class_id;
+        item->offset = offset;
+        item->len = len;
+        memset(item->mask, 0, sizeof(item->mask));
+    }
+
+    // Data memory is big-endian; merge with bits staged earlier
+    uint8_t v[2] = { value >> 8, value & 0xff };
+    uint8_t m[2] = { mask >> 8, mask & 0xff };
+    if (len == 1) {
+        v[0] = v[1];
+        m[0] = m[1];
+    }
+    for (int j = 0; j < len; j++) {
+        item->value[j] = (item->value[j] & ~m[j]) | (v[j] & m[j]);
+        item->mask[j] |= m[j];
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_config_set_capacity(bq27427_config_t *cfg, uint16_t capacity)
+{
+    return bq27427_config_set_dm(cfg, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY, capacity, 0xffff, 2);
+}
+
+esp_err_t bq27427_config_set_design_energy(bq27427_config_t *cfg, uint16_t energy)
+{
+    return bq27427_config_set_dm(cfg, BQ27427_ID_STATE, BQ27427_DM_DESIGN_ENERGY, energy, 0xffff, 2);
+}
+
+esp_err_t bq27427_config_set_terminate_voltage(bq27427_config_t *cfg, uint16_t voltage)
+{
+    return bq27427_config_set_dm(cfg, BQ27427_ID_STATE, BQ27427_DM_TERMINATE_VOLTAGE, voltage, 0xffff, 2);
+}
+
+esp_err_t bq27427_config_set_discharge_current_threshold(bq27427_config_t *cfg, uint16_t current)
+{
+    return bq27427_config_set_dm(cfg, BQ27427_ID_CURRENT_THRESH, BQ27427_DM_DSG_CURRENT, current, 0xffff, 2);
+}
+
+esp_err_t bq27427_config_set_taper_voltage(bq27427_config_t *cfg, uint16_t voltage)
+{
+    return bq27427_config_set_dm(cfg, BQ27427_ID_STATE, BQ27427_DM_TAPER_VOLTAGE, voltage, 0xffff, 2);
+}
+
+esp_err_t bq27427_config_set_taper_rate(bq27427_config_t *cfg, uint16_t rate)
+{
+    return bq27427_config_set_dm(cfg, BQ27427_ID_STATE, BQ27427_DM_TAPER_RATE, rate, 0xffff, 2);
+}
+#endif
+
+#ifdef CONFIG_BQ27427_GPOUT
+esp_err_t bq27427_config_set_gpout_polarity(bq27427_config_t *cfg, uint8_t activeHigh)
+{
+    return bq27427_config_set_dm(cfg, BQ27427_ID_REGISTERS, BQ27427_DM_OPCONFIG,
+                                 activeHigh ? BQ27427_OPCONFIG_GPIOPOL : 0, BQ27427_OPCONFIG_GPIOPOL, 2);
+}
+
+esp_err_t bq27427_config_set_gpout_function(bq27427_config_t *cfg, gpout_function function)
+{
+    CHECK_ARG(function == SOC_INT || function == BAT_LOW);
+
+    return bq27427_config_set_dm(cfg, BQ27427_ID_REGISTERS, BQ27427_DM_OPCONFIG,
+                                 function == BAT_LOW ? BQ27427_OPCONFIG_BATLOWEN : 0, BQ27427_OPCONFIG_BATLOWEN, 2);
+}
+
+esp_err_t bq27427_config_set_soc1_thresholds(bq27427_config_t *cfg, uint8_t set, uint8_t clear)
+{
+    CHECK_ARG(set <= 100 && clear <= 100 && clear > set);
+
+    CHECK(bq27427_config_set_dm(cfg, BQ27427_ID_DISCHARGE, BQ27427_DM_SOC1_SET, set, 0xff, 1));
+    return bq27427_config_set_dm(cfg, BQ27427_ID_DISCHARGE, BQ27427_DM_SOC1_CLEAR, clear, 0xff, 1);
+}
+
+esp_err_t bq27427_config_set_socf_thresholds(bq27427_config_t *cfg, uint8_t set, uint8_t clear)
+{
+    CHECK_ARG(set <= 100 && clear <= 100 && clear > set);
+
+    CHECK(bq27427_config_set_dm(cfg, BQ27427_ID_DISCHARGE, BQ27427_DM_SOCF_SET, set, 0xff, 1));
+    return bq27427_config_set_dm(cfg, BQ27427_ID_DISCHARGE, BQ27427_DM_SOCF_CLEAR, clear, 0xff, 1);
+}
+
+esp_err_t bq27427_config_set_soci_delta(bq27427_config_t *cfg, uint8_t delta)
+{
+    CHECK_ARG(delta >= 1 && delta <= 100);
+
+    return bq27427_config_set_dm(cfg, BQ27427_ID_STATE, BQ27427_DM_SOCI_DELTA, delta, 0xff, 1);
+}
+#endif
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+esp_err_t bq27427_config_set_chem_id(bq27427_config_t *cfg, chemistry_profiles chem_id)
+{
+    CHECK_ARG(cfg);
+    CHECK_ARG(chem_id == CHEM_A || chem_id == CHEM_B || chem_id == CHEM_C);
+
+    cfg->chem_id = chem_id;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_config_commit(bq27427_config_t *cfg)
+{
+    CHECK_ARG(cfg && cfg->dev);
+
+    bq27427_t *dev = cfg->dev;
+
+    TAKE_SEQUENCE(dev);
+    SEQUENCE_CHECK(dev, config_commit(dev, cfg));
+    GIVE_SEQUENCE(dev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_image_dump(bq27427_t *dev, bq27427_image_t *image)
+{
+    CHECK_ARG(dev && image);
+
+    bool reseal;
+
+    memset(image, 0, sizeof(bq27427_image_t));
+    image->magic = BQ27427_IMAGE_MAGIC;
+    image->version = BQ27427_IMAGE_VERSION;
+
+    TAKE_SEQUENCE(dev);
+    SEQUENCE_CHECK(dev, dm_open(dev, &reseal));
+    SEQUENCE_CHECK(dev, dm_close(dev, reseal, image_dump(dev, image)));
+    GIVE_SEQUENCE(dev);
+
+    ESP_LOGD(TAG, "Dumped %d blocks", image->count);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_image_apply(bq27427_t *dev, const bq27427_image_t *image, uint32_t flags, uint8_t *written)
+{
+    CHECK_ARG(dev && image);
+    CHECK(image_check(image));
+
+    uint8_t count = 0;
+    bool reseal;
+
+    TAKE_SEQUENCE(dev);
+    SEQUENCE_CHECK(dev, dm_open(dev, &reseal));
+    bool own_session = !dev->cfgupdate;
+    esp_err_t err = image_apply(dev, image, flags, &count);
+    if (own_session && dev->cfgupdate) {
+        // enter_config() found the gauge unsealed by dm_open() above
+        dev->reseal = reseal;
+        reseal = false;
+        esp_err_t r = exit_config(dev);
+        if (err == ESP_OK)
+            err = r;
+    }
+    SEQUENCE_CHECK(dev, dm_close(dev, reseal, err));
+    GIVE_SEQUENCE(dev);
+
+    ESP_LOGD(TAG, "Image applied, %d blocks written", count);
+    if (written)
+        *written = count;
+
+    return ESP_OK;
+}
+#endif
+
+esp_err_t bq27427_set_recovery(bq27427_t *dev, const bq27427_recovery_t *policy)
+{
+    CHECK_ARG(dev && policy);
+
+    TAKE_MUTEX(dev);
+    dev->recovery = *policy;
+    dev->i2c_dev.timeout_ticks = policy->timeout_ticks;
+    if (!policy->offline_after) {
+        dev->offline = false;
+        dev->failures = 0;
+    }
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+}
+
+bool bq27427_is_offline(const bq27427_t *dev)
+{
+    return dev && dev->offline;
+}
+
+esp_err_t bq27427_recover_bus(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+    TAKE_MUTEX(dev);
+    esp_err_t err = bus_recover(dev);
+    // The gauge may have lost a Control() subcommand or a block selection
+    drop_state(dev);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return err;
+}
+
+esp_err_t bq27427_get_stats(bq27427_t *dev, bq27427_stats_t *stats)
+{
+    CHECK_ARG(dev && stats);
+
+#ifdef CONFIG_BQ27427_STATS
+    TAKE_MUTEX(dev);
+    *stats = dev->stats;
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t bq27427_reset_stats(bq27427_t *dev)
+{
+    CHECK_ARG(dev);
+
+#ifdef CONFIG_BQ27427_STATS
+    TAKE_MUTEX(dev);
+    stats_reset(dev);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t bq27427_set_trace(bq27427_t *dev, bq27427_trace_t *trace)
+{
+    CHECK_ARG(dev);
+
+#ifdef CONFIG_BQ27427_TRACE
+    if (trace) {
+        CHECK(bq27427_trace_init(trace));
+        trace->addr = dev->i2c_dev.addr;
+#if HELPER_TARGET_IS_ESP32
+        trace->clk_hz = dev->i2c_dev.cfg.master.clk_speed;
+#else
+        trace->clk_hz = 0;
+#endif
+    }
+    TAKE_MUTEX(dev);
+    dev->trace = trace;
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return ESP_OK;
+#else
+    (void)trace;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
 }
@@ -0,0 +1,213 @@
+#include <string.h>
+#include <esp_log.h>
+#include "bq27427_async.h"
+
+static const char *TAG = "bq27427_async";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+static bool transition(bq27427_request_t *req, uint32_t from, uint32_t to)
+{
+    return __atomic_compare_exchange_n(&req->state, &from, to, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void complete(bq27427_request_t *req, esp_err_t err)
+{
+    bq27427_request_cb_t cb = req->cb;
+    void *ctx = req->ctx;
+    TaskHandle_t notify = req->notify;
+
+    // A polling owner may reuse or free the request from here on
+    req->err = err;
+    __atomic_store_n(&req->state, BQ27427_REQUEST_DONE, __ATOMIC_RELEASE);
+    if (cb)
+        cb(req, ctx);
+    if (notify)
+        xTaskNotifyGive(notify);
+}
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+static esp_err_t write_dm(bq27427_t *dev, bq27427_request_t *req)
+{
+    bq27427_config_t cfg;
+
+    CHECK(bq27427_config_begin(dev, &cfg));
+    CHECK(bq27427_config_set_dm(&cfg, req->dm.class_id, req->dm.offset, req->dm.value, req->dm.mask, req->dm.len));
+
+    return bq27427_config_commit(&cfg);
+}
+#endif
+
+static esp_err_t execute(bq27427_t *dev, bq27427_request_t *req)
+{
+    switch (req->type) {
+        case BQ27427_REQUEST_SNAPSHOT:
+            return bq27427_read_snapshot(dev, req->snapshot.fields, &req->snapshot.result);
+        case BQ27427_REQUEST_CONTROL:
+            return bq27427_read_control(dev, req->control.subcommand, &req->control.result);
+#ifdef CONFIG_BQ27427_DM_ACCESS
+        case BQ27427_REQUEST_DM_READ:
+            return bq27427_read_dm(dev, req->dm.class_id, req->dm.offset, req->dm.data, req->dm.len);
+#endif
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+        case BQ27427_REQUEST_DM_WRITE:
+            return write_dm(dev, req);
+        case BQ27427_REQUEST_CONFIG:
+            return bq27427_config_commit(req->config.config);
+#else
+        // Stripped from this build, see CONFIG_BQ27427_CONFIG_WRITE
+        case BQ27427_REQUEST_DM_WRITE:
+        case BQ27427_REQUEST_CONFIG:
+#ifndef CONFIG_BQ27427_DM_ACCESS
+        case BQ27427_REQUEST_DM_READ:
+#endif
+            return ESP_ERR_NOT_SUPPORTED;
+#endif
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+}
+
+static void run(bq27427_async_t *async, bq27427_request_t *req)
+{
+    if (!async->running || !transition(req, BQ27427_REQUEST_QUEUED, BQ27427_REQUEST_RUNNING)) {
+        complete(req, ESP_ERR_INVALID_STATE);
+        return;
+    }
+    if (req->timeout && (int32_t)(xTaskGetTickCount() - req->deadline) >= 0) {
+        ESP_LOGD(TAG, "Request type %d expired in the queue", req->type);
+        complete(req, ESP_ERR_TIMEOUT);
+        return;
+    }
+
+    complete(req, execute(async->dev, req));
+}
+
+static void async_task(void *arg)
+{
+    bq27427_async_t *async = (bq27427_async_t *)arg;
+    bq27427_request_t *req;
+
+    for (;;) {
+        xQueueReceive(async->queue, &req, portMAX_DELAY);
+        // A NULL request is the stop signal, sent behind everything queued
+        if (!req)
+            break;
+        run(async, req);
+    }
+
+    xSemaphoreGive(async->stopped);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The stack is the caller's: bq27427_async_stop() deletes the task once it is suspended
+    vTaskSuspend(NULL);
+#else
+    vTaskDelete(NULL);
+#endif
+}
+
+static void release(bq27427_async_t *async)
+{
+    if (async->queue)
+        vQueueDelete(async->queue);
+    if (async->stopped)
+        vSemaphoreDelete(async->stopped);
+    async->queue = NULL;
+    async->stopped = NULL;
+}
+
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+// Delete a task that suspended itself; once it is gone its stack and TCB are the caller's again
+static void delete_suspended(TaskHandle_t task)
+{
+    while (eTaskGetState(task) != eSuspended)
+        vTaskDelay(1);
+    vTaskDelete(task);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_async_start(bq27427_async_t *async, bq27427_t *dev, const bq27427_async_config_t *config)
+{
+    CHECK_ARG(async && dev && config && config->queue_length);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    CHECK_ARG(config->task_stack && config->queue_storage);
+#endif
+
+    memset(async, 0, sizeof(bq27427_async_t));
+    async->dev = dev;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The task, the queue and the semaphore live in async, the stack and the queue slots are the caller's
+    async->queue = xQueueCreateStatic(config->queue_length, sizeof(bq27427_request_t *),
+                                      (uint8_t *)config->queue_storage, &async->queue_buf);
+    async->stopped = xSemaphoreCreateBinaryStatic(&async->stopped_buf);
+    async->running = true;
+    async->task = xTaskCreateStatic(async_task, "bq27427_async", config->task_stack_size, async,
+                                    config->task_priority, config->task_stack, &async->task_buf);
+#else
+    async->queue = xQueueCreate(config->queue_length, sizeof(bq27427_request_t *));
+    async->stopped = xSemaphoreCreateBinary();
+    if (!async->queue || !async->stopped) {
+        release(async);
+        return ESP_ERR_NO_MEM;
+    }
+
+    async->running = true;
+    if (xTaskCreate(async_task, "bq27427_async", config->task_stack_size, async, config->task_priority,
+                    &async->task) != pdPASS) {
+        release(async);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_async_stop(bq27427_async_t *async)
+{
+    CHECK_ARG(async && async->task);
+
+    bq27427_request_t *stop = NULL;
+
+    async->running = false;
+    xQueueSendToBack(async->queue, &stop, portMAX_DELAY);
+    // The request in progress may be a configuration session; the worker must be gone before async is freed
+    xSemaphoreTake(async->stopped, portMAX_DELAY);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    delete_suspended(async->task);
+#endif
+    async->task = NULL;
+    release(async);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_async_submit(bq27427_async_t *async, bq27427_request_t *req)
+{
+    CHECK_ARG(async && req);
+    if (!async->running)
+        return ESP_ERR_INVALID_STATE;
+
+    req->err = ESP_OK;
+    req->deadline = xTaskGetTickCount() + req->timeout;
+    __atomic_store_n(&req->state, BQ27427_REQUEST_QUEUED, __ATOMIC_RELEASE);
+    if (xQueueSendToBack(async->queue, &req, 0) != pdTRUE) {
+        __atomic_store_n(&req->state, BQ27427_REQUEST_IDLE, __ATOMIC_RELEASE);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_async_cancel(bq27427_async_t *async, bq27427_request_t *req)
+{
+    CHECK_ARG(async && req);
+
+    return transition(req, BQ27427_REQUEST_QUEUED, BQ27427_REQUEST_CANCELLED) ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+bool bq27427_async_done(const bq27427_request_t *req)
+{
+    return req && __atomic_load_n(&req->state, __ATOMIC_ACQUIRE) == BQ27427_REQUEST_DONE;
+}
@@ -0,0 +1,128 @@
+#include <stddef.h>
+#include <string.h>
+#include <esp_log.h>
+#include "bq27427_boot.h"
+
+static const char *TAG = "bq27427_boot";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// Hash of what the configuration writes, independent of the descriptor
+static uint32_t config_hash(const bq27427_config_t *cfg)
+{
+    uint32_t hash = fnv1a(FNV_OFFSET, &cfg->chem_id, sizeof(cfg->chem_id));
+
+    hash = fnv1a(hash, &cfg->count, sizeof(cfg->count));
+    return fnv1a(hash, cfg->items, cfg->count * sizeof(bq27427_config_item_t));
+}
+
+static uint32_t state_check(const bq27427_boot_state_t *state)
+{
+    return fnv1a(FNV_OFFSET, state, offsetof(bq27427_boot_state_t, check));
+}
+
+static bool state_valid(const bq27427_boot_state_t *state)
+{
+    return state->magic == BQ27427_BOOT_MAGIC && state->check == state_check(state);
+}
+
+static void state_seal(bq27427_boot_state_t *state)
+{
+    state->check = state_check(state);
+}
+
+// ITPOR stays set until a session ends with SOFT_RESET, so always run one
+static esp_err_t configure_after_por(bq27427_t *dev, bq27427_config_t *cfg)
+{
+    CHECK(bq27427_enter_config(dev, true));
+    esp_err_t err = bq27427_config_commit(cfg);
+    esp_err_t r = bq27427_exit_config(dev, true);
+
+    return err != ESP_OK ? err : r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_boot(bq27427_t *dev, bq27427_config_t *cfg, bq27427_boot_state_t *state,
+                       bq27427_boot_result_t *result)
+{
+    CHECK_ARG(dev && cfg && state && cfg->dev == dev);
+
+    uint32_t hash = config_hash(cfg);
+    uint16_t flags;
+    bq27427_boot_result_t path;
+
+    if (!state_valid(state)) {
+        ESP_LOGD(TAG, "No saved state");
+        memset(state, 0, sizeof(bq27427_boot_state_t));
+        state->magic = BQ27427_BOOT_MAGIC;
+        state_seal(state);
+    }
+
+    CHECK(bq27427_get_flags(dev, &flags));
+    if (flags & BQ27427_FLAG_ITPOR) {
+        // The gauge reloaded its defaults; nothing saved about it is true anymore
+        path = BQ27427_BOOT_POR;
+        CHECK(configure_after_por(dev, cfg));
+    } else {
+        // Hand the data memory cache saved before sleep back to the descriptor
+        CHECK(bq27427_dm_cache_restore(dev, state->dm_cache));
+        if (state->config_hash == hash) {
+            path = BQ27427_BOOT_FAST;
+        } else {
+            path = BQ27427_BOOT_CHECKED;
+            CHECK(bq27427_config_commit(cfg));
+        }
+    }
+
+    if (state->config_hash != hash) {
+        state->config_hash = hash;
+        state_seal(state);
+    }
+    ESP_LOGD(TAG, "Boot path %d", path);
+    if (result)
+        *result = path;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_boot_save(bq27427_t *dev, bq27427_boot_state_t *state, const bq27427_snapshot_t *snapshot)
+{
+    CHECK_ARG(dev && state && state_valid(state));
+
+    CHECK(bq27427_dm_cache_save(dev, state->dm_cache));
+
+    state->has_snapshot = snapshot != NULL;
+    if (snapshot)
+        state->snapshot = *snapshot;
+    state_seal(state);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_boot_last_snapshot(const bq27427_boot_state_t *state, bq27427_snapshot_t *snapshot)
+{
+    CHECK_ARG(state && snapshot);
+
+    if (!state_valid(state) || !state->has_snapshot)
+        return ESP_ERR_NOT_FOUND;
+    *snapshot = state->snapshot;
+
+    return ESP_OK;
+}
@@ -0,0 +1,262 @@
+#include <string.h>
+#include <esp_attr.h>
+#include <esp_log.h>
+#include "bq27427_events.h"
+
+static const char *TAG = "bq27427_events";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define EVENT_FIELDS (BQ27427_FIELD_FLAGS | BQ27427_FIELD_SOC)
+
+static void IRAM_ATTR gpout_isr(void *arg)
+{
+    bq27427_events_t *ev = (bq27427_events_t *)arg;
+    BaseType_t woken = pdFALSE;
+
+    ev->irq_tick = xTaskGetTickCountFromISR();
+    vTaskNotifyGiveFromISR(ev->task, &woken);
+    if (woken)
+        portYIELD_FROM_ISR();
+}
+
+static void publish(bq27427_events_t *ev, bq27427_event_type_t type, const bq27427_snapshot_t *snap, TickType_t tick)
+{
+    bq27427_event_t event = {
+        .type = type,
+        .flags = snap->flags,
+        .soc = snap->soc,
+        .timestamp = tick,
+    };
+    bq27427_events_subscriber_t subscribers[CONFIG_BQ27427_EVENTS_MAX_SUBSCRIBERS];
+
+    // Call from a copy with the lock released, so that callbacks can subscribe and unsubscribe
+    xSemaphoreTake(ev->lock, portMAX_DELAY);
+    memcpy(subscribers, ev->subscribers, sizeof(subscribers));
+    xSemaphoreGive(ev->lock);
+    for (int i = 0; i < CONFIG_BQ27427_EVENTS_MAX_SUBSCRIBERS; i++)
+        if (subscribers[i].cb)
+            subscribers[i].cb(ev->dev, &event, subscribers[i].ctx);
+}
+
+// Turn the difference between two Flags() readings into events
+static void dispatch(bq27427_events_t *ev, const bq27427_snapshot_t *snap, TickType_t tick)
+{
+    uint16_t changed = ev->flags ^ snap->flags;
+
+    if (ev->config.function == SOC_INT && snap->soc != ev->soc)
+        publish(ev, BQ27427_EVENT_SOC_DELTA, snap, tick);
+    if (changed & BQ27427_FLAG_SOC1)
+        publish(ev, snap->flags & BQ27427_FLAG_SOC1 ? BQ27427_EVENT_SOC1_SET : BQ27427_EVENT_SOC1_CLEAR, snap, tick);
+    if (changed & BQ27427_FLAG_SOCF)
+        publish(ev, snap->flags & BQ27427_FLAG_SOCF ? BQ27427_EVENT_SOCF_SET : BQ27427_EVENT_SOCF_CLEAR, snap, tick);
+    if (changed & BQ27427_FLAG_BAT_DET)
+        publish(ev, snap->flags & BQ27427_FLAG_BAT_DET ? BQ27427_EVENT_BAT_INSERTED : BQ27427_EVENT_BAT_REMOVED,
+                snap, tick);
+    ev->flags = snap->flags;
+    ev->soc = snap->soc;
+}
+
+static void event_task(void *arg)
+{
+    bq27427_events_t *ev = (bq27427_events_t *)arg;
+    bq27427_snapshot_t snap;
+
+    while (ev->running) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!ev->running)
+            break;
+
+        TickType_t tick = ev->irq_tick;
+        esp_err_t err = bq27427_read_snapshot(ev->dev, EVENT_FIELDS, &snap);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Could not read gauge after GPOUT interrupt: %s", esp_err_to_name(err));
+            continue;
+        }
+        dispatch(ev, &snap, tick);
+    }
+
+    xSemaphoreGive(ev->stopped);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The stack is the caller's: bq27427_events_stop() deletes the task once it is suspended
+    vTaskSuspend(NULL);
+#else
+    vTaskDelete(NULL);
+#endif
+}
+
+static esp_err_t configure_gauge(bq27427_t *dev, const bq27427_events_config_t *config)
+{
+    bq27427_config_t cfg;
+
+    CHECK(bq27427_config_begin(dev, &cfg));
+    CHECK(bq27427_config_set_gpout_function(&cfg, config->function));
+    CHECK(bq27427_config_set_gpout_polarity(&cfg, config->active_high));
+    if (config->soci_delta)
+        CHECK(bq27427_config_set_soci_delta(&cfg, config->soci_delta));
+
+    return bq27427_config_commit(&cfg);
+}
+
+static esp_err_t install_isr(bq27427_events_t *ev)
+{
+    const bq27427_events_config_t *config = &ev->config;
+    gpio_config_t io = {
+        .pin_bit_mask = 1ULL << config->gpio,
+        .mode = GPIO_MODE_INPUT,
+        // GPOUT is open drain
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+    };
+
+    // SOC_INT is a pulse on the active edge, BAT_LOW is a level that changes both ways
+    if (config->function == BAT_LOW)
+        io.intr_type = GPIO_INTR_ANYEDGE;
+    else
+        io.intr_type = config->active_high ? GPIO_INTR_POSEDGE : GPIO_INTR_NEGEDGE;
+
+    CHECK(gpio_config(&io));
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+        return err;
+
+    return gpio_isr_handler_add(config->gpio, gpout_isr, ev);
+}
+
+static void release(bq27427_events_t *ev)
+{
+    if (ev->lock)
+        vSemaphoreDelete(ev->lock);
+    if (ev->stopped)
+        vSemaphoreDelete(ev->stopped);
+    ev->lock = NULL;
+    ev->stopped = NULL;
+}
+
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+// Delete a task that suspended itself; once it is gone its stack and TCB are the caller's again
+static void delete_suspended(TaskHandle_t task)
+{
+    while (eTaskGetState(task) != eSuspended)
+        vTaskDelay(1);
+    vTaskDelete(task);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_events_start(bq27427_events_t *ev, bq27427_t *dev, const bq27427_events_config_t *config)
+{
+    CHECK_ARG(ev && dev && config);
+    CHECK_ARG(config->function == SOC_INT || config->function == BAT_LOW);
+    CHECK_ARG(config->soci_delta <= 100);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    CHECK_ARG(config->task_stack);
+#endif
+
+    if (config->configure_gauge)
+        CHECK(configure_gauge(dev, config));
+
+    memset(ev, 0, sizeof(bq27427_events_t));
+    ev->dev = dev;
+    ev->config = *config;
+
+    // Events are reported relative to the state at start
+    bq27427_snapshot_t snap;
+    CHECK(bq27427_read_snapshot(dev, EVENT_FIELDS, &snap));
+    ev->flags = snap.flags;
+    ev->soc = snap.soc;
+
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The task and the semaphores live in ev, the stack is the caller's
+    ev->lock = xSemaphoreCreateMutexStatic(&ev->lock_buf);
+    ev->stopped = xSemaphoreCreateBinaryStatic(&ev->stopped_buf);
+    ev->running = true;
+    ev->task = xTaskCreateStatic(event_task, "bq27427_events", config->task_stack_size, ev, config->task_priority,
+                                 config->task_stack, &ev->task_buf);
+#else
+    ev->lock = xSemaphoreCreateMutex();
+    ev->stopped = xSemaphoreCreateBinary();
+    if (!ev->lock || !ev->stopped) {
+        release(ev);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ev->running = true;
+    if (xTaskCreate(event_task, "bq27427_events", config->task_stack_size, ev, config->task_priority,
+                    &ev->task) != pdPASS) {
+        release(ev);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
+    esp_err_t err = install_isr(ev);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Could not install GPOUT interrupt on GPIO %d: %s", config->gpio, esp_err_to_name(err));
+        bq27427_events_stop(ev);
+        return err;
+    }
+    ESP_LOGD(TAG, "Event mode started on GPIO %d", config->gpio);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_events_stop(bq27427_events_t *ev)
+{
+    CHECK_ARG(ev && ev->task);
+
+    gpio_isr_handler_remove(ev->config.gpio);
+    ev->running = false;
+    xTaskNotifyGive(ev->task);
+    /*
+     * The task may be waiting for the device mutex behind a configuration
+     * session, which can take seconds. Returning before it exits would let
+     * it touch ev after the caller freed it, so there is no timeout.
+     */
+    xSemaphoreTake(ev->stopped, portMAX_DELAY);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    delete_suspended(ev->task);
+#endif
+    ev->task = NULL;
+    release(ev);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_events_subscribe(bq27427_events_t *ev, bq27427_event_cb_t cb, void *ctx)
+{
+    CHECK_ARG(ev && ev->lock && cb);
+
+    esp_err_t err = ESP_ERR_NO_MEM;
+    xSemaphoreTake(ev->lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_BQ27427_EVENTS_MAX_SUBSCRIBERS; i++) {
+        if (!ev->subscribers[i].cb) {
+            ev->subscribers[i].cb = cb;
+            ev->subscribers[i].ctx = ctx;
+            err = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(ev->lock);
+
+    return err;
+}
+
+esp_err_t bq27427_events_unsubscribe(bq27427_events_t *ev, bq27427_event_cb_t cb, void *ctx)
+{
+    CHECK_ARG(ev && ev->lock && cb);
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(ev->lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_BQ27427_EVENTS_MAX_SUBSCRIBERS; i++) {
+        if (ev->subscribers[i].cb == cb && ev->subscribers[i].ctx == ctx) {
+            ev->subscribers[i].cb = NULL;
+            ev->subscribers[i].ctx = NULL;
+            err = ESP_OK;
+        }
+    }
+    xSemaphoreGive(ev->lock);
+
+    return err;
+}
@@ -0,0 +1,345 @@
+#include <inttypes.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_idf_lib_helpers.h>
+#include "bq27427_group.h"
+
+static const char *TAG = "bq27427_group";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define I2C_FREQ_HZ 400000
+#define MUX_UNKNOWN 0xff
+
+// Sort key: direct gauges first, then by multiplexer and channel
+#define ORDER_KEY(m) (((m)->mux_addr << 3) | (m)->mux_channel)
+
+static esp_err_t write_mux(i2c_dev_t *mux, uint8_t channels)
+{
+    I2C_DEV_TAKE_MUTEX(mux);
+    I2C_DEV_CHECK(mux, i2c_dev_write(mux, NULL, 0, &channels, 1));
+    I2C_DEV_GIVE_MUTEX(mux);
+
+    ESP_LOGV(TAG, "TCA9548 0x%02x on port %d: channels 0x%02x", mux->addr, mux->port, channels);
+
+    return ESP_OK;
+}
+
+/*
+ * Connect the member's channel and disconnect every other channel on the
+ * port, writing only the multiplexers whose selection changes. Caller must
+ * hold the bus lock.
+ */
+static esp_err_t select_channel(bq27427_group_bus_t *bus, const bq27427_group_member_t *member)
+{
+    for (int i = 0; i < TCA9548_ADDR_COUNT; i++) {
+        if (!(bus->mux_used & (1 << i)))
+            continue;
+        uint8_t want = member->mux_addr == TCA9548_ADDR_BASE + i ? 1 << member->mux_channel : 0;
+        if (bus->mux_sel[i] == want)
+            continue;
+        esp_err_t err = write_mux(&bus->mux[i], want);
+        if (err != ESP_OK) {
+            bus->mux_sel[i] = MUX_UNKNOWN;
+            return err;
+        }
+        bus->mux_sel[i] = want;
+    }
+
+    return ESP_OK;
+}
+
+static void scan_bus(bq27427_group_t *group, bq27427_group_bus_t *bus)
+{
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    for (int i = 0; i < bus->count; i++) {
+        uint8_t index = bus->order[bus->reverse ? bus->count - 1 - i : i];
+        bq27427_group_member_t *member = &group->members[index];
+
+        esp_err_t err = select_channel(bus, member);
+        if (err == ESP_OK)
+            err = bq27427_read_snapshot(&member->dev, group->job_fields, &group->job_snapshots[index]);
+        group->job_results[index] = err;
+    }
+    bus->reverse = !bus->reverse;
+    xSemaphoreGive(bus->lock);
+}
+
+static void bus_task(void *arg)
+{
+    bq27427_group_bus_t *bus = (bq27427_group_bus_t *)arg;
+    bq27427_group_t *group = bus->group;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!group->running)
+            break;
+        scan_bus(group, bus);
+        xSemaphoreGive(group->done);
+    }
+
+    xSemaphoreGive(group->done);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The stack is the caller's: bq27427_group_free() deletes the task once it is suspended
+    vTaskSuspend(NULL);
+#else
+    vTaskDelete(NULL);
+#endif
+}
+
+static bq27427_group_bus_t *get_bus(bq27427_group_t *group, i2c_port_t port)
+{
+    for (int i = 0; i < group->bus_count; i++)
+        if (group->buses[i].port == port)
+            return &group->buses[i];
+    if (group->bus_count == BQ27427_GROUP_MAX_BUSES)
+        return NULL;
+
+    bq27427_group_bus_t *bus = &group->buses[group->bus_count++];
+    bus->group = group;
+    bus->port = port;
+    memset(bus->mux_sel, MUX_UNKNOWN, sizeof(bus->mux_sel));
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    bus->lock = xSemaphoreCreateMutexStatic(&bus->lock_buf);
+#else
+    bus->lock = xSemaphoreCreateMutex();
+#endif
+
+    return bus;
+}
+
+static esp_err_t add_mux(bq27427_group_bus_t *bus, const bq27427_group_member_config_t *config)
+{
+    int i = config->mux_addr - TCA9548_ADDR_BASE;
+    if (bus->mux_used & (1 << i))
+        return ESP_OK;
+
+    i2c_dev_t *mux = &bus->mux[i];
+    memset(mux, 0, sizeof(i2c_dev_t));
+    mux->port = config->port;
+    mux->addr = config->mux_addr;
+    mux->cfg.sda_io_num = config->sda_gpio;
+    mux->cfg.scl_io_num = config->scl_gpio;
+#if HELPER_TARGET_IS_ESP32
+    mux->cfg.master.clk_speed = I2C_FREQ_HZ;
+#endif
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    mux->mutex = xSemaphoreCreateMutexStatic(&bus->mux_lock_buf[i]);
+#else
+    CHECK(i2c_dev_create_mutex(mux));
+#endif
+    bus->mux_used |= 1 << i;
+
+    return ESP_OK;
+}
+
+static esp_err_t add_member(bq27427_group_t *group, const bq27427_group_member_config_t *config)
+{
+    bq27427_group_bus_t *bus = get_bus(group, config->port);
+    if (!bus)
+        return ESP_ERR_INVALID_ARG;
+    if (!bus->lock)
+        return ESP_ERR_NO_MEM;
+    if (config->mux_addr)
+        CHECK(add_mux(bus, config));
+
+    bq27427_group_member_t *member = &group->members[group->count];
+    CHECK(bq27427_init_desc(&member->dev, config->port, config->sda_gpio, config->scl_gpio));
+    member->bus = bus - group->buses;
+    member->mux_addr = config->mux_addr;
+    member->mux_channel = config->mux_channel;
+
+    // Insertion sort keeps the scan order grouped by multiplexer and channel
+    int pos = bus->count++;
+    while (pos > 0 && ORDER_KEY(&group->members[bus->order[pos - 1]]) > ORDER_KEY(member)) {
+        bus->order[pos] = bus->order[pos - 1];
+        pos--;
+    }
+    bus->order[pos] = group->count++;
+
+    return ESP_OK;
+}
+
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+// Delete a task that suspended itself; once it is gone its stack and TCB are the caller's again
+static void delete_suspended(TaskHandle_t task)
+{
+    while (eTaskGetState(task) != eSuspended)
+        vTaskDelay(1);
+    vTaskDelete(task);
+}
+#endif
+
+// A worker may be in the middle of a scan; each must be gone before the group is freed
+static void stop_workers(bq27427_group_t *group)
+{
+    int started = 0;
+
+    group->running = false;
+    for (int i = 0; i < group->bus_count; i++) {
+        if (group->buses[i].task) {
+            xTaskNotifyGive(group->buses[i].task);
+            started++;
+        }
+    }
+    for (int i = 0; i < started; i++)
+        xSemaphoreTake(group->done, portMAX_DELAY);
+    for (int i = 0; i < group->bus_count; i++) {
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+        if (group->buses[i].task)
+            delete_suspended(group->buses[i].task);
+#endif
+        group->buses[i].task = NULL;
+    }
+}
+
+static void release(bq27427_group_t *group)
+{
+    for (size_t i = 0; i < group->count; i++)
+        bq27427_free_desc(&group->members[i].dev);
+    for (int i = 0; i < group->bus_count; i++) {
+        bq27427_group_bus_t *bus = &group->buses[i];
+        for (int j = 0; j < TCA9548_ADDR_COUNT; j++) {
+            if (!(bus->mux_used & (1 << j)))
+                continue;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+            vSemaphoreDelete(bus->mux[j].mutex);
+#else
+            i2c_dev_delete_mutex(&bus->mux[j]);
+#endif
+        }
+        if (bus->lock)
+            vSemaphoreDelete(bus->lock);
+    }
+    if (group->lock)
+        vSemaphoreDelete(group->lock);
+    if (group->done)
+        vSemaphoreDelete(group->done);
+    memset(group, 0, sizeof(bq27427_group_t));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_group_init(bq27427_group_t *group, const bq27427_group_member_config_t *members, size_t count,
+                             const bq27427_group_config_t *config)
+{
+    CHECK_ARG(group && members && config);
+    CHECK_ARG(count && count <= CONFIG_BQ27427_GROUP_MAX_GAUGES);
+    for (size_t i = 0; i < count; i++) {
+        uint8_t addr = members[i].mux_addr;
+        CHECK_ARG(!addr || (addr >= TCA9548_ADDR_BASE && addr < TCA9548_ADDR_BASE + TCA9548_ADDR_COUNT));
+        CHECK_ARG(members[i].mux_channel < TCA9548_CHANNELS);
+    }
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    CHECK_ARG(config->task_stacks);
+#endif
+
+    memset(group, 0, sizeof(bq27427_group_t));
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    group->lock = xSemaphoreCreateMutexStatic(&group->lock_buf);
+    group->done = xSemaphoreCreateCountingStatic(BQ27427_GROUP_MAX_BUSES, 0, &group->done_buf);
+#else
+    group->lock = xSemaphoreCreateMutex();
+    group->done = xSemaphoreCreateCounting(BQ27427_GROUP_MAX_BUSES, 0);
+#endif
+    if (!group->lock || !group->done) {
+        release(group);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err;
+    for (size_t i = 0; i < count; i++) {
+        if ((err = add_member(group, &members[i])) != ESP_OK) {
+            ESP_LOGE(TAG, "Could not add gauge %d: %s", (int)i, esp_err_to_name(err));
+            release(group);
+            return err;
+        }
+    }
+
+    group->running = true;
+    for (int i = 0; i < group->bus_count; i++) {
+        bq27427_group_bus_t *bus = &group->buses[i];
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+        // Worker i runs on the i-th stack of the caller's array
+        bus->task = xTaskCreateStatic(bus_task, "bq27427_group", config->task_stack_size, bus, config->task_priority,
+                                      config->task_stacks + i * config->task_stack_size, &bus->task_buf);
+#else
+        if (xTaskCreate(bus_task, "bq27427_group", config->task_stack_size, bus, config->task_priority,
+                        &bus->task) != pdPASS) {
+            stop_workers(group);
+            release(group);
+            return ESP_ERR_NO_MEM;
+        }
+#endif
+    }
+    ESP_LOGD(TAG, "%d gauges on %d ports", (int)group->count, group->bus_count);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_group_free(bq27427_group_t *group)
+{
+    CHECK_ARG(group && group->running);
+
+    xSemaphoreTake(group->lock, portMAX_DELAY);
+    stop_workers(group);
+    xSemaphoreGive(group->lock);
+    release(group);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_group_read_snapshot(bq27427_group_t *group, uint32_t fields, bq27427_snapshot_t *snapshots,
+                                      esp_err_t *results)
+{
+    CHECK_ARG(group && group->running && snapshots);
+    CHECK_ARG(fields && !(fields & ~BQ27427_FIELD_ALL));
+
+    esp_err_t local[CONFIG_BQ27427_GROUP_MAX_GAUGES];
+    if (!results)
+        results = local;
+
+    xSemaphoreTake(group->lock, portMAX_DELAY);
+    group->job_fields = fields;
+    group->job_snapshots = snapshots;
+    group->job_results = results;
+    for (int i = 0; i < group->bus_count; i++)
+        xTaskNotifyGive(group->buses[i].task);
+    for (int i = 0; i < group->bus_count; i++)
+        xSemaphoreTake(group->done, portMAX_DELAY);
+    xSemaphoreGive(group->lock);
+
+    for (size_t i = 0; i < group->count; i++)
+        if (results[i] != ESP_OK)
+            return results[i];
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_group_acquire(bq27427_group_t *group, size_t index, bq27427_t **dev)
+{
+    CHECK_ARG(group && dev && index < group->count);
+
+    bq27427_group_member_t *member = &group->members[index];
+    bq27427_group_bus_t *bus = &group->buses[member->bus];
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    esp_err_t err = select_channel(bus, member);
+    if (err != ESP_OK) {
+        xSemaphoreGive(bus->lock);
+        return err;
+    }
+    *dev = &member->dev;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_group_release(bq27427_group_t *group, size_t index)
+{
+    CHECK_ARG(group && index < group->count);
+
+    xSemaphoreGive(group->buses[group->members[index].bus].lock);
+
+    return ESP_OK;
+}
@@ -0,0 +1,258 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "bq27427_learning.h"
+
+static const char *TAG = "bq27427_learning";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define UPDATE_BITS (BQ27427_STATUS_QMAX_UP | BQ27427_STATUS_RES_UP)
+
+// Index in bq27427_learning_t.blocks
+#define BLOCK_STATE_0 0
+#define BLOCK_RA      2
+
+static const struct {
+    uint8_t class_id;
+    uint8_t block;
+} watched[BQ27427_LEARNING_BLOCKS] = {
+    { BQ27427_ID_STATE, 0 },
+    { BQ27427_ID_STATE, 1 },
+    { BQ27427_ID_R_A_RAM, 0 },
+};
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+// BlockDataCheckSum() of a block
+static uint8_t block_checksum(const uint8_t *data)
+{
+    uint8_t sum = 0;
+
+    for (int i = 0; i < BQ27427_DM_BLOCK_SIZE; i++)
+        sum += data[i];
+
+    return 0xff - sum;
+}
+
+/*
+ * Encode the bytes where cur differs from old as runs of offset, count,
+ * bytes. Changes less than three bytes apart share a run, since a new run
+ * costs two bytes of header. Runs are then at least two bytes apart, so the
+ * payload never exceeds BQ27427_LEARNING_RECORD_MAX. Returns its length.
+ */
+static uint8_t encode_delta(const uint8_t *old, const uint8_t *cur, uint8_t *out)
+{
+    uint8_t n = 0;
+    int i = 0;
+
+    while (i < BQ27427_DM_BLOCK_SIZE) {
+        if (old[i] == cur[i]) {
+            i++;
+            continue;
+        }
+        int end = i + 1, last = i;
+        while (end < BQ27427_DM_BLOCK_SIZE && end - last <= 2) {
+            if (old[end] != cur[end])
+                last = end;
+            end++;
+        }
+        int count = last - i + 1;
+        out[n++] = i;
+        out[n++] = count;
+        memcpy(out + n, cur + i, count);
+        n += count;
+        i = last + 1;
+    }
+
+    return n;
+}
+
+static esp_err_t read_blocks(bq27427_learning_t *mon, uint8_t cause)
+{
+    bq27427_learning_record_t rec = {
+        .timestamp_us = esp_timer_get_time(),
+        .status = mon->status,
+        .cause = cause,
+    };
+    uint8_t cur[BQ27427_LEARNING_BLOCKS][BQ27427_DM_BLOCK_SIZE];
+    bool sealed = mon->status & BQ27427_STATUS_SS;
+    bool changed = false;
+    esp_err_t err = ESP_OK;
+
+    // One unseal for all blocks instead of one per bq27427_read_dm()
+    if (sealed)
+        CHECK(bq27427_unseal(mon->dev));
+    for (int i = 0; i < BQ27427_LEARNING_BLOCKS && err == ESP_OK; i++)
+        err = bq27427_read_dm(mon->dev, watched[i].class_id, watched[i].block * BQ27427_DM_BLOCK_SIZE, cur[i],
+                              BQ27427_DM_BLOCK_SIZE);
+    if (sealed) {
+        esp_err_t r = bq27427_seal(mon->dev);
+        if (err == ESP_OK)
+            err = r;
+    }
+    CHECK(err);
+    mon->block_reads++;
+    mon->verified_us = mon->probed_us = rec.timestamp_us;
+
+    for (int i = 0; i < BQ27427_LEARNING_BLOCKS; i++) {
+        bq27427_learning_block_t *b = &mon->blocks[i];
+        if (mon->baseline && !memcmp(b->data, cur[i], BQ27427_DM_BLOCK_SIZE))
+            continue;
+        rec.class_id = b->class_id;
+        rec.block = b->block;
+        if (mon->baseline)
+            rec.len = encode_delta(b->data, cur[i], rec.data);
+        else {
+            rec.data[0] = 0;
+            rec.data[1] = BQ27427_DM_BLOCK_SIZE;
+            memcpy(rec.data + 2, cur[i], BQ27427_DM_BLOCK_SIZE);
+            rec.len = BQ27427_LEARNING_RECORD_MAX;
+        }
+        memcpy(b->data, cur[i], BQ27427_DM_BLOCK_SIZE);
+        b->checksum = block_checksum(b->data);
+        changed = true;
+        mon->config.cb(&rec, mon->config.ctx);
+    }
+    mon->baseline = true;
+
+    // Keep the count of learning events even if the watched blocks did not move
+    if (!changed && (cause & (BQ27427_LEARNING_QMAX | BQ27427_LEARNING_RES))) {
+        rec.class_id = rec.block = rec.len = 0;
+        mon->config.cb(&rec, mon->config.ctx);
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * Compare the checksums of the watched blocks with the copies. Returns the
+ * causes for the blocks that moved, 0 if none did.
+ */
+static esp_err_t probe_blocks(bq27427_learning_t *mon, uint8_t *cause)
+{
+    bool sealed = mon->status & BQ27427_STATUS_SS;
+    esp_err_t err = ESP_OK;
+
+    *cause = 0;
+    if (sealed)
+        CHECK(bq27427_unseal(mon->dev));
+    for (int i = 0; i < BQ27427_LEARNING_BLOCKS && err == ESP_OK; i++) {
+        uint8_t checksum;
+        err = bq27427_read_dm_checksum(mon->dev, watched[i].class_id, watched[i].block, &checksum);
+        if (err == ESP_OK && checksum != mon->blocks[i].checksum)
+            *cause |= watched[i].class_id == BQ27427_ID_STATE ? BQ27427_LEARNING_QMAX : BQ27427_LEARNING_RES;
+    }
+    if (sealed) {
+        esp_err_t r = bq27427_seal(mon->dev);
+        if (err == ESP_OK)
+            err = r;
+    }
+    CHECK(err);
+    mon->probes++;
+    mon->probed_us = esp_timer_get_time();
+    if (*cause)
+        *cause |= BQ27427_LEARNING_PROBE;
+
+    return ESP_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_learning_init(bq27427_learning_t *mon, bq27427_t *dev, const bq27427_learning_config_t *config)
+{
+    CHECK_ARG(mon && dev && config && config->cb);
+
+    memset(mon, 0, sizeof(bq27427_learning_t));
+    mon->dev = dev;
+    mon->config = *config;
+    for (int i = 0; i < BQ27427_LEARNING_BLOCKS; i++) {
+        mon->blocks[i].class_id = watched[i].class_id;
+        mon->blocks[i].block = watched[i].block;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_learning_poll(bq27427_learning_t *mon)
+{
+    CHECK_ARG(mon && mon->dev);
+
+    uint16_t status;
+    uint8_t cause = 0;
+
+    CHECK(bq27427_get_status(mon->dev, &status));
+    mon->polls++;
+
+    // Only a rising edge is an event: the bits stay set after the first update
+    uint16_t raised = mon->polls > 1 ? status & ~mon->status & UPDATE_BITS : 0;
+    mon->status = status;
+    if (raised & BQ27427_STATUS_QMAX_UP)
+        cause |= BQ27427_LEARNING_QMAX;
+    if (raised & BQ27427_STATUS_RES_UP)
+        cause |= BQ27427_LEARNING_RES;
+    int64_t now = esp_timer_get_time();
+    if (!mon->baseline)
+        cause |= BQ27427_LEARNING_BASELINE;
+    else if (mon->config.verify_interval_ms &&
+             now - mon->verified_us >= (int64_t)mon->config.verify_interval_ms * 1000)
+        cause |= BQ27427_LEARNING_VERIFY;
+    else if (!cause && (status & UPDATE_BITS) &&
+             now - mon->probed_us >= (int64_t)mon->config.probe_interval_ms * 1000)
+        // A set bit hides later updates, so look at the checksums instead
+        CHECK(probe_blocks(mon, &cause));
+    if (cause & BQ27427_LEARNING_QMAX)
+        mon->qmax_updates++;
+    if (cause & BQ27427_LEARNING_RES)
+        mon->res_updates++;
+    if (!cause)
+        return ESP_OK;
+
+    ESP_LOGD(TAG, "Reading learned data, cause 0x%x, status 0x%04x", cause, status);
+
+    return read_blocks(mon, cause);
+}
+
+esp_err_t bq27427_learning_apply(uint8_t *block, const bq27427_learning_record_t *record)
+{
+    CHECK_ARG(block && record && record->len <= BQ27427_LEARNING_RECORD_MAX);
+
+    for (uint8_t i = 0; i < record->len;) {
+        if (i + 2 > record->len)
+            return ESP_ERR_INVALID_RESPONSE;
+        uint8_t offset = record->data[i], count = record->data[i + 1];
+        if (offset + count > BQ27427_DM_BLOCK_SIZE || i + 2 + count > record->len)
+            return ESP_ERR_INVALID_RESPONSE;
+        memcpy(block + offset, record->data + i + 2, count);
+        i += 2 + count;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_learning_get_qmax(const bq27427_learning_t *mon, uint16_t *qmax)
+{
+    CHECK_ARG(mon && qmax);
+
+    if (!mon->baseline)
+        return ESP_ERR_INVALID_STATE;
+    *qmax = get_be16(mon->blocks[BLOCK_STATE_0].data + BQ27427_DM_QMAX);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_learning_get_ra(const bq27427_learning_t *mon, uint16_t *ra)
+{
+    CHECK_ARG(mon && ra);
+
+    if (!mon->baseline)
+        return ESP_ERR_INVALID_STATE;
+    for (int i = 0; i < BQ27427_DM_RA_COUNT; i++)
+        ra[i] = get_be16(mon->blocks[BLOCK_RA].data + BQ27427_DM_RA_0 + 2 * i);
+
+    return ESP_OK;
+}
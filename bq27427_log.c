@@ -0,0 +1,623 @@
+#include <stddef.h>
+#include <string.h>
+#include <esp_log.h>
+#include "bq27427_log.h"
+
+static const char *TAG = "bq27427_log";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+/*
+ * Record tags. Erased storage reads as 0xFF, which ends a page.
+ */
+#define TAG_KEYFRAME 0x4b // 'K' seq, ms, every field in full
+#define TAG_DELTA    0x44 // 'D' interval change, changed mask, field changes
+#define TAG_GAP      0x47 // 'G' samples skipped, then as TAG_DELTA
+#define TAG_ERASED   0xff
+
+#define FIELD_SOH 13 // Bit of BQ27427_FIELD_SOH: two bytes, not a word
+
+/*
+ * Location of each 16-bit field in bq27427_snapshot_t, indexed by bit
+ * position in bq27427_field_t. StateOfHealth() is two separate bytes.
+ */
+static const uint8_t field_offsets[BQ27427_FIELD_COUNT] = {
+    offsetof(bq27427_snapshot_t, temperature),
+    offsetof(bq27427_snapshot_t, voltage),
+    offsetof(bq27427_snapshot_t, flags),
+    offsetof(bq27427_snapshot_t, nom_capacity),
+    offsetof(bq27427_snapshot_t, avail_capacity),
+    offsetof(bq27427_snapshot_t, rem_capacity),
+    offsetof(bq27427_snapshot_t, full_capacity),
+    offsetof(bq27427_snapshot_t, avg_current),
+    offsetof(bq27427_snapshot_t, stdby_current),
+    offsetof(bq27427_snapshot_t, max_current),
+    offsetof(bq27427_snapshot_t, avg_power),
+    offsetof(bq27427_snapshot_t, soc),
+    offsetof(bq27427_snapshot_t, int_temperature),
+    offsetof(bq27427_snapshot_t, soh),
+    offsetof(bq27427_snapshot_t, rem_cap_unfl),
+    offsetof(bq27427_snapshot_t, rem_cap_fil),
+    offsetof(bq27427_snapshot_t, full_cap_unfl),
+    offsetof(bq27427_snapshot_t, full_cap_fil),
+    offsetof(bq27427_snapshot_t, soc_unfl),
+};
+
+static uint16_t field_get(const bq27427_snapshot_t *snap, int i)
+{
+    uint16_t v;
+
+    if (i == FIELD_SOH)
+        return snap->soh | snap->soh_status << 8;
+    memcpy(&v, (const uint8_t *)snap + field_offsets[i], sizeof(v));
+
+    return v;
+}
+
+static void field_set(bq27427_snapshot_t *snap, int i, uint16_t v)
+{
+    if (i == FIELD_SOH) {
+        snap->soh = v & 0xff;
+        snap->soh_status = v >> 8;
+        return;
+    }
+    memcpy((uint8_t *)snap + field_offsets[i], &v, sizeof(v));
+}
+
+static uint32_t fnv1a(const uint8_t *p, size_t len)
+{
+    uint32_t hash = FNV_OFFSET;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+
+    return n;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline uint32_t next_page(const bq27427_log_storage_t *storage, uint32_t page)
+{
+    page += storage->page_size;
+
+    return page < storage->size ? page : 0;
+}
+
+static inline uint32_t prev_page(const bq27427_log_storage_t *storage, uint32_t page)
+{
+    return (page ? page : storage->size) - storage->page_size;
+}
+
+static bool storage_valid(const bq27427_log_storage_t *storage)
+{
+    return storage->read && storage->write && storage->erase && storage->page_size >= BQ27427_LOG_MIN_PAGE &&
+           storage->size >= 2 * storage->page_size && storage->size % storage->page_size == 0;
+}
+
+static esp_err_t read_header(const bq27427_log_storage_t *storage, uint32_t page, uint32_t *seq, uint32_t *fields)
+{
+    uint8_t h[BQ27427_LOG_HEADER_SIZE];
+
+    CHECK(storage->read(storage->ctx, page, h, sizeof(h)));
+    if (get_le32(h) != BQ27427_LOG_MAGIC || get_le32(h + 16) != fnv1a(h, 16) ||
+        get_le32(h + 12) != storage->page_size)
+        return ESP_ERR_NOT_FOUND;
+    *seq = get_le32(h + 4);
+    *fields = get_le32(h + 8);
+
+    return ESP_OK;
+}
+
+// Page with the highest sequence number, in serial number order
+static esp_err_t find_newest(const bq27427_log_storage_t *storage, uint32_t *page, uint32_t *seq)
+{
+    bool found = false;
+
+    for (uint32_t p = 0; p < storage->size; p += storage->page_size) {
+        uint32_t s, fields;
+        esp_err_t err = read_header(storage, p, &s, &fields);
+        if (err == ESP_ERR_NOT_FOUND)
+            continue;
+        CHECK(err);
+        if (!found || (int32_t)(s - *seq) > 0) {
+            *page = p;
+            *seq = s;
+            found = true;
+        }
+    }
+
+    return found ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+// Previous page of the chain ending at page, if it is still intact
+static bool chain_prev(const bq27427_log_storage_t *storage, uint32_t page, uint32_t seq, uint32_t *prev)
+{
+    uint32_t p = prev_page(storage, page), s, fields;
+
+    if (read_header(storage, p, &s, &fields) != ESP_OK || s != seq - 1)
+        return false;
+    *prev = p;
+
+    return true;
+}
+
+/////////////////////////////// Reader ////////////////////////////////////////
+
+static esp_err_t enter_page(bq27427_log_reader_t *r, uint32_t page)
+{
+    CHECK(read_header(&r->storage, page, &r->page_seq, &r->fields));
+    r->page = page;
+    r->pos = page + BQ27427_LOG_HEADER_SIZE;
+    r->has_prev = false;
+    r->cache_len = 0;
+
+    return ESP_OK;
+}
+
+// ESP_ERR_NOT_FOUND at the end of the page
+static esp_err_t read_byte(bq27427_log_reader_t *r, uint8_t *b)
+{
+    uint32_t end = r->page + r->storage.page_size;
+
+    if (r->pos >= end)
+        return ESP_ERR_NOT_FOUND;
+    if (r->pos < r->cache_pos || r->pos >= r->cache_pos + r->cache_len) {
+        uint32_t len = end - r->pos < sizeof(r->cache) ? end - r->pos : sizeof(r->cache);
+        CHECK(r->storage.read(r->storage.ctx, r->pos, r->cache, len));
+        r->cache_pos = r->pos;
+        r->cache_len = len;
+    }
+    *b = r->cache[r->pos++ - r->cache_pos];
+
+    return ESP_OK;
+}
+
+// ESP_ERR_INVALID_RESPONSE if the varint is cut off by the end of the page or too long
+static esp_err_t read_varint(bq27427_log_reader_t *r, uint64_t *v)
+{
+    uint8_t b;
+
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        esp_err_t err = read_byte(r, &b);
+        if (err == ESP_ERR_NOT_FOUND)
+            return ESP_ERR_INVALID_RESPONSE;
+        CHECK(err);
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return ESP_OK;
+    }
+
+    return ESP_ERR_INVALID_RESPONSE;
+}
+
+/*
+ * Decode the record at r->pos. Returns ESP_ERR_NOT_FOUND at the clean end of
+ * the page and ESP_ERR_INVALID_RESPONSE for a record cut short; either way
+ * r->pos is left at the start of the record.
+ */
+static esp_err_t read_record(bq27427_log_reader_t *r, bq27427_sample_t *sample)
+{
+    uint32_t start = r->pos, seq = r->prev_seq;
+    int64_t ms = r->prev_ms, interval = r->prev_interval;
+    uint16_t values[BQ27427_FIELD_COUNT];
+    uint64_t v, mask = 0;
+    uint8_t tag;
+    esp_err_t err;
+
+#define READ(out) do { if ((err = read_varint(r, (out))) != ESP_OK) goto fail; } while (0)
+
+    // Decode into locals so that a record cut short leaves the state as it was
+    memcpy(values, r->prev, sizeof(values));
+    if ((err = read_byte(r, &tag)) != ESP_OK)
+        goto fail;
+    switch (tag) {
+        case TAG_KEYFRAME:
+            READ(&v);
+            seq = v;
+            READ(&v);
+            ms = v;
+            interval = 0;
+            for (int i = 0; i < BQ27427_FIELD_COUNT; i++) {
+                if (!(r->fields & (1 << i)))
+                    continue;
+                READ(&v);
+                values[i] = v;
+            }
+            break;
+        case TAG_DELTA:
+        case TAG_GAP:
+            if (!r->has_prev) {
+                err = ESP_ERR_INVALID_RESPONSE;
+                goto fail;
+            }
+            v = 0;
+            if (tag == TAG_GAP)
+                READ(&v);
+            seq += 1 + v;
+            READ(&v);
+            interval += unzigzag(v);
+            ms += interval;
+            READ(&mask);
+            for (int i = 0, k = 0; i < BQ27427_FIELD_COUNT; i++) {
+                if (!(r->fields & (1 << i)))
+                    continue;
+                if (mask & (1ull << k++)) {
+                    READ(&v);
+                    values[i] += (int16_t)unzigzag(v);
+                }
+            }
+            break;
+        case TAG_ERASED:
+            err = ESP_ERR_NOT_FOUND;
+            goto fail;
+        default:
+            err = ESP_ERR_INVALID_RESPONSE;
+            goto fail;
+    }
+
+#undef READ
+
+    r->prev_seq = seq;
+    r->prev_ms = ms;
+    r->prev_interval = interval;
+    memcpy(r->prev, values, sizeof(values));
+    r->has_prev = true;
+
+    memset(sample, 0, sizeof(bq27427_sample_t));
+    sample->seq = seq;
+    sample->timestamp_us = ms * 1000;
+    sample->snap.fields = r->fields;
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++)
+        if (r->fields & (1 << i))
+            field_set(&sample->snap, i, values[i]);
+
+    return ESP_OK;
+
+fail:
+    r->pos = start;
+    if (err == ESP_ERR_INVALID_RESPONSE)
+        ESP_LOGW(TAG, "Record at 0x%08x cut short", (unsigned)start);
+
+    return err;
+}
+
+/////////////////////////////// Writer ////////////////////////////////////////
+
+static esp_err_t write_staged(bq27427_log_t *log)
+{
+    if (!log->fill)
+        return ESP_OK;
+    CHECK(log->storage.write(log->storage.ctx, log->pos, log->buf, log->fill));
+    log->pos += log->fill;
+    log->bytes += log->fill;
+    log->fill = 0;
+
+    return ESP_OK;
+}
+
+static esp_err_t stage(bq27427_log_t *log, const uint8_t *data, size_t len)
+{
+    if (log->fill + len > sizeof(log->buf))
+        CHECK(write_staged(log));
+    memcpy(log->buf + log->fill, data, len);
+    log->fill += len;
+
+    return ESP_OK;
+}
+
+static esp_err_t start_page(bq27427_log_t *log, uint32_t page, uint32_t seq)
+{
+    uint8_t h[BQ27427_LOG_HEADER_SIZE];
+
+    CHECK(write_staged(log));
+    CHECK(log->storage.erase(log->storage.ctx, page, log->storage.page_size));
+    put_le32(h, BQ27427_LOG_MAGIC);
+    put_le32(h + 4, seq);
+    put_le32(h + 8, log->fields);
+    put_le32(h + 12, log->storage.page_size);
+    put_le32(h + 16, fnv1a(h, 16));
+
+    log->page = page;
+    log->page_seq = seq;
+    log->pos = page;
+    log->has_prev = false;
+    ESP_LOGD(TAG, "Page %u at 0x%08x", (unsigned)seq, (unsigned)page);
+
+    return stage(log, h, sizeof(h));
+}
+
+static size_t encode_keyframe(bq27427_log_t *log, uint32_t seq, int64_t ms, const uint16_t *values, uint8_t *rec)
+{
+    size_t n = 0;
+
+    rec[n++] = TAG_KEYFRAME;
+    n += put_varint(rec + n, seq);
+    n += put_varint(rec + n, ms);
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++)
+        if (log->fields & (1 << i))
+            n += put_varint(rec + n, values[i]);
+
+    return n;
+}
+
+static size_t encode_delta(bq27427_log_t *log, uint32_t seq, int64_t ms, const uint16_t *values, uint8_t *rec)
+{
+    uint8_t changes[BQ27427_LOG_RECORD_MAX];
+    uint32_t mask = 0;
+    size_t n = 0, len = 0;
+    int k = 0;
+
+    rec[n++] = seq == log->prev_seq + 1 ? TAG_DELTA : TAG_GAP;
+    if (rec[0] == TAG_GAP)
+        n += put_varint(rec + n, seq - log->prev_seq - 1);
+    n += put_varint(rec + n, zigzag((ms - log->prev_ms) - log->prev_interval));
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++) {
+        if (!(log->fields & (1 << i)))
+            continue;
+        int16_t d = values[i] - log->prev[i];
+        if (d) {
+            mask |= 1 << k;
+            len += put_varint(changes + len, zigzag(d));
+        }
+        k++;
+    }
+    n += put_varint(rec + n, mask);
+    memcpy(rec + n, changes, len);
+
+    return n + len;
+}
+
+// Find where the newest page ends, or start a new page if it can't be continued
+static esp_err_t resume(bq27427_log_t *log, uint32_t page, uint32_t seq)
+{
+    bq27427_log_reader_t r = { .storage = log->storage };
+    bq27427_sample_t sample;
+    esp_err_t err;
+
+    CHECK(enter_page(&r, page));
+    if (r.fields != log->fields)
+        return start_page(log, next_page(&log->storage, page), seq + 1);
+    while ((err = read_record(&r, &sample)) == ESP_OK)
+        ;
+    if (err != ESP_ERR_NOT_FOUND && err != ESP_ERR_INVALID_RESPONSE)
+        return err;
+    if (err == ESP_ERR_INVALID_RESPONSE || r.pos + BQ27427_LOG_RECORD_MAX > page + log->storage.page_size)
+        return start_page(log, next_page(&log->storage, page), seq + 1);
+
+    log->page = page;
+    log->page_seq = seq;
+    log->pos = r.pos;
+    ESP_LOGD(TAG, "Continuing page %u at 0x%08x", (unsigned)seq, (unsigned)r.pos);
+
+    return ESP_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static esp_err_t file_read(void *ctx, uint32_t offset, void *data, size_t len)
+{
+    FILE *f = (FILE *)ctx;
+
+    if (fseek(f, offset, SEEK_SET) || fread(data, 1, len, f) != len)
+        return ESP_FAIL;
+
+    return ESP_OK;
+}
+
+static esp_err_t file_write(void *ctx, uint32_t offset, const void *data, size_t len)
+{
+    FILE *f = (FILE *)ctx;
+
+    if (fseek(f, offset, SEEK_SET) || fwrite(data, 1, len, f) != len || fflush(f))
+        return ESP_FAIL;
+
+    return ESP_OK;
+}
+
+static esp_err_t file_erase(void *ctx, uint32_t offset, size_t len)
+{
+    FILE *f = (FILE *)ctx;
+    uint8_t ff[64];
+
+    memset(ff, 0xff, sizeof(ff));
+    if (fseek(f, offset, SEEK_SET))
+        return ESP_FAIL;
+    while (len) {
+        size_t n = len < sizeof(ff) ? len : sizeof(ff);
+        if (fwrite(ff, 1, n, f) != n)
+            return ESP_FAIL;
+        len -= n;
+    }
+
+    return fflush(f) ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t bq27427_log_storage_file(bq27427_log_storage_t *storage, FILE *file, uint32_t size, uint32_t page_size)
+{
+    CHECK_ARG(storage && file);
+
+    storage->read = file_read;
+    storage->write = file_write;
+    storage->erase = file_erase;
+    storage->ctx = file;
+    storage->size = size;
+    storage->page_size = page_size;
+    CHECK_ARG(storage_valid(storage));
+
+    if (fseek(file, 0, SEEK_END))
+        return ESP_FAIL;
+    long end = ftell(file);
+    if (end < 0)
+        return ESP_FAIL;
+    if ((uint32_t)end < size)
+        return file_erase(file, end, size - end);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_log_open(bq27427_log_t *log, const bq27427_log_storage_t *storage, uint32_t fields)
+{
+    CHECK_ARG(log && storage && storage_valid(storage));
+    CHECK_ARG(fields && !(fields & ~BQ27427_FIELD_ALL));
+
+    uint32_t page, seq;
+
+    memset(log, 0, sizeof(bq27427_log_t));
+    log->storage = *storage;
+    log->fields = fields;
+
+    esp_err_t err = find_newest(storage, &page, &seq);
+    if (err == ESP_ERR_NOT_FOUND)
+        return start_page(log, 0, 0);
+    CHECK(err);
+
+    return resume(log, page, seq);
+}
+
+esp_err_t bq27427_log_append(bq27427_log_t *log, const bq27427_sample_t *sample)
+{
+    CHECK_ARG(log && sample && (sample->snap.fields & log->fields) == log->fields);
+
+    uint16_t values[BQ27427_FIELD_COUNT];
+    uint8_t rec[BQ27427_LOG_RECORD_MAX];
+    int64_t ms = sample->timestamp_us / 1000;
+    bool delta = log->has_prev && (int32_t)(sample->seq - log->prev_seq) > 0;
+    size_t len;
+
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++)
+        if (log->fields & (1 << i))
+            values[i] = field_get(&sample->snap, i);
+
+    len = delta ? encode_delta(log, sample->seq, ms, values, rec) : encode_keyframe(log, sample->seq, ms, values, rec);
+    if (log->pos + log->fill + len > log->page + log->storage.page_size) {
+        CHECK(start_page(log, next_page(&log->storage, log->page), log->page_seq + 1));
+        delta = false;
+        len = encode_keyframe(log, sample->seq, ms, values, rec);
+    }
+    CHECK(stage(log, rec, len));
+
+    log->prev_interval = delta ? ms - log->prev_ms : 0;
+    log->prev_ms = ms;
+    log->prev_seq = sample->seq;
+    memcpy(log->prev, values, sizeof(values));
+    log->has_prev = true;
+    log->samples++;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_log_flush(bq27427_log_t *log)
+{
+    CHECK_ARG(log);
+
+    return write_staged(log);
+}
+
+esp_err_t bq27427_log_reader_init(bq27427_log_reader_t *reader, const bq27427_log_storage_t *storage)
+{
+    CHECK_ARG(reader && storage && storage_valid(storage));
+
+    uint32_t page, seq;
+
+    memset(reader, 0, sizeof(bq27427_log_reader_t));
+    reader->storage = *storage;
+    CHECK(find_newest(storage, &page, &seq));
+    for (uint32_t n = storage->size / storage->page_size; n > 1 && chain_prev(storage, page, seq, &page); n--)
+        seq--;
+
+    return enter_page(reader, page);
+}
+
+esp_err_t bq27427_log_reader_seek(bq27427_log_reader_t *reader, int64_t timestamp_us)
+{
+    CHECK_ARG(reader && storage_valid(&reader->storage));
+
+    const bq27427_log_storage_t *storage = &reader->storage;
+    bq27427_sample_t sample;
+    uint32_t page, seq;
+    bool found = false;
+
+    CHECK(find_newest(storage, &page, &seq));
+    for (uint32_t n = storage->size / storage->page_size; n > 0; n--) {
+        CHECK(enter_page(reader, page));
+        if (read_record(reader, &sample) == ESP_OK && sample.timestamp_us <= timestamp_us) {
+            found = true;
+            break;
+        }
+        if (n == 1 || !chain_prev(storage, page, seq, &page))
+            break;
+        seq--;
+    }
+    if (!found)
+        return ESP_ERR_NOT_FOUND;
+
+    // Decode forward; keep the state before the first sample in range
+    CHECK(enter_page(reader, page));
+    for (;;) {
+        bq27427_log_reader_t before = *reader;
+        esp_err_t err = bq27427_log_reader_next(reader, &sample);
+        if (err == ESP_ERR_NOT_FOUND || (err == ESP_OK && sample.timestamp_us >= timestamp_us)) {
+            *reader = before;
+            return ESP_OK;
+        }
+        CHECK(err);
+    }
+}
+
+esp_err_t bq27427_log_reader_next(bq27427_log_reader_t *reader, bq27427_sample_t *sample)
+{
+    CHECK_ARG(reader && sample);
+
+    for (;;) {
+        esp_err_t err = read_record(reader, sample);
+        if (err != ESP_ERR_NOT_FOUND && err != ESP_ERR_INVALID_RESPONSE)
+            return err;
+
+        // End of page, clean or cut short: continue on the next page of the chain
+        uint32_t page = next_page(&reader->storage, reader->page), seq, fields;
+        if (read_header(&reader->storage, page, &seq, &fields) != ESP_OK || seq != reader->page_seq + 1)
+            return ESP_ERR_NOT_FOUND;
+        CHECK(enter_page(reader, page));
+    }
+}
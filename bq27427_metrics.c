@@ -0,0 +1,189 @@
+#include <string.h>
+#include <esp_log.h>
+#include "bq27427_metrics.h"
+
+static const char *TAG = "bq27427_metrics";
+
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define ONE (1 << BQ27427_METRICS_FRAC_BITS)
+#define READ_ATTEMPTS 4 // Consistent copies tried by bq27427_metrics_get()
+
+static bool field_value(const bq27427_snapshot_t *s, bq27427_field_t field, uint16_t *v)
+{
+    switch (field) {
+        case BQ27427_FIELD_TEMP: *v = s->temperature; break;
+        case BQ27427_FIELD_VOLTAGE: *v = s->voltage; break;
+        case BQ27427_FIELD_NOM_CAPACITY: *v = s->nom_capacity; break;
+        case BQ27427_FIELD_AVAIL_CAPACITY: *v = s->avail_capacity; break;
+        case BQ27427_FIELD_REM_CAPACITY: *v = s->rem_capacity; break;
+        case BQ27427_FIELD_FULL_CAPACITY: *v = s->full_capacity; break;
+        case BQ27427_FIELD_AVG_CURRENT: *v = s->avg_current; break;
+        case BQ27427_FIELD_STDBY_CURRENT: *v = s->stdby_current; break;
+        case BQ27427_FIELD_MAX_CURRENT: *v = s->max_current; break;
+        case BQ27427_FIELD_AVG_POWER: *v = s->avg_power; break;
+        case BQ27427_FIELD_SOC: *v = s->soc; break;
+        case BQ27427_FIELD_INT_TEMP: *v = s->int_temperature; break;
+        case BQ27427_FIELD_SOH: *v = s->soh; break;
+        case BQ27427_FIELD_REM_CAP_UNFL: *v = s->rem_cap_unfl; break;
+        case BQ27427_FIELD_REM_CAP_FIL: *v = s->rem_cap_fil; break;
+        case BQ27427_FIELD_FULL_CAP_UNFL: *v = s->full_cap_unfl; break;
+        case BQ27427_FIELD_FULL_CAP_FIL: *v = s->full_cap_fil; break;
+        case BQ27427_FIELD_SOC_UNFL: *v = s->soc_unfl; break;
+        default: return false;
+    }
+
+    return true;
+}
+
+static bool field_is_signed(bq27427_field_t field)
+{
+    return field == BQ27427_FIELD_AVG_CURRENT || field == BQ27427_FIELD_STDBY_CURRENT ||
+           field == BQ27427_FIELD_MAX_CURRENT || field == BQ27427_FIELD_AVG_POWER;
+}
+
+static inline int32_t value_at(const bq27427_metric_t *m, uint16_t pos)
+{
+    return m->is_signed ? (int16_t)m->values[pos] : m->values[pos];
+}
+
+/*
+ * Monotonic deques. Both hold window positions in the order the samples
+ * arrived; the values at those positions only ever increase (min) or
+ * decrease (max) from front to back, so the front is the extreme of the
+ * window. A new sample first pops every entry from the back that it makes
+ * irrelevant, and the front leaves when its position is overwritten. Each
+ * position enters and leaves a deque once, hence O(1) amortized.
+ */
+#define DEQUE_AT(m, q, i) ((q)->pos[((q)->head + (i)) % (m)->config.window])
+
+static void deque_expire(const bq27427_metric_t *m, bq27427_metric_deque_t *q, uint16_t pos)
+{
+    if (q->len && q->pos[q->head] == pos) {
+        q->head = (q->head + 1) % m->config.window;
+        q->len--;
+    }
+}
+
+static void deque_push(bq27427_metric_t *m, bq27427_metric_deque_t *q, uint16_t pos, bool is_min)
+{
+    int32_t v = value_at(m, pos);
+
+    while (q->len) {
+        int32_t back = value_at(m, DEQUE_AT(m, q, q->len - 1));
+        if (is_min ? back < v : back > v)
+            break;
+        q->len--;
+    }
+    DEQUE_AT(m, q, q->len) = pos;
+    q->len++;
+}
+
+static void add_sample(bq27427_metric_t *m, uint16_t raw, int64_t timestamp_us)
+{
+    uint16_t pos = m->pos;
+    int32_t v;
+
+    if (m->count == m->config.window) {
+        m->sum -= value_at(m, pos);
+        deque_expire(m, &m->min, pos);
+        deque_expire(m, &m->max, pos);
+    } else
+        m->count++;
+    m->values[pos] = raw;
+    v = value_at(m, pos);
+    m->sum += v;
+    deque_push(m, &m->min, pos, true);
+    deque_push(m, &m->max, pos, false);
+    m->pos = (pos + 1) % m->config.window;
+
+    /*
+     * First-order low-pass filter for irregular sample spacing:
+     * ewma += (v - ewma) * dt / (tau + dt)
+     */
+    int64_t dt = timestamp_us - m->timestamp_us;
+    int64_t tau = (int64_t)m->config.ewma_tau_ms * 1000;
+    if (!m->samples || !tau)
+        m->ewma = v * ONE;
+    else if (dt > 0)
+        m->ewma += ((int64_t)v * ONE - m->ewma) * dt / (tau + dt);
+    m->samples++;
+    m->timestamp_us = timestamp_us;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_metrics_init(bq27427_metrics_t *metrics, const bq27427_metric_config_t *config, size_t count)
+{
+    CHECK_ARG(metrics && config && count && count <= CONFIG_BQ27427_METRICS_MAX);
+
+    uint16_t dummy;
+    bq27427_snapshot_t snap = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        CHECK_ARG(field_value(&snap, config[i].field, &dummy));
+        CHECK_ARG(config[i].window && config[i].window <= CONFIG_BQ27427_METRICS_WINDOW_MAX);
+    }
+
+    memset(metrics, 0, sizeof(bq27427_metrics_t));
+    metrics->count = count;
+    for (size_t i = 0; i < count; i++) {
+        metrics->metric[i].config = config[i];
+        metrics->metric[i].is_signed = field_is_signed(config[i].field);
+    }
+    ESP_LOGD(TAG, "Tracking %u metrics", (unsigned)count);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_metrics_update(bq27427_metrics_t *metrics, const bq27427_snapshot_t *snapshot, int64_t timestamp_us)
+{
+    CHECK_ARG(metrics && snapshot);
+
+    // Same sequence protocol as the sampler slots: odd while writing
+    __atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (size_t i = 0; i < metrics->count; i++) {
+        bq27427_metric_t *m = &metrics->metric[i];
+        uint16_t raw;
+        if ((snapshot->fields & m->config.field) && field_value(snapshot, m->config.field, &raw))
+            add_sample(m, raw, timestamp_us);
+    }
+    __atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELEASE);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_metrics_get(bq27427_metrics_t *metrics, size_t index, bq27427_metric_value_t *value)
+{
+    CHECK_ARG(metrics && value && index < metrics->count);
+
+    const bq27427_metric_t *m = &metrics->metric[index];
+    uint32_t seq;
+
+    /*
+     * A writer of lower priority that this task preempted mid-update cannot
+     * finish while we retry, so give up after a few attempts.
+     */
+    for (int attempt = 0;; attempt++) {
+        if (attempt == READ_ATTEMPTS)
+            return ESP_ERR_INVALID_STATE;
+        if ((seq = __atomic_load_n(&metrics->seq, __ATOMIC_ACQUIRE)) & 1)
+            continue;
+        value->field = m->config.field;
+        value->samples = m->samples;
+        value->count = m->count;
+        value->timestamp_us = m->timestamp_us;
+        if (m->count) {
+            value->last = value_at(m, (m->pos + m->config.window - 1) % m->config.window);
+            value->min = value_at(m, m->min.pos[m->min.head]);
+            value->max = value_at(m, m->max.pos[m->max.head]);
+            value->mean = (int64_t)m->sum * ONE / m->count;
+            value->ewma = m->ewma;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&metrics->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+
+    return value->count ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
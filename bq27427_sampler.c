@@ -0,0 +1,204 @@
+#include <inttypes.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "bq27427_sampler.h"
+
+static const char *TAG = "bq27427_sampler";
+
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define RING_SIZE CONFIG_BQ27427_SAMPLER_RING_SIZE
+
+/*
+ * Slot protocol. Sample number n lives in ring[n % RING_SIZE]. The producer
+ * sets the slot's seq to 2n + 1 before writing the sample and to 2n + 2 after,
+ * then publishes head = n + 1. A reader looking for sample n accepts the copy
+ * only if seq was 2n + 2 both before and after copying.
+ */
+#define SEQ_WRITING(n) (2 * (n) + 1)
+#define SEQ_DONE(n)    (2 * (n) + 2)
+
+static void publish(bq27427_sampler_t *s, const bq27427_snapshot_t *snap, int64_t timestamp)
+{
+    uint32_t n = s->head;
+    bq27427_sampler_slot_t *slot = &s->ring[n % RING_SIZE];
+
+    __atomic_store_n(&slot->seq, SEQ_WRITING(n), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->sample.seq = n;
+    slot->sample.timestamp_us = timestamp;
+    slot->sample.snap = *snap;
+    __atomic_store_n(&slot->seq, SEQ_DONE(n), __ATOMIC_RELEASE);
+    __atomic_store_n(&s->head, n + 1, __ATOMIC_RELEASE);
+}
+
+// Copy sample n if it is still in its slot
+static bool copy_sample(bq27427_sampler_t *s, uint32_t n, bq27427_sample_t *out)
+{
+    bq27427_sampler_slot_t *slot = &s->ring[n % RING_SIZE];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != SEQ_DONE(n))
+        return false;
+    memcpy(out, &slot->sample, sizeof(bq27427_sample_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == SEQ_DONE(n);
+}
+
+static void sampler_task(void *arg)
+{
+    bq27427_sampler_t *s = (bq27427_sampler_t *)arg;
+    TickType_t period = pdMS_TO_TICKS(s->config.period_ms);
+    TickType_t wake = xTaskGetTickCount();
+    bq27427_snapshot_t snap;
+
+    while (s->running) {
+        int64_t timestamp = esp_timer_get_time();
+        esp_err_t err = bq27427_read_snapshot(s->dev, s->config.fields, &snap);
+        if (err == ESP_OK) {
+            publish(s, &snap, timestamp);
+            if (s->config.metrics)
+                bq27427_metrics_update(s->config.metrics, &snap, timestamp);
+        } else {
+            s->errors++;
+            ESP_LOGW(TAG, "Sample failed: %s", esp_err_to_name(err));
+        }
+
+        // Sleep on a notification so that bq27427_sampler_stop() can wake us
+        wake += period;
+        TickType_t now = xTaskGetTickCount();
+        if ((int32_t)(wake - now) > 0)
+            ulTaskNotifyTake(pdTRUE, wake - now);
+        else
+            wake = now;
+    }
+
+    xSemaphoreGive(s->stopped);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The stack is the caller's: bq27427_sampler_stop() deletes the task once it is suspended
+    vTaskSuspend(NULL);
+#else
+    vTaskDelete(NULL);
+#endif
+}
+
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+// Delete a task that suspended itself; once it is gone its stack and TCB are the caller's again
+static void delete_suspended(TaskHandle_t task)
+{
+    while (eTaskGetState(task) != eSuspended)
+        vTaskDelay(1);
+    vTaskDelete(task);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_sampler_start(bq27427_sampler_t *sampler, bq27427_t *dev, const bq27427_sampler_config_t *config)
+{
+    CHECK_ARG(sampler && dev && config);
+    CHECK_ARG(config->fields && !(config->fields & ~BQ27427_FIELD_ALL));
+    CHECK_ARG(config->period_ms && pdMS_TO_TICKS(config->period_ms));
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    CHECK_ARG(config->task_stack);
+#endif
+
+    memset(sampler, 0, sizeof(bq27427_sampler_t));
+    sampler->dev = dev;
+    sampler->config = *config;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The task and the semaphore live in sampler, the stack is the caller's
+    sampler->stopped = xSemaphoreCreateBinaryStatic(&sampler->stopped_buf);
+    sampler->running = true;
+    sampler->task = xTaskCreateStatic(sampler_task, "bq27427_sampler", config->task_stack_size, sampler,
+                                      config->task_priority, config->task_stack, &sampler->task_buf);
+#else
+    sampler->stopped = xSemaphoreCreateBinary();
+    if (!sampler->stopped)
+        return ESP_ERR_NO_MEM;
+
+    sampler->running = true;
+    if (xTaskCreate(sampler_task, "bq27427_sampler", config->task_stack_size, sampler, config->task_priority,
+                    &sampler->task) != pdPASS) {
+        vSemaphoreDelete(sampler->stopped);
+        sampler->stopped = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    ESP_LOGD(TAG, "Sampling 0x%05" PRIx32 " every %" PRIu32 " ms", config->fields, config->period_ms);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_sampler_stop(bq27427_sampler_t *sampler)
+{
+    CHECK_ARG(sampler && sampler->task);
+
+    sampler->running = false;
+    xTaskNotifyGive(sampler->task);
+    // A read can wait for a configuration session; the task must be gone before sampler is freed
+    xSemaphoreTake(sampler->stopped, portMAX_DELAY);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    delete_suspended(sampler->task);
+#endif
+    vSemaphoreDelete(sampler->stopped);
+    sampler->stopped = NULL;
+    sampler->task = NULL;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_sampler_reader_init(bq27427_sampler_t *sampler, bq27427_sampler_reader_t *reader, bool from_oldest)
+{
+    CHECK_ARG(sampler && reader);
+
+    uint32_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+    reader->dropped = 0;
+    if (!from_oldest)
+        reader->next = head;
+    else
+        reader->next = head > RING_SIZE ? head - RING_SIZE : 0;
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_sampler_read(bq27427_sampler_t *sampler, bq27427_sampler_reader_t *reader, bq27427_sample_t *sample)
+{
+    CHECK_ARG(sampler && reader && sample);
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+        if (reader->next == head)
+            return ESP_ERR_NOT_FOUND;
+        if (head - reader->next > RING_SIZE) {
+            // Lapped by the producer: continue from the oldest sample kept
+            reader->dropped += head - reader->next - RING_SIZE;
+            reader->next = head - RING_SIZE;
+        }
+        if (copy_sample(sampler, reader->next, sample)) {
+            reader->next++;
+            return ESP_OK;
+        }
+        /*
+         * The slot is being overwritten with sample next + RING_SIZE. Waiting
+         * for the producer could spin forever if it runs at a lower priority
+         * on the same core, so the sample counts as dropped.
+         */
+        reader->dropped++;
+        reader->next++;
+    }
+}
+
+esp_err_t bq27427_sampler_latest(bq27427_sampler_t *sampler, bq27427_sample_t *sample)
+{
+    CHECK_ARG(sampler && sample);
+
+    // Step back over slots the producer is rewriting instead of waiting for it
+    uint32_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+    for (uint32_t n = head; n && head - n < RING_SIZE; n--)
+        if (copy_sample(sampler, n - 1, sample))
+            return ESP_OK;
+
+    return ESP_ERR_NOT_FOUND;
+}
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include "bq27427_scheduler.h"
+
+static const char *TAG = "bq27427_scheduler";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define POLL_FIELDS (BQ27427_FIELD_FLAGS | BQ27427_FIELD_SOC | BQ27427_FIELD_AVG_CURRENT)
+
+static uint32_t rate_period(const bq27427_scheduler_t *sched, bq27427_rate_t rate)
+{
+    switch (rate) {
+        case BQ27427_RATE_IDLE:
+            return sched->config.idle_ms;
+        case BQ27427_RATE_FAST:
+            return sched->config.fast_ms;
+        default:
+            return sched->config.normal_ms;
+    }
+}
+
+static bool near(uint16_t soc, uint8_t threshold, uint8_t margin)
+{
+    return threshold && abs((int)soc - threshold) <= margin;
+}
+
+// Conditions that call for the fast rate, in order of precedence
+static bool fast_trigger(bq27427_scheduler_t *sched, const bq27427_snapshot_t *snap, bq27427_rate_reason_t *reason)
+{
+    const bq27427_scheduler_config_t *config = &sched->config;
+
+    if (sched->primed && ((sched->prev_flags ^ snap->flags) & (BQ27427_FLAG_CHG | BQ27427_FLAG_DSG))) {
+        *reason = BQ27427_RATE_REASON_CHG_DSG;
+        return true;
+    }
+    if (near(snap->soc, sched->soc1_set, config->soc_margin) || near(snap->soc, sched->socf_set, config->soc_margin)) {
+        *reason = BQ27427_RATE_REASON_SOC_THRESHOLD;
+        return true;
+    }
+    if (sched->primed && config->current_step_ma
+            && abs((int)snap->avg_current - sched->prev_current) >= config->current_step_ma) {
+        *reason = BQ27427_RATE_REASON_CURRENT_STEP;
+        return true;
+    }
+
+    return false;
+}
+
+// Pick the rate for the next period. Reads CONTROL_STATUS only if needed.
+static bq27427_rate_t evaluate(bq27427_scheduler_t *sched, const bq27427_snapshot_t *snap,
+                               bq27427_rate_reason_t *reason)
+{
+    if (fast_trigger(sched, snap, reason)) {
+        sched->hold = sched->config.fast_hold;
+        return BQ27427_RATE_FAST;
+    }
+    if (sched->hold) {
+        sched->hold--;
+        *reason = BQ27427_RATE_REASON_HOLD;
+        return BQ27427_RATE_FAST;
+    }
+    int current = abs(snap->avg_current);
+    if (current < sched->config.standby_current_ma) {
+        *reason = BQ27427_RATE_REASON_STANDBY;
+        return BQ27427_RATE_IDLE;
+    }
+
+    uint16_t status;
+    // The gauge only sleeps below Sleep Current, so above it SLEEP is known clear
+    if (current < sched->sleep_current
+        && bq27427_get_status(sched->dev, &status) == ESP_OK && (status & BQ27427_STATUS_SLEEP)) {
+        *reason = BQ27427_RATE_REASON_SLEEP;
+        return BQ27427_RATE_IDLE;
+    }
+    *reason = BQ27427_RATE_REASON_ACTIVE;
+
+    return BQ27427_RATE_NORMAL;
+}
+
+static void poll(bq27427_scheduler_t *sched)
+{
+    bq27427_snapshot_t snap;
+    bq27427_rate_reason_t reason;
+
+    esp_err_t err = bq27427_read_snapshot(sched->dev, POLL_FIELDS | sched->config.fields, &snap);
+    if (err != ESP_OK) {
+        // Keep the current rate, a failed read tells nothing about the battery
+        sched->errors++;
+        ESP_LOGW(TAG, "Poll failed: %s", esp_err_to_name(err));
+        return;
+    }
+    sched->polls++;
+    if (sched->config.on_poll)
+        sched->config.on_poll(sched->dev, &snap, sched->config.ctx);
+
+    bq27427_rate_t rate = evaluate(sched, &snap, &reason);
+    if (!sched->primed)
+        reason = BQ27427_RATE_REASON_START;
+    if (rate != sched->rate || !sched->primed) {
+        ESP_LOGD(TAG, "Rate %d -> %d (reason %d)", sched->rate, rate, reason);
+        sched->rate = rate;
+        if (sched->config.on_rate)
+            sched->config.on_rate(sched->dev, rate, rate_period(sched, rate), reason, sched->config.ctx);
+    }
+    sched->prev_flags = snap.flags;
+    sched->prev_current = snap.avg_current;
+    sched->primed = true;
+}
+
+static void scheduler_task(void *arg)
+{
+    bq27427_scheduler_t *sched = (bq27427_scheduler_t *)arg;
+
+    while (sched->running) {
+        poll(sched);
+        // Sleep on a notification so that bq27427_scheduler_stop() can wake us
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(rate_period(sched, sched->rate)));
+    }
+
+    xSemaphoreGive(sched->stopped);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The stack is the caller's: bq27427_scheduler_stop() deletes the task once it is suspended
+    vTaskSuspend(NULL);
+#else
+    vTaskDelete(NULL);
+#endif
+}
+
+static esp_err_t read_thresholds(bq27427_scheduler_t *sched)
+{
+    CHECK(bq27427_get_soc1_set_threshold(sched->dev, &sched->soc1_set));
+    CHECK(bq27427_get_socf_set_threshold(sched->dev, &sched->socf_set));
+    CHECK(bq27427_get_sleep_current(sched->dev, &sched->sleep_current));
+    if (!sched->config.standby_current_ma) {
+        // Dsg Current Threshold is in 0.1 h: the current that drains Design Capacity in that time
+        uint16_t hours, capacity;
+        CHECK(bq27427_get_discharge_current_threshold(sched->dev, &hours));
+        CHECK(bq27427_get_capacity(sched->dev, DESIGN, &capacity));
+        if (hours)
+            sched->config.standby_current_ma = (uint32_t)capacity * 10 / hours;
+    }
+
+    return ESP_OK;
+}
+
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+// Delete a task that suspended itself; once it is gone its stack and TCB are the caller's again
+static void delete_suspended(TaskHandle_t task)
+{
+    while (eTaskGetState(task) != eSuspended)
+        vTaskDelay(1);
+    vTaskDelete(task);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_scheduler_start(bq27427_scheduler_t *sched, bq27427_t *dev, const bq27427_scheduler_config_t *config)
+{
+    CHECK_ARG(sched && dev && config);
+    CHECK_ARG(!(config->fields & ~BQ27427_FIELD_ALL));
+    CHECK_ARG(config->fast_ms && config->fast_ms <= config->normal_ms && config->normal_ms <= config->idle_ms);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    CHECK_ARG(config->task_stack);
+#endif
+
+    memset(sched, 0, sizeof(bq27427_scheduler_t));
+    sched->dev = dev;
+    sched->config = *config;
+    sched->rate = BQ27427_RATE_NORMAL;
+    CHECK(read_thresholds(sched));
+
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    // The task and the semaphore live in sched, the stack is the caller's
+    sched->stopped = xSemaphoreCreateBinaryStatic(&sched->stopped_buf);
+    sched->running = true;
+    sched->task = xTaskCreateStatic(scheduler_task, "bq27427_sched", config->task_stack_size, sched,
+                                    config->task_priority, config->task_stack, &sched->task_buf);
+#else
+    sched->stopped = xSemaphoreCreateBinary();
+    if (!sched->stopped)
+        return ESP_ERR_NO_MEM;
+
+    sched->running = true;
+    if (xTaskCreate(scheduler_task, "bq27427_sched", config->task_stack_size, sched, config->task_priority,
+                    &sched->task) != pdPASS) {
+        vSemaphoreDelete(sched->stopped);
+        sched->stopped = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    ESP_LOGD(TAG, "SOC1 %u%%, SOCF %u%%, standby %u mA, sleep %u mA", sched->soc1_set, sched->socf_set,
+             sched->config.standby_current_ma, sched->sleep_current);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_scheduler_stop(bq27427_scheduler_t *sched)
+{
+    CHECK_ARG(sched && sched->task);
+
+    sched->running = false;
+    xTaskNotifyGive(sched->task);
+    // A poll can wait for a configuration session; the task must be gone before sched is freed
+    xSemaphoreTake(sched->stopped, portMAX_DELAY);
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+    delete_suspended(sched->task);
+#endif
+    vSemaphoreDelete(sched->stopped);
+    sched->stopped = NULL;
+    sched->task = NULL;
+
+    return ESP_OK;
+}
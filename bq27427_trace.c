@@ -0,0 +1,261 @@
+#include <string.h>
+#include <esp_log.h>
+#include "bq27427_trace.h"
+
+static const char *TAG = "bq27427_trace";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
+
+#define RING_SIZE CONFIG_BQ27427_TRACE_SIZE
+#define FLUSH_CHUNK (BQ27427_TRACE_HEADER_SIZE + 2 * BQ27427_TRACE_RECORD_MAX)
+
+/*
+ * Record layout: flags, register, length, delta varint, duration varint,
+ * payload. Flags never take the value of the first byte of
+ * BQ27427_TRACE_MAGIC, so a decoder tells headers from records.
+ */
+#define FLAG_WRITE       0x80
+#define FLAG_RESULT_MASK 0x03
+
+static inline bool has_payload(uint8_t flags)
+{
+    return (flags & FLAG_WRITE) || (flags & FLAG_RESULT_MASK) == BQ27427_TRACE_OK;
+}
+
+static bq27427_trace_result_t classify(esp_err_t err)
+{
+    switch (err) {
+        case ESP_OK:
+            return BQ27427_TRACE_OK;
+        case ESP_FAIL:
+            return BQ27427_TRACE_NACK;
+        case ESP_ERR_TIMEOUT:
+            return BQ27427_TRACE_TIMEOUT;
+        default:
+            return BQ27427_TRACE_ERROR;
+    }
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+
+    return n;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint8_t ring_get(const bq27427_trace_t *t, uint32_t off)
+{
+    return t->buf[off % RING_SIZE];
+}
+
+// Varint at a ring offset; returns its length
+static size_t ring_varint(const bq27427_trace_t *t, uint32_t off, uint64_t *v)
+{
+    size_t n = 0;
+    uint8_t b;
+
+    *v = 0;
+    do {
+        b = ring_get(t, off + n);
+        *v |= (uint64_t)(b & 0x7f) << (7 * n);
+        n++;
+    } while (b & 0x80);
+
+    return n;
+}
+
+// Length of the record at a ring offset, and the time since its predecessor
+static size_t ring_record(const bq27427_trace_t *t, uint32_t off, uint64_t *delta)
+{
+    uint8_t flags = ring_get(t, off);
+    uint8_t len = ring_get(t, off + 2);
+    uint64_t duration;
+    size_t n = 3;
+
+    n += ring_varint(t, off + n, delta);
+    n += ring_varint(t, off + n, &duration);
+    if (has_payload(flags))
+        n += len < BQ27427_TRACE_PAYLOAD_MAX ? len : BQ27427_TRACE_PAYLOAD_MAX;
+
+    return n;
+}
+
+// Remove the oldest record; the next one then counts from its time
+static void drop_oldest(bq27427_trace_t *t, bool flushed)
+{
+    uint64_t delta;
+    size_t n = ring_record(t, t->tail, &delta);
+
+    t->base_us += delta;
+    t->tail = (t->tail + n) % RING_SIZE;
+    t->used -= n;
+    t->records--;
+    if (!flushed)
+        t->dropped++;
+}
+
+static size_t put_header(const bq27427_trace_t *t, uint8_t *p)
+{
+    put_le32(p, BQ27427_TRACE_MAGIC);
+    p[4] = BQ27427_TRACE_VERSION;
+    p[5] = t->addr;
+    p[6] = p[7] = 0;
+    put_le32(p + 8, t->clk_hz);
+    put_le32(p + 12, (uint32_t)t->base_us);
+    put_le32(p + 16, (uint32_t)((uint64_t)t->base_us >> 32));
+
+    return BQ27427_TRACE_HEADER_SIZE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+esp_err_t bq27427_trace_init(bq27427_trace_t *trace)
+{
+    CHECK_ARG(trace);
+
+    memset(trace, 0, sizeof(bq27427_trace_t));
+
+    return ESP_OK;
+}
+
+void bq27427_trace_record(bq27427_trace_t *trace, uint8_t reg, const void *data, size_t len, bool write, esp_err_t err,
+                          int64_t start_us, uint32_t duration_us)
+{
+    uint8_t rec[BQ27427_TRACE_RECORD_MAX];
+    size_t n = 0;
+
+    // The first record of an empty ring starts the time base
+    if (!trace->records)
+        trace->base_us = trace->last_us = start_us;
+    rec[n++] = (write ? FLAG_WRITE : 0) | classify(err);
+    rec[n++] = reg;
+    rec[n++] = len > UINT8_MAX ? UINT8_MAX : len;
+    n += put_varint(rec + n, start_us > trace->last_us ? start_us - trace->last_us : 0);
+    n += put_varint(rec + n, duration_us);
+    if (has_payload(rec[0])) {
+        size_t p = len < BQ27427_TRACE_PAYLOAD_MAX ? len : BQ27427_TRACE_PAYLOAD_MAX;
+        memcpy(rec + n, data, p);
+        n += p;
+    }
+
+    while (RING_SIZE - trace->used < n)
+        drop_oldest(trace, false);
+    for (size_t i = 0; i < n; i++)
+        trace->buf[(trace->head + i) % RING_SIZE] = rec[i];
+    trace->head = (trace->head + n) % RING_SIZE;
+    trace->used += n;
+    trace->records++;
+    trace->last_us = start_us;
+}
+
+esp_err_t bq27427_trace_flush(bq27427_t *dev, bq27427_trace_t *trace, bq27427_trace_write_t write, void *ctx)
+{
+    CHECK_ARG(dev && trace && write);
+
+    uint8_t chunk[FLUSH_CHUNK];
+    uint32_t dropped = 0;
+    bool first = true;
+
+    for (;;) {
+        size_t n = 0, header = 0;
+
+        I2C_DEV_TAKE_MUTEX(&dev->i2c_dev);
+        // A new header whenever the stream no longer continues where the last chunk ended
+        if (first || trace->dropped != dropped)
+            n = header = put_header(trace, chunk);
+        first = false;
+        dropped = trace->dropped;
+        while (trace->records) {
+            uint64_t delta;
+            size_t len = ring_record(trace, trace->tail, &delta);
+            if (n + len > sizeof(chunk))
+                break;
+            for (size_t i = 0; i < len; i++)
+                chunk[n + i] = ring_get(trace, trace->tail + i);
+            n += len;
+            drop_oldest(trace, true);
+        }
+        bool done = !trace->records;
+        I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+        if (n > header)
+            CHECK(write(ctx, chunk, n));
+        if (done)
+            break;
+    }
+    ESP_LOGD(TAG, "Trace flushed, %u records dropped so far", (unsigned)trace->dropped);
+
+    return ESP_OK;
+}
+
+esp_err_t bq27427_trace_parse(const uint8_t *data, size_t len, size_t *pos, bq27427_trace_stream_t *stream,
+                              bq27427_trace_record_t *record)
+{
+    CHECK_ARG(data && pos && stream && record);
+
+    size_t p = *pos;
+    uint64_t v[2];
+
+    while (p + 4 <= len && get_le32(data + p) == BQ27427_TRACE_MAGIC) {
+        if (p + BQ27427_TRACE_HEADER_SIZE > len || data[p + 4] != BQ27427_TRACE_VERSION)
+            return ESP_ERR_INVALID_RESPONSE;
+        stream->addr = data[p + 5];
+        stream->clk_hz = get_le32(data + p + 8);
+        stream->time_us = (int64_t)(get_le32(data + p + 12) | (uint64_t)get_le32(data + p + 16) << 32);
+        p += BQ27427_TRACE_HEADER_SIZE;
+    }
+    if (p >= len)
+        return ESP_ERR_NOT_FOUND;
+    if (p + 3 > len || (data[p] & ~(FLAG_WRITE | FLAG_RESULT_MASK)))
+        return ESP_ERR_INVALID_RESPONSE;
+
+    uint8_t flags = data[p];
+    record->write = flags & FLAG_WRITE;
+    record->result = flags & FLAG_RESULT_MASK;
+    record->reg = data[p + 1];
+    record->len = data[p + 2];
+    p += 3;
+    for (int i = 0; i < 2; i++) {
+        v[i] = 0;
+        for (int shift = 0;; shift += 7) {
+            if (p >= len || shift > 63)
+                return ESP_ERR_INVALID_RESPONSE;
+            v[i] |= (uint64_t)(data[p] & 0x7f) << shift;
+            if (!(data[p++] & 0x80))
+                break;
+        }
+    }
+    record->payload_len = 0;
+    record->data = NULL;
+    if (has_payload(flags)) {
+        record->payload_len = record->len < BQ27427_TRACE_PAYLOAD_MAX ? record->len : BQ27427_TRACE_PAYLOAD_MAX;
+        if (p + record->payload_len > len)
+            return ESP_ERR_INVALID_RESPONSE;
+        record->data = data + p;
+        p += record->payload_len;
+    }
+    stream->time_us += v[0];
+    record->timestamp_us = stream->time_us;
+    record->duration_us = v[1] > UINT32_MAX ? UINT32_MAX : (uint32_t)v[1];
+    *pos = p;
+
+    return ESP_OK;
+}
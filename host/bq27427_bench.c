@@ -0,0 +1,498 @@
+/*
+ * Bus cost of every public driver function, measured on the simulator.
+ *
+ * Each function is called twice on a freshly reset, sealed gauge with ITPOR
+ * cleared: the first call shows the cold cost, the second the cost once the
+ * driver's caches are warm. One CSV row is printed per call:
+ *
+ *   function      name of the benchmarked call
+ *   call          1 (cold) or 2 (warm)
+ *   result        esp_err_t returned
+ *   transactions  I2C transfers (START..STOP)
+ *   bytes         bytes on the wire, including address and register bytes
+ *   mutex         i2c_dev_t mutex acquisitions
+ *   wait_us       gauge-side waits (CFGUPMODE polling and other delays)
+ *   wall_100k_us  modeled duration at 100 kHz
+ *   wall_400k_us  modeled duration at 400 kHz
+ *
+ * The modeled duration is the bit clocks on the wire at the given frequency,
+ * plus a fixed per-transfer overhead, plus the waits.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bq27427.h>
+#include <bq27427_boot.h>
+#include <bq27427_trace.h>
+#include "bq27427_sim.h"
+
+#define PORT 0
+#define OVERHEAD_US 20
+
+typedef esp_err_t (*bench_fn_t)(bq27427_t *dev);
+
+typedef struct {
+    const char *name;
+    bench_fn_t fn;
+    bench_fn_t setup;   // Run once before the first call and not measured, may be NULL
+} bench_t;
+
+/*
+ * Wrap one driver call into a bench_fn_t. The body can use the scratch
+ * variables u8, u16, i16, b, func and snap.
+ */
+#define BENCH(id, expr) \
+    static esp_err_t bench_##id(bq27427_t *dev) \
+    { \
+        uint8_t u8; uint16_t u16; int16_t i16; bool b; gpout_function func; bq27427_snapshot_t snap; \
+        (void)u8; (void)u16; (void)i16; (void)b; (void)func; (void)snap; \
+        return expr; \
+    }
+
+#define TELEMETRY_FIELDS (BQ27427_FIELD_TEMP | BQ27427_FIELD_VOLTAGE | BQ27427_FIELD_FLAGS \
+                          | BQ27427_FIELD_REM_CAPACITY | BQ27427_FIELD_FULL_CAPACITY | BQ27427_FIELD_AVG_CURRENT \
+                          | BQ27427_FIELD_AVG_POWER | BQ27427_FIELD_SOC | BQ27427_FIELD_SOH)
+
+BENCH(get_voltage, bq27427_get_voltage(dev, &u16))
+BENCH(get_current_avg, bq27427_get_current(dev, AVG, &i16))
+BENCH(get_current_stby, bq27427_get_current(dev, STBY, &i16))
+BENCH(get_current_max, bq27427_get_current(dev, MAX, &i16))
+BENCH(get_capacity_remain, bq27427_get_capacity(dev, REMAIN, &u16))
+BENCH(get_capacity_full, bq27427_get_capacity(dev, FULL, &u16))
+BENCH(get_capacity_avail, bq27427_get_capacity(dev, AVAIL, &u16))
+BENCH(get_capacity_avail_full, bq27427_get_capacity(dev, AVAIL_FULL, &u16))
+BENCH(get_capacity_remain_f, bq27427_get_capacity(dev, REMAIN_F, &u16))
+BENCH(get_capacity_remain_uf, bq27427_get_capacity(dev, REMAIN_UF, &u16))
+BENCH(get_capacity_full_f, bq27427_get_capacity(dev, FULL_F, &u16))
+BENCH(get_capacity_full_uf, bq27427_get_capacity(dev, FULL_UF, &u16))
+BENCH(get_capacity_design, bq27427_get_capacity(dev, DESIGN, &u16))
+BENCH(get_power, bq27427_get_power(dev, &i16))
+BENCH(get_soc_filtered, bq27427_get_soc(dev, FILTERED, &u16))
+BENCH(get_soc_unfiltered, bq27427_get_soc(dev, UNFILTERED, &u16))
+BENCH(get_soh_percent, bq27427_get_soh(dev, PERCENT, &u8))
+BENCH(get_soh_stat, bq27427_get_soh(dev, SOH_STAT, &u8))
+BENCH(get_temperature_battery, bq27427_get_temperature(dev, BATTERY, &u16))
+BENCH(get_temperature_internal, bq27427_get_temperature(dev, INTERNAL_TEMP, &u16))
+BENCH(read_snapshot_all, bq27427_read_snapshot(dev, BQ27427_FIELD_ALL, &snap))
+BENCH(read_snapshot_telemetry, bq27427_read_snapshot(dev, TELEMETRY_FIELDS, &snap))
+BENCH(read_cached_telemetry, bq27427_read_cached(dev, TELEMETRY_FIELDS, 1000000, &snap, NULL))
+BENCH(get_voltage_cached, bq27427_get_voltage_cached(dev, 1000000, &u16, NULL))
+BENCH(get_current_cached, bq27427_get_current_cached(dev, 1000000, &i16, NULL))
+BENCH(get_power_cached, bq27427_get_power_cached(dev, 1000000, &i16, NULL))
+BENCH(get_soc_cached, bq27427_get_soc_cached(dev, 1000000, &u16, NULL))
+BENCH(get_temperature_cached, bq27427_get_temperature_cached(dev, 1000000, &u16, NULL))
+BENCH(get_flags_cached, bq27427_get_flags_cached(dev, 1000000, &u16, NULL))
+BENCH(get_flags, bq27427_get_flags(dev, &u16))
+BENCH(get_status, bq27427_get_status(dev, &u16))
+BENCH(read_control, bq27427_read_control(dev, BQ27427_CONTROL_FW_VERSION, &u16))
+BENCH(get_device_type, bq27427_get_device_type(dev, &u16))
+BENCH(get_chem_id, bq27427_get_chem_id(dev, &u16))
+BENCH(get_soc_flag, bq27427_get_soc_flag(dev, &b))
+BENCH(get_socf_flag, bq27427_get_socf_flag(dev, &b))
+BENCH(get_itpor_flag, bq27427_get_itpor_flag(dev, &b))
+BENCH(get_fc_flag, bq27427_get_fc_flag(dev, &b))
+BENCH(get_chg_flag, bq27427_get_chg_flag(dev, &b))
+BENCH(get_dsg_flag, bq27427_get_dsg_flag(dev, &b))
+BENCH(get_design_energy, bq27427_get_design_energy(dev, &u16))
+BENCH(get_terminate_voltage, bq27427_get_terminate_voltage(dev, &u16))
+BENCH(get_discharge_current_threshold, bq27427_get_discharge_current_threshold(dev, &u16))
+BENCH(get_sleep_current, bq27427_get_sleep_current(dev, &u16))
+BENCH(get_taper_voltage, bq27427_get_taper_voltage(dev, &u16))
+BENCH(get_taper_rate, bq27427_get_taper_rate(dev, &u16))
+BENCH(get_gpout_polarity, bq27427_get_gpout_polarity(dev, &u8))
+BENCH(get_gpout_function, bq27427_get_gpout_function(dev, &func))
+BENCH(get_soc1_set_threshold, bq27427_get_soc1_set_threshold(dev, &u8))
+BENCH(get_soc1_clear_threshold, bq27427_get_soc1_clear_threshold(dev, &u8))
+BENCH(get_socf_set_threshold, bq27427_get_socf_set_threshold(dev, &u8))
+BENCH(get_socf_clear_threshold, bq27427_get_socf_clear_threshold(dev, &u8))
+BENCH(get_soci_delta, bq27427_get_soci_delta(dev, &u8))
+BENCH(read_dm, bq27427_read_dm(dev, BQ27427_ID_STATE, 0, &u8, 1))
+BENCH(read_dm_checksum, bq27427_read_dm_checksum(dev, BQ27427_ID_STATE, 0, &u8))
+BENCH(set_capacity, bq27427_set_capacity(dev, 1200))
+BENCH(set_design_energy, bq27427_set_design_energy(dev, 4440))
+BENCH(set_terminate_voltage, bq27427_set_terminate_voltage(dev, 3000))
+BENCH(set_discharge_current_threshold, bq27427_set_discharge_current_threshold(dev, 150))
+BENCH(set_taper_voltage, bq27427_set_taper_voltage(dev, 4150))
+BENCH(set_taper_rate, bq27427_set_taper_rate(dev, 120))
+BENCH(set_gpout_polarity, bq27427_set_gpout_polarity(dev, 1))
+BENCH(set_gpout_function, bq27427_set_gpout_function(dev, SOC_INT))
+BENCH(set_soc1_thresholds, bq27427_set_soc1_thresholds(dev, 12, 18))
+BENCH(set_socf_thresholds, bq27427_set_socf_thresholds(dev, 3, 6))
+BENCH(set_soci_delta, bq27427_set_soci_delta(dev, 5))
+BENCH(set_chem_id, bq27427_set_chem_id(dev, CHEM_B))
+BENCH(unseal, bq27427_unseal(dev))
+BENCH(seal, bq27427_seal(dev))
+BENCH(dm_cache_invalidate, bq27427_dm_cache_invalidate(dev))
+BENCH(pulse_gpout, bq27427_pulse_gpout(dev))
+BENCH(reset, bq27427_reset(dev))
+BENCH(recover_bus, bq27427_recover_bus(dev))
+BENCH(is_offline, bq27427_is_offline(dev) ? ESP_FAIL : ESP_OK)
+BENCH(reset_stats, bq27427_reset_stats(dev))
+
+static esp_err_t bench_identify(bq27427_t *dev)
+{
+    bq27427_info_t info;
+
+    return bq27427_identify(dev, &info);
+}
+
+// Voltage and StateOfCharge() as a plan computed by the caller
+static esp_err_t bench_read_bursts(bq27427_t *dev)
+{
+    static const bq27427_burst_t bursts[] = {
+        { BQ27427_COMMAND_VOLTAGE, 2 },
+        { BQ27427_COMMAND_SOC, 2 },
+    };
+    uint8_t buf[BQ27427_SNAPSHOT_SIZE];
+
+    return bq27427_read_bursts(dev, bursts, sizeof(bursts) / sizeof(bursts[0]), buf);
+}
+
+static esp_err_t bench_get_stats(bq27427_t *dev)
+{
+    bq27427_stats_t stats;
+
+    return bq27427_get_stats(dev, &stats);
+}
+
+static esp_err_t bench_set_recovery(bq27427_t *dev)
+{
+    bq27427_recovery_t policy = {
+        .retries = 2,
+        .backoff_ms = 10,
+        .offline_after = 5,
+        .probe_interval_ms = 1000,
+    };
+
+    return bq27427_set_recovery(dev, &policy);
+}
+
+static bq27427_trace_t trace;
+
+static esp_err_t bench_set_trace(bq27427_t *dev)
+{
+    return bq27427_set_trace(dev, &trace);
+}
+
+static esp_err_t bench_enter_exit_config(bq27427_t *dev)
+{
+    esp_err_t err = bq27427_enter_config(dev, true);
+
+    return err == ESP_OK ? bq27427_exit_config(dev, true) : err;
+}
+
+// The provisioning sequence
+static void stage_provisioning(bq27427_t *dev, bq27427_config_t *cfg)
+{
+    bq27427_config_begin(dev, cfg);
+    bq27427_config_set_capacity(cfg, 1200);
+    bq27427_config_set_design_energy(cfg, 4440);
+    bq27427_config_set_terminate_voltage(cfg, 3000);
+    bq27427_config_set_taper_rate(cfg, 120);
+    bq27427_config_set_soc1_thresholds(cfg, 12, 18);
+    bq27427_config_set_socf_thresholds(cfg, 3, 6);
+    bq27427_config_set_chem_id(cfg, CHEM_B);
+}
+
+// The provisioning sequence as one transaction
+static esp_err_t bench_config_commit(bq27427_t *dev)
+{
+    bq27427_config_t cfg;
+
+    stage_provisioning(dev, &cfg);
+
+    return bq27427_config_commit(&cfg);
+}
+
+// The parameters the provisioning sequence leaves alone, as one transaction
+static esp_err_t bench_config_commit_other(bq27427_t *dev)
+{
+    bq27427_config_t cfg;
+
+    bq27427_config_begin(dev, &cfg);
+    bq27427_config_set_discharge_current_threshold(&cfg, 150);
+    bq27427_config_set_taper_voltage(&cfg, 4150);
+    bq27427_config_set_soci_delta(&cfg, 5);
+    bq27427_config_set_gpout_polarity(&cfg, 1);
+    bq27427_config_set_gpout_function(&cfg, SOC_INT);
+    bq27427_config_set_dm(&cfg, BQ27427_ID_POWER, BQ27427_DM_SLEEP_CURRENT, 20, 0xffff, 2);
+
+    return bq27427_config_commit(&cfg);
+}
+
+// The same sequence through the individual setters
+static esp_err_t bench_config_setters(bq27427_t *dev)
+{
+    esp_err_t err = bq27427_set_capacity(dev, 1200);
+
+    if (err == ESP_OK)
+        err = bq27427_set_design_energy(dev, 4440);
+    if (err == ESP_OK)
+        err = bq27427_set_terminate_voltage(dev, 3000);
+    if (err == ESP_OK)
+        err = bq27427_set_taper_rate(dev, 120);
+    if (err == ESP_OK)
+        err = bq27427_set_soc1_thresholds(dev, 12, 18);
+    if (err == ESP_OK)
+        err = bq27427_set_socf_thresholds(dev, 3, 6);
+    if (err == ESP_OK)
+        err = bq27427_set_chem_id(dev, CHEM_B);
+
+    return err;
+}
+
+static bq27427_boot_state_t boot_state;
+
+// Wake from deep sleep: the first call finds no state, the second the one it left
+static esp_err_t bench_boot(bq27427_t *dev)
+{
+    bq27427_config_t cfg;
+    esp_err_t err;
+
+    stage_provisioning(dev, &cfg);
+    if ((err = bq27427_boot(dev, &cfg, &boot_state, NULL)) != ESP_OK)
+        return err;
+
+    return bq27427_boot_save(dev, &boot_state, NULL);
+}
+
+// The gauge already holds the configuration, the driver's caches are cold
+static esp_err_t setup_boot_checked(bq27427_t *dev)
+{
+    bq27427_config_t cfg;
+    esp_err_t err;
+
+    stage_provisioning(dev, &cfg);
+    if ((err = bq27427_config_commit(&cfg)) != ESP_OK)
+        return err;
+
+    return bq27427_dm_cache_invalidate(dev);
+}
+
+/*
+ * Wake with the RTC state lost: the configuration is compared with data
+ * memory, and since the gauge matches, no CFGUPDATE session is opened:
+ * wait_us is the bus spacing of the unseal, not the 150 ms of a session.
+ */
+static esp_err_t bench_boot_checked(bq27427_t *dev)
+{
+    bq27427_boot_state_t state;
+    bq27427_boot_result_t path;
+    bq27427_config_t cfg;
+    esp_err_t err;
+
+    memset(&state, 0, sizeof(state));
+    stage_provisioning(dev, &cfg);
+    if ((err = bq27427_boot(dev, &cfg, &state, &path)) != ESP_OK)
+        return err;
+
+    return path == BQ27427_BOOT_CHECKED ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+static bq27427_image_t golden;
+
+// Golden image: the defaults with a different design capacity, so one block differs
+static esp_err_t make_golden(void)
+{
+    bq27427_t dev;
+    esp_err_t err;
+
+    if ((err = bq27427_init_desc(&dev, PORT, 0, 0)) != ESP_OK)
+        return err;
+    err = bq27427_image_dump(&dev, &golden);
+    bq27427_free_desc(&dev);
+    if (err != ESP_OK)
+        return err;
+
+    for (int i = 0; i < golden.count; i++) {
+        bq27427_image_block_t *b = &golden.blocks[i];
+        if (b->class_id != BQ27427_ID_STATE || b->block != 0)
+            continue;
+        b->data[BQ27427_DM_DESIGN_CAPACITY] = 1200 >> 8;
+        b->data[BQ27427_DM_DESIGN_CAPACITY + 1] = 1200 & 0xff;
+        uint8_t sum = 0;
+        for (int j = 0; j < BQ27427_DM_BLOCK_SIZE; j++)
+            sum += b->data[j];
+        b->checksum = 0xff - sum;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t bench_image_dump(bq27427_t *dev)
+{
+    bq27427_image_t image;
+
+    return bq27427_image_dump(dev, &image);
+}
+
+static esp_err_t bench_image_apply(bq27427_t *dev)
+{
+    return bq27427_image_apply(dev, &golden, 0, NULL);
+}
+
+#define ENTRY(id) { #id, bench_##id, NULL }
+#define ENTRY_SETUP(id) { #id, bench_##id, setup_##id }
+
+static const bench_t benches[] = {
+    ENTRY(get_voltage),
+    ENTRY(get_current_avg),
+    ENTRY(get_current_stby),
+    ENTRY(get_current_max),
+    ENTRY(get_capacity_remain),
+    ENTRY(get_capacity_full),
+    ENTRY(get_capacity_avail),
+    ENTRY(get_capacity_avail_full),
+    ENTRY(get_capacity_remain_f),
+    ENTRY(get_capacity_remain_uf),
+    ENTRY(get_capacity_full_f),
+    ENTRY(get_capacity_full_uf),
+    ENTRY(get_capacity_design),
+    ENTRY(get_power),
+    ENTRY(get_soc_filtered),
+    ENTRY(get_soc_unfiltered),
+    ENTRY(get_soh_percent),
+    ENTRY(get_soh_stat),
+    ENTRY(get_temperature_battery),
+    ENTRY(get_temperature_internal),
+    ENTRY(read_snapshot_all),
+    ENTRY(read_snapshot_telemetry),
+    ENTRY(read_cached_telemetry),
+    ENTRY(get_voltage_cached),
+    ENTRY(get_current_cached),
+    ENTRY(get_power_cached),
+    ENTRY(get_soc_cached),
+    ENTRY(get_temperature_cached),
+    ENTRY(get_flags_cached),
+    ENTRY(read_bursts),
+    ENTRY(get_flags),
+    ENTRY(get_status),
+    ENTRY(read_control),
+    ENTRY(get_device_type),
+    ENTRY(identify),
+    ENTRY(get_chem_id),
+    ENTRY(get_soc_flag),
+    ENTRY(get_socf_flag),
+    ENTRY(get_itpor_flag),
+    ENTRY(get_fc_flag),
+    ENTRY(get_chg_flag),
+    ENTRY(get_dsg_flag),
+    ENTRY(get_design_energy),
+    ENTRY(get_terminate_voltage),
+    ENTRY(get_discharge_current_threshold),
+    ENTRY(get_sleep_current),
+    ENTRY(get_taper_voltage),
+    ENTRY(get_taper_rate),
+    ENTRY(get_gpout_polarity),
+    ENTRY(get_gpout_function),
+    ENTRY(get_soc1_set_threshold),
+    ENTRY(get_soc1_clear_threshold),
+    ENTRY(get_socf_set_threshold),
+    ENTRY(get_socf_clear_threshold),
+    ENTRY(get_soci_delta),
+    ENTRY(read_dm),
+    ENTRY(read_dm_checksum),
+    ENTRY(set_capacity),
+    ENTRY(set_design_energy),
+    ENTRY(set_terminate_voltage),
+    ENTRY(set_discharge_current_threshold),
+    ENTRY(set_taper_voltage),
+    ENTRY(set_taper_rate),
+    ENTRY(set_gpout_polarity),
+    ENTRY(set_gpout_function),
+    ENTRY(set_soc1_thresholds),
+    ENTRY(set_socf_thresholds),
+    ENTRY(set_soci_delta),
+    ENTRY(set_chem_id),
+    ENTRY(enter_exit_config),
+    ENTRY(config_commit),
+    ENTRY(config_commit_other),
+    ENTRY(config_setters),
+    ENTRY(boot),
+    ENTRY_SETUP(boot_checked),
+    ENTRY(image_dump),
+    ENTRY(image_apply),
+    ENTRY(unseal),
+    ENTRY(seal),
+    ENTRY(dm_cache_invalidate),
+    ENTRY(pulse_gpout),
+    ENTRY(reset),
+    ENTRY(recover_bus),
+    ENTRY(is_offline),
+    ENTRY(set_recovery),
+    ENTRY(get_stats),
+    ENTRY(reset_stats),
+    ENTRY(set_trace),
+};
+
+static uint64_t bus_us(uint64_t bits, uint32_t hz)
+{
+    return (bits * 1000000 + hz - 1) / hz;
+}
+
+static void run(const bench_t *bench, bq27427_sim_t *sim)
+{
+    bq27427_t dev;
+
+    bq27427_sim_power_on_reset(sim);
+    bq27427_sim_set_flags(sim, 0, BQ27427_FLAG_ITPOR);
+    if (bq27427_init_desc(&dev, PORT, 0, 0) != ESP_OK) {
+        fprintf(stderr, "%s: bq27427_init_desc() failed\n", bench->name);
+        exit(1);
+    }
+    if (bench->setup && bench->setup(&dev) != ESP_OK) {
+        fprintf(stderr, "%s: setup failed\n", bench->name);
+        exit(1);
+    }
+
+    for (int call = 1; call <= 2; call++) {
+        bq27427_sim_stats_t stats;
+
+        bq27427_sim_reset_stats();
+        uint64_t start = bq27427_sim_time_us();
+        esp_err_t err = bench->fn(&dev);
+        uint64_t elapsed = bq27427_sim_time_us() - start;
+        bq27427_sim_get_stats(&stats);
+
+        uint64_t wait = elapsed - stats.bus_time_us;
+        uint64_t overhead = (uint64_t)stats.transactions * OVERHEAD_US;
+        printf("%s,%d,%d,%" PRIu32 ",%" PRIu64 ",%" PRIu32 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               bench->name, call, err, stats.transactions, stats.bytes, stats.mutex_takes, wait,
+               bus_us(stats.bits, 100000) + overhead + wait,
+               bus_us(stats.bits, 400000) + overhead + wait);
+    }
+
+    bq27427_free_desc(&dev);
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = argc > 1 ? argv[1] : NULL;
+    bq27427_sim_timing_t timing = {
+        .cfgupdate_ms = 50,
+        .soft_reset_ms = 100,
+        .overhead_us = OVERHEAD_US,
+    };
+
+    bq27427_sim_set_timing(&timing);
+    bq27427_sim_t *sim = bq27427_sim_create(PORT, BQ27427_I2C_ADDRESS);
+    if (!sim) {
+        fprintf(stderr, "bq27427_sim_create() failed\n");
+        return 1;
+    }
+
+    if (make_golden() != ESP_OK) {
+        fprintf(stderr, "Could not dump the golden image\n");
+        return 1;
+    }
+
+    printf("function,call,result,transactions,bytes,mutex,wait_us,wall_100k_us,wall_400k_us\n");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+        if (!only || !strcmp(only, benches[i].name))
+            run(&benches[i], sim);
+
+    bq27427_sim_destroy(sim);
+
+    return 0;
+}
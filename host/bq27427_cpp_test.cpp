@@ -0,0 +1,104 @@
+/*
+ * Compile and behaviour test of the C++ front end, include/bq27427.hpp.
+ *
+ *   bq27427_cpp_test
+ *
+ * Built with -std=c++17 -Wall -Wextra -Werror. The burst plans of a few
+ * register sets are checked at compile time against the merge rule of
+ * bq27427_read_snapshot(): registers at most BQ27427_SNAPSHOT_MAX_GAP bytes
+ * apart share a burst, the order they are named in does not matter and a
+ * repeated register is read once. At run time a Gauge<Device> on the
+ * simulator decodes every unit type, signed ones included, in as many
+ * transfers as its plan has bursts.
+ *
+ * Prints each failed check; the exit status is 1 if any failed.
+ */
+#include <cstdio>
+#include <bq27427.hpp>
+#include "bq27427_sim.h"
+
+#define PORT 0
+
+#define EXPECT(x) do { if (!(x)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #x); failures++; } } while (0)
+
+using namespace bq27427;
+
+// One register, one burst of two bytes
+static_assert(burst_plan<reg::Voltage>.count == 1);
+static_assert(burst_plan<reg::Voltage>.bursts[0].reg == BQ27427_COMMAND_VOLTAGE);
+static_assert(burst_plan<reg::Voltage>.bursts[0].len == 2);
+
+// Eight bytes apart still share a burst, in any order
+static_assert(burst_plan<reg::AverageCurrent, reg::Voltage, reg::Flags>.count == 1);
+static_assert(burst_plan<reg::AverageCurrent, reg::Voltage, reg::Flags>.bursts[0].reg == BQ27427_COMMAND_VOLTAGE);
+static_assert(burst_plan<reg::AverageCurrent, reg::Voltage, reg::Flags>.bursts[0].len ==
+              BQ27427_COMMAND_AVG_CURRENT + 2 - BQ27427_COMMAND_VOLTAGE);
+
+// Ten bytes apart do not
+static_assert(burst_plan<reg::Voltage, reg::AverageCurrent>.count == 2);
+static_assert(burst_plan<reg::Voltage, reg::AverageCurrent>.bursts[1].reg == BQ27427_COMMAND_AVG_CURRENT);
+static_assert(burst_plan<reg::Voltage, reg::AverageCurrent>.bursts[1].len == 2);
+
+// A repeated register is read once
+static_assert(burst_plan<reg::StateOfCharge, reg::StateOfCharge>.count == 1);
+static_assert(burst_plan<reg::StateOfCharge, reg::StateOfCharge>.bursts[0].len == 2);
+
+// A chain of gaps of at most eight bytes spans the whole block of standard commands
+using Chain = BurstPlan<7>;
+constexpr Chain chain = burst_plan<reg::StateOfChargeUnfiltered, reg::Temperature, reg::AveragePower, reg::Flags,
+                                   reg::RemainingCapacityUnfiltered, reg::AverageCurrent, reg::StateOfHealth>;
+static_assert(chain.count == 1);
+static_assert(chain.bursts[0].reg == BQ27427_SNAPSHOT_FIRST_REG);
+static_assert(chain.bursts[0].len == BQ27427_SNAPSHOT_SIZE);
+
+static_assert(field_mask<reg::Voltage, reg::StateOfCharge> == (BQ27427_FIELD_VOLTAGE | BQ27427_FIELD_SOC));
+static_assert(std::is_same_v<reg::AverageCurrent::unit::rep, int16_t>);
+static_assert(to_decicelsius(Decikelvin(2982)) == 250);
+
+static int failures;
+
+int main()
+{
+    bq27427_sim_t *sim = bq27427_sim_create(PORT, BQ27427_I2C_ADDRESS);
+    bq27427_t dev;
+    bq27427_sim_stats_t stats;
+
+    if (!sim || bq27427_init_desc(&dev, PORT, 0, 0) != ESP_OK) {
+        printf("setup failed\n");
+        return 1;
+    }
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_VOLTAGE, 3812);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_AVG_CURRENT, static_cast<uint16_t>(-250));
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_AVG_POWER, static_cast<uint16_t>(-953));
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_SOC, 87);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_TEMP, 2982);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_SOH, 0x0196);
+
+    Gauge<> gauge{Device{&dev}};
+    Millivolts voltage;
+    Milliamps current;
+    Percent soc;
+
+    bq27427_sim_reset_stats();
+    esp_err_t err = gauge.read<reg::Voltage, reg::AverageCurrent, reg::StateOfCharge>(voltage, current, soc);
+    EXPECT(err == ESP_OK);
+    bq27427_sim_get_stats(&stats);
+    size_t bursts = burst_plan<reg::Voltage, reg::AverageCurrent, reg::StateOfCharge>.count;
+    EXPECT(bursts == 3 && stats.transactions == bursts);
+    EXPECT(voltage == Millivolts(3812));
+    EXPECT(current.count() == -250);
+    EXPECT(soc.count() == 87);
+
+    Milliwatts power;
+    Decikelvin temperature;
+    Health health;
+    EXPECT(gauge.average_power(power) == ESP_OK && power.count() == -953);
+    EXPECT(gauge.temperature(temperature) == ESP_OK && to_decicelsius(temperature) == 250);
+    EXPECT(gauge.state_of_health(health) == ESP_OK && health.percent == 0x96 && health.status == 0x01);
+
+    bq27427_free_desc(&dev);
+    bq27427_sim_destroy(sim);
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
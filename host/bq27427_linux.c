@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <driver/gpio.h>
+#include <esp_rom_sys.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "bq27427_linux.h"
+
+#define MAX_WRITE 64 // Longest register write of the driver, a data memory block is 32 bytes
+
+typedef struct {
+    int fd;
+    bool owned;     // Opened here, closed by bq27427_linux_close()
+} port_t;
+
+static pthread_mutex_t ports_lock = PTHREAD_MUTEX_INITIALIZER;
+static port_t ports[BQ27427_LINUX_MAX_PORTS];
+static bool ports_ready;
+
+static int default_ioctl(int fd, unsigned long request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static bq27427_linux_ioctl_t xfer_ioctl = default_ioctl;
+
+// Called with ports_lock held
+static void ports_init(void)
+{
+    if (ports_ready)
+        return;
+    for (int i = 0; i < BQ27427_LINUX_MAX_PORTS; i++)
+        ports[i].fd = -1;
+    ports_ready = true;
+}
+
+static int port_fd(i2c_port_t port)
+{
+    if (port < 0 || port >= BQ27427_LINUX_MAX_PORTS)
+        return -1;
+
+    pthread_mutex_lock(&ports_lock);
+    ports_init();
+    if (ports[port].fd < 0) {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/i2c-%d", port);
+        ports[port].fd = open(path, O_RDWR | O_CLOEXEC);
+        ports[port].owned = ports[port].fd >= 0;
+    }
+    int fd = ports[port].fd;
+    pthread_mutex_unlock(&ports_lock);
+
+    return fd;
+}
+
+static esp_err_t errno_to_esp(int err)
+{
+    switch (err) {
+        case ETIMEDOUT:
+            return ESP_ERR_TIMEOUT;
+        case EINVAL:
+            return ESP_ERR_INVALID_ARG;
+        case ENOMEM:
+            return ESP_ERR_NO_MEM;
+        default:
+            // ENXIO and EREMOTEIO are a NACK, EAGAIN lost arbitration
+            return ESP_FAIL;
+    }
+}
+
+// Run messages as one combined transfer: repeated START between them, one STOP at the end
+static esp_err_t rdwr(const i2c_dev_t *dev, struct i2c_msg *msgs, int count)
+{
+    int fd = port_fd(dev->port);
+    if (fd < 0)
+        return ESP_ERR_INVALID_STATE;
+
+    struct i2c_rdwr_ioctl_data data = { .msgs = msgs, .nmsgs = count };
+    if (xfer_ioctl(fd, I2C_RDWR, &data) < 0)
+        return errno_to_esp(errno);
+
+    return ESP_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// i2cdev API
+
+esp_err_t i2c_dev_create_mutex(i2c_dev_t *dev)
+{
+    if (!dev)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+    if (!m)
+        return ESP_ERR_NO_MEM;
+    pthread_mutex_init(m, NULL);
+    dev->mutex = m;
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_dev_delete_mutex(i2c_dev_t *dev)
+{
+    if (!dev || !dev->mutex)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_destroy(dev->mutex);
+    free(dev->mutex);
+    dev->mutex = NULL;
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_dev_take_mutex(i2c_dev_t *dev)
+{
+    if (!dev || !dev->mutex)
+        return ESP_ERR_INVALID_ARG;
+
+    return pthread_mutex_lock(dev->mutex) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t i2c_dev_give_mutex(i2c_dev_t *dev)
+{
+    if (!dev || !dev->mutex)
+        return ESP_ERR_INVALID_ARG;
+
+    return pthread_mutex_unlock(dev->mutex) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size)
+{
+    if (!dev || !in_data || !in_size)
+        return ESP_ERR_INVALID_ARG;
+
+    struct i2c_msg msgs[2];
+    int count = 0;
+
+    if (out_data && out_size)
+        msgs[count++] = (struct i2c_msg) { .addr = dev->addr, .flags = 0, .len = out_size, .buf = (uint8_t *)out_data };
+    msgs[count++] = (struct i2c_msg) { .addr = dev->addr, .flags = I2C_M_RD, .len = in_size, .buf = in_data };
+
+    return rdwr(dev, msgs, count);
+}
+
+esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size)
+{
+    if (!dev || !out_data || !out_size)
+        return ESP_ERR_INVALID_ARG;
+
+    // The register address and the data have to go out in one message
+    uint8_t buf[MAX_WRITE];
+    if (out_reg_size + out_size > sizeof(buf))
+        return ESP_ERR_INVALID_SIZE;
+    if (out_reg && out_reg_size)
+        memcpy(buf, out_reg, out_reg_size);
+    else
+        out_reg_size = 0;
+    memcpy(buf + out_reg_size, out_data, out_size);
+
+    struct i2c_msg msg = { .addr = dev->addr, .flags = 0, .len = out_reg_size + out_size, .buf = buf };
+
+    return rdwr(dev, &msg, 1);
+}
+
+esp_err_t i2c_dev_read_reg(const i2c_dev_t *dev, uint8_t reg, void *in_data, size_t in_size)
+{
+    return i2c_dev_read(dev, &reg, 1, in_data, in_size);
+}
+
+esp_err_t i2c_dev_write_reg(const i2c_dev_t *dev, uint8_t reg, const void *out_data, size_t out_size)
+{
+    return i2c_dev_write(dev, &reg, 1, out_data, out_size);
+}
+
+// The adapter driver owns the pins
+esp_err_t i2c_set_pin(i2c_port_t i2c_num, int sda_io_num, int scl_io_num, bool sda_pullup_en, bool scl_pullup_en,
+                      i2c_mode_t mode)
+{
+    (void)i2c_num; (void)sda_io_num; (void)scl_io_num; (void)sda_pullup_en; (void)scl_pullup_en; (void)mode;
+    return ESP_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeRTOS and ESP-IDF shims
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us)
+{
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    sleep_us((uint64_t)ticks * portTICK_PERIOD_MS * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(monotonic_us() / (portTICK_PERIOD_MS * 1000));
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t)monotonic_us();
+}
+
+void esp_rom_delay_us(uint32_t us)
+{
+    sleep_us(us);
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    (void)gpio_num; (void)mode;
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    (void)gpio_num; (void)level;
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    (void)gpio_num;
+    return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transport control
+
+esp_err_t bq27427_linux_attach(i2c_port_t port, int fd)
+{
+    if (port < 0 || port >= BQ27427_LINUX_MAX_PORTS)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&ports_lock);
+    ports_init();
+    if (ports[port].owned)
+        close(ports[port].fd);
+    ports[port].fd = fd;
+    ports[port].owned = false;
+    pthread_mutex_unlock(&ports_lock);
+
+    return ESP_OK;
+}
+
+void bq27427_linux_close(void)
+{
+    pthread_mutex_lock(&ports_lock);
+    ports_init();
+    for (int i = 0; i < BQ27427_LINUX_MAX_PORTS; i++) {
+        if (ports[i].owned)
+            close(ports[i].fd);
+        ports[i].fd = -1;
+        ports[i].owned = false;
+    }
+    pthread_mutex_unlock(&ports_lock);
+}
+
+void bq27427_linux_set_ioctl(bq27427_linux_ioctl_t fn)
+{
+    xfer_ioctl = fn ? fn : default_ioctl;
+}
@@ -0,0 +1,79 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Linux transport.
+ *
+ * Implements the i2cdev API declared in host/include/i2cdev.h on top of the
+ * Linux i2c-dev interface, so the same bq27427.c runs on Linux gateways.
+ * The i2c_port_t of a descriptor selects /dev/i2c-<port>, opened on first
+ * use. Every i2cdev call is a single I2C_RDWR ioctl: a register read is
+ * the register address write and the data read as one combined transfer
+ * with a repeated START, a register write is one message. Separate i2cdev
+ * calls are not merged into one I2C_RDWR: its messages follow each other
+ * with no bus free time, and the gauge needs 66 us between packets, which
+ * the driver spaces out between calls.
+ *
+ * FreeRTOS delays, ticks and esp_timer run on CLOCK_MONOTONIC. Bus
+ * recovery is left to the kernel adapter driver, so the GPIO calls of the
+ * driver see an idle bus.
+ */
+#pragma once
+
+#include <i2cdev.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BQ27427_LINUX_MAX_PORTS 16
+
+/**
+ * @brief ioctl(2) replacement, for tests without an I2C adapter
+ */
+typedef int (*bq27427_linux_ioctl_t)(int fd, unsigned long request, void *arg);
+
+/**
+    Use an already open file descriptor for a port instead of opening
+    /dev/i2c-<port>. The descriptor is not closed by bq27427_linux_close().
+
+    @return ESP_OK on success, ESP_ERR_INVALID_ARG if port is out of range
+*/
+esp_err_t bq27427_linux_attach(i2c_port_t port, int fd);
+
+/**
+    Close every /dev/i2c-N the transport opened and forget attached
+    descriptors
+*/
+void bq27427_linux_close(void);
+
+/**
+    Route I2C_RDWR through another function
+
+    @param fn replacement, NULL for ioctl(2)
+*/
+void bq27427_linux_set_ioctl(bq27427_linux_ioctl_t fn);
+
+#ifdef __cplusplus
+}
+#endif
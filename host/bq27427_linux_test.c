@@ -0,0 +1,246 @@
+/*
+ * Test of the Linux transport against a mock ioctl(2).
+ *
+ *   bq27427_linux_test
+ *
+ * The mock stands in for an adapter with a BQ27427 on it. It checks the
+ * shape of every I2C_RDWR request, answers register reads from a register
+ * file and Control() subcommands, and fails on demand with a given errno.
+ * Covered: a register read is the address write and the data read as one
+ * combined transfer, a register write is one message carrying the address
+ * and the data, errno maps to esp_err_t as documented, the driver retries a
+ * NACK as its recovery policy says, and a port without an adapter or a write
+ * longer than the transport buffer is refused.
+ *
+ * Prints each failed check; the exit status is 1 if any failed.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <bq27427.h>
+#include "bq27427_linux.h"
+
+#define PORT 1
+#define FD 42
+#define DEVICE_TYPE 0x0427
+
+#define EXPECT(x) do { if (!(x)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #x); failures++; } } while (0)
+
+static int failures;
+
+static struct {
+    uint8_t regs[128];
+    uint16_t subcommand;    // Last Control() subcommand written
+    int ioctls;
+    int combined;           // Requests of an address write and a read
+    int writes;             // Requests of one write message
+    int malformed;          // Requests of any other shape
+    int fail_count;         // Requests left to fail
+    int fail_errno;
+    struct i2c_msg last[2]; // Messages of the last request
+    uint8_t last_out[8];    // Bytes of the last write message
+} mock;
+
+static uint16_t control_response(uint16_t subcommand)
+{
+    switch (subcommand) {
+        case BQ27427_CONTROL_DEVICE_TYPE:
+            return DEVICE_TYPE;
+        case BQ27427_CONTROL_STATUS:
+            return BQ27427_STATUS_SS | BQ27427_STATUS_INITCOMP;
+        default:
+            return 0;
+    }
+}
+
+static int mock_ioctl(int fd, unsigned long request, void *arg)
+{
+    struct i2c_rdwr_ioctl_data *data = arg;
+
+    mock.ioctls++;
+    if (fd != FD || request != I2C_RDWR || !data->nmsgs || data->nmsgs > 2) {
+        mock.malformed++;
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(mock.last, data->msgs, data->nmsgs * sizeof(struct i2c_msg));
+    if (mock.fail_count) {
+        mock.fail_count--;
+        errno = mock.fail_errno;
+        return -1;
+    }
+
+    struct i2c_msg *out = &data->msgs[0];
+    if (out->addr != BQ27427_I2C_ADDRESS || (out->flags & I2C_M_RD) || !out->len || out->len > sizeof(mock.regs)) {
+        mock.malformed++;
+        errno = EINVAL;
+        return -1;
+    }
+    uint8_t reg = out->buf[0];
+    if (data->nmsgs == 2) {
+        struct i2c_msg *in = &data->msgs[1];
+        if (out->len != 1 || in->addr != BQ27427_I2C_ADDRESS || !(in->flags & I2C_M_RD) ||
+            reg + in->len > sizeof(mock.regs)) {
+            mock.malformed++;
+            errno = EINVAL;
+            return -1;
+        }
+        mock.combined++;
+        memcpy(in->buf, mock.regs + reg, in->len);
+        return 2;
+    }
+
+    mock.writes++;
+    memcpy(mock.last_out, out->buf, out->len < sizeof(mock.last_out) ? out->len : sizeof(mock.last_out));
+    if (reg == BQ27427_COMMAND_CONTROL && out->len == 3) {
+        mock.subcommand = out->buf[1] | out->buf[2] << 8;
+        uint16_t w = control_response(mock.subcommand);
+        mock.regs[BQ27427_COMMAND_CONTROL] = w & 0xff;
+        mock.regs[BQ27427_COMMAND_CONTROL + 1] = w >> 8;
+    } else if ((size_t)reg + out->len - 1 <= sizeof(mock.regs))
+        memcpy(mock.regs + reg, out->buf + 1, out->len - 1);
+
+    return 1;
+}
+
+static void reset_mock(void)
+{
+    memset(&mock, 0, sizeof(mock));
+    mock.regs[BQ27427_COMMAND_VOLTAGE] = 3800 & 0xff;
+    mock.regs[BQ27427_COMMAND_VOLTAGE + 1] = 3800 >> 8;
+    mock.regs[BQ27427_COMMAND_SOC] = 75;
+}
+
+static void test_register_read(bq27427_t *dev)
+{
+    uint16_t voltage = 0;
+
+    reset_mock();
+    EXPECT(bq27427_get_voltage(dev, &voltage) == ESP_OK);
+    EXPECT(voltage == 3800);
+    EXPECT(mock.ioctls == 1 && mock.combined == 1);
+    EXPECT(mock.last[0].len == 1 && !(mock.last[0].flags & I2C_M_RD));
+    EXPECT(mock.last[1].len == 2 && (mock.last[1].flags & I2C_M_RD));
+}
+
+static void test_control(bq27427_t *dev)
+{
+    uint16_t type = 0;
+
+    reset_mock();
+    EXPECT(bq27427_read_control(dev, BQ27427_CONTROL_DEVICE_TYPE, &type) == ESP_OK);
+    EXPECT(type == DEVICE_TYPE);
+    // The subcommand goes out with its register address in one message
+    EXPECT(mock.writes == 1 && mock.combined == 1 && !mock.malformed);
+    EXPECT(mock.last_out[0] == BQ27427_COMMAND_CONTROL && mock.subcommand == BQ27427_CONTROL_DEVICE_TYPE);
+}
+
+static void test_snapshot(bq27427_t *dev)
+{
+    bq27427_snapshot_t snap;
+
+    reset_mock();
+    EXPECT(bq27427_read_snapshot(dev, BQ27427_FIELD_VOLTAGE | BQ27427_FIELD_SOC, &snap) == ESP_OK);
+    EXPECT(snap.voltage == 3800 && snap.soc == 75);
+    EXPECT(mock.ioctls && mock.combined == mock.ioctls && !mock.writes);
+}
+
+static void test_errno(void)
+{
+    static const struct {
+        int err;
+        esp_err_t expected;
+    } cases[] = {
+        { ETIMEDOUT, ESP_ERR_TIMEOUT },
+        { EINVAL, ESP_ERR_INVALID_ARG },
+        { ENOMEM, ESP_ERR_NO_MEM },
+        { ENXIO, ESP_FAIL },
+        { EREMOTEIO, ESP_FAIL },
+        { EAGAIN, ESP_FAIL },
+    };
+    i2c_dev_t i2c = { .port = PORT, .addr = BQ27427_I2C_ADDRESS };
+    uint8_t buf[2];
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        reset_mock();
+        mock.fail_count = 1;
+        mock.fail_errno = cases[i].err;
+        esp_err_t err = i2c_dev_read_reg(&i2c, BQ27427_COMMAND_VOLTAGE, buf, sizeof(buf));
+        if (err != cases[i].expected) {
+            printf("errno %d: got %d, expected %d\n", cases[i].err, err, cases[i].expected);
+            failures++;
+        }
+    }
+}
+
+static void test_nack(bq27427_t *dev)
+{
+    bq27427_recovery_t policy = { .retries = 2 };
+    uint16_t voltage;
+
+    // Without retries a NACK is returned at once
+    reset_mock();
+    mock.fail_count = 1;
+    mock.fail_errno = ENXIO;
+    EXPECT(bq27427_get_voltage(dev, &voltage) == ESP_FAIL);
+    EXPECT(mock.ioctls == 1);
+
+    // Two NACKs are absorbed by two retries
+    EXPECT(bq27427_set_recovery(dev, &policy) == ESP_OK);
+    reset_mock();
+    mock.fail_count = 2;
+    mock.fail_errno = EREMOTEIO;
+    voltage = 0;
+    EXPECT(bq27427_get_voltage(dev, &voltage) == ESP_OK);
+    EXPECT(voltage == 3800 && mock.ioctls == 3);
+
+    // A third one is not
+    reset_mock();
+    mock.fail_count = 3;
+    mock.fail_errno = ENXIO;
+    EXPECT(bq27427_get_voltage(dev, &voltage) == ESP_FAIL);
+    EXPECT(mock.ioctls == 3);
+
+    policy.retries = 0;
+    EXPECT(bq27427_set_recovery(dev, &policy) == ESP_OK);
+}
+
+static void test_refused(void)
+{
+    i2c_dev_t i2c = { .port = BQ27427_LINUX_MAX_PORTS, .addr = BQ27427_I2C_ADDRESS };
+    uint8_t buf[80] = { 0 };
+
+    reset_mock();
+    EXPECT(i2c_dev_read_reg(&i2c, BQ27427_COMMAND_VOLTAGE, buf, 2) == ESP_ERR_INVALID_STATE);
+    i2c.port = PORT;
+    EXPECT(i2c_dev_write_reg(&i2c, BQ27427_EXTENDED_BLOCKDATA, buf, sizeof(buf)) == ESP_ERR_INVALID_SIZE);
+    EXPECT(mock.ioctls == 0);
+}
+
+int main(void)
+{
+    bq27427_t dev;
+
+    bq27427_linux_set_ioctl(mock_ioctl);
+    bq27427_linux_attach(PORT, FD);
+    if (bq27427_init_desc(&dev, PORT, 0, 0) != ESP_OK) {
+        printf("bq27427_init_desc failed\n");
+        return 1;
+    }
+
+    test_register_read(&dev);
+    test_control(&dev);
+    test_snapshot(&dev);
+    test_errno();
+    test_nack(&dev);
+    test_refused();
+
+    bq27427_free_desc(&dev);
+    bq27427_linux_close();
+    bq27427_linux_set_ioctl(NULL);
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Decode a telemetry log written by bq27427_log_append() into CSV.
+ *
+ *   bq27427_logdump [-p page_size] image > log.csv
+ *
+ * image is a copy of the log storage: the log file, or a raw partition read
+ * with `esptool.py read_flash` or `parttool.py read_partition`. page_size
+ * defaults to 4096, the erase unit of ESP32 flash. One row is printed per
+ * sample, oldest first; the header row is repeated when the logged fields
+ * change. A summary with the encoded size and the size of the same samples
+ * as plain 16-bit values and a 64-bit timestamp goes to stderr.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bq27427_log.h>
+
+static const char *field_names[BQ27427_FIELD_COUNT] = {
+    "temperature", "voltage", "flags", "nom_capacity", "avail_capacity", "rem_capacity", "full_capacity",
+    "avg_current", "stdby_current", "max_current", "avg_power", "soc", "int_temperature", "soh,soh_status",
+    "rem_cap_unfl", "rem_cap_fil", "full_cap_unfl", "full_cap_fil", "soc_unfl",
+};
+
+static void print_header(uint32_t fields)
+{
+    printf("seq,timestamp_ms");
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++)
+        if (fields & (1 << i))
+            printf(",%s", field_names[i]);
+    printf("\n");
+}
+
+static void print_sample(const bq27427_sample_t *s)
+{
+    const bq27427_snapshot_t *p = &s->snap;
+    uint32_t f = p->fields;
+
+    printf("%" PRIu32 ",%" PRId64, s->seq, s->timestamp_us / 1000);
+#define COL(bit, fmt, v) do { if (f & (bit)) printf("," fmt, v); } while (0)
+    COL(BQ27427_FIELD_TEMP, "%u", p->temperature);
+    COL(BQ27427_FIELD_VOLTAGE, "%u", p->voltage);
+    COL(BQ27427_FIELD_FLAGS, "0x%04x", p->flags);
+    COL(BQ27427_FIELD_NOM_CAPACITY, "%u", p->nom_capacity);
+    COL(BQ27427_FIELD_AVAIL_CAPACITY, "%u", p->avail_capacity);
+    COL(BQ27427_FIELD_REM_CAPACITY, "%u", p->rem_capacity);
+    COL(BQ27427_FIELD_FULL_CAPACITY, "%u", p->full_capacity);
+    COL(BQ27427_FIELD_AVG_CURRENT, "%d", p->avg_current);
+    COL(BQ27427_FIELD_STDBY_CURRENT, "%d", p->stdby_current);
+    COL(BQ27427_FIELD_MAX_CURRENT, "%d", p->max_current);
+    COL(BQ27427_FIELD_AVG_POWER, "%d", p->avg_power);
+    COL(BQ27427_FIELD_SOC, "%u", p->soc);
+    COL(BQ27427_FIELD_INT_TEMP, "%u", p->int_temperature);
+    if (f & BQ27427_FIELD_SOH)
+        printf(",%u,0x%02x", p->soh, p->soh_status);
+    COL(BQ27427_FIELD_REM_CAP_UNFL, "%u", p->rem_cap_unfl);
+    COL(BQ27427_FIELD_REM_CAP_FIL, "%u", p->rem_cap_fil);
+    COL(BQ27427_FIELD_FULL_CAP_UNFL, "%u", p->full_cap_unfl);
+    COL(BQ27427_FIELD_FULL_CAP_FIL, "%u", p->full_cap_fil);
+    COL(BQ27427_FIELD_SOC_UNFL, "%u", p->soc_unfl);
+#undef COL
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t page_size = 4096;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        if (opt != 'p')
+            goto usage;
+        page_size = strtoul(optarg, NULL, 0);
+    }
+    if (optind != argc - 1)
+        goto usage;
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+
+    // Whole pages only, so that the image is never extended
+    bq27427_log_storage_t storage;
+    bq27427_log_reader_t reader;
+    esp_err_t err = bq27427_log_storage_file(&storage, f, size - size % page_size, page_size);
+    if (err == ESP_OK)
+        err = bq27427_log_reader_init(&reader, &storage);
+    if (err != ESP_OK) {
+        fprintf(stderr, "%s: no log found (%s)\n", argv[optind], esp_err_to_name(err));
+        return 1;
+    }
+
+    bq27427_sample_t sample;
+    uint32_t fields = 0, samples = 0, pages = 1;
+    uint64_t encoded = BQ27427_LOG_HEADER_SIZE, plain = 0;
+
+    for (;;) {
+        uint32_t page = reader.page, pos = reader.pos;
+        if (bq27427_log_reader_next(&reader, &sample) != ESP_OK)
+            break;
+        if (reader.page != page) {
+            pos = reader.page;
+            pages++;
+        }
+        encoded += reader.pos - pos;
+        plain += sizeof(int64_t) + 2 * __builtin_popcount(sample.snap.fields);
+        samples++;
+        if (sample.snap.fields != fields) {
+            fields = sample.snap.fields;
+            print_header(fields);
+        }
+        print_sample(&sample);
+    }
+
+    fprintf(stderr, "%" PRIu32 " samples in %" PRIu32 " pages, %" PRIu64 " bytes encoded, %" PRIu64
+            " bytes plain (%.1fx)\n", samples, pages, encoded, plain, encoded ? (double)plain / encoded : 0.0);
+    fclose(f);
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-p page_size] image\n", argv[0]);
+    return 2;
+}
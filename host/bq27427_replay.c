@@ -0,0 +1,419 @@
+/*
+ * Replay a bus trace recorded with bq27427_set_trace() against the current
+ * driver on the simulator, and compare the bus cost.
+ *
+ *   bq27427_replay [-g gap_us] [-o overhead_us] trace.bin > replay.csv
+ *   bq27427_replay -d trace.bin
+ *
+ * The trace is cut into bursts at idle gaps longer than gap_us (default
+ * 2000). The reads in each burst are turned back into driver calls:
+ *
+ *   snapshot  standard command reads: one bq27427_read_snapshot() of every
+ *             field the burst read, after loading the values the gauge
+ *             returned into the simulator
+ *   control   a Control() subcommand followed by a read of its result:
+ *             bq27427_read_control()
+ *   dm_read   a data memory block selected and its checksum read, with the
+ *             unseal and seal around it: bq27427_read_dm()
+ *
+ * A burst that writes data memory or issues a subcommand that changes the
+ * gauge state is a configuration session; it is counted as "config" but
+ * not replayed, like reads of other registers ("other"). The simulator
+ * advances its clock along the trace, so time-dependent driver behavior
+ * sees the same spacing as the field unit did.
+ *
+ * One CSV row per kind of operation compares the recorded transfers with
+ * those of the replay. Both bus times use the simulator's model (bit clocks
+ * at the traced SCL frequency plus overhead_us per transfer, default 20);
+ * recorded_wall_us is what the field unit measured. -d prints the decoded
+ * trace instead.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bq27427.h>
+#include <bq27427_trace.h>
+#include "bq27427_sim.h"
+
+#define PORT 0
+#define DEFAULT_CLK_HZ 400000
+
+typedef enum {
+    OP_SNAPSHOT,
+    OP_CONTROL,
+    OP_DM_READ,
+    OP_CONFIG,
+    OP_OTHER,
+    OP_COUNT,
+} op_kind_t;
+
+static const char *op_names[OP_COUNT] = { "snapshot", "control", "dm_read", "config", "other" };
+
+typedef struct {
+    uint32_t count;
+    uint32_t rec_transactions, rep_transactions;
+    uint64_t rec_bytes, rep_bytes;
+    uint64_t rec_bus_us, rep_bus_us;
+    uint64_t rec_wall_us;
+    uint32_t rep_errors;
+} op_totals_t;
+
+typedef struct {
+    bq27427_trace_record_t rec;
+    uint32_t clk_hz;
+} transfer_t;
+
+static op_totals_t totals[OP_COUNT];
+static uint32_t overhead_us = 20;
+
+// Same model as the simulator's account()
+static void model(const transfer_t *t, uint64_t *bytes, uint64_t *us)
+{
+    size_t out = t->rec.write ? 1 + t->rec.len : 1, in = t->rec.write ? 0 : t->rec.len;
+    uint32_t clk = t->clk_hz ? t->clk_hz : DEFAULT_CLK_HZ;
+    uint64_t bits;
+
+    *bytes = 1 + out + (in ? 1 + in : 0);
+    bits = 2 + (in ? 1 : 0) + *bytes * 9;
+    *us = (bits * 1000000 + clk - 1) / clk + overhead_us;
+}
+
+static void account_recorded(op_kind_t kind, const transfer_t *t)
+{
+    uint64_t bytes, us;
+
+    model(t, &bytes, &us);
+    totals[kind].rec_transactions++;
+    totals[kind].rec_bytes += bytes;
+    totals[kind].rec_bus_us += us;
+    totals[kind].rec_wall_us += t->rec.duration_us;
+}
+
+static void account_replay(op_kind_t kind, const bq27427_sim_stats_t *before, esp_err_t err)
+{
+    bq27427_sim_stats_t after;
+
+    bq27427_sim_get_stats(&after);
+    totals[kind].count++;
+    totals[kind].rep_transactions += after.transactions - before->transactions;
+    totals[kind].rep_bytes += after.bytes - before->bytes;
+    totals[kind].rep_bus_us += after.bus_time_us - before->bus_time_us;
+    if (err != ESP_OK)
+        totals[kind].rep_errors++;
+}
+
+static inline uint16_t word(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static bool is_control_read(uint16_t sub)
+{
+    switch (sub) {
+        case BQ27427_CONTROL_STATUS:
+        case BQ27427_CONTROL_DEVICE_TYPE:
+        case BQ27427_CONTROL_FW_VERSION:
+        case BQ27427_CONTROL_DM_CODE:
+        case BQ27427_CONTROL_PREV_MACWRITE:
+        case BQ27427_CONTROL_CHEM_ID:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Writes that only belong to reads: subcommands, data memory addressing, seal state
+static bool is_read_side_write(const bq27427_trace_record_t *r)
+{
+    switch (r->reg) {
+        case BQ27427_COMMAND_CONTROL:
+            return r->payload_len == 2 && (is_control_read(word(r->data)) || word(r->data) == BQ27427_UNSEAL_KEY ||
+                                           word(r->data) == BQ27427_CONTROL_SEALED);
+        case BQ27427_EXTENDED_CONTROL:
+        case BQ27427_EXTENDED_DATACLASS:
+        case BQ27427_EXTENDED_DATABLOCK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static uint32_t covered_fields(uint8_t reg, uint8_t len)
+{
+    static const uint8_t regs[BQ27427_FIELD_COUNT] = {
+        BQ27427_COMMAND_TEMP, BQ27427_COMMAND_VOLTAGE, BQ27427_COMMAND_FLAGS, BQ27427_COMMAND_NOM_CAPACITY,
+        BQ27427_COMMAND_AVAIL_CAPACITY, BQ27427_COMMAND_REM_CAPACITY, BQ27427_COMMAND_FULL_CAPACITY,
+        BQ27427_COMMAND_AVG_CURRENT, BQ27427_COMMAND_STDBY_CURRENT, BQ27427_COMMAND_MAX_CURRENT,
+        BQ27427_COMMAND_AVG_POWER, BQ27427_COMMAND_SOC, BQ27427_COMMAND_INT_TEMP, BQ27427_COMMAND_SOH,
+        BQ27427_COMMAND_REM_CAP_UNFL, BQ27427_COMMAND_REM_CAP_FIL, BQ27427_COMMAND_FULL_CAP_UNFL,
+        BQ27427_COMMAND_FULL_CAP_FIL, BQ27427_COMMAND_SOC_UNFL,
+    };
+    uint32_t fields = 0;
+
+    for (int i = 0; i < BQ27427_FIELD_COUNT; i++)
+        if (regs[i] >= reg && regs[i] + 2 <= reg + len)
+            fields |= 1 << i;
+
+    return fields;
+}
+
+static bool is_snapshot_read(const bq27427_trace_record_t *r)
+{
+    return !r->write && r->reg >= BQ27427_SNAPSHOT_FIRST_REG && r->reg + r->len - 1 <= BQ27427_SNAPSHOT_LAST_REG;
+}
+
+// A status check that opens a data memory access, rather than a read of its own
+static bool opens_dm_access(const transfer_t *t, size_t n, size_t i)
+{
+    if (i + 2 >= n || !t[i + 2].rec.write)
+        return false;
+
+    const bq27427_trace_record_t *r = &t[i + 2].rec;
+
+    return (r->reg == BQ27427_COMMAND_CONTROL && r->payload_len == 2 && word(r->data) == BQ27427_UNSEAL_KEY) ||
+           r->reg == BQ27427_EXTENDED_CONTROL || r->reg == BQ27427_EXTENDED_DATACLASS;
+}
+
+static void replay_burst(bq27427_t *dev, bq27427_sim_t *sim, const transfer_t *t, size_t n)
+{
+    bool config = false, dm = false;
+    uint32_t fields = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const bq27427_trace_record_t *r = &t[i].rec;
+        if (r->write && !is_read_side_write(r))
+            config = true;
+        if (!r->write && (r->reg == BQ27427_EXTENDED_BLOCKDATA || r->reg == BQ27427_EXTENDED_CHECKSUM))
+            dm = true;
+        if (is_snapshot_read(r) && r->result == BQ27427_TRACE_OK) {
+            fields |= covered_fields(r->reg, r->len);
+            // Let the simulated gauge return what the real one did
+            for (int b = 0; b + 1 < r->payload_len; b += 2)
+                if (!((r->reg + b) & 1))
+                    bq27427_sim_set_word(sim, r->reg + b, word(r->data + b));
+        }
+    }
+
+    if (config) {
+        totals[OP_CONFIG].count++;
+        for (size_t i = 0; i < n; i++)
+            account_recorded(OP_CONFIG, &t[i]);
+        return;
+    }
+
+    bool snapshot_done = false;
+    uint16_t pending = 0xffff;
+    uint8_t dm_class = 0, dm_block = 0;
+    bq27427_sim_stats_t before;
+
+    for (size_t i = 0; i < n; i++) {
+        const bq27427_trace_record_t *r = &t[i].rec;
+        op_kind_t kind = OP_OTHER;
+
+        if (is_snapshot_read(r)) {
+            kind = OP_SNAPSHOT;
+            if (!snapshot_done && fields) {
+                bq27427_snapshot_t snap;
+                bq27427_sim_get_stats(&before);
+                account_replay(OP_SNAPSHOT, &before, bq27427_read_snapshot(dev, fields, &snap));
+                snapshot_done = true;
+            }
+        } else if (r->reg == BQ27427_COMMAND_CONTROL) {
+            kind = OP_CONTROL;
+            if (r->write && r->payload_len == 2 && is_control_read(word(r->data)) &&
+                !(dm && opens_dm_access(t, n, i))) {
+                pending = word(r->data);
+            } else if (!r->write && pending != 0xffff) {
+                uint16_t out;
+                bq27427_sim_get_stats(&before);
+                account_replay(OP_CONTROL, &before, bq27427_read_control(dev, pending, &out));
+                pending = 0xffff;
+            } else if (dm) {
+                // Seal state checks and changes around a data memory access
+                kind = OP_DM_READ;
+            }
+        } else if (r->reg == BQ27427_EXTENDED_DATACLASS || r->reg == BQ27427_EXTENDED_DATABLOCK ||
+                   r->reg == BQ27427_EXTENDED_CONTROL || r->reg == BQ27427_EXTENDED_BLOCKDATA) {
+            kind = OP_DM_READ;
+            if (r->write && r->reg == BQ27427_EXTENDED_DATACLASS && r->payload_len)
+                dm_class = r->data[0];
+            if (r->write && r->reg == BQ27427_EXTENDED_DATABLOCK && r->payload_len)
+                dm_block = r->data[0];
+        } else if (r->reg == BQ27427_EXTENDED_CHECKSUM) {
+            // Every block access, cached or not, ends with its checksum
+            uint8_t byte;
+            kind = OP_DM_READ;
+            bq27427_sim_get_stats(&before);
+            account_replay(OP_DM_READ, &before,
+                           bq27427_read_dm(dev, dm_class, dm_block * BQ27427_DM_BLOCK_SIZE, &byte, 1));
+        }
+        if (kind == OP_OTHER)
+            totals[OP_OTHER].count++;
+        account_recorded(kind, &t[i]);
+    }
+}
+
+static void dump(const transfer_t *t, size_t n)
+{
+    static const char *results[] = { "ok", "nack", "timeout", "error" };
+
+    printf("time_us,duration_us,dir,reg,len,result,data\n");
+    for (size_t i = 0; i < n; i++) {
+        const bq27427_trace_record_t *r = &t[i].rec;
+        printf("%" PRId64 ",%" PRIu32 ",%s,0x%02x,%u,%s,", r->timestamp_us, r->duration_us, r->write ? "W" : "R",
+               r->reg, r->len, results[r->result]);
+        for (int b = 0; b < r->payload_len; b++)
+            printf("%02x", r->data[b]);
+        printf("\n");
+    }
+}
+
+static uint8_t *load(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data = NULL;
+
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size > 0 && (data = malloc(size)) && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *len = size > 0 ? size : 0;
+
+    return data;
+}
+
+static void print_change(const char *what, uint64_t recorded, uint64_t replay)
+{
+    fprintf(stderr, "%-14s %10" PRIu64 " -> %10" PRIu64, what, recorded, replay);
+    if (recorded)
+        fprintf(stderr, "  (%+.1f%%)", 100.0 * ((double)replay - recorded) / recorded);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t gap_us = 2000;
+    bool dump_only = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dg:o:")) != -1) {
+        switch (opt) {
+            case 'd':
+                dump_only = true;
+                break;
+            case 'g':
+                gap_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                overhead_us = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind != argc - 1)
+        goto usage;
+
+    size_t len, pos = 0, n = 0, cap = 0;
+    uint8_t *data = load(argv[optind], &len);
+    if (!data)
+        return 1;
+
+    transfer_t *t = NULL;
+    bq27427_trace_stream_t stream = { 0 };
+    bq27427_trace_record_t rec;
+    esp_err_t err;
+    while ((err = bq27427_trace_parse(data, len, &pos, &stream, &rec)) == ESP_OK) {
+        if (n == cap) {
+            cap = cap ? 2 * cap : 1024;
+            t = realloc(t, cap * sizeof(transfer_t));
+            if (!t)
+                return 1;
+        }
+        t[n].rec = rec;
+        t[n].clk_hz = stream.clk_hz;
+        n++;
+    }
+    if (err != ESP_ERR_NOT_FOUND)
+        fprintf(stderr, "%s: malformed at offset %zu, using the first %zu transfers\n", argv[optind], pos, n);
+    if (!n) {
+        fprintf(stderr, "%s: no transfers\n", argv[optind]);
+        return 1;
+    }
+    if (dump_only) {
+        dump(t, n);
+        return 0;
+    }
+
+    bq27427_sim_timing_t timing = { .cfgupdate_ms = 50, .soft_reset_ms = 100, .overhead_us = overhead_us };
+    bq27427_sim_set_timing(&timing);
+    bq27427_sim_t *sim = bq27427_sim_create(PORT, BQ27427_I2C_ADDRESS);
+    bq27427_t dev;
+    if (!sim || bq27427_init_desc(&dev, PORT, 0, 0) != ESP_OK) {
+        fprintf(stderr, "Simulator setup failed\n");
+        return 1;
+    }
+    dev.i2c_dev.cfg.master.clk_speed = t[0].clk_hz ? t[0].clk_hz : DEFAULT_CLK_HZ;
+    // A field unit runs a configured gauge
+    bq27427_sim_set_flags(sim, 0, BQ27427_FLAG_ITPOR);
+
+    uint64_t sim_start = bq27427_sim_time_us();
+    int64_t trace_start = t[0].rec.timestamp_us;
+    for (size_t start = 0, i = 1; i <= n; i++) {
+        if (i < n) {
+            const bq27427_trace_record_t *prev = &t[i - 1].rec;
+            if (t[i].rec.timestamp_us - (prev->timestamp_us + prev->duration_us) <= gap_us)
+                continue;
+        }
+        uint64_t at = sim_start + (t[start].rec.timestamp_us - trace_start);
+        if (bq27427_sim_time_us() < at)
+            bq27427_sim_advance_us(at - bq27427_sim_time_us());
+        replay_burst(&dev, sim, t + start, i - start);
+        start = i;
+    }
+
+    op_totals_t sum = { 0 };
+    printf("op,count,recorded_transactions,replay_transactions,recorded_bytes,replay_bytes,"
+           "recorded_bus_us,replay_bus_us,recorded_wall_us,replay_errors\n");
+    for (int k = 0; k < OP_COUNT; k++) {
+        op_totals_t *o = &totals[k];
+        printf("%s,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+               ",%" PRIu32 "\n", op_names[k], o->count, o->rec_transactions, o->rep_transactions, o->rec_bytes,
+               o->rep_bytes, o->rec_bus_us, o->rep_bus_us, o->rec_wall_us, o->rep_errors);
+        if (k == OP_CONFIG || k == OP_OTHER)
+            continue;
+        sum.rec_transactions += o->rec_transactions;
+        sum.rep_transactions += o->rep_transactions;
+        sum.rec_bus_us += o->rec_bus_us;
+        sum.rep_bus_us += o->rep_bus_us;
+    }
+
+    fprintf(stderr, "%zu transfers replayed as %" PRIu32 " calls, recorded -> replay:\n", n,
+            totals[OP_SNAPSHOT].count + totals[OP_CONTROL].count + totals[OP_DM_READ].count);
+    print_change("transactions", sum.rec_transactions, sum.rep_transactions);
+    print_change("bus time (us)", sum.rec_bus_us, sum.rep_bus_us);
+    if (totals[OP_CONFIG].count || totals[OP_OTHER].count)
+        fprintf(stderr, "not replayed: %" PRIu32 " configuration bursts, %" PRIu32 " other transfers\n",
+                totals[OP_CONFIG].count, totals[OP_OTHER].count);
+
+    bq27427_free_desc(&dev);
+    bq27427_sim_destroy(sim);
+    free(t);
+    free(data);
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-d] [-g gap_us] [-o overhead_us] trace\n", argv[0]);
+    return 2;
+}
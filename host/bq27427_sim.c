@@ -0,0 +1,804 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <driver/gpio.h>
+#include <esp_rom_sys.h>
+#include <bq27427.h>
+#include "bq27427_sim.h"
+
+#define DEFAULT_CLK_HZ 100000
+#define BUS_LOCKS 8 // Ports that can be busy at the same time in realtime mode
+
+#define CHEM_ID_A 0x3230
+#define CHEM_ID_B 0x1202
+#define CHEM_ID_C 0x3142
+
+struct bq27427_sim {
+    i2c_port_t port;
+    uint8_t addr;
+
+    uint8_t regs[128];              // Standard command register file, little-endian words
+    uint16_t status;                // CONTROL_STATUS bits besides SS and INITCOMP
+    uint16_t control;               // Last Control() subcommand
+    bool control_written;           // A subcommand was written since creation
+    pthread_t control_owner;        // Thread that wrote it
+    uint16_t chem_id;
+    bool sealed;
+    bool unseal_half;               // First half of the unseal key received
+    pthread_t unseal_owner;         // Thread that wrote the first half
+
+    bool cfgupdate;                 // SET_CFGUPDATE accepted
+    uint64_t cfgupmode_at;          // Time CFGUPMODE becomes set
+    bool exiting;                   // SOFT_RESET received in CFGUPDATE
+    uint64_t exit_at;               // Time CFGUPMODE is cleared
+
+    uint8_t dm_class;
+    uint8_t dm_block;
+    uint8_t block[BQ27427_DM_BLOCK_SIZE];
+    bool block_dirty;               // Block data written since the block was loaded
+    pthread_t block_owner;          // Thread that wrote it
+    uint32_t block_writes;
+    uint8_t dm[256][BQ27427_SIM_CLASS_SIZE];
+
+    bq27427_sim_fault_t fault;
+    uint32_t fault_count;           // Transfers or SCL clocks left, 0 for no limit
+    int sda_pin;                    // Lines of the last descriptor that addressed the gauge
+    int scl_pin;
+    bool scl_high;
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static bq27427_sim_t *devices[BQ27427_SIM_MAX_DEVICES];
+static bq27427_sim_stats_t stats;
+static bq27427_sim_timing_t timing = {
+    .cfgupdate_ms = 50,
+    .soft_reset_ms = 100,
+    .overhead_us = 20,
+};
+static uint64_t now_us;
+static pthread_mutex_t bus_locks[BUS_LOCKS] = { [0 ... BUS_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+static bq27427_sim_mutex_hook_t mutex_hook;
+static uint32_t mutex_fail_in;      // Takes until one fails, plus one; 0 for none
+static __thread uint64_t mutex_wait_ns, mutex_taken_ns;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_us(uint64_t us)
+{
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+// Count a step that continues what another thread started. Called with sim_lock held.
+static void check_owner(bool pending, pthread_t owner)
+{
+    if (pending && !pthread_equal(owner, pthread_self()))
+        stats.torn++;
+}
+
+static inline void put_le16(uint8_t *buf, uint16_t v)
+{
+    buf[0] = v & 0xff;
+    buf[1] = v >> 8;
+}
+
+static inline uint16_t get_le16(const uint8_t *buf)
+{
+    return (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
+}
+
+static inline void put_be16(uint8_t *buf, uint16_t v)
+{
+    buf[0] = v >> 8;
+    buf[1] = v & 0xff;
+}
+
+static inline uint16_t get_be16(const uint8_t *buf)
+{
+    return ((uint16_t)buf[0] << 8) | buf[1];
+}
+
+static uint8_t checksum(const uint8_t *data)
+{
+    uint8_t sum = 0;
+
+    for (int i = 0; i < BQ27427_DM_BLOCK_SIZE; i++)
+        sum += data[i];
+
+    return 0xff - sum;
+}
+
+static void set_flags(bq27427_sim_t *sim, uint16_t set, uint16_t clear)
+{
+    uint16_t flags = get_le16(&sim->regs[BQ27427_COMMAND_FLAGS]);
+
+    put_le16(&sim->regs[BQ27427_COMMAND_FLAGS], (flags & ~clear) | set);
+}
+
+// Apply gauge-side state changes that are due at the current time
+static void update(bq27427_sim_t *sim)
+{
+    if (sim->cfgupdate && !sim->exiting && now_us >= sim->cfgupmode_at)
+        set_flags(sim, BQ27427_FLAG_CFGUPMODE, 0);
+    if (sim->exiting && now_us >= sim->exit_at) {
+        sim->cfgupdate = false;
+        sim->exiting = false;
+        set_flags(sim, 0, BQ27427_FLAG_CFGUPMODE | BQ27427_FLAG_ITPOR);
+    }
+}
+
+static void load_block(bq27427_sim_t *sim)
+{
+    check_owner(sim->block_dirty, sim->block_owner);
+    sim->block_dirty = false;
+    if (sim->sealed || sim->dm_block >= BQ27427_SIM_CLASS_SIZE / BQ27427_DM_BLOCK_SIZE) {
+        memset(sim->block, 0, sizeof(sim->block));
+        return;
+    }
+    memcpy(sim->block, &sim->dm[sim->dm_class][sim->dm_block * BQ27427_DM_BLOCK_SIZE], BQ27427_DM_BLOCK_SIZE);
+}
+
+static void commit_block(bq27427_sim_t *sim, uint8_t csum)
+{
+    bool in_cfgupdate = get_le16(&sim->regs[BQ27427_COMMAND_FLAGS]) & BQ27427_FLAG_CFGUPMODE;
+
+    check_owner(sim->block_dirty, sim->block_owner);
+    sim->block_dirty = false;
+    if (sim->sealed || !in_cfgupdate || csum != checksum(sim->block)
+            || sim->dm_block >= BQ27427_SIM_CLASS_SIZE / BQ27427_DM_BLOCK_SIZE) {
+        stats.rejected++;
+        return;
+    }
+    memcpy(&sim->dm[sim->dm_class][sim->dm_block * BQ27427_DM_BLOCK_SIZE], sim->block, BQ27427_DM_BLOCK_SIZE);
+    sim->block_writes++;
+}
+
+static void load_defaults(bq27427_sim_t *sim)
+{
+    memset(sim->regs, 0, sizeof(sim->regs));
+    memset(sim->dm, 0, sizeof(sim->dm));
+
+    put_le16(&sim->regs[BQ27427_COMMAND_TEMP], 2982);
+    put_le16(&sim->regs[BQ27427_COMMAND_VOLTAGE], 3800);
+    put_le16(&sim->regs[BQ27427_COMMAND_FLAGS], BQ27427_FLAG_ITPOR | BQ27427_FLAG_BAT_DET | BQ27427_FLAG_DSG);
+    put_le16(&sim->regs[BQ27427_COMMAND_NOM_CAPACITY], 1005);
+    put_le16(&sim->regs[BQ27427_COMMAND_AVAIL_CAPACITY], 1340);
+    put_le16(&sim->regs[BQ27427_COMMAND_REM_CAPACITY], 1005);
+    put_le16(&sim->regs[BQ27427_COMMAND_FULL_CAPACITY], 1340);
+    put_le16(&sim->regs[BQ27427_COMMAND_AVG_CURRENT], (uint16_t) - 150);
+    put_le16(&sim->regs[BQ27427_COMMAND_STDBY_CURRENT], (uint16_t) - 10);
+    put_le16(&sim->regs[BQ27427_COMMAND_MAX_CURRENT], (uint16_t) - 500);
+    put_le16(&sim->regs[BQ27427_COMMAND_AVG_POWER], (uint16_t) - 570);
+    put_le16(&sim->regs[BQ27427_COMMAND_SOC], 75);
+    put_le16(&sim->regs[BQ27427_COMMAND_INT_TEMP], 2992);
+    put_le16(&sim->regs[BQ27427_COMMAND_SOH], 0x0364);
+    put_le16(&sim->regs[BQ27427_COMMAND_REM_CAP_UNFL], 1010);
+    put_le16(&sim->regs[BQ27427_COMMAND_REM_CAP_FIL], 1005);
+    put_le16(&sim->regs[BQ27427_COMMAND_FULL_CAP_UNFL], 1345);
+    put_le16(&sim->regs[BQ27427_COMMAND_FULL_CAP_FIL], 1340);
+    put_le16(&sim->regs[BQ27427_COMMAND_SOC_UNFL], 75);
+
+    uint8_t *dm = sim->dm[BQ27427_ID_REGISTERS];
+    put_be16(dm + BQ27427_DM_OPCONFIG, BQ27427_OPCONFIG_BIE | BQ27427_OPCONFIG_SLEEP | BQ27427_OPCONFIG_RMFCC
+             | BQ27427_OPCONFIG_BATLOWEN | BQ27427_OPCONFIG_TEMPS);
+    dm = sim->dm[BQ27427_ID_POWER];
+    put_be16(dm + BQ27427_DM_SLEEP_CURRENT, 10);
+    dm = sim->dm[BQ27427_ID_DISCHARGE];
+    dm[BQ27427_DM_SOC1_SET] = 10;
+    dm[BQ27427_DM_SOC1_CLEAR] = 15;
+    dm[BQ27427_DM_SOCF_SET] = 2;
+    dm[BQ27427_DM_SOCF_CLEAR] = 5;
+    dm = sim->dm[BQ27427_ID_CURRENT_THRESH];
+    put_be16(dm + BQ27427_DM_DSG_CURRENT, 167);
+    dm = sim->dm[BQ27427_ID_STATE];
+    put_be16(dm + BQ27427_DM_DESIGN_CAPACITY, 1340);
+    put_be16(dm + BQ27427_DM_DESIGN_ENERGY, 4960);
+    put_be16(dm + BQ27427_DM_TERMINATE_VOLTAGE, 3200);
+    dm[BQ27427_DM_SOCI_DELTA] = 1;
+    put_be16(dm + BQ27427_DM_TAPER_RATE, 100);
+    put_be16(dm + BQ27427_DM_TAPER_VOLTAGE, 4100);
+    dm = sim->dm[BQ27427_ID_CODES];
+    put_be16(dm, BQ27427_UNSEAL_KEY);
+    put_be16(dm + 2, BQ27427_UNSEAL_KEY);
+
+    sim->status = 0;
+    sim->control = BQ27427_CONTROL_STATUS;
+    sim->chem_id = CHEM_ID_A;
+    sim->sealed = true;
+    sim->unseal_half = false;
+    sim->cfgupdate = false;
+    sim->exiting = false;
+    sim->dm_class = 0;
+    sim->dm_block = 0;
+    memset(sim->block, 0, sizeof(sim->block));
+    sim->block_dirty = false;
+}
+
+static uint16_t control_response(bq27427_sim_t *sim)
+{
+    switch (sim->control) {
+        case BQ27427_CONTROL_DEVICE_TYPE:
+            return BQ27427_DEVICE_ID;
+        case BQ27427_CONTROL_FW_VERSION:
+            return 0x0202;
+        case BQ27427_CONTROL_DM_CODE:
+            return 0x0048;
+        case BQ27427_CONTROL_CHEM_ID:
+            return sim->chem_id;
+        default:
+            return sim->status | BQ27427_STATUS_INITCOMP | (sim->sealed ? BQ27427_STATUS_SS : 0);
+    }
+}
+
+static void control(bq27427_sim_t *sim, uint16_t function)
+{
+    bool unsealed = !sim->sealed;
+
+    if (function == BQ27427_UNSEAL_KEY) {
+        if (sim->unseal_half) {
+            check_owner(true, sim->unseal_owner);
+            sim->sealed = false;
+        }
+        sim->unseal_half = !sim->unseal_half;
+        sim->unseal_owner = pthread_self();
+        return;
+    }
+    sim->unseal_half = false;
+    sim->control = function;
+    sim->control_written = true;
+    sim->control_owner = pthread_self();
+
+    switch (function) {
+        case BQ27427_CONTROL_SEALED:
+            sim->sealed = true;
+            break;
+        case BQ27427_CONTROL_SET_CFGUPDATE:
+            if (unsealed && !sim->cfgupdate) {
+                sim->cfgupdate = true;
+                stats.cfgupdates++;
+                sim->cfgupmode_at = now_us + timing.cfgupdate_ms * 1000ULL;
+            }
+            break;
+        case BQ27427_CONTROL_SOFT_RESET:
+            if (unsealed && sim->cfgupdate && !sim->exiting) {
+                sim->exiting = true;
+                sim->exit_at = now_us + timing.soft_reset_ms * 1000ULL;
+            }
+            break;
+        case BQ27427_CONTROL_RESET:
+            if (unsealed)
+                load_defaults(sim);
+            break;
+        case BQ27427_CONTROL_CHEM_A:
+        case BQ27427_CONTROL_CHEM_B:
+        case BQ27427_CONTROL_CHEM_C:
+            if (unsealed && (get_le16(&sim->regs[BQ27427_COMMAND_FLAGS]) & BQ27427_FLAG_CFGUPMODE))
+                sim->chem_id = function == BQ27427_CONTROL_CHEM_A ? CHEM_ID_A
+                               : function == BQ27427_CONTROL_CHEM_B ? CHEM_ID_B : CHEM_ID_C;
+            break;
+        default:
+            break;
+    }
+}
+
+static uint8_t read_byte(bq27427_sim_t *sim, uint8_t addr)
+{
+    uint16_t w;
+
+    switch (addr) {
+        case BQ27427_COMMAND_CONTROL:
+        case BQ27427_COMMAND_CONTROL + 1:
+            w = control_response(sim);
+            return addr == BQ27427_COMMAND_CONTROL ? w & 0xff : w >> 8;
+        case BQ27427_EXTENDED_OPCONFIG:
+        case BQ27427_EXTENDED_OPCONFIG + 1:
+            w = get_be16(&sim->dm[BQ27427_ID_REGISTERS][BQ27427_DM_OPCONFIG]);
+            return addr == BQ27427_EXTENDED_OPCONFIG ? w & 0xff : w >> 8;
+        case BQ27427_EXTENDED_CAPACITY:
+        case BQ27427_EXTENDED_CAPACITY + 1:
+            w = get_be16(&sim->dm[BQ27427_ID_STATE][BQ27427_DM_DESIGN_CAPACITY]);
+            return addr == BQ27427_EXTENDED_CAPACITY ? w & 0xff : w >> 8;
+        case BQ27427_EXTENDED_DATACLASS:
+            return sim->dm_class;
+        case BQ27427_EXTENDED_DATABLOCK:
+            return sim->dm_block;
+        case BQ27427_EXTENDED_CHECKSUM:
+            return checksum(sim->block);
+        case BQ27427_EXTENDED_CONTROL:
+            return 0;
+        default:
+            if (addr >= BQ27427_EXTENDED_BLOCKDATA && addr < BQ27427_EXTENDED_BLOCKDATA + BQ27427_DM_BLOCK_SIZE)
+                return sim->block[addr - BQ27427_EXTENDED_BLOCKDATA];
+            return sim->regs[addr & 0x7f];
+    }
+}
+
+static void write_bytes(bq27427_sim_t *sim, uint8_t reg, const uint8_t *data, size_t len)
+{
+    if (reg == BQ27427_COMMAND_CONTROL && len == 2) {
+        control(sim, get_le16(data));
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        uint8_t addr = reg + i;
+        if (addr == BQ27427_EXTENDED_DATACLASS) {
+            sim->dm_class = data[i];
+            sim->dm_block = 0;
+            load_block(sim);
+        } else if (addr == BQ27427_EXTENDED_DATABLOCK) {
+            sim->dm_block = data[i];
+            load_block(sim);
+        } else if (addr == BQ27427_EXTENDED_CHECKSUM)
+            commit_block(sim, data[i]);
+        else if (addr >= BQ27427_EXTENDED_BLOCKDATA && addr < BQ27427_EXTENDED_BLOCKDATA + BQ27427_DM_BLOCK_SIZE) {
+            if (!sim->sealed) {
+                check_owner(sim->block_dirty, sim->block_owner);
+                sim->block[addr - BQ27427_EXTENDED_BLOCKDATA] = data[i];
+                sim->block_dirty = true;
+                sim->block_owner = pthread_self();
+            }
+        }
+        // Other registers are read-only
+    }
+}
+
+static bq27427_sim_t *find(const i2c_dev_t *dev)
+{
+    for (int i = 0; i < BQ27427_SIM_MAX_DEVICES; i++)
+        if (devices[i] && devices[i]->port == dev->port && devices[i]->addr == dev->addr)
+            return devices[i];
+
+    return NULL;
+}
+
+/*
+ * Account one transfer: START, address and register bytes, an optional
+ * repeated START with the read address, the data bytes and STOP. Each byte
+ * takes nine clocks including its ACK.
+ */
+static uint64_t account(const i2c_dev_t *dev, size_t out_size, size_t in_size)
+{
+    uint32_t clk = dev->cfg.master.clk_speed ? dev->cfg.master.clk_speed : DEFAULT_CLK_HZ;
+    uint64_t bytes = 1 + out_size + (in_size ? 1 + in_size : 0);
+    uint64_t bits = 2 + (in_size ? 1 : 0) + bytes * 9;
+    uint64_t us = (bits * 1000000 + clk - 1) / clk + timing.overhead_us;
+
+    stats.transactions++;
+    if (in_size)
+        stats.reads++;
+    else
+        stats.writes++;
+    stats.bytes += bytes;
+    stats.bits += bits;
+    stats.bus_time_us += us;
+    now_us += us;
+
+    return us;
+}
+
+// Apply an injected fault to one transfer. Called with sim_lock held.
+static esp_err_t fault(bq27427_sim_t *sim)
+{
+    esp_err_t err = ESP_ERR_TIMEOUT;
+
+    switch (sim->fault) {
+        case BQ27427_SIM_FAULT_NACK:
+            stats.nacks++;
+            err = ESP_FAIL;
+            break;
+        case BQ27427_SIM_FAULT_TIMEOUT:
+        case BQ27427_SIM_FAULT_SDA_STUCK:
+            now_us += (uint64_t)timing.bus_timeout_ms * 1000;
+            break;
+        default:
+            return ESP_OK;
+    }
+    if (sim->fault != BQ27427_SIM_FAULT_SDA_STUCK && sim->fault_count && !--sim->fault_count)
+        sim->fault = BQ27427_SIM_FAULT_NONE;
+
+    return err;
+}
+
+// Run one transfer on the model. Called with sim_lock held.
+static esp_err_t execute(const i2c_dev_t *dev, const uint8_t *out, size_t out_size, uint8_t *in, size_t in_size)
+{
+    bq27427_sim_t *sim = find(dev);
+    if (!sim) {
+        stats.nacks++;
+        return ESP_FAIL;
+    }
+    sim->sda_pin = dev->cfg.sda_io_num;
+    sim->scl_pin = dev->cfg.scl_io_num;
+    esp_err_t err = fault(sim);
+    if (err != ESP_OK)
+        return err;
+    update(sim);
+    if (!in_size && out_size)
+        write_bytes(sim, out[0], out + 1, out_size - 1);
+    else if (in_size) {
+        uint8_t reg = out_size ? out[0] : 0;
+        if (reg == BQ27427_COMMAND_CONTROL)
+            check_owner(sim->control_written, sim->control_owner);
+        for (size_t i = 0; i < in_size; i++)
+            in[i] = read_byte(sim, reg + i);
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t transfer(const i2c_dev_t *dev, const uint8_t *out, size_t out_size, uint8_t *in, size_t in_size)
+{
+    pthread_mutex_t *bus = &bus_locks[(unsigned)dev->port % BUS_LOCKS];
+
+    pthread_mutex_lock(bus);
+    pthread_mutex_lock(&sim_lock);
+    uint64_t start = now_us;
+    account(dev, out_size, in_size);
+    esp_err_t err = execute(dev, out, out_size, in, in_size);
+    uint64_t busy = timing.realtime ? now_us - start : 0;
+    pthread_mutex_unlock(&sim_lock);
+
+    // The port stays busy for as long as the transfer is on the wire
+    if (busy)
+        sleep_us(busy);
+    pthread_mutex_unlock(bus);
+
+    return err;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// i2cdev API
+
+esp_err_t i2c_dev_create_mutex(i2c_dev_t *dev)
+{
+    if (!dev)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+    if (!m)
+        return ESP_ERR_NO_MEM;
+    // Catch a give by a thread that does not hold it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    dev->mutex = m;
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_dev_delete_mutex(i2c_dev_t *dev)
+{
+    if (!dev || !dev->mutex)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_destroy(dev->mutex);
+    free(dev->mutex);
+    dev->mutex = NULL;
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_dev_take_mutex(i2c_dev_t *dev)
+{
+    if (!dev || !dev->mutex)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&sim_lock);
+    stats.mutex_takes++;
+    bool fail = mutex_fail_in && !--mutex_fail_in;
+    pthread_mutex_unlock(&sim_lock);
+    if (fail)
+        return ESP_ERR_TIMEOUT;
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(dev->mutex);
+    mutex_taken_ns = monotonic_ns();
+    mutex_wait_ns = mutex_taken_ns - start;
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_dev_give_mutex(i2c_dev_t *dev)
+{
+    if (!dev || !dev->mutex)
+        return ESP_ERR_INVALID_ARG;
+
+    uint64_t hold = monotonic_ns() - mutex_taken_ns;
+    if (pthread_mutex_unlock(dev->mutex)) {
+        pthread_mutex_lock(&sim_lock);
+        stats.bad_gives++;
+        pthread_mutex_unlock(&sim_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (mutex_hook)
+        mutex_hook(dev, mutex_wait_ns, hold);
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size)
+{
+    if (!dev || !in_data || !in_size)
+        return ESP_ERR_INVALID_ARG;
+
+    return transfer(dev, out_data, out_data ? out_size : 0, in_data, in_size);
+}
+
+esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size)
+{
+    if (!dev || !out_data || !out_size || out_reg_size > 1)
+        return ESP_ERR_INVALID_ARG;
+
+    uint8_t buf[1 + 64];
+    if (out_reg_size + out_size > sizeof(buf))
+        return ESP_ERR_INVALID_SIZE;
+    if (out_reg_size)
+        memcpy(buf, out_reg, out_reg_size);
+    memcpy(buf + out_reg_size, out_data, out_size);
+
+    return transfer(dev, buf, out_reg_size + out_size, NULL, 0);
+}
+
+esp_err_t i2c_dev_read_reg(const i2c_dev_t *dev, uint8_t reg, void *in_data, size_t in_size)
+{
+    return i2c_dev_read(dev, &reg, 1, in_data, in_size);
+}
+
+esp_err_t i2c_dev_write_reg(const i2c_dev_t *dev, uint8_t reg, const void *out_data, size_t out_size)
+{
+    return i2c_dev_write(dev, &reg, 1, out_data, out_size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeRTOS and ESP-IDF shims
+
+void vTaskDelay(TickType_t ticks)
+{
+    uint64_t us = (uint64_t)ticks * portTICK_PERIOD_MS * 1000;
+
+    bq27427_sim_advance_us(us);
+    pthread_mutex_lock(&sim_lock);
+    bool realtime = timing.realtime;
+    pthread_mutex_unlock(&sim_lock);
+    if (realtime)
+        sleep_us(us);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(bq27427_sim_time_us() / (portTICK_PERIOD_MS * 1000));
+}
+
+void esp_rom_delay_us(uint32_t us)
+{
+    bq27427_sim_advance_us(us);
+}
+
+esp_err_t i2c_set_pin(i2c_port_t i2c_num, int sda_io_num, int scl_io_num, bool sda_pullup_en, bool scl_pullup_en,
+                      i2c_mode_t mode)
+{
+    (void)i2c_num; (void)sda_io_num; (void)scl_io_num; (void)sda_pullup_en; (void)scl_pullup_en; (void)mode;
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    (void)gpio_num; (void)mode;
+    return ESP_OK;
+}
+
+// Rising edges on the SCL line of a gauge with SDA stuck count towards its release
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    pthread_mutex_lock(&sim_lock);
+    for (int i = 0; i < BQ27427_SIM_MAX_DEVICES; i++) {
+        bq27427_sim_t *sim = devices[i];
+        if (!sim || sim->scl_pin != gpio_num)
+            continue;
+        if (level && !sim->scl_high && sim->fault == BQ27427_SIM_FAULT_SDA_STUCK
+                && (!sim->fault_count || !--sim->fault_count))
+            sim->fault = BQ27427_SIM_FAULT_NONE;
+        sim->scl_high = level;
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    int level = 1;
+
+    pthread_mutex_lock(&sim_lock);
+    for (int i = 0; i < BQ27427_SIM_MAX_DEVICES; i++)
+        if (devices[i] && devices[i]->sda_pin == gpio_num && devices[i]->fault == BQ27427_SIM_FAULT_SDA_STUCK)
+            level = 0;
+    pthread_mutex_unlock(&sim_lock);
+
+    return level;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t)bq27427_sim_time_us();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulator control
+
+bq27427_sim_t *bq27427_sim_create(i2c_port_t port, uint8_t addr)
+{
+    bq27427_sim_t *sim = calloc(1, sizeof(bq27427_sim_t));
+    if (!sim)
+        return NULL;
+    sim->port = port;
+    sim->addr = addr;
+    sim->sda_pin = -1;
+    sim->scl_pin = -1;
+    sim->scl_high = true;
+    load_defaults(sim);
+
+    pthread_mutex_lock(&sim_lock);
+    for (int i = 0; i < BQ27427_SIM_MAX_DEVICES; i++) {
+        if (!devices[i]) {
+            devices[i] = sim;
+            pthread_mutex_unlock(&sim_lock);
+            return sim;
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    free(sim);
+
+    return NULL;
+}
+
+void bq27427_sim_destroy(bq27427_sim_t *sim)
+{
+    pthread_mutex_lock(&sim_lock);
+    for (int i = 0; i < BQ27427_SIM_MAX_DEVICES; i++)
+        if (devices[i] == sim)
+            devices[i] = NULL;
+    pthread_mutex_unlock(&sim_lock);
+    free(sim);
+}
+
+void bq27427_sim_power_on_reset(bq27427_sim_t *sim)
+{
+    pthread_mutex_lock(&sim_lock);
+    load_defaults(sim);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void bq27427_sim_set_word(bq27427_sim_t *sim, uint8_t cmd, uint16_t value)
+{
+    pthread_mutex_lock(&sim_lock);
+    put_le16(&sim->regs[cmd & 0x7e], value);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+uint16_t bq27427_sim_get_word(bq27427_sim_t *sim, uint8_t cmd)
+{
+    pthread_mutex_lock(&sim_lock);
+    update(sim);
+    uint16_t v = get_le16(&sim->regs[cmd & 0x7e]);
+    pthread_mutex_unlock(&sim_lock);
+
+    return v;
+}
+
+void bq27427_sim_set_flags(bq27427_sim_t *sim, uint16_t set, uint16_t clear)
+{
+    pthread_mutex_lock(&sim_lock);
+    set_flags(sim, set, clear);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void bq27427_sim_set_status(bq27427_sim_t *sim, uint16_t set, uint16_t clear)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim->status = ((sim->status & ~clear) | set) & ~(BQ27427_STATUS_SS | BQ27427_STATUS_INITCOMP);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+bool bq27427_sim_is_sealed(bq27427_sim_t *sim)
+{
+    pthread_mutex_lock(&sim_lock);
+    bool sealed = sim->sealed;
+    pthread_mutex_unlock(&sim_lock);
+
+    return sealed;
+}
+
+bool bq27427_sim_in_cfgupdate(bq27427_sim_t *sim)
+{
+    pthread_mutex_lock(&sim_lock);
+    update(sim);
+    bool cfgupdate = sim->cfgupdate;
+    pthread_mutex_unlock(&sim_lock);
+
+    return cfgupdate;
+}
+
+uint32_t bq27427_sim_block_writes(bq27427_sim_t *sim)
+{
+    pthread_mutex_lock(&sim_lock);
+    uint32_t n = sim->block_writes;
+    pthread_mutex_unlock(&sim_lock);
+
+    return n;
+}
+
+uint8_t *bq27427_sim_dm(bq27427_sim_t *sim, uint8_t class_id)
+{
+    return sim->dm[class_id];
+}
+
+void bq27427_sim_inject_fault(bq27427_sim_t *sim, bq27427_sim_fault_t fault, uint32_t count)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim->fault = fault;
+    sim->fault_count = count;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void bq27427_sim_set_timing(const bq27427_sim_timing_t *t)
+{
+    pthread_mutex_lock(&sim_lock);
+    timing = *t;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void bq27427_sim_fail_mutex(uint32_t after)
+{
+    pthread_mutex_lock(&sim_lock);
+    mutex_fail_in = after + 1;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void bq27427_sim_set_mutex_hook(bq27427_sim_mutex_hook_t hook)
+{
+    mutex_hook = hook;
+}
+
+void bq27427_sim_get_stats(bq27427_sim_stats_t *out)
+{
+    pthread_mutex_lock(&sim_lock);
+    *out = stats;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void bq27427_sim_reset_stats(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&sim_lock);
+}
+
+uint64_t bq27427_sim_time_us(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    uint64_t t = now_us;
+    pthread_mutex_unlock(&sim_lock);
+
+    return t;
+}
+
+void bq27427_sim_advance_us(uint64_t us)
+{
+    pthread_mutex_lock(&sim_lock);
+    now_us += us;
+    pthread_mutex_unlock(&sim_lock);
+}
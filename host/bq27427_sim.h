@@ -0,0 +1,220 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Software model of the BQ27427 for host builds.
+ *
+ * The simulator implements the i2cdev API declared in host/include/i2cdev.h,
+ * so bq27427.c compiles and runs unchanged on Linux. Each transfer is routed
+ * to the simulated gauge registered at the descriptor's port and address.
+ *
+ * Time is simulated: every transfer advances the clock by its duration on the
+ * wire at the descriptor's clock speed, and vTaskDelay() advances it without
+ * sleeping. xTaskGetTickCount() returns milliseconds of simulated time.
+ *
+ * The model is thread-safe. With the realtime timing option, transfers also
+ * take their duration in wall-clock time and occupy their port meanwhile, so
+ * threads sharing a bus contend for it as they would on hardware.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <i2cdev.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BQ27427_SIM_MAX_DEVICES	16
+#define BQ27427_SIM_CLASS_SIZE	96 // Bytes of data memory per subclass (three blocks)
+
+/**
+ * @brief Bus statistics, accumulated over all simulated devices
+ */
+typedef struct {
+	uint32_t transactions;   // START..STOP transfers
+	uint32_t reads;          // Transfers that read data
+	uint32_t writes;         // Transfers that only write
+	uint64_t bytes;          // Bytes on the wire, including address and register bytes
+	uint64_t bits;           // Bit clocks, including START, STOP and ACK
+	uint32_t mutex_takes;    // i2c_dev_take_mutex() calls
+	uint32_t bad_gives;      // i2c_dev_give_mutex() calls by a thread not holding the mutex
+	uint32_t nacks;          // Transfers to an absent address
+	uint32_t rejected;       // Data memory commits refused by the gauge
+	uint32_t cfgupdates;     // SET_CFGUPDATE subcommands that entered CFGUPDATE mode
+	uint32_t torn;           // Steps that continue a sequence another thread left half done
+	uint64_t bus_time_us;    // Time spent on the wire at the descriptors' clock speed
+} bq27427_sim_stats_t;
+
+/**
+ * @brief Gauge-side latencies of the model
+ */
+typedef struct {
+	uint32_t cfgupdate_ms;   // SET_CFGUPDATE until CFGUPMODE is set
+	uint32_t soft_reset_ms;  // SOFT_RESET until CFGUPMODE is cleared
+	uint32_t overhead_us;    // Driver and controller overhead added to each transfer
+	uint32_t bus_timeout_ms; // Time a transfer takes to fail with ESP_ERR_TIMEOUT
+	bool realtime;           // Transfers hold their port for their duration and vTaskDelay() sleeps
+} bq27427_sim_timing_t;
+
+/**
+ * @brief Called when a thread gives back an i2c_dev_t mutex
+ *
+ * wait_ns is how long the thread waited to take the mutex, hold_ns how long
+ * it held it, both in wall-clock time.
+ */
+typedef void (*bq27427_sim_mutex_hook_t)(const i2c_dev_t *dev, uint64_t wait_ns, uint64_t hold_ns);
+
+/**
+ * @brief Faults a simulated gauge can show
+ */
+typedef enum {
+	BQ27427_SIM_FAULT_NONE,
+	BQ27427_SIM_FAULT_NACK,       // Transfers are not acknowledged: ESP_FAIL
+	BQ27427_SIM_FAULT_TIMEOUT,    // Transfers fail with ESP_ERR_TIMEOUT after bus_timeout_ms
+	BQ27427_SIM_FAULT_SDA_STUCK,  // SDA held low: transfers time out until SCL is clocked
+} bq27427_sim_fault_t;
+
+typedef struct bq27427_sim bq27427_sim_t;
+
+/**
+    Create a simulated gauge answering at the given port and address. The
+    gauge starts as after a power-on reset: sealed, data memory at defaults
+    and ITPOR set.
+
+    @return the gauge, or NULL if BQ27427_SIM_MAX_DEVICES are in use
+*/
+bq27427_sim_t *bq27427_sim_create(i2c_port_t port, uint8_t addr);
+
+/**
+    Remove a simulated gauge from the bus
+*/
+void bq27427_sim_destroy(bq27427_sim_t *sim);
+
+/**
+    Model a power-on reset: data memory defaults, sealed, ITPOR set
+*/
+void bq27427_sim_power_on_reset(bq27427_sim_t *sim);
+
+/**
+    Set the value returned by a standard command, e.g. BQ27427_COMMAND_VOLTAGE
+*/
+void bq27427_sim_set_word(bq27427_sim_t *sim, uint8_t cmd, uint16_t value);
+
+/**
+    Get the value returned by a standard command
+*/
+uint16_t bq27427_sim_get_word(bq27427_sim_t *sim, uint8_t cmd);
+
+/**
+    Set and clear bits of Flags()
+*/
+void bq27427_sim_set_flags(bq27427_sim_t *sim, uint16_t set, uint16_t clear);
+
+/**
+    Set and clear bits of the CONTROL_STATUS word. SS and INITCOMP are
+    maintained by the model.
+*/
+void bq27427_sim_set_status(bq27427_sim_t *sim, uint16_t set, uint16_t clear);
+
+/**
+    @return true if the gauge is sealed
+*/
+bool bq27427_sim_is_sealed(bq27427_sim_t *sim);
+
+/**
+    @return true while the gauge is in CFGUPDATE mode
+*/
+bool bq27427_sim_in_cfgupdate(bq27427_sim_t *sim);
+
+/**
+    @return number of data memory blocks committed since creation
+*/
+uint32_t bq27427_sim_block_writes(bq27427_sim_t *sim);
+
+/**
+    Access the data memory of a subclass, BQ27427_SIM_CLASS_SIZE bytes
+*/
+uint8_t *bq27427_sim_dm(bq27427_sim_t *sim, uint8_t class_id);
+
+/**
+    Make transfers to the gauge fail. The data lines of the gauge are the
+    SDA and SCL pins of the descriptor that last addressed it.
+
+    @param fault kind of failure, BQ27427_SIM_FAULT_NONE to clear
+    @param count for NACK and TIMEOUT, the number of transfers that fail, 0
+    for all until cleared; for SDA_STUCK, the SCL clocks needed to release
+    SDA
+*/
+void bq27427_sim_inject_fault(bq27427_sim_t *sim, bq27427_sim_fault_t fault, uint32_t count);
+
+/**
+    Set the gauge-side latencies. Applies to all simulated gauges.
+*/
+void bq27427_sim_set_timing(const bq27427_sim_timing_t *timing);
+
+/**
+    Make an i2c_dev_take_mutex() call fail with ESP_ERR_TIMEOUT, as the
+    real one does when CONFIG_I2CDEV_TIMEOUT expires. Applies to all
+    descriptors.
+
+    @param after number of takes that still succeed first
+*/
+void bq27427_sim_fail_mutex(uint32_t after);
+
+/**
+    Observe i2c_dev_t mutex use. Install before starting the threads that
+    use the driver.
+
+    @param hook called in the thread that gives the mutex, NULL to remove
+*/
+void bq27427_sim_set_mutex_hook(bq27427_sim_mutex_hook_t hook);
+
+/**
+    Get the bus statistics accumulated since the last reset. torn counts
+    Control() results read by a thread other than the one that wrote the
+    subcommand, unseal keys completed by another thread, and data memory
+    blocks committed or discarded by another thread than the one that
+    modified them.
+*/
+void bq27427_sim_get_stats(bq27427_sim_stats_t *stats);
+
+/**
+    Reset the bus statistics
+*/
+void bq27427_sim_reset_stats(void);
+
+/**
+    @return simulated time in microseconds
+*/
+uint64_t bq27427_sim_time_us(void);
+
+/**
+    Advance simulated time
+*/
+void bq27427_sim_advance_us(uint64_t us);
+
+#ifdef __cplusplus
+}
+#endif
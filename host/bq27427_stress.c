@@ -0,0 +1,411 @@
+/*
+ * Contention stress test: many threads using the driver at once.
+ *
+ *   bq27427_stress [-d devices] [-r readers] [-w writers] [-t ms] [-i ms] > stress.csv
+ *
+ * Reader threads call single-step functions in a loop: bq27427_get_voltage(),
+ * bq27427_get_soc(), bq27427_read_control() with three subcommands,
+ * bq27427_read_snapshot() and bq27427_get_terminate_voltage(). Writer threads
+ * sleep -i ms (default 100) and then toggle the terminate voltage, a full
+ * configuration session with unseal, CFGUPDATE, block write, soft reset and
+ * seal. Threads are spread round-robin over the gauges, each of which sits
+ * on its own port. The simulator runs in realtime mode: transfers occupy
+ * their port for their duration at 400 kHz and the gauge-side waits of a
+ * session pass in wall-clock time.
+ *
+ * Each run lasts -t ms (default 1000). Without -d and -r, runs cover 1 and
+ * 4 gauges with 1, 2, 4, 8 and 16 readers; -w sets the writers of every run
+ * (default 1). One CSV row per run:
+ *
+ *   devices, readers, writers  shape of the run
+ *   ops, ops_per_s             reader calls completed, and per second over all readers
+ *   p50_us .. max_us           reader call latency
+ *   writes, write_p50_us, write_max_us
+ *                              configuration sessions of the writers
+ *   wait_p50_us .. wait_max_us time to take the i2c_dev_t mutex, all threads
+ *   hold_p50_us .. hold_max_us time the i2c_dev_t mutex was held, all threads
+ *   errors                     calls that did not return ESP_OK
+ *   bad                        results that do not match the gauge: another
+ *                              gauge's value, another subcommand's result
+ *   torn                       Control() pairs, unseal keys and data memory
+ *                              blocks another thread stepped into, as seen
+ *                              by the simulator
+ *
+ * The exit status is 1 if any run saw a bad result or a torn sequence.
+ */
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <bq27427.h>
+#include "bq27427_sim.h"
+
+#define MAX_DEVICES 8
+#define MAX_THREADS 64
+#define CLK_HZ 400000
+#define TERMINATE_STEP_MV 100 // Writers toggle between the default and the default plus this
+
+#define SNAPSHOT_FIELDS (BQ27427_FIELD_VOLTAGE | BQ27427_FIELD_FLAGS | BQ27427_FIELD_SOC)
+
+typedef struct {
+    uint32_t *v;
+    size_t n, cap;
+} samples_t;
+
+typedef struct {
+    bq27427_t dev;
+    bq27427_sim_t *sim;
+    uint16_t voltage;            // Values the gauge returns, distinct per gauge
+    uint16_t soc;
+    uint16_t fw_version;
+    uint16_t terminate[2];       // The two values the writers alternate between
+} gauge_t;
+
+typedef struct {
+    pthread_t thread;
+    gauge_t *gauge;
+    unsigned index;
+    bool writer;
+    samples_t latency;           // Calls, ns
+    samples_t wait;              // Mutex waits, ns
+    samples_t hold;              // Mutex holds, ns
+    uint32_t errors;
+    uint32_t bad;
+} worker_t;
+
+typedef struct {
+    uint64_t ops, writes, elapsed_ns;
+    samples_t latency, write_latency, wait, hold;
+    uint32_t errors, bad, torn;
+} result_t;
+
+static atomic_bool stop;
+static uint32_t write_interval_ms = 100;
+static __thread worker_t *self; // Thread whose mutex use the hook records
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void push(samples_t *s, uint64_t ns)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->v = realloc(s->v, s->cap * sizeof(s->v[0]));
+        if (!s->v) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+static void append(samples_t *dst, const samples_t *src)
+{
+    for (size_t i = 0; i < src->n; i++)
+        push(dst, src->v[i]);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted samples, in microseconds
+static double percentile_us(const samples_t *s, double p)
+{
+    if (!s->n)
+        return 0;
+    size_t rank = (size_t)(p * s->n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > s->n)
+        rank = s->n;
+
+    return s->v[rank - 1] / 1000.0;
+}
+
+static void mutex_hook(const i2c_dev_t *dev, uint64_t wait_ns, uint64_t hold_ns)
+{
+    (void)dev;
+    if (!self)
+        return;
+    push(&self->wait, wait_ns);
+    push(&self->hold, hold_ns);
+}
+
+/*
+ * One reader call, chosen by i. Returns the driver's result; *bad is set if
+ * the call succeeded with a value this gauge does not return.
+ */
+static esp_err_t read_one(gauge_t *g, unsigned i, bool *bad)
+{
+    bq27427_snapshot_t snap;
+    uint16_t v;
+    esp_err_t err;
+
+    switch (i % 7) {
+        case 0:
+            err = bq27427_get_voltage(&g->dev, &v);
+            *bad = v != g->voltage;
+            break;
+        case 1:
+            err = bq27427_get_soc(&g->dev, FILTERED, &v);
+            *bad = v != g->soc;
+            break;
+        case 2:
+            err = bq27427_read_control(&g->dev, BQ27427_CONTROL_DEVICE_TYPE, &v);
+            *bad = v != BQ27427_DEVICE_ID;
+            break;
+        case 3:
+            err = bq27427_read_control(&g->dev, BQ27427_CONTROL_FW_VERSION, &v);
+            *bad = v != g->fw_version;
+            break;
+        case 4:
+            // SS follows the writers, INITCOMP is always set
+            err = bq27427_read_control(&g->dev, BQ27427_CONTROL_STATUS, &v);
+            *bad = !(v & BQ27427_STATUS_INITCOMP) || v == BQ27427_DEVICE_ID || v == g->fw_version;
+            break;
+        case 5:
+            err = bq27427_read_snapshot(&g->dev, SNAPSHOT_FIELDS, &snap);
+            *bad = snap.voltage != g->voltage || snap.soc != g->soc;
+            break;
+        default:
+            err = bq27427_get_terminate_voltage(&g->dev, &v);
+            *bad = v != g->terminate[0] && v != g->terminate[1];
+            break;
+    }
+    if (err != ESP_OK)
+        *bad = false;
+
+    return err;
+}
+
+static void *reader(void *arg)
+{
+    worker_t *w = arg;
+    unsigned i = w->index; // Start threads at different calls
+
+    self = w;
+    while (!atomic_load(&stop)) {
+        bool bad = false;
+        uint64_t start = monotonic_ns();
+        esp_err_t err = read_one(w->gauge, i++, &bad);
+        push(&w->latency, monotonic_ns() - start);
+        if (err != ESP_OK)
+            w->errors++;
+        if (bad)
+            w->bad++;
+    }
+
+    return NULL;
+}
+
+static void *writer(void *arg)
+{
+    worker_t *w = arg;
+    unsigned i = 1;
+
+    self = w;
+    while (!atomic_load(&stop)) {
+        usleep(write_interval_ms * 1000);
+        if (atomic_load(&stop))
+            break;
+        uint64_t start = monotonic_ns();
+        esp_err_t err = bq27427_set_terminate_voltage(&w->gauge->dev, w->gauge->terminate[i++ & 1]);
+        push(&w->latency, monotonic_ns() - start);
+        if (err != ESP_OK)
+            w->errors++;
+    }
+
+    return NULL;
+}
+
+static int setup_gauge(gauge_t *g, int index)
+{
+    bq27427_info_t info;
+
+    memset(g, 0, sizeof(gauge_t));
+    g->voltage = 3600 + 17 * index;
+    g->soc = 40 + index;
+    g->sim = bq27427_sim_create(index, BQ27427_I2C_ADDRESS);
+    if (!g->sim)
+        return -1;
+    bq27427_sim_set_word(g->sim, BQ27427_COMMAND_VOLTAGE, g->voltage);
+    bq27427_sim_set_word(g->sim, BQ27427_COMMAND_SOC, g->soc);
+    if (bq27427_init_desc(&g->dev, index, 0, 0) != ESP_OK)
+        return -1;
+    g->dev.i2c_dev.cfg.master.clk_speed = CLK_HZ;
+    if (bq27427_identify(&g->dev, &info) != ESP_OK
+            || bq27427_get_terminate_voltage(&g->dev, &g->terminate[0]) != ESP_OK)
+        return -1;
+    g->fw_version = info.fw_version;
+    g->terminate[1] = g->terminate[0] + TERMINATE_STEP_MV;
+
+    return 0;
+}
+
+static int run(int devices, int readers, int writers, uint32_t duration_ms, result_t *r)
+{
+    static gauge_t gauges[MAX_DEVICES];
+    static worker_t workers[MAX_THREADS];
+    int threads = readers + writers;
+    bq27427_sim_stats_t stats;
+
+    memset(r, 0, sizeof(result_t));
+    for (int i = 0; i < devices; i++)
+        if (setup_gauge(&gauges[i], i) != 0) {
+            fprintf(stderr, "gauge %d: setup failed\n", i);
+            return -1;
+        }
+
+    bq27427_sim_reset_stats();
+    atomic_store(&stop, false);
+    memset(workers, 0, sizeof(workers));
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < threads; i++) {
+        worker_t *w = &workers[i];
+        w->index = i;
+        w->writer = i >= readers;
+        w->gauge = &gauges[(w->writer ? i - readers : i) % devices];
+        if (pthread_create(&w->thread, NULL, w->writer ? writer : reader, w) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    usleep(duration_ms * 1000);
+    atomic_store(&stop, true);
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    r->elapsed_ns = monotonic_ns() - start;
+
+    for (int i = 0; i < threads; i++) {
+        worker_t *w = &workers[i];
+        if (w->writer) {
+            r->writes += w->latency.n;
+            append(&r->write_latency, &w->latency);
+        } else {
+            r->ops += w->latency.n;
+            append(&r->latency, &w->latency);
+        }
+        append(&r->wait, &w->wait);
+        append(&r->hold, &w->hold);
+        r->errors += w->errors;
+        r->bad += w->bad;
+        free(w->latency.v);
+        free(w->wait.v);
+        free(w->hold.v);
+    }
+    samples_t *all[] = { &r->latency, &r->write_latency, &r->wait, &r->hold };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        qsort(all[i]->v, all[i]->n, sizeof(uint32_t), cmp_u32);
+
+    bq27427_sim_get_stats(&stats);
+    r->torn = stats.torn;
+    for (int i = 0; i < devices; i++) {
+        bq27427_free_desc(&gauges[i].dev);
+        bq27427_sim_destroy(gauges[i].sim);
+    }
+
+    return 0;
+}
+
+static void print_row(int devices, int readers, int writers, const result_t *r)
+{
+    printf("%d,%d,%d,%" PRIu64 ",%.0f,%.1f,%.1f,%.1f,%.1f,%" PRIu64 ",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,"
+           "%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n",
+           devices, readers, writers, r->ops, r->ops * 1e9 / r->elapsed_ns,
+           percentile_us(&r->latency, 0.5), percentile_us(&r->latency, 0.99), percentile_us(&r->latency, 0.999),
+           percentile_us(&r->latency, 1),
+           r->writes, percentile_us(&r->write_latency, 0.5), percentile_us(&r->write_latency, 1),
+           percentile_us(&r->wait, 0.5), percentile_us(&r->wait, 0.99), percentile_us(&r->wait, 1),
+           percentile_us(&r->hold, 0.5), percentile_us(&r->hold, 0.99), percentile_us(&r->hold, 1),
+           r->errors, r->bad, r->torn);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int device_counts[] = { 1, 4 }, reader_counts[] = { 1, 2, 4, 8, 16 };
+    int n_devices = 2, n_readers = 5, writers = 1;
+    uint32_t duration_ms = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:r:w:t:i:")) != -1) {
+        switch (opt) {
+            case 'd':
+                device_counts[0] = atoi(optarg);
+                n_devices = 1;
+                break;
+            case 'r':
+                reader_counts[0] = atoi(optarg);
+                n_readers = 1;
+                break;
+            case 'w':
+                writers = atoi(optarg);
+                break;
+            case 't':
+                duration_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                write_interval_ms = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind != argc || device_counts[0] < 1 || device_counts[0] > MAX_DEVICES || reader_counts[0] < 0
+            || writers < 0 || reader_counts[0] + writers > MAX_THREADS || reader_counts[0] + writers == 0)
+        goto usage;
+
+    // Sleeps of a few hundred microseconds should not be rounded up to the default 50 us slack
+    prctl(PR_SET_TIMERSLACK, 1UL);
+    bq27427_sim_timing_t timing = {
+        .cfgupdate_ms = 50,
+        .soft_reset_ms = 100,
+        .overhead_us = 20,
+        .realtime = true,
+    };
+    bq27427_sim_set_timing(&timing);
+    bq27427_sim_set_mutex_hook(mutex_hook);
+
+    uint32_t bad = 0, torn = 0;
+    printf("devices,readers,writers,ops,ops_per_s,p50_us,p99_us,p999_us,max_us,writes,write_p50_us,write_max_us,"
+           "wait_p50_us,wait_p99_us,wait_max_us,hold_p50_us,hold_p99_us,hold_max_us,errors,bad,torn\n");
+    for (int d = 0; d < n_devices; d++) {
+        for (int n = 0; n < n_readers; n++) {
+            result_t r;
+            if (run(device_counts[d], reader_counts[n], writers, duration_ms, &r) != 0)
+                return 1;
+            print_row(device_counts[d], reader_counts[n], writers, &r);
+            bad += r.bad;
+            torn += r.torn;
+            free(r.latency.v);
+            free(r.write_latency.v);
+            free(r.wait.v);
+            free(r.hold.v);
+        }
+    }
+    if (bad || torn) {
+        fprintf(stderr, "%" PRIu32 " bad results, %" PRIu32 " torn sequences\n", bad, torn);
+        return 1;
+    }
+    fprintf(stderr, "no bad results, no torn sequences\n");
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-d devices] [-r readers] [-w writers] [-t ms] [-i ms]\n", argv[0]);
+    return 2;
+}
@@ -0,0 +1,685 @@
+/*
+ * Behaviour test of the driver on the simulator.
+ *
+ *   bq27427_test
+ *
+ * Each case starts from a freshly reset, sealed gauge with ITPOR cleared and
+ * asserts on the values the driver returns and on the simulator counters:
+ *
+ *   snapshot         every field of bq27427_read_snapshot() decodes to what
+ *                    the gauge holds, in one transfer
+ *   dm_cache         a cached block costs a checksum read, which catches a
+ *                    rewrite by another master and a reset the driver did
+ *                    not observe; ITPOR drops the cache
+ *   commit_noop      committing the configuration the gauge already holds
+ *                    enters no CFGUPDATE session and writes no block; after
+ *                    a reset the driver did not observe, it writes again
+ *   chem_noop        staging the active chemistry costs one Control() pair,
+ *                    with no unseal and no session
+ *   chem_change      staging another chemistry does open a session
+ *   yield_fail       a mutex take that times out between two steps of a
+ *                    sequence ends it with the error, without giving back
+ *                    the mutex it does not hold; the next sequence runs
+ *   learning         the learning monitor sends whole blocks first, then
+ *                    deltas that rebuild the gauge's blocks; a change
+ *                    behind a QMAX_UP already set is found by a checksum
+ *                    probe; bq27427_learning_apply() refuses bad records
+ *   log_round_trip   a file-backed telemetry log wrapped several times
+ *                    decodes to the samples appended; seek finds the first
+ *                    sample at or after a time; reopening continues the log,
+ *                    and a record cut short by a reset is skipped
+ *   log_size         a slow discharge logs at least 4 times smaller than
+ *                    whole 16-bit values and a 64-bit timestamp
+ *   metrics          after every sample of random signed and unsigned
+ *                    sequences, bq27427_metrics_get() agrees with a rescan
+ *                    of the window and a floating-point moving average
+ *
+ * Prints each failed check; the exit status is 1 if any failed.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <bq27427.h>
+#include <bq27427_learning.h>
+#include <bq27427_log.h>
+#include <bq27427_metrics.h>
+#include "bq27427_sim.h"
+
+#define PORT 0
+
+#define EXPECT(x) do { if (!(x)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #x); failures++; } } while (0)
+
+static int failures;
+static bq27427_sim_t *sim;
+
+static void fresh(bq27427_t *dev)
+{
+    bq27427_sim_power_on_reset(sim);
+    bq27427_sim_set_flags(sim, 0, BQ27427_FLAG_ITPOR);
+    if (bq27427_init_desc(dev, PORT, 0, 0) != ESP_OK) {
+        printf("bq27427_init_desc failed\n");
+        failures++;
+    }
+    bq27427_sim_reset_stats();
+}
+
+// The provisioning sequence of the examples
+static void stage_provisioning(bq27427_t *dev, bq27427_config_t *cfg)
+{
+    bq27427_config_begin(dev, cfg);
+    bq27427_config_set_capacity(cfg, 1200);
+    bq27427_config_set_design_energy(cfg, 4440);
+    bq27427_config_set_terminate_voltage(cfg, 3000);
+    bq27427_config_set_soc1_thresholds(cfg, 12, 18);
+    bq27427_config_set_chem_id(cfg, CHEM_B);
+}
+
+static void test_snapshot(void)
+{
+    bq27427_t dev;
+    bq27427_snapshot_t snap;
+    bq27427_sim_stats_t stats;
+
+    fresh(&dev);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_TEMP, 2931);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_VOLTAGE, 3712);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_AVG_CURRENT, (uint16_t)-250);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_AVG_POWER, (uint16_t)-928);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_SOC, 42);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_SOH, 0x0261);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_REM_CAPACITY, 563);
+    bq27427_sim_set_word(sim, BQ27427_COMMAND_SOC_UNFL, 43);
+    bq27427_sim_reset_stats();
+
+    EXPECT(bq27427_read_snapshot(&dev, BQ27427_FIELD_ALL, &snap) == ESP_OK);
+    EXPECT(snap.fields == BQ27427_FIELD_ALL);
+    EXPECT(snap.temperature == 2931);
+    EXPECT(snap.voltage == 3712);
+    EXPECT(snap.flags == bq27427_sim_get_word(sim, BQ27427_COMMAND_FLAGS));
+    EXPECT(snap.avg_current == -250);
+    EXPECT(snap.avg_power == -928);
+    EXPECT(snap.soc == 42);
+    EXPECT(snap.soh == 0x61 && snap.soh_status == 0x02);
+    EXPECT(snap.rem_capacity == 563);
+    EXPECT(snap.soc_unfl == 43);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.transactions == 1 && stats.mutex_takes == 1);
+
+    bq27427_free_desc(&dev);
+}
+
+static uint16_t dm_word(bq27427_t *dev, uint8_t class_id, uint8_t offset)
+{
+    uint8_t buf[2] = { 0 };
+
+    EXPECT(bq27427_read_dm(dev, class_id, offset, buf, sizeof(buf)) == ESP_OK);
+    return buf[0] << 8 | buf[1];
+}
+
+static void test_dm_cache(void)
+{
+    bq27427_t dev;
+    bq27427_config_t cfg;
+    bq27427_sim_stats_t stats;
+    uint8_t *state = bq27427_sim_dm(sim, BQ27427_ID_STATE);
+    uint16_t flags;
+
+    fresh(&dev);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == 1340);
+
+    // Swap the bytes of Design Capacity: the block checksum stays the same, the copy is served
+    uint8_t *p = state + BQ27427_DM_DESIGN_CAPACITY;
+    uint8_t t = p[0];
+    p[0] = p[1];
+    p[1] = t;
+    bq27427_sim_reset_stats();
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == 1340);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.reads == 2); // CONTROL_STATUS and the checksum, not the block
+    p[1] = p[0];
+    p[0] = t;
+
+    // Held unsealed by the driver, a hit is the checksum read alone
+    EXPECT(bq27427_unseal(&dev) == ESP_OK);
+    bq27427_sim_reset_stats();
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == 1340);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.reads == 1);
+    EXPECT(bq27427_seal(&dev) == ESP_OK);
+
+    // Another master rewrites Terminate Voltage: the checksum differs, the block is read again
+    state[BQ27427_DM_TERMINATE_VOLTAGE] = 3100 >> 8;
+    state[BQ27427_DM_TERMINATE_VOLTAGE + 1] = 3100 & 0xff;
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_TERMINATE_VOLTAGE) == 3100);
+
+    // The gauge resets to defaults and nobody reads Flags(): the probe still notices
+    stage_provisioning(&dev, &cfg);
+    EXPECT(bq27427_config_commit(&cfg) == ESP_OK);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == 1200);
+    bq27427_sim_power_on_reset(sim);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == 1340);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_TERMINATE_VOLTAGE) == 3200);
+
+    // ITPOR in Flags() drops the cache, the next read fetches the block even if the checksum matches
+    t = p[0];
+    p[0] = p[1];
+    p[1] = t;
+    bq27427_sim_set_flags(sim, BQ27427_FLAG_ITPOR, 0);
+    EXPECT(bq27427_get_flags(&dev, &flags) == ESP_OK);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == ((1340 & 0xff) << 8 | 1340 >> 8));
+
+    bq27427_free_desc(&dev);
+}
+
+static void test_commit_noop(void)
+{
+    bq27427_t dev;
+    bq27427_config_t cfg;
+    bq27427_sim_stats_t stats;
+
+    fresh(&dev);
+    stage_provisioning(&dev, &cfg);
+    EXPECT(bq27427_config_commit(&cfg) == ESP_OK);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.cfgupdates == 1 && !stats.rejected);
+    uint32_t writes = bq27427_sim_block_writes(sim);
+
+    bq27427_sim_reset_stats();
+    stage_provisioning(&dev, &cfg);
+    EXPECT(bq27427_config_commit(&cfg) == ESP_OK);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.cfgupdates == 0);
+    EXPECT(bq27427_sim_block_writes(sim) == writes);
+    EXPECT(bq27427_sim_is_sealed(sim));
+
+    // The gauge loses its configuration in a reset the driver does not observe: the commit writes it again
+    bq27427_sim_power_on_reset(sim);
+    bq27427_sim_reset_stats();
+    stage_provisioning(&dev, &cfg);
+    cfg.chem_id = 0;
+    EXPECT(bq27427_config_commit(&cfg) == ESP_OK);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.cfgupdates == 1 && !stats.rejected);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == 1200);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_TERMINATE_VOLTAGE) == 3000);
+    EXPECT(bq27427_sim_is_sealed(sim));
+
+    bq27427_free_desc(&dev);
+}
+
+static void test_chem_noop(void)
+{
+    bq27427_t dev;
+    bq27427_sim_stats_t stats;
+
+    fresh(&dev);
+    EXPECT(bq27427_set_chem_id(&dev, CHEM_A) == ESP_OK);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.cfgupdates == 0);
+    EXPECT(stats.transactions == 2); // CHEM_ID subcommand and its result
+    EXPECT(bq27427_sim_is_sealed(sim));
+
+    bq27427_free_desc(&dev);
+}
+
+static void test_chem_change(void)
+{
+    bq27427_t dev;
+    bq27427_sim_stats_t stats;
+    uint16_t chem_id;
+
+    fresh(&dev);
+    EXPECT(bq27427_set_chem_id(&dev, CHEM_B) == ESP_OK);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.cfgupdates == 1);
+    EXPECT(bq27427_get_chem_id(&dev, &chem_id) == ESP_OK);
+    EXPECT(chem_id == BQ27427_CHEM_ID_B);
+    EXPECT(bq27427_sim_is_sealed(sim));
+
+    bq27427_free_desc(&dev);
+}
+
+static void test_yield_fail(void)
+{
+    bq27427_t dev;
+    bq27427_config_t cfg;
+    bq27427_sim_stats_t stats;
+
+    fresh(&dev);
+    // The sequence takes the mutex, then fails to take it back after comparing the first block
+    bq27427_sim_fail_mutex(1);
+    stage_provisioning(&dev, &cfg);
+    cfg.chem_id = 0;
+    EXPECT(bq27427_config_commit(&cfg) == ESP_ERR_TIMEOUT);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.mutex_takes == 2 && stats.bad_gives == 0);
+    EXPECT(!bq27427_sim_in_cfgupdate(sim));
+
+    // Fail while waiting for CFGUPMODE: the gauge is left in CFGUPDATE and the next commit finishes
+    bq27427_sim_reset_stats();
+    bq27427_sim_fail_mutex(1);
+    stage_provisioning(&dev, &cfg);
+    EXPECT(bq27427_config_commit(&cfg) == ESP_ERR_TIMEOUT);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.bad_gives == 0);
+    EXPECT(bq27427_sim_in_cfgupdate(sim));
+
+    bq27427_sim_reset_stats();
+    stage_provisioning(&dev, &cfg);
+    EXPECT(bq27427_config_commit(&cfg) == ESP_OK);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.bad_gives == 0 && !stats.rejected);
+    EXPECT(!bq27427_sim_in_cfgupdate(sim));
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_DESIGN_CAPACITY) == 1200);
+    EXPECT(dm_word(&dev, BQ27427_ID_STATE, BQ27427_DM_TERMINATE_VOLTAGE) == 3000);
+
+    bq27427_free_desc(&dev);
+}
+
+// Records of test_learning, and the blocks they rebuild
+static bq27427_learning_record_t learned[4];
+static int learned_count;
+static uint8_t learned_blocks[BQ27427_LEARNING_BLOCKS][BQ27427_DM_BLOCK_SIZE];
+
+static void learning_record(const bq27427_learning_record_t *record, void *ctx)
+{
+    int i = record->class_id == BQ27427_ID_R_A_RAM ? 2 : record->block;
+
+    (void)ctx;
+    if (learned_count < 4)
+        learned[learned_count] = *record;
+    learned_count++;
+    if (record->class_id)
+        EXPECT(bq27427_learning_apply(learned_blocks[i], record) == ESP_OK);
+}
+
+// Poll once and return the records it sent
+static int learning_poll(bq27427_learning_t *mon)
+{
+    learned_count = 0;
+    EXPECT(bq27427_learning_poll(mon) == ESP_OK);
+    return learned_count;
+}
+
+static bool learning_rebuilt(void)
+{
+    uint8_t *state = bq27427_sim_dm(sim, BQ27427_ID_STATE);
+
+    return !memcmp(learned_blocks[0], state, BQ27427_DM_BLOCK_SIZE)
+           && !memcmp(learned_blocks[1], state + BQ27427_DM_BLOCK_SIZE, BQ27427_DM_BLOCK_SIZE)
+           && !memcmp(learned_blocks[2], bq27427_sim_dm(sim, BQ27427_ID_R_A_RAM), BQ27427_DM_BLOCK_SIZE);
+}
+
+static void test_learning(void)
+{
+    const bq27427_learning_config_t config = { .cb = learning_record };
+    bq27427_t dev;
+    bq27427_learning_t mon;
+    bq27427_sim_stats_t stats;
+    uint8_t *state = bq27427_sim_dm(sim, BQ27427_ID_STATE);
+    uint16_t qmax;
+
+    fresh(&dev);
+    EXPECT(bq27427_learning_init(&mon, &dev, &config) == ESP_OK);
+    EXPECT(bq27427_learning_get_qmax(&mon, &qmax) == ESP_ERR_INVALID_STATE);
+
+    // The first poll sends every block whole
+    memset(learned_blocks, 0, sizeof(learned_blocks));
+    EXPECT(learning_poll(&mon) == 3);
+    EXPECT(learned[0].cause == BQ27427_LEARNING_BASELINE && learned[0].len == BQ27427_LEARNING_RECORD_MAX);
+    EXPECT(learned[2].class_id == BQ27427_ID_R_A_RAM && learned[2].block == 0);
+    EXPECT(learning_rebuilt());
+    EXPECT(bq27427_sim_is_sealed(sim));
+
+    // Nothing learned: one Control() pair
+    bq27427_sim_reset_stats();
+    EXPECT(learning_poll(&mon) == 0);
+    bq27427_sim_get_stats(&stats);
+    EXPECT(stats.transactions == 2 && mon.probes == 0);
+
+    // Qmax and Update Status change with QMAX_UP: one run of three bytes
+    state[BQ27427_DM_QMAX] = 0x3f;
+    state[BQ27427_DM_QMAX + 1] = 0x12;
+    state[BQ27427_DM_UPDATE_STATUS] = 0x05;
+    bq27427_sim_set_status(sim, BQ27427_STATUS_QMAX_UP, 0);
+    EXPECT(learning_poll(&mon) == 1);
+    EXPECT(learned[0].cause == BQ27427_LEARNING_QMAX);
+    EXPECT(learned[0].class_id == BQ27427_ID_STATE && learned[0].block == 0);
+    EXPECT(learned[0].len == 5 && learned[0].data[0] == BQ27427_DM_QMAX && learned[0].data[1] == 3);
+    EXPECT(learning_rebuilt());
+    EXPECT(bq27427_learning_get_qmax(&mon, &qmax) == ESP_OK && qmax == 0x3f12);
+    EXPECT(mon.qmax_updates == 1);
+
+    // QMAX_UP stays set, so the next update is found by the checksum probe
+    // Bytes one apart share a run
+    state[BQ27427_DM_QMAX + 1] = 0x34;
+    state[BQ27427_DM_UPDATE_STATUS + 1] ^= 0xff;
+    state[BQ27427_DM_BLOCK_SIZE + 7] ^= 0xff;
+    EXPECT(learning_poll(&mon) == 2);
+    EXPECT(learned[0].cause == (BQ27427_LEARNING_QMAX | BQ27427_LEARNING_PROBE));
+    EXPECT(learned[0].len == 5 && learned[0].data[0] == BQ27427_DM_QMAX + 1 && learned[0].data[1] == 3);
+    EXPECT(learned[1].block == 1 && learned[1].len == 3 && learned[1].data[0] == 7);
+    EXPECT(learning_rebuilt());
+    EXPECT(mon.probes == 1 && mon.qmax_updates == 2);
+
+    // A probe that finds nothing sends nothing
+    EXPECT(learning_poll(&mon) == 0);
+    EXPECT(mon.probes == 2);
+
+    // A learning event that moved no block is still reported
+    bq27427_sim_set_status(sim, BQ27427_STATUS_RES_UP, BQ27427_STATUS_QMAX_UP);
+    EXPECT(learning_poll(&mon) == 1);
+    EXPECT(learned[0].cause == BQ27427_LEARNING_RES && learned[0].class_id == 0 && learned[0].len == 0);
+    EXPECT(bq27427_sim_is_sealed(sim));
+
+    // Malformed records
+    bq27427_learning_record_t bad = { .class_id = BQ27427_ID_STATE, .len = 4, .data = { 31, 2 } };
+    uint8_t block[BQ27427_DM_BLOCK_SIZE];
+    EXPECT(bq27427_learning_apply(block, &bad) == ESP_ERR_INVALID_RESPONSE);
+    bad.len = 1;
+    EXPECT(bq27427_learning_apply(block, &bad) == ESP_ERR_INVALID_RESPONSE);
+    bad.len = 3;
+    bad.data[0] = 0;
+    EXPECT(bq27427_learning_apply(block, &bad) == ESP_ERR_INVALID_RESPONSE);
+    bad.len = BQ27427_LEARNING_RECORD_MAX + 1;
+    EXPECT(bq27427_learning_apply(block, &bad) == ESP_ERR_INVALID_ARG);
+
+    bq27427_free_desc(&dev);
+}
+
+// Slow discharge at 1 s with a few ms of jitter, the same for a given seq every time
+static void log_sample(uint32_t seq, bq27427_sample_t *sample)
+{
+    bq27427_snapshot_t *p = &sample->snap;
+    uint32_t h = (seq * 2654435761u) >> 16;
+
+    memset(sample, 0, sizeof(bq27427_sample_t));
+    sample->seq = seq;
+    sample->timestamp_us = (int64_t)(seq * 1000 + h % 3) * 1000;
+    p->fields = BQ27427_FIELD_ALL;
+    p->temperature = 2982 + seq / 300 % 3;
+    p->voltage = 3900 - seq / 20;
+    p->flags = BQ27427_FLAG_BAT_DET | BQ27427_FLAG_DSG;
+    p->nom_capacity = 1005 - seq / 24;
+    p->avail_capacity = 1340;
+    p->rem_capacity = 1005 - seq / 24;
+    p->full_capacity = 1340;
+    p->avg_current = -150 + (int)(h % 5) - 2;
+    p->stdby_current = -10;
+    p->max_current = -500;
+    p->avg_power = p->voltage * p->avg_current / 1000;
+    p->soc = 75 - seq / 360;
+    p->int_temperature = 2992 + seq / 300 % 3;
+    p->soh = 100;
+    p->soh_status = 3;
+    p->rem_cap_unfl = 1010 - seq / 24;
+    p->rem_cap_fil = 1005 - seq / 24;
+    p->full_cap_unfl = 1345;
+    p->full_cap_fil = 1340;
+    p->soc_unfl = 75 - seq / 360;
+}
+
+static void log_append(bq27427_log_t *log, uint32_t from, uint32_t to)
+{
+    bq27427_sample_t sample;
+
+    for (uint32_t seq = from; seq < to; seq++) {
+        log_sample(seq, &sample);
+        EXPECT(bq27427_log_append(log, &sample) == ESP_OK);
+    }
+}
+
+/*
+ * Decode the whole log. Every sample must be the one log_sample() made for
+ * its seq, and seqs must follow each other except across lost. Returns the
+ * number of samples.
+ */
+static uint32_t log_check(const bq27427_log_storage_t *storage, uint32_t lost, uint32_t *first, uint32_t *last)
+{
+    bq27427_log_reader_t reader;
+    bq27427_sample_t sample, expected;
+    uint32_t count = 0;
+    esp_err_t err;
+
+    EXPECT(bq27427_log_reader_init(&reader, storage) == ESP_OK);
+    while ((err = bq27427_log_reader_next(&reader, &sample)) == ESP_OK) {
+        log_sample(sample.seq, &expected);
+        EXPECT(!memcmp(&sample, &expected, sizeof(sample)));
+        if (count)
+            EXPECT(sample.seq == *last + 1 || (*last + 1 == lost && sample.seq == lost + 1));
+        else
+            *first = sample.seq;
+        *last = sample.seq;
+        count++;
+    }
+    EXPECT(err == ESP_ERR_NOT_FOUND);
+
+    return count;
+}
+
+static void test_log_round_trip(void)
+{
+    FILE *f = tmpfile();
+    bq27427_log_storage_t storage;
+    bq27427_log_reader_t reader;
+    bq27427_sample_t sample;
+    bq27427_log_t log;
+    uint32_t first, last, pages = 8;
+
+    EXPECT(f && bq27427_log_storage_file(&storage, f, pages * BQ27427_LOG_MIN_PAGE, BQ27427_LOG_MIN_PAGE) == ESP_OK);
+    EXPECT(bq27427_log_open(&log, &storage, BQ27427_FIELD_ALL) == ESP_OK);
+    log_append(&log, 0, 1000);
+    EXPECT(bq27427_log_flush(&log) == ESP_OK);
+    EXPECT(log.page_seq >= 3 * pages); // Wrapped at least three times
+    EXPECT(log_check(&storage, 0, &first, &last) > 100);
+    EXPECT(first > 0 && last == 999);
+
+    // Seek: the first sample at or after a time, and nothing before the oldest page
+    uint32_t mid = (first + last) / 2;
+    log_sample(mid, &sample);
+    EXPECT(bq27427_log_reader_init(&reader, &storage) == ESP_OK);
+    EXPECT(bq27427_log_reader_seek(&reader, sample.timestamp_us) == ESP_OK);
+    EXPECT(bq27427_log_reader_next(&reader, &sample) == ESP_OK && sample.seq == mid);
+    log_sample(mid, &sample);
+    EXPECT(bq27427_log_reader_seek(&reader, sample.timestamp_us + 1) == ESP_OK);
+    EXPECT(bq27427_log_reader_next(&reader, &sample) == ESP_OK && sample.seq == mid + 1);
+    EXPECT(bq27427_log_reader_seek(&reader, 0) == ESP_ERR_NOT_FOUND);
+
+    // Reopened after a clean stop, appending continues on the same page
+    uint32_t page = log.page;
+    EXPECT(bq27427_log_open(&log, &storage, BQ27427_FIELD_ALL) == ESP_OK);
+    EXPECT(log.page == page);
+    log_append(&log, 1000, 1010);
+    EXPECT(bq27427_log_flush(&log) == ESP_OK);
+    log_check(&storage, 0, &first, &last);
+    EXPECT(last == 1009);
+
+    // A reset in the middle of writing a record with room left on its page: only the tag made it to storage
+    uint32_t start;
+    do {
+        page = log.page;
+        start = log.pos;
+        log_append(&log, last + 1, last + 2);
+        EXPECT(bq27427_log_flush(&log) == ESP_OK);
+        last++;
+    } while (log.page != page || log.pos + BQ27427_LOG_RECORD_MAX > page + BQ27427_LOG_MIN_PAGE);
+    uint8_t ff[BQ27427_LOG_RECORD_MAX];
+    memset(ff, 0xff, sizeof(ff));
+    EXPECT(storage.write(storage.ctx, start + 1, ff, log.pos - start - 1) == ESP_OK);
+    uint32_t lost = last, before = last;
+    log_check(&storage, 0, &first, &last);
+    EXPECT(last == lost - 1);
+
+    // bq27427_log_open() leaves the cut page behind, and readers step over it
+    EXPECT(bq27427_log_open(&log, &storage, BQ27427_FIELD_ALL) == ESP_OK);
+    EXPECT(log.page != page);
+    log_append(&log, lost + 1, lost + 40);
+    EXPECT(bq27427_log_flush(&log) == ESP_OK);
+    EXPECT(log_check(&storage, lost, &first, &last) > 40);
+    EXPECT(first <= before - 1 && last == lost + 39);
+
+    fclose(f);
+}
+
+static void test_log_size(void)
+{
+    FILE *f = tmpfile();
+    bq27427_log_storage_t storage;
+    bq27427_log_t log;
+    uint32_t n = 3600;
+
+    // An hour at 1 s on 4 KiB pages, the erase unit of ESP32 flash
+    EXPECT(f && bq27427_log_storage_file(&storage, f, 64 * 4096, 4096) == ESP_OK);
+    EXPECT(bq27427_log_open(&log, &storage, BQ27427_FIELD_ALL) == ESP_OK);
+    log_append(&log, 0, n);
+    EXPECT(bq27427_log_flush(&log) == ESP_OK);
+
+    // Whole 16-bit values and a 64-bit timestamp, as bq27427_logdump reports it
+    uint32_t raw = n * (BQ27427_FIELD_COUNT * 2 + 8);
+    printf("log: %u samples in %u bytes, %.1f times less than %u raw\n", (unsigned)n, (unsigned)log.bytes,
+           (double)raw / log.bytes, (unsigned)raw);
+    EXPECT(log.bytes * 4 <= raw);
+
+    fclose(f);
+}
+
+// One metric of test_metrics and the range its random values are drawn from
+typedef struct {
+    bq27427_field_t field;
+    uint16_t window;
+    uint32_t ewma_tau_ms;
+    int32_t lo, hi;
+} metrics_case_t;
+
+static const metrics_case_t metrics_cases[] = {
+    { BQ27427_FIELD_VOLTAGE, 8, 5000, 0, 65535 },
+    { BQ27427_FIELD_SOC, 1, 0, 0, 100 },
+    { BQ27427_FIELD_SOC, CONFIG_BQ27427_METRICS_WINDOW_MAX, 2000, 40, 43 },   // Mostly ties
+    { BQ27427_FIELD_AVG_CURRENT, 5, 3000, -32768, 32767 },
+    { BQ27427_FIELD_AVG_CURRENT, CONFIG_BQ27427_METRICS_WINDOW_MAX, 1000, -2, 2 },
+    { BQ27427_FIELD_AVG_POWER, 3, 0, -500, 500 },
+    { BQ27427_FIELD_REM_CAPACITY, 17, 10000, 900, 1100 },
+};
+
+static uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void metrics_set_value(bq27427_snapshot_t *snap, bq27427_field_t field, int32_t v)
+{
+    snap->fields = field;
+    switch (field) {
+        case BQ27427_FIELD_VOLTAGE: snap->voltage = v; break;
+        case BQ27427_FIELD_SOC: snap->soc = v; break;
+        case BQ27427_FIELD_AVG_CURRENT: snap->avg_current = v; break;
+        case BQ27427_FIELD_AVG_POWER: snap->avg_power = v; break;
+        case BQ27427_FIELD_REM_CAPACITY: snap->rem_capacity = v; break;
+        default: break;
+    }
+}
+
+// Feed one case and compare every result with a rescan of the values kept here
+static void metrics_run(const metrics_case_t *c, uint32_t seed)
+{
+    const bq27427_metric_config_t config = { c->field, c->window, c->ewma_tau_ms };
+    bq27427_metrics_t metrics;
+    bq27427_metric_value_t value;
+    bq27427_snapshot_t snap;
+    int32_t history[600];
+    uint32_t n = 0;
+    int64_t t = 0, last_t = 0;
+    double ewma = 0;
+
+    EXPECT(bq27427_metrics_init(&metrics, &config, 1) == ESP_OK);
+    EXPECT(bq27427_metrics_get(&metrics, 0, &value) == ESP_ERR_NOT_FOUND);
+    for (int i = 0; i < 600; i++) {
+        uint32_t r = xorshift32(&seed);
+        int64_t dt = r % 8 ? 500000 + r % 1000000 : 0;
+        int32_t v = c->lo + (int32_t)(xorshift32(&seed) % (uint32_t)(c->hi - c->lo + 1));
+
+        t += dt;
+        memset(&snap, 0, sizeof(snap));
+        metrics_set_value(&snap, c->field, v);
+        // A sample without the field leaves the metric alone
+        if (r % 11 == 0)
+            snap.fields = BQ27427_FIELD_FLAGS;
+        EXPECT(bq27427_metrics_update(&metrics, &snap, t) == ESP_OK);
+        if (snap.fields != c->field)
+            continue;
+
+        // dt runs from the previous sample of the metric
+        dt = t - last_t;
+        last_t = t;
+        if (!n || !c->ewma_tau_ms)
+            ewma = v;
+        else if (dt > 0)
+            ewma += (v - ewma) * dt / (c->ewma_tau_ms * 1000.0 + dt);
+        history[n++] = v;
+
+        uint16_t count = n < c->window ? n : c->window;
+        int32_t min = v, max = v;
+        int64_t sum = 0;
+        for (uint32_t j = n - count; j < n; j++) {
+            min = history[j] < min ? history[j] : min;
+            max = history[j] > max ? history[j] : max;
+            sum += history[j];
+        }
+
+        EXPECT(bq27427_metrics_get(&metrics, 0, &value) == ESP_OK);
+        double drift = (double)value.ewma / (1 << BQ27427_METRICS_FRAC_BITS) - ewma;
+        bool ok = value.samples == n && value.count == count && value.timestamp_us == t && value.last == v
+                  && value.min == min && value.max == max
+                  && value.mean == sum * (1 << BQ27427_METRICS_FRAC_BITS) / count
+                  && drift > -0.25 && drift < 0.25;
+        if (!ok) {
+            printf("metrics: field 0x%x window %u, sample %u: min %d/%d max %d/%d mean %d/%d ewma %.2f/%.2f\n",
+                   (unsigned)c->field, c->window, (unsigned)n, (int)value.min, (int)min, (int)value.max, (int)max,
+                   (int)value.mean, (int)(sum * (1 << BQ27427_METRICS_FRAC_BITS) / count),
+                   (double)value.ewma / (1 << BQ27427_METRICS_FRAC_BITS), ewma);
+            failures++;
+            return;
+        }
+    }
+}
+
+static void test_metrics(void)
+{
+    for (size_t i = 0; i < sizeof(metrics_cases) / sizeof(metrics_cases[0]); i++)
+        metrics_run(&metrics_cases[i], 0x9e3779b9u * (i + 1));
+}
+
+int main(void)
+{
+    bq27427_sim_timing_t timing = {
+        .cfgupdate_ms = 50,
+        .soft_reset_ms = 100,
+    };
+
+    bq27427_sim_set_timing(&timing);
+    sim = bq27427_sim_create(PORT, BQ27427_I2C_ADDRESS);
+    if (!sim) {
+        printf("bq27427_sim_create failed\n");
+        return 1;
+    }
+
+    test_snapshot();
+    test_dm_cache();
+    test_commit_noop();
+    test_chem_noop();
+    test_chem_change();
+    test_yield_fail();
+    test_learning();
+    test_log_round_trip();
+    test_log_size();
+    test_metrics();
+
+    bq27427_sim_destroy(sim);
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
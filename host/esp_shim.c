@@ -0,0 +1,79 @@
+/*
+ * FreeRTOS and ESP-IDF shims shared by the simulator and the Linux
+ * transport: mutexes on pthreads and error names.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    StaticSemaphore_t *m = malloc(sizeof(StaticSemaphore_t));
+    if (m) {
+        pthread_mutex_init(&m->mutex, NULL);
+        m->is_static = false;
+    }
+
+    return m;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf)
+{
+    pthread_mutex_init(&buf->mutex, NULL);
+    buf->is_static = true;
+
+    return buf;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    StaticSemaphore_t *m = sem;
+
+    pthread_mutex_destroy(&m->mutex);
+    if (!m->is_static)
+        free(m);
+}
+
+// Only portMAX_DELAY is supported
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    (void)ticks;
+    return pthread_mutex_lock(&((StaticSemaphore_t *)sem)->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return pthread_mutex_unlock(&((StaticSemaphore_t *)sem)->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_FAIL:
+            return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:
+            return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:
+            return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:
+            return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED:
+            return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT:
+            return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE:
+            return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC:
+            return "ESP_ERR_INVALID_CRC";
+        default:
+            return "UNKNOWN ERROR";
+    }
+}
@@ -0,0 +1,7 @@
+/*
+ * RAM of one device descriptor in a build profile, for `make size-check`:
+ * the size of this object's bss is sizeof(bq27427_t).
+ */
+#include <bq27427.h>
+
+bq27427_t bq27427_footprint;
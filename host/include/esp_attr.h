@@ -0,0 +1,6 @@
+/*
+ * Host build shim: section attributes have no meaning on the host.
+ */
+#pragma once
+
+#define IRAM_ATTR
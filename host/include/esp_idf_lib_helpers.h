@@ -0,0 +1,7 @@
+/*
+ * Host build shim: the simulated bus behaves like an ESP32 I2C master.
+ */
+#pragma once
+
+#define HELPER_TARGET_IS_ESP32 1
+#define HELPER_TARGET_IS_ESP8266 0
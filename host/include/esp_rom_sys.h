@@ -0,0 +1,16 @@
+/*
+ * Host build shim: busy-wait delays advance the simulated clock.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void esp_rom_delay_us(uint32_t us);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,40 @@
+/*
+ * Host build shim: FreeRTOS types. Ticks are milliseconds of the simulated
+ * bus clock, see bq27427_sim.h.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void *SemaphoreHandle_t;
+typedef uint8_t StackType_t;    // As on ESP-IDF, stack depths are in bytes
+
+// A semaphore handle points at one of these, see esp_shim.c
+typedef struct {
+    pthread_mutex_t mutex;
+    bool is_static;
+} StaticSemaphore_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              pdTRUE
+#define portMAX_DELAY       ((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS  1
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(ms))
+
+// Storage of the kernel objects of the background helpers, which are only
+// compiled on the host (make size-check), never run
+typedef struct {
+    void *reserved[24];
+} StaticTask_t;
+
+typedef struct {
+    void *reserved[20];
+} StaticQueue_t;
+
+#define portYIELD_FROM_ISR() do { } while (0)
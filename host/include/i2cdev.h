@@ -0,0 +1,79 @@
+/*
+ * Host build shim: the subset of the esp-idf-lib i2cdev API used by the
+ * driver, which is the whole transport interface of bq27427.c. It is
+ * implemented by the BQ27427 simulator (bq27427_sim.c), which routes each
+ * transfer to the simulated gauge at the descriptor's port and address, and
+ * by the Linux transport (bq27427_linux.c) on /dev/i2c-N.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int i2c_port_t;
+
+typedef enum {
+    I2C_MODE_SLAVE,
+    I2C_MODE_MASTER,
+} i2c_mode_t;
+
+typedef struct {
+    int sda_io_num;
+    int scl_io_num;
+    bool sda_pullup_en;
+    bool scl_pullup_en;
+    struct {
+        uint32_t clk_speed;
+    } master;
+} i2c_config_t;
+
+typedef struct {
+    i2c_port_t port;
+    i2c_config_t cfg;
+    uint8_t addr;
+    SemaphoreHandle_t mutex;
+    uint32_t timeout_ticks;
+} i2c_dev_t;
+
+esp_err_t i2c_dev_create_mutex(i2c_dev_t *dev);
+esp_err_t i2c_dev_delete_mutex(i2c_dev_t *dev);
+esp_err_t i2c_dev_take_mutex(i2c_dev_t *dev);
+esp_err_t i2c_dev_give_mutex(i2c_dev_t *dev);
+esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size);
+esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size);
+esp_err_t i2c_dev_read_reg(const i2c_dev_t *dev, uint8_t reg, void *in_data, size_t in_size);
+esp_err_t i2c_dev_write_reg(const i2c_dev_t *dev, uint8_t reg, const void *out_data, size_t out_size);
+
+// From driver/i2c.h: route the pins back to the controller after bus recovery
+esp_err_t i2c_set_pin(i2c_port_t i2c_num, int sda_io_num, int scl_io_num, bool sda_pullup_en, bool scl_pullup_en,
+                      i2c_mode_t mode);
+
+#define I2C_DEV_TAKE_MUTEX(dev) do { \
+        esp_err_t __ = i2c_dev_take_mutex(dev); \
+        if (__ != ESP_OK) return __;\
+    } while (0)
+
+#define I2C_DEV_GIVE_MUTEX(dev) do { \
+        esp_err_t __ = i2c_dev_give_mutex(dev); \
+        if (__ != ESP_OK) return __;\
+    } while (0)
+
+#define I2C_DEV_CHECK(dev, X) do { \
+        esp_err_t ___ = X; \
+        if (___ != ESP_OK) { \
+            I2C_DEV_GIVE_MUTEX(dev); \
+            return ___; \
+        } \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
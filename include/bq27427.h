@@ -24,7 +24,9 @@
 #pragma once
 
 #include <stdint.h> // system headers first
+#include <stdbool.h>
 #include <esp_err.h> // then, esp-idf headers
+#include <i2cdev.h>
 // #include "local.h" // local header files at the end.
 
 #ifdef __cplusplus
@@ -140,6 +142,8 @@ extern "C" {
 // Extended data commands offer additional functionality beyond the standard
 // set of commands. They are used in the same manner; however, unlike standard
 // commands, extended commands are not limited to 2-byte words.
+#define BQ27427_EXTENDED_OPCONFIG	0x3A // OpConfig()
+#define BQ27427_EXTENDED_CAPACITY	0x3C // DesignCapacity()
 #define BQ27427_EXTENDED_DATACLASS	0x3E // DataClass()
 #define BQ27427_EXTENDED_DATABLOCK	0x3F // DataBlock()
 #define BQ27427_EXTENDED_BLOCKDATA	0x40 // BlockData()
@@ -157,7 +161,7 @@ extern "C" {
 // #define BQ27427_ID_CONFIG_DATA		48  // Data
 #define BQ27427_ID_DISCHARGE		49  // Discharge
 #define BQ27427_ID_REGISTERS		64  // Registers
-// #define BQ27427_ID_POWER			68  // Power
+#define BQ27427_ID_POWER			68  // Power
 // Gas Gauging Classes
 #define BQ27427_ID_IT_CFG			80  // IT Cfg
 #define BQ27427_ID_CURRENT_THRESH	81  // Current Thresholds
@@ -186,9 +190,40 @@ extern "C" {
 #define BQ27427_OPCONFIG_BATLOWEN   (1<<2)
 #define BQ27427_OPCONFIG_TEMPS      (1<<0)
 
+////////////////////////////////////////
+// Data Memory Parameter Locations    //
+////////////////////////////////////////
+// Byte offsets of the parameters inside their subclass. Data memory is
+// accessed in 32-byte blocks; values are stored big-endian.
+#define BQ27427_DM_BLOCK_SIZE		32
+// Discharge subclass (BQ27427_ID_DISCHARGE)
+#define BQ27427_DM_SOC1_SET			0  // SOC1 Set Threshold, %
+#define BQ27427_DM_SOC1_CLEAR		1  // SOC1 Clear Threshold, %
+#define BQ27427_DM_SOCF_SET			2  // SOCF Set Threshold, %
+#define BQ27427_DM_SOCF_CLEAR		3  // SOCF Clear Threshold, %
+// Registers subclass (BQ27427_ID_REGISTERS)
+#define BQ27427_DM_OPCONFIG			0  // OpConfig
+// Power subclass (BQ27427_ID_POWER)
+#define BQ27427_DM_SLEEP_CURRENT	11 // Sleep Current, mA
+// Current Thresholds subclass (BQ27427_ID_CURRENT_THRESH)
+#define BQ27427_DM_DSG_CURRENT		0  // Dsg Current Threshold, 0.1 h
+// State subclass (BQ27427_ID_STATE)
+#define BQ27427_DM_QMAX				0  // Qmax Cell 0, learned capacity; 16384 is Design Capacity
+#define BQ27427_DM_UPDATE_STATUS	2  // Update Status, learning state
+#define BQ27427_DM_DESIGN_CAPACITY	6  // Design Capacity, mAh
+#define BQ27427_DM_DESIGN_ENERGY	8  // Design Energy, mWh
+#define BQ27427_DM_TERMINATE_VOLTAGE	10 // Terminate Voltage, mV
+#define BQ27427_DM_SOCI_DELTA		16 // SOCI Delta, %
+#define BQ27427_DM_TAPER_RATE		17 // Taper Rate, 0.1 h
+#define BQ27427_DM_TAPER_VOLTAGE	19 // Taper Voltage, mV
+// R_a RAM subclass (BQ27427_ID_R_A_RAM)
+#define BQ27427_DM_RA_0				0  // R_a0 to R_a14, cell resistance per grid point, big-endian words
+#define BQ27427_DM_RA_COUNT			15
+
 
 
 #define BQ72441_I2C_TIMEOUT 2000
+#define BQ27427_CFGUPMODE_POLL_MS 10 // Flags() polling interval while waiting for CFGUPMODE
 
 /** 
 * @brief Chemistry profiles
@@ -199,6 +234,11 @@ typedef enum {
 	CHEM_C = BQ27427_CONTROL_CHEM_C   // 4.4V
 } chemistry_profiles;
 
+// CONTROL_CHEM_ID results of the chemistry profiles
+#define BQ27427_CHEM_ID_A	0x3230
+#define BQ27427_CHEM_ID_B	0x1202
+#define BQ27427_CHEM_ID_C	0x3142
+
 /**
  * @brief Parameters for the current() function, to specify which current to read
  */
@@ -247,105 +287,337 @@ typedef enum {
 	BAT_LOW  // Set GPOUT to BAT_LOW functionality
 } gpout_function;
 
+/////////////////////////////
+// Standard Command Bursts //
+/////////////////////////////
+// The standard commands from Temperature() (0x02) to StateOfChargeUnfiltered()
+// (0x30) form one contiguous register block that the gauge can return in a
+// single incremental read. bq27427_read_snapshot() merges the requested
+// fields into as few bursts as possible.
+#define BQ27427_SNAPSHOT_FIRST_REG	BQ27427_COMMAND_TEMP
+#define BQ27427_SNAPSHOT_LAST_REG	(BQ27427_COMMAND_SOC_UNFL + 1)
+#define BQ27427_SNAPSHOT_SIZE		(BQ27427_SNAPSHOT_LAST_REG - BQ27427_SNAPSHOT_FIRST_REG + 1)
+// Maximum number of unrequested bytes a burst may read to bridge two fields
+// instead of starting a new transaction. Addressing a read costs about three
+// bytes on the wire plus the per-transfer driver overhead.
+#define BQ27427_SNAPSHOT_MAX_GAP	8
+
+/**
+ * @brief Fields of bq27427_snapshot_t, used as a bit mask
+ */
+typedef enum {
+	BQ27427_FIELD_TEMP           = (1 << 0),  // Temperature()
+	BQ27427_FIELD_VOLTAGE        = (1 << 1),  // Voltage()
+	BQ27427_FIELD_FLAGS          = (1 << 2),  // Flags()
+	BQ27427_FIELD_NOM_CAPACITY   = (1 << 3),  // NominalAvailableCapacity()
+	BQ27427_FIELD_AVAIL_CAPACITY = (1 << 4),  // FullAvailableCapacity()
+	BQ27427_FIELD_REM_CAPACITY   = (1 << 5),  // RemainingCapacity()
+	BQ27427_FIELD_FULL_CAPACITY  = (1 << 6),  // FullChargeCapacity()
+	BQ27427_FIELD_AVG_CURRENT    = (1 << 7),  // AverageCurrent()
+	BQ27427_FIELD_STDBY_CURRENT  = (1 << 8),  // StandbyCurrent()
+	BQ27427_FIELD_MAX_CURRENT    = (1 << 9),  // MaxLoadCurrent()
+	BQ27427_FIELD_AVG_POWER      = (1 << 10), // AveragePower()
+	BQ27427_FIELD_SOC            = (1 << 11), // StateOfCharge()
+	BQ27427_FIELD_INT_TEMP       = (1 << 12), // InternalTemperature()
+	BQ27427_FIELD_SOH            = (1 << 13), // StateOfHealth()
+	BQ27427_FIELD_REM_CAP_UNFL   = (1 << 14), // RemainingCapacityUnfiltered()
+	BQ27427_FIELD_REM_CAP_FIL    = (1 << 15), // RemainingCapacityFiltered()
+	BQ27427_FIELD_FULL_CAP_UNFL  = (1 << 16), // FullChargeCapacityUnfiltered()
+	BQ27427_FIELD_FULL_CAP_FIL   = (1 << 17), // FullChargeCapacityFiltered()
+	BQ27427_FIELD_SOC_UNFL       = (1 << 18), // StateOfChargeUnfiltered()
+} bq27427_field_t;
+
+#define BQ27427_FIELD_COUNT	19
+#define BQ27427_FIELD_ALL	((1 << BQ27427_FIELD_COUNT) - 1)
+
+/**
+ * @brief Decoded standard command values read in one bus pass
+ *
+ * Only the members whose bit is set in `fields` are valid.
+ */
+typedef struct {
+	uint32_t fields;           // bq27427_field_t mask of valid members
+	uint16_t temperature;      // Battery temperature, 0.1 K
+	uint16_t voltage;          // Battery voltage, mV
+	uint16_t flags;            // Flags() register
+	uint16_t nom_capacity;     // Nominal available capacity, mAh
+	uint16_t avail_capacity;   // Full available capacity, mAh
+	uint16_t rem_capacity;     // Remaining capacity, mAh
+	uint16_t full_capacity;    // Full charge capacity, mAh
+	int16_t avg_current;       // Average current, mA. >0 indicates charging
+	int16_t stdby_current;     // Standby current, mA
+	int16_t max_current;       // Max load current, mA
+	int16_t avg_power;         // Average power, mW. >0 indicates charging
+	uint16_t soc;              // State of charge, %
+	uint16_t int_temperature;  // Internal IC temperature, 0.1 K
+	uint8_t soh;               // State of health, %
+	uint8_t soh_status;        // State of health status bits
+	uint16_t rem_cap_unfl;     // Remaining capacity unfiltered, mAh
+	uint16_t rem_cap_fil;      // Remaining capacity filtered, mAh
+	uint16_t full_cap_unfl;    // Full charge capacity unfiltered, mAh
+	uint16_t full_cap_fil;     // Full charge capacity filtered, mAh
+	uint16_t soc_unfl;         // State of charge unfiltered, %
+} bq27427_snapshot_t;
+
+/**
+ * @brief One incremental read inside the standard command block
+ */
+typedef struct {
+	uint8_t reg;  // First register, BQ27427_SNAPSHOT_FIRST_REG or above
+	uint8_t len;  // Number of bytes, must end at BQ27427_SNAPSHOT_LAST_REG or below
+} bq27427_burst_t;
+
+/**
+ * @brief Latest value of every standard command the driver has read
+ *
+ * Written under the device mutex and read without any lock: seq is odd while
+ * the writer updates the cache, readers retry when it changed under them.
+ */
+typedef struct {
+	uint32_t seq;
+	uint32_t fields;                        // bq27427_field_t mask ever read
+	int64_t stamp[BQ27427_FIELD_COUNT];     // esp_timer time of each read, us
+	uint8_t regs[BQ27427_SNAPSHOT_SIZE];    // Raw standard command block
+} bq27427_latest_t;
+
+///////////////////////
+// Bus statistics, collected when CONFIG_BQ27427_STATS is enabled. Durations
+// are esp_timer microseconds.
+#define BQ27427_STATS_BUCKETS		16
+#define BQ27427_STATS_COMMANDS		32     // Standard commands by code / 2, data memory commands share the last
+#define BQ27427_STATS_SUBCOMMANDS	16
+#define BQ27427_STATS_OTHER			0xffff // Subcommand slot for everything not tracked
+
+/**
+ * @brief Latency histogram
+ *
+ * Bucket 0 counts durations below 64 us, bucket i those in
+ * [32 << i, 64 << i) us, and the last bucket everything longer.
+ */
+typedef struct {
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t buckets[BQ27427_STATS_BUCKETS];
+} bq27427_histogram_t;
+
+/**
+ * @brief Control() subcommand statistics
+ */
+typedef struct {
+	uint16_t subcommand;             // BQ27427_CONTROL_*, BQ27427_UNSEAL_KEY or BQ27427_STATS_OTHER
+	bq27427_histogram_t latency;     // Subcommand write plus result read, if any
+} bq27427_subcommand_stats_t;
+
+/**
+ * @brief Bus statistics of one device descriptor
+ */
+typedef struct {
+	int64_t since_us;                                              // Time of the last reset
+	bq27427_histogram_t commands[BQ27427_STATS_COMMANDS];          // One sample per I2C transfer
+	bq27427_subcommand_stats_t subcommands[BQ27427_STATS_SUBCOMMANDS];
+	bq27427_histogram_t mutex_wait;                                // Time to take the i2c_dev_t mutex
+	bq27427_histogram_t cfgupmode_wait;                            // Time for CFGUPMODE to set or clear
+	uint32_t nacks;                                                // Transfers that failed with ESP_FAIL
+	uint32_t timeouts;                                             // Transfers that failed with ESP_ERR_TIMEOUT
+	uint32_t errors;                                               // Transfers that failed otherwise
+	uint32_t retries;                                              // Transfers attempted again
+	uint32_t bus_recoveries;                                       // SCL clocked to release SDA
+} bq27427_stats_t;
+
+/**
+ * @brief Recovery policy for failed transfers
+ *
+ * A transfer that fails with a NACK or a timeout is attempted again up to
+ * retries times, after backoff_ms, doubled for each further retry. A gauge
+ * that holds SDA low is not released here, since the pins are shared with
+ * the other devices on the port; see bq27427_recover_bus(). After
+ * offline_after transfers in a row have failed
+ * this way, the descriptor is marked offline: every call fails at once with
+ * ESP_ERR_INVALID_STATE, except that every probe_interval_ms the call first
+ * reads CONTROL_DEVICE_TYPE, and if that succeeds the descriptor is back
+ * online with its cached gauge state dropped.
+ *
+ * The duration of a single attempt is bounded by CONFIG_I2CDEV_TIMEOUT and
+ * by timeout_ticks for clock stretching. All zero, as set by
+ * bq27427_init_desc(), means one attempt and no circuit breaker.
+ */
+typedef struct {
+	uint32_t timeout_ticks;         // Clock stretching timeout, see i2c_dev_t; 0 for the i2cdev default
+	uint32_t cfgupmode_timeout_ms;  // Bound on waiting for CFGUPMODE; 0 for BQ72441_I2C_TIMEOUT
+	uint8_t retries;                // Extra attempts of a failed transfer
+	uint16_t backoff_ms;            // Delay before the first retry
+	uint16_t max_backoff_ms;        // Cap of the doubled delay, 0 for no cap
+	uint8_t offline_after;          // Failed transfers in a row before going offline, 0 to never
+	uint32_t probe_interval_ms;     // Time between probes while offline
+} bq27427_recovery_t;
+
+#ifndef CONFIG_BQ27427_DM_CACHE_BLOCKS
+#define CONFIG_BQ27427_DM_CACHE_BLOCKS 4
+#endif
+
+/**
+ * @brief Shadow copy of one 32-byte data memory block
+ */
+typedef struct {
+	uint8_t class_id;                    // Subclass ID, BQ27427_ID_*
+	uint8_t block;                       // Block index inside the subclass
+	uint8_t checksum;                    // BlockDataCheckSum() of data
+	bool valid;
+	uint32_t last_used;                  // LRU stamp
+	uint8_t data[BQ27427_DM_BLOCK_SIZE];
+} bq27427_dm_block_t;
+
+typedef struct bq27427_trace bq27427_trace_t; // See bq27427_trace.h
+
+/**
+ * @brief Device descriptor
+ */
+typedef struct {
+	i2c_dev_t i2c_dev;     // I2C device descriptor
+	bool unsealed;         // The driver unsealed the gauge and it has not been sealed or reset since
+	bool selected;         // DataClass()/DataBlock() currently select sel_class/sel_block
+	bool itpor;            // ITPOR in the last Flags() read
+	bool cfgupdate;        // The driver put the gauge in CFGUPDATE mode
+	bool user_config;      // The application owns the CFGUPDATE session
+	bool reseal;           // Seal the gauge when the CFGUPDATE session ends
+	uint8_t sel_class;
+	uint8_t sel_block;
+#ifdef CONFIG_BQ27427_DM_ACCESS
+	uint32_t dm_stamp;     // LRU clock of dm_cache
+	bq27427_dm_block_t dm_cache[CONFIG_BQ27427_DM_CACHE_BLOCKS];
+#endif
+	bq27427_latest_t latest;
+	SemaphoreHandle_t seq_lock; // Held for the whole of a multi-step sequence
+	bool bus_lost;         // The sequence holding seq_lock could not take the mutex back
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StaticSemaphore_t seq_lock_buf;
+	StaticSemaphore_t bus_lock_buf; // Storage of i2c_dev.mutex
+#endif
+	bq27427_recovery_t recovery;
+	uint8_t failures;      // Transfers in a row that failed after all retries
+	bool offline;          // Circuit breaker open
+	int64_t probe_at;      // esp_timer time of the next probe while offline
+#ifdef CONFIG_BQ27427_STATS
+	bq27427_stats_t stats;
+#endif
+#ifdef CONFIG_BQ27427_TRACE
+	bq27427_trace_t *trace;  // Receives every transfer, may be NULL
+#endif
+} bq27427_t;
+
 /**
     Initializes I2C and verifies communication with the BQ27427.
     Must be called before using any other functions.
     
-    @param sda pin number for I2C data line
-    @param scl pin number for I2C clock line
-    @return true if communication was successful.
+    @param port I2C port
+    @param sda_gpio pin number for I2C data line
+    @param scl_gpio pin number for I2C clock line
+    @return ESP_OK on success
 */
-esp_err_t bq27427_init_desc(i2c_dev_t *dev, i2c_port_t port, gpio_num_t sda_gpio, gpio_num_t scl_gpio);
+esp_err_t bq27427_init_desc(bq27427_t *dev, i2c_port_t port, gpio_num_t sda_gpio, gpio_num_t scl_gpio);
 
 /**
-    Configures the design capacity of the connected battery.
+    Frees the device descriptor
     
-    @param capacity of battery (unsigned 16-bit value)
-    @return true if capacity successfully set.
+    @return ESP_OK on success
 */
-esp_err_t bq27427_set_capacity(i2c_dev_t *dev, uint16_t *capacity);
+esp_err_t bq27427_free_desc(bq27427_t *dev);
 
+#ifdef CONFIG_BQ27427_DM_ACCESS
 /**
     Reads and returns the design energy of the connected battery
     
     @return design energy in milliWattHours (mWh)
 */
-esp_err_t bq27427_get_design_energy(i2c_dev_t *dev, uint16_t *energy);
+esp_err_t bq27427_get_design_energy(bq27427_t *dev, uint16_t *energy);
 
 /**
-    Configures the design energy of the connected battery.
+    Reads and returns the terminate voltage of the connected battery
     
-    @param energy of battery (unsigned 16-bit value)
-    @return true if energy successfully set.
+    @return terminate voltage in millivolts (mV)
 */
-esp_err_t bq27427_set_design_energy(i2c_dev_t *dev, uint16_t *energy);
+esp_err_t bq27427_get_terminate_voltage(bq27427_t *dev, uint16_t *voltage);
 
 /**
-    Reads and returns the terminate voltage of the connected battery
+    Reads and returns the discharge current threshold
     
-    @return terminate voltage in millivolts (mV)
+    @return discharge current threshold in 0.1h units
 */
-esp_err_t bq27427_get_terminate_voltage(i2c_dev_t *dev, uint16_t *voltage);
+esp_err_t bq27427_get_discharge_current_threshold(bq27427_t *dev, uint16_t *current);
 
 /**
-    Configures terminate voltage (lowest operational voltage of battery powered circuit)
+    Reads and returns the sleep current: the gauge enters SLEEP only while
+    |AverageCurrent()| is below it
     
-    @param voltage of battery (unsigned 16-bit value)
-    @return true if voltage successfully set.
+    @return sleep current in milliamps (mA)
 */
-esp_err_t bq27427_set_terminate_voltage(i2c_dev_t *dev, uint16_t *voltage);
+esp_err_t bq27427_get_sleep_current(bq27427_t *dev, uint16_t *current);
 
 /**
-    Reads and returns the discharge current threshold
+    Reads and returns the taper voltage of the connected battery
     
-    @return discharge current threshold in 0.1h units
+    @return taper voltage in millivolts (mV)
 */
-esp_err_t bq27427_get_discharge_current_threshold(i2c_dev_t *dev, uint16_t *current);
+esp_err_t bq27427_get_taper_voltage(bq27427_t *dev, uint16_t *voltage);
 
 /**
-    Configures discharge current threshold
+    Reads and returns the taper rate of the connected battery
     
-    @param value in 0.1h units (unsigned 16-bit value)
-    @return true if threshold successfully set.
+    @return taper rate in 0.1 h units
 */
-esp_err_t bq27427_set_discharge_current_threshold(i2c_dev_t *dev, uint16_t *current);
+esp_err_t bq27427_get_taper_rate(bq27427_t *dev, uint16_t *rate);
+#endif
 
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
 /**
-    Reads and returns the taper voltage of the connected battery
+    Configures the design capacity of the connected battery.
     
-    @return taper voltage in millivolts (mV)
+    @param capacity of battery (unsigned 16-bit value)
+    @return true if capacity successfully set.
 */
-esp_err_t bq27427_get_taper_voltage(i2c_dev_t *dev, uint16_t *voltage);
+esp_err_t bq27427_set_capacity(bq27427_t *dev, uint16_t capacity);
 
 /**
-    Configures taper voltage
+    Configures the design energy of the connected battery.
+    
+    @param energy of battery (unsigned 16-bit value)
+    @return true if energy successfully set.
+*/
+esp_err_t bq27427_set_design_energy(bq27427_t *dev, uint16_t energy);
+
+/**
+    Configures terminate voltage (lowest operational voltage of battery powered circuit)
     
     @param voltage of battery (unsigned 16-bit value)
     @return true if voltage successfully set.
 */
-esp_err_t bq27427_set_taper_voltage(i2c_dev_t *dev, uint16_t *voltage);
+esp_err_t bq27427_set_terminate_voltage(bq27427_t *dev, uint16_t voltage);
 
 /**
-    Reads and returns the taper rate of the connected battery
+    Configures discharge current threshold
     
-    @return taper rate in 0.1 h units
+    @param value in 0.1h units (unsigned 16-bit value)
+    @return true if threshold successfully set.
 */
-esp_err_t bq27427_get_taper_rate(i2c_dev_t *dev, uint16_t *rate);
+esp_err_t bq27427_set_discharge_current_threshold(bq27427_t *dev, uint16_t current);
 
 /**
-    Configures taper rate of connected battery
+    Configures taper voltage
     
-    @param rate in 0.1 h units (unsigned 16-bit value)
-    @return true if taper rate successfully set.
+    @param voltage of battery (unsigned 16-bit value)
+    @return true if voltage successfully set.
 */
-esp_err_t bq27427_set_taper_rate(i2c_dev_t *dev, uint16_t *rate);
+esp_err_t bq27427_set_taper_voltage(bq27427_t *dev, uint16_t voltage);
 
 /**
     Configures taper rate of connected battery
     
-    @return true if current polarity successfully changed.
+    @param rate in 0.1 h units (unsigned 16-bit value)
+    @return true if taper rate successfully set.
 */
-esp_err_t bq27427_change_current_polarity(i2c_dev_t *dev);
+esp_err_t bq27427_set_taper_rate(bq27427_t *dev, uint16_t rate);
+#endif
 
 /////////////////////////////
 // Battery Characteristics //
@@ -355,7 +627,7 @@ esp_err_t bq27427_change_current_polarity(i2c_dev_t *dev);
     
     @return battery voltage in mV
 */
-esp_err_t bq27427_get_voltage(i2c_dev_t *dev, uint16_t *voltage);
+esp_err_t bq27427_get_voltage(bq27427_t *dev, uint16_t *voltage);
 
 /**
     Reads and returns the specified current measurement
@@ -363,7 +635,7 @@ esp_err_t bq27427_get_voltage(i2c_dev_t *dev, uint16_t *voltage);
     @param current_measure enum specifying current value to be read
     @return specified current measurement in mA. >0 indicates charging.
 */
-esp_err_t bq27427_get_current(i2c_dev_t *dev, current_measure type, int16_t *current);
+esp_err_t bq27427_get_current(bq27427_t *dev, current_measure type, int16_t *current);
 
 /**
     Reads and returns the specified capacity measurement
@@ -371,14 +643,14 @@ esp_err_t bq27427_get_current(i2c_dev_t *dev, current_measure type, int16_t *cur
     @param capacity_measure enum specifying capacity value to be read
     @return specified capacity measurement in mAh.
 */
-esp_err_t bq27427_get_capacity(i2c_dev_t *dev, capacity_measure type, uint16_t *capacity);
+esp_err_t bq27427_get_capacity(bq27427_t *dev, capacity_measure type, uint16_t *capacity);
 
 /**
     Reads and returns measured average power
     
-    @return average power in mAh. >0 indicates charging.
+    @return average power in mW. >0 indicates charging.
 */
-esp_err_t bq27427_get_power(i2c_dev_t *dev, int16_t *power);
+esp_err_t bq27427_get_power(bq27427_t *dev, int16_t *power);
 
 /**
     Reads and returns specified state of charge measurement
@@ -386,7 +658,7 @@ esp_err_t bq27427_get_power(i2c_dev_t *dev, int16_t *power);
     @param soc_measure enum specifying filtered or unfiltered measurement
     @return specified state of charge measurement in %
 */
-esp_err_t bq27427_get_soc(i2c_dev_t *dev, soc_measure type, uint16_t *soc);
+esp_err_t bq27427_get_soc(bq27427_t *dev, soc_measure type, uint16_t *soc);
 
 /**
     Reads and returns specified state of health measurement
@@ -394,25 +666,125 @@ esp_err_t bq27427_get_soc(i2c_dev_t *dev, soc_measure type, uint16_t *soc);
     @param soh_measure enum specifying filtered or unfiltered measurement
     @return specified state of health measurement in %, or status bits
 */
-esp_err_t bq27427_get_soh(i2c_dev_t *dev, soh_measure type, uint8_t *soh);
+esp_err_t bq27427_get_soh(bq27427_t *dev, soh_measure type, uint8_t *soh);
 
 /**
     Reads and returns specified temperature measurement
     
     @param temp_measure enum specifying internal or battery measurement
-    @return specified temperature measurement in degrees C
+    @return specified temperature measurement in 0.1 K
 */
-esp_err_t bq27427_get_temperature(i2c_dev_t *dev, temp_measure type, uint16_t *temperature);
+esp_err_t bq27427_get_temperature(bq27427_t *dev, temp_measure type, uint16_t *temperature);
+
+/**
+    Reads several standard commands in one pass. The requested fields are
+    merged into the fewest contiguous burst reads and decoded under a single
+    hold of the device mutex, so all values come from the same instant.
+    
+    @param fields bq27427_field_t mask of the values to read
+    @param snapshot receives the decoded values; snapshot->fields is set to
+    the mask that was read
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_read_snapshot(bq27427_t *dev, uint32_t fields, bq27427_snapshot_t *snapshot);
+
+/**
+    Executes a burst plan computed by the caller, for front ends that merge
+    fields at compile time (see bq27427.hpp). All bursts run under a single
+    hold of the device mutex; the fields they cover completely refresh the
+    latest-value cache, as with bq27427_read_snapshot().
+    
+    @param bursts reads to issue, in any order
+    @param count number of bursts
+    @param buf BQ27427_SNAPSHOT_SIZE bytes mirroring the standard command
+    block from BQ27427_SNAPSHOT_FIRST_REG; only the bytes of the bursts are
+    written
+    @return ESP_OK on success, ESP_ERR_INVALID_ARG if a burst leaves the block
+*/
+esp_err_t bq27427_read_bursts(bq27427_t *dev, const bq27427_burst_t *bursts, size_t count, uint8_t *buf);
+
+/**
+    Returns standard command values from the latest-value cache. Every
+    standard command the driver reads, by any getter or snapshot, refreshes
+    the cache. Fields younger than max_age_us are returned without taking the
+    device mutex; only stale fields are read from the gauge, in one snapshot.
+    
+    @param fields bq27427_field_t mask of the values to return
+    @param max_age_us oldest acceptable value, 0 to always read the gauge
+    @param snapshot receives the values
+    @param age_us receives the age of the oldest returned value, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_read_cached(bq27427_t *dev, uint32_t fields, uint32_t max_age_us, bq27427_snapshot_t *snapshot,
+                              uint32_t *age_us);
+
+/**
+    Cached variant of bq27427_get_voltage(), see bq27427_read_cached()
+    
+    @param max_age_us oldest acceptable value
+    @param age_us receives the age of the returned value, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_get_voltage_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *voltage, uint32_t *age_us);
+
+/**
+    Cached variant of bq27427_get_current() for AverageCurrent(), see
+    bq27427_read_cached()
+    
+    @param max_age_us oldest acceptable value
+    @param age_us receives the age of the returned value, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_get_current_cached(bq27427_t *dev, uint32_t max_age_us, int16_t *current, uint32_t *age_us);
+
+/**
+    Cached variant of bq27427_get_power(), see bq27427_read_cached()
+    
+    @param max_age_us oldest acceptable value
+    @param age_us receives the age of the returned value, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_get_power_cached(bq27427_t *dev, uint32_t max_age_us, int16_t *power, uint32_t *age_us);
+
+/**
+    Cached variant of bq27427_get_soc() for the filtered SOC, see
+    bq27427_read_cached()
+    
+    @param max_age_us oldest acceptable value
+    @param age_us receives the age of the returned value, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_get_soc_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *soc, uint32_t *age_us);
+
+/**
+    Cached variant of bq27427_get_temperature() for the battery temperature,
+    see bq27427_read_cached()
+    
+    @param max_age_us oldest acceptable value
+    @param age_us receives the age of the returned value, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_get_temperature_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *temperature, uint32_t *age_us);
+
+/**
+    Cached variant of bq27427_get_flags(), see bq27427_read_cached()
+    
+    @param max_age_us oldest acceptable value
+    @param age_us receives the age of the returned value, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_get_flags_cached(bq27427_t *dev, uint32_t max_age_us, uint16_t *flags, uint32_t *age_us);
 
 ////////////////////////////	
 // GPOUT Control Commands //
 ////////////////////////////
+#ifdef CONFIG_BQ27427_GPOUT
 /**
     Get GPOUT polarity setting (active-high or active-low)
     
     @return true if active-high, false if active-low
 */
-esp_err_t bq27427_get_gpout_polarity(i2c_dev_t *dev, uint8_t *polarity);
+esp_err_t bq27427_get_gpout_polarity(bq27427_t *dev, uint8_t *polarity);
 
 /**
     Set GPOUT polarity to active-high or active-low
@@ -420,14 +792,14 @@ esp_err_t bq27427_get_gpout_polarity(i2c_dev_t *dev, uint8_t *polarity);
     @param activeHigh is true if active-high, false if active-low
     @return true on success
 */
-esp_err_t bq27427_set_gpout_polarity(i2c_dev_t *dev, uint8_t activeHigh);
+esp_err_t bq27427_set_gpout_polarity(bq27427_t *dev, uint8_t activeHigh);
 
 /**
     Get GPOUT function (BAT_LOW or SOC_INT)
     
     @return true if BAT_LOW or false if SOC_INT
 */
-esp_err_t bq27427_get_gpout_function(i2c_dev_t *dev, gpout_function *function);
+esp_err_t bq27427_get_gpout_function(bq27427_t *dev, gpout_function *function);
 
 /**
     Set GPOUT function to BAT_LOW or SOC_INT
@@ -435,101 +807,105 @@ esp_err_t bq27427_get_gpout_function(i2c_dev_t *dev, gpout_function *function);
     @param function should be either BAT_LOW or SOC_INT
     @return true on success
 */
-esp_err_t bq27427_set_gpout_function(i2c_dev_t *dev, gpout_function *function);
+esp_err_t bq27427_set_gpout_function(bq27427_t *dev, gpout_function function);
 
 /**
-    Get SOC1_Set Threshold - threshold to set the alert flag
+    Set the SOC1 set and clear thresholds to a percentage
     
-    @return state of charge value between 0 and 100%
+    @param set and clear percentages between 0 and 100. clear > set.
+    @return true on success
 */
-esp_err_t bq27427_soc1_set_threshold(i2c_dev_t *dev);
+esp_err_t bq27427_set_soc1_thresholds(bq27427_t *dev, uint8_t set, uint8_t clear);
 
 /**
-    Get SOC1_Clear Threshold - threshold to clear the alert flag
+    Set the SOCF set and clear thresholds to a percentage
     
-    @return state of charge value between 0 and 100%
+    @param set and clear percentages between 0 and 100. clear > set.
+    @return true on success
 */
-esp_err_t bq27427_soc1_clear_threshold(i2c_dev_t *dev);
+esp_err_t bq27427_set_socf_thresholds(bq27427_t *dev, uint8_t set, uint8_t clear);
+#endif
 
+#ifdef CONFIG_BQ27427_DM_ACCESS
 /**
-    Set the SOC1 set and clear thresholds to a percentage
+    Get SOC1_Set Threshold - threshold to set the alert flag
     
-    @param set and clear percentages between 0 and 100. clear > set.
-    @return true on success
+    @return state of charge value between 0 and 100%
 */
-esp_err_t bq27427_set_soc1_thresholds(i2c_dev_t *dev, uint8_t *set, uint8_t *clear);
+esp_err_t bq27427_get_soc1_set_threshold(bq27427_t *dev, uint8_t *threshold);
 
 /**
-    Get SOCF_Set Threshold - threshold to set the alert flag
+    Get SOC1_Clear Threshold - threshold to clear the alert flag
     
     @return state of charge value between 0 and 100%
 */
-esp_err_t bq27427_socf_set_threshold(i2c_dev_t *dev);
+esp_err_t bq27427_get_soc1_clear_threshold(bq27427_t *dev, uint8_t *threshold);
 
 /**
-    Get SOCF_Clear Threshold - threshold to clear the alert flag
+    Get SOCF_Set Threshold - threshold to set the alert flag
     
     @return state of charge value between 0 and 100%
 */
-esp_err_t bq27427_socf_clear_threshold(i2c_dev_t *dev);
+esp_err_t bq27427_get_socf_set_threshold(bq27427_t *dev, uint8_t *threshold);
 
 /**
-    Set the SOCF set and clear thresholds to a percentage
+    Get SOCF_Clear Threshold - threshold to clear the alert flag
     
-    @param set and clear percentages between 0 and 100. clear > set.
-    @return true on success
+    @return state of charge value between 0 and 100%
 */
-esp_err_t bq27427_set_socf_thresholds(i2c_dev_t *dev, uint8_t *set, uint8_t *clear);
+esp_err_t bq27427_get_socf_clear_threshold(bq27427_t *dev, uint8_t *threshold);
+#endif
 
 /**
     Check if the SOC1 flag is set in flags()
     
     @return true if flag is set
 */
-esp_err_t bq27427_get_soc_flag(i2c_dev_t *dev, bool *out);
+esp_err_t bq27427_get_soc_flag(bq27427_t *dev, bool *out);
 
 /**
     Check if the SOCF flag is set in flags()
     
     @return true if flag is set
 */
-esp_err_t bq27427_get_socf_flag(i2c_dev_t *dev, bool *out);
+esp_err_t bq27427_get_socf_flag(bq27427_t *dev, bool *out);
 
 /**
     Check if the ITPOR flag is set in flags()
     
     @return true if flag is set
 */
-esp_err_t bq27427_get_itpor_flag(i2c_dev_t *dev, bool *out);
+esp_err_t bq27427_get_itpor_flag(bq27427_t *dev, bool *out);
 
 /**
     Check if the FC flag is set in flags()
     
     @return true if flag is set
 */
-esp_err_t bq27427_get_fc_flag(i2c_dev_t *dev, bool *out);
+esp_err_t bq27427_get_fc_flag(bq27427_t *dev, bool *out);
 
 /**
     Check if the CHG flag is set in flags()
     
     @return true if flag is set
 */
-esp_err_t bq27427_get_chg_flag(i2c_dev_t *dev, bool *out);
+esp_err_t bq27427_get_chg_flag(bq27427_t *dev, bool *out);
 
 /**
     Check if the DSG flag is set in flags()
     
     @return true if flag is set
 */
-esp_err_t bq27427_get_dsg_flag(i2c_dev_t *dev, bool *out);
+esp_err_t bq27427_get_dsg_flag(bq27427_t *dev, bool *out);
 
 
+#ifdef CONFIG_BQ27427_GPOUT
 /**
     Get the SOC_INT interval delta
     
     @return interval percentage value between 1 and 100
 */
-esp_err_t bq27427_get_soci_delta(i2c_dev_t *dev, uint8_t *delta);
+esp_err_t bq27427_get_soci_delta(bq27427_t *dev, uint8_t *delta);
 
 /**
     Set the SOC_INT interval delta to a value between 1 and 100
@@ -537,14 +913,15 @@ esp_err_t bq27427_get_soci_delta(i2c_dev_t *dev, uint8_t *delta);
     @param interval percentage value between 1 and 100
     @return true on success
 */
-esp_err_t bq27427_set_soci_delta(i2c_dev_t *dev, uint8_t *delta);
+esp_err_t bq27427_set_soci_delta(bq27427_t *dev, uint8_t delta);
 
 /**
     Pulse the GPOUT pin - must be in SOC_INT mode
     
     @return true on success
 */
-esp_err_t bq27427_pulse_gpout(i2c_dev_t *dev);
+esp_err_t bq27427_pulse_gpout(bq27427_t *dev);
+#endif
 
 //////////////////////////
 // Control Sub-commands //
@@ -555,60 +932,392 @@ esp_err_t bq27427_pulse_gpout(i2c_dev_t *dev);
     
     @return 16-bit value read from DEVICE_TYPE subcommand
 */
-esp_err_t bq27427_get_device_type(i2c_dev_t *dev, uint16_t *dev_type);
+esp_err_t bq27427_get_device_type(bq27427_t *dev, uint16_t *dev_type);
 
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
 /**
     Configures the chemistry profile of the connected battery.
     
     @param chem_id enum specifying chemistry profile value to be set
     @return true if chemistry profile successfully set.
 */
-esp_err_t bq27427_set_chem_id(i2c_dev_t *dev, chemistry_profiles *chem_id);
+esp_err_t bq27427_set_chem_id(bq27427_t *dev, chemistry_profiles chem_id);
+#endif
 
 /**
     Reads and returns the battery chemistry profile.
     
     @return chemistry profile enum value
 */
-esp_err_t bq27427_get_chem_id(i2c_dev_t *dev, uint16_t *out);
+esp_err_t bq27427_get_chem_id(bq27427_t *dev, uint16_t *out);
 
 /**
-    Enter configuration mode - set userControl if calling from an Arduino
-    sketch and you want control over when to exitConfig.
+    Issues a read-only Control() subcommand and returns its result. Only
+    CONTROL_STATUS, DEVICE_TYPE, FW_VERSION, DM_CODE, PREV_MACWRITE and
+    CHEM_ID are accepted; subcommands that change the gauge state have
+    dedicated functions.
     
-    @param userControl is true if the Arduino sketch is handling entering 
-    and exiting config mode (should be false in library calls).
-    @return true on success
+    @param subcommand BQ27427_CONTROL_* subcommand
+    @param out receives the 16-bit result
+    @return ESP_OK on success, ESP_ERR_INVALID_ARG for other subcommands
 */
-esp_err_t bq27427_enter_config(i2c_dev_t *dev, uint8_t userControl);
+esp_err_t bq27427_read_control(bq27427_t *dev, uint16_t subcommand, uint16_t *out);
 
 /**
-    Exit configuration mode
+ * @brief Identification of a gauge, see bq27427_identify()
+ */
+typedef struct {
+	uint16_t device_type;  // CONTROL_DEVICE_TYPE
+	uint16_t fw_version;   // CONTROL_FW_VERSION
+	uint16_t dm_code;      // CONTROL_DM_CODE
+	uint16_t chem_id;      // CONTROL_CHEM_ID
+	uint16_t status;       // CONTROL_STATUS
+	bool sealed;           // SS set in CONTROL_STATUS
+	bool initialized;      // INITCOMP set in CONTROL_STATUS
+} bq27427_info_t;
+
+/**
+    Read the identification subcommands of Control() back to back under a
+    single lock, with only the packet spacing the gauge requires between
+    transfers. DEVICE_TYPE is read first, so an absent or foreign device
+    costs one or two transfers.
     
-    @return true on success
+    @param info receives the identification
+    @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if the device type is
+    not BQ27427_DEVICE_ID (info->device_type is still set)
 */
-esp_err_t bq27427_exit_config(i2c_dev_t *dev, uint8_t userControl);
+esp_err_t bq27427_identify(bq27427_t *dev, bq27427_info_t *info);
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+/**
+    Enter configuration mode - set userControl if the application wants
+    control over when to exit config mode.
+    
+    @param userControl is true if the application is handling entering
+    and exiting config mode. While it does, setters and
+    bq27427_config_commit() write inside that session instead of opening
+    their own.
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_enter_config(bq27427_t *dev, uint8_t userControl);
+
+/**
+    Exit configuration mode. Issues SOFT_RESET so that the gauge resimulates
+    with the new data memory, and seals it again if it was sealed before
+    bq27427_enter_config().
+    
+    @param userControl is true to end a session opened with userControl
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_exit_config(bq27427_t *dev, uint8_t userControl);
+#endif
+
+/////////////////////////////////
+// Configuration Transactions  //
+/////////////////////////////////
+// Every setter above is a complete configuration session: unseal, enter
+// CFGUPDATE, write one block, SOFT_RESET and wait for CFGUPMODE to clear.
+// A transaction stages any number of changes and applies them in a single
+// session. Changes are grouped by subclass and block, only bytes that differ
+// from the current data memory contents are written, and each block checksum
+// is updated incrementally from the bytes that changed.
+//
+//     bq27427_config_t cfg;
+//     bq27427_config_begin(&dev, &cfg);
+//     bq27427_config_set_capacity(&cfg, 1200);
+//     bq27427_config_set_terminate_voltage(&cfg, 3200);
+//     bq27427_config_set_soc1_thresholds(&cfg, 10, 15);
+//     bq27427_config_commit(&cfg);
+
+#ifndef CONFIG_BQ27427_CONFIG_MAX_ITEMS
+#define CONFIG_BQ27427_CONFIG_MAX_ITEMS 16
+#endif
+
+/**
+ * @brief One staged data memory change
+ */
+typedef struct {
+	uint8_t class_id;   // Subclass ID, BQ27427_ID_*
+	uint8_t offset;     // Byte offset inside the subclass
+	uint8_t len;        // 1 or 2 bytes
+	uint8_t value[2];   // Big-endian value
+	uint8_t mask[2];    // Bits of value to apply
+} bq27427_config_item_t;
+
+/**
+ * @brief Staged configuration transaction
+ */
+typedef struct {
+	bq27427_t *dev;
+	uint16_t chem_id;   // CHEM_A/B/C subcommand, 0 if unchanged
+	uint8_t count;
+	bq27427_config_item_t items[CONFIG_BQ27427_CONFIG_MAX_ITEMS];
+} bq27427_config_t;
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+/**
+    Start a configuration transaction. Nothing is sent to the gauge until
+    bq27427_config_commit().
+    
+    @param cfg transaction to initialize
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_config_begin(bq27427_t *dev, bq27427_config_t *cfg);
+
+/**
+    Stage a raw data memory change. Staging the same location twice keeps
+    the last value.
+    
+    @param class_id subclass ID, BQ27427_ID_*
+    @param offset byte offset inside the subclass
+    @param value value to write, 1 or 2 bytes
+    @param mask bits of value to write; other bits keep their current value
+    @param len 1 or 2, the value must not cross a block boundary
+    @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the transaction is full
+*/
+esp_err_t bq27427_config_set_dm(bq27427_config_t *cfg, uint8_t class_id, uint8_t offset, uint16_t value, uint16_t mask,
+                                uint8_t len);
+
+esp_err_t bq27427_config_set_capacity(bq27427_config_t *cfg, uint16_t capacity);
+esp_err_t bq27427_config_set_design_energy(bq27427_config_t *cfg, uint16_t energy);
+esp_err_t bq27427_config_set_terminate_voltage(bq27427_config_t *cfg, uint16_t voltage);
+esp_err_t bq27427_config_set_discharge_current_threshold(bq27427_config_t *cfg, uint16_t current);
+esp_err_t bq27427_config_set_taper_voltage(bq27427_config_t *cfg, uint16_t voltage);
+esp_err_t bq27427_config_set_taper_rate(bq27427_config_t *cfg, uint16_t rate);
+esp_err_t bq27427_config_set_chem_id(bq27427_config_t *cfg, chemistry_profiles chem_id);
+#ifdef CONFIG_BQ27427_GPOUT
+esp_err_t bq27427_config_set_gpout_polarity(bq27427_config_t *cfg, uint8_t activeHigh);
+esp_err_t bq27427_config_set_gpout_function(bq27427_config_t *cfg, gpout_function function);
+esp_err_t bq27427_config_set_soc1_thresholds(bq27427_config_t *cfg, uint8_t set, uint8_t clear);
+esp_err_t bq27427_config_set_socf_thresholds(bq27427_config_t *cfg, uint8_t set, uint8_t clear);
+esp_err_t bq27427_config_set_soci_delta(bq27427_config_t *cfg, uint8_t delta);
+#endif
+
+/**
+    Apply all staged changes in one configuration session with a single
+    SOFT_RESET. If no staged value differs from data memory and a staged
+    chemistry is the one CONTROL_CHEM_ID reports, the gauge is not put into
+    CFGUPDATE mode at all. The comparison is made against blocks confirmed
+    by their checksum, so a gauge that lost its configuration in a reset the
+    driver did not observe is written again.
+    
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_config_commit(bq27427_config_t *cfg);
+#endif
 
 /**
     Read the flags() command
     
     @return 16-bit representation of flags() command register
 */
-esp_err_t bq27427_get_flags(i2c_dev_t *dev, uint16_t *out);
+esp_err_t bq27427_get_flags(bq27427_t *dev, uint16_t *out);
 
 /**
     Read the CONTROL_STATUS subcommand of control()
     
     @return 16-bit representation of CONTROL_STATUS subcommand
 */
-esp_err_t bq27427_get_status(i2c_dev_t *dev, uint16_t *out);
+esp_err_t bq27427_get_status(bq27427_t *dev, uint16_t *out);
 
 /**
-    Issue a factory reset to the BQ27427
+    Issue a factory reset to the BQ27427. Drops the data memory cache.
     
-    @return true on success
-*/	
-esp_err_t bq27427_reset(i2c_dev_t *dev);
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_reset(bq27427_t *dev);
+
+/**
+    Unseal the gauge so that data memory can be accessed. Data memory reads
+    on a sealed gauge unseal and reseal it around every access; keeping it
+    unsealed lets cached blocks be revalidated with a single checksum read.
+    
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_unseal(bq27427_t *dev);
+
+/**
+    Seal the gauge
+    
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_seal(bq27427_t *dev);
+
+#ifdef CONFIG_BQ27427_DM_ACCESS
+/**
+    Read bytes from data memory. The containing 32-byte block is kept in a
+    per-device cache keyed by subclass and block; while cached, a read only
+    costs a BlockDataCheckSum() read to confirm that the copy is current,
+    so a gauge reset or another master's write that the driver did not
+    observe is still noticed. The cache is dropped when ITPOR is observed in
+    Flags() or on reset.
+    
+    @param class_id subclass ID, BQ27427_ID_*
+    @param offset byte offset inside the subclass
+    @param data buffer for the bytes read
+    @param len number of bytes, must not cross a block boundary
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_read_dm(bq27427_t *dev, uint8_t class_id, uint8_t offset, uint8_t *data, uint8_t len);
+
+/**
+    Read the BlockDataCheckSum() of a data memory block without its data, to
+    tell whether a copy kept elsewhere is still current. Bypasses the cache.
+    
+    @param class_id subclass ID, BQ27427_ID_*
+    @param block block index inside the subclass
+    @param checksum receives 0xff minus the byte sum of the block
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_read_dm_checksum(bq27427_t *dev, uint8_t class_id, uint8_t block, uint8_t *checksum);
+
+/**
+    Drop every cached data memory block
+    
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_dm_cache_invalidate(bq27427_t *dev);
+
+/**
+    Copy the data memory cache out, e.g. to keep it across deep sleep.
+    Waits for a running sequence to end.
+    
+    @param blocks receives CONFIG_BQ27427_DM_CACHE_BLOCKS entries
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_dm_cache_save(bq27427_t *dev, bq27427_dm_block_t *blocks);
+
+/**
+    Replace the data memory cache with a copy from bq27427_dm_cache_save().
+    A restored block is still confirmed by its checksum before it is used.
+    
+    @param blocks CONFIG_BQ27427_DM_CACHE_BLOCKS entries
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_dm_cache_restore(bq27427_t *dev, const bq27427_dm_block_t *blocks);
+#endif
+
+///////////////////////
+// Data Memory Image //
+///////////////////////
+// A binary copy of every data memory subclass, for provisioning. The image is
+// stored little-endian as laid out below; block data is raw data memory.
+#define BQ27427_IMAGE_MAGIC		0x4d493742 // "B7IM"
+#define BQ27427_IMAGE_VERSION	1
+#define BQ27427_IMAGE_MAX_BLOCKS	16
+
+// bq27427_image_apply() flags
+#define BQ27427_IMAGE_APPLY_CODES		(1 << 0) // Also write the Codes subclass (unseal keys)
+#define BQ27427_IMAGE_TRUST_CHECKSUM	(1 << 1) // Treat equal checksums as equal blocks
+
+/**
+ * @brief One data memory block of an image
+ */
+typedef struct {
+	uint8_t class_id;                    // Subclass ID, BQ27427_ID_*
+	uint8_t block;                       // Block index inside the subclass
+	uint8_t checksum;                    // BlockDataCheckSum() of data
+	uint8_t reserved;
+	uint8_t data[BQ27427_DM_BLOCK_SIZE];
+} bq27427_image_block_t;
+
+/**
+ * @brief Data memory image
+ */
+typedef struct {
+	uint32_t magic;        // BQ27427_IMAGE_MAGIC
+	uint16_t version;      // BQ27427_IMAGE_VERSION
+	uint16_t device_type;  // CONTROL_DEVICE_TYPE of the source gauge
+	uint16_t fw_version;   // CONTROL_FW_VERSION of the source gauge
+	uint16_t chem_id;      // CONTROL_CHEM_ID of the source gauge
+	uint8_t count;         // Number of blocks used
+	uint8_t reserved[3];
+	bq27427_image_block_t blocks[BQ27427_IMAGE_MAX_BLOCKS];
+} bq27427_image_t;
+
+#ifdef CONFIG_BQ27427_CONFIG_WRITE
+/**
+    Read every known data memory subclass into an image
+    
+    @param image receives the image
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_image_dump(bq27427_t *dev, bq27427_image_t *image);
+
+/**
+    Make the gauge's data memory match an image. Each block's checksum is
+    read first and only blocks that differ are written, all in one
+    configuration session with a single SOFT_RESET; if nothing differs, no
+    session is started. The chemistry profile is switched first if it
+    differs. The Codes subclass is skipped unless BQ27427_IMAGE_APPLY_CODES
+    is given, since it holds the unseal keys the driver relies on.
+    
+    @param image image from bq27427_image_dump()
+    @param flags BQ27427_IMAGE_* flags
+    @param written receives the number of blocks written, may be NULL
+    @return ESP_OK on success, ESP_ERR_INVALID_VERSION for a malformed image,
+    ESP_ERR_INVALID_CRC if a block does not match its checksum,
+    ESP_ERR_NOT_SUPPORTED if the image is for another device type
+*/
+esp_err_t bq27427_image_apply(bq27427_t *dev, const bq27427_image_t *image, uint32_t flags, uint8_t *written);
+#endif
+
+/**
+    Set how failed transfers are retried and when the descriptor goes
+    offline, see bq27427_recovery_t. Setting a policy without a circuit
+    breaker brings an offline descriptor back online.
+    
+    @param policy recovery policy, copied
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_set_recovery(bq27427_t *dev, const bq27427_recovery_t *policy);
+
+/**
+    @return true while the circuit breaker of the descriptor is open
+*/
+bool bq27427_is_offline(const bq27427_t *dev);
+
+/**
+    Release SDA if the gauge holds it low: SCL is clocked until SDA rises,
+    a STOP is issued and the pins are handed back to the I2C controller.
+    This drives the pins of the whole port. Call it only while no other
+    device on the port can be in a transfer, e.g. between
+    bq27427_group_acquire() and bq27427_group_release(), or with all users
+    of the port stopped; a device that pulls SDA low in
+    the middle of its own transfer would otherwise be taken for a stuck
+    bus and its transfer corrupted.
+    
+    @return ESP_OK if SDA is high afterwards, ESP_FAIL if it is still held
+    low, ESP_ERR_NOT_SUPPORTED on ESP8266
+*/
+esp_err_t bq27427_recover_bus(bq27427_t *dev);
+
+/**
+    Copy the bus statistics of a descriptor
+    
+    @param stats receives the statistics
+    @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if CONFIG_BQ27427_STATS
+    is disabled
+*/
+esp_err_t bq27427_get_stats(bq27427_t *dev, bq27427_stats_t *stats);
+
+/**
+    Clear the bus statistics of a descriptor
+    
+    @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if CONFIG_BQ27427_STATS
+    is disabled
+*/
+esp_err_t bq27427_reset_stats(bq27427_t *dev);
+
+/**
+    Attach a trace ring that records every transfer of the descriptor, see
+    bq27427_trace.h. The ring is emptied.
+    
+    @param trace caller-owned ring, valid while attached; NULL to detach
+    @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if CONFIG_BQ27427_TRACE
+    is disabled
+*/
+esp_err_t bq27427_set_trace(bq27427_t *dev, bq27427_trace_t *trace);
 
 #ifdef __cplusplus
 }
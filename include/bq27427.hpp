@@ -0,0 +1,295 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * C++17 front end.
+ *
+ * bq27427::Gauge<Transport> reads standard commands through a table of
+ * register descriptors. Each descriptor in bq27427::reg names the command
+ * code, the bq27427_field_t bit and the unit type, whose representation
+ * carries the signedness and whose std::ratio the scale to SI units. A read
+ * of a descriptor compiles to one burst at a constant address followed by a
+ * constant decode; there is no runtime lookup.
+ *
+ *   bq27427::Gauge<> gauge{bq27427::Device{&dev}};
+ *   bq27427::Millivolts voltage;
+ *   bq27427::Percent soc;
+ *   gauge.read<bq27427::reg::Voltage, bq27427::reg::StateOfCharge>(voltage, soc);
+ *
+ * Reading several descriptors at once merges them into bursts with the same
+ * rule as bq27427_read_snapshot(), but the plan is computed by the compiler
+ * (bq27427::burst_plan) and executed with bq27427_read_bursts().
+ *
+ * A Transport is any copyable type with
+ *
+ *   esp_err_t read(const bq27427_burst_t *bursts, size_t count, uint8_t *block);
+ *
+ * with the contract of bq27427_read_bursts(). bq27427::Device forwards to
+ * the C driver, so reads share its mutex, recovery policy, statistics and
+ * latest-value cache. Configuration and data memory stay with the C API.
+ */
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ratio>
+#include <type_traits>
+#include <esp_err.h>
+#include "bq27427.h"
+
+namespace bq27427 {
+
+/**
+ * @brief Value in a fixed unit, stored in the representation the gauge uses
+ *
+ * Tag keeps quantities of different kinds apart, Scale converts the stored
+ * count to the SI unit.
+ */
+template <typename Tag, typename Rep, typename Scale>
+class Quantity {
+public:
+	using rep = Rep;
+	using scale = Scale;
+
+	constexpr Quantity() : count_() {}
+	constexpr explicit Quantity(Rep count) : count_(count) {}
+
+	constexpr Rep count() const { return count_; }
+
+	// Value in the SI unit (V, A, Ah, W, K or a fraction of one)
+	template <typename T = float>
+	constexpr T si() const { return static_cast<T>(count_) * Scale::num / Scale::den; }
+
+	static constexpr Quantity decode(const uint8_t *p)
+	{
+		return Quantity(static_cast<Rep>(static_cast<uint16_t>(p[0] | (p[1] << 8))));
+	}
+
+	friend constexpr bool operator==(Quantity a, Quantity b) { return a.count_ == b.count_; }
+	friend constexpr bool operator!=(Quantity a, Quantity b) { return a.count_ != b.count_; }
+	friend constexpr bool operator<(Quantity a, Quantity b) { return a.count_ < b.count_; }
+	friend constexpr bool operator>(Quantity a, Quantity b) { return a.count_ > b.count_; }
+	friend constexpr bool operator<=(Quantity a, Quantity b) { return a.count_ <= b.count_; }
+	friend constexpr bool operator>=(Quantity a, Quantity b) { return a.count_ >= b.count_; }
+
+private:
+	Rep count_;
+};
+
+using Millivolts    = Quantity<struct VoltageTag, uint16_t, std::milli>;
+using Milliamps     = Quantity<struct CurrentTag, int16_t, std::milli>;      // >0 indicates charging
+using MilliampHours = Quantity<struct ChargeTag, uint16_t, std::milli>;
+using Milliwatts    = Quantity<struct PowerTag, int16_t, std::milli>;        // >0 indicates charging
+using Percent       = Quantity<struct RatioTag, uint16_t, std::centi>;
+using Decikelvin    = Quantity<struct TemperatureTag, uint16_t, std::deci>;
+
+/**
+    Temperature in 0.1 °C, rounded towards the colder value
+*/
+constexpr int32_t to_decicelsius(Decikelvin t)
+{
+	return static_cast<int32_t>(t.count()) - 2732;
+}
+
+/**
+ * @brief Flags() register
+ */
+class Flags {
+public:
+	constexpr Flags() : bits_(0) {}
+	constexpr explicit Flags(uint16_t bits) : bits_(bits) {}
+
+	constexpr uint16_t bits() const { return bits_; }
+	// True if all bits of a BQ27427_FLAG_* mask are set
+	constexpr bool has(uint16_t mask) const { return (bits_ & mask) == mask; }
+
+	static constexpr Flags decode(const uint8_t *p) { return Flags(static_cast<uint16_t>(p[0] | (p[1] << 8))); }
+
+private:
+	uint16_t bits_;
+};
+
+/**
+ * @brief StateOfHealth(): percentage in the low byte, status in the high byte
+ */
+struct Health {
+	uint8_t percent;
+	uint8_t status;
+
+	static constexpr Health decode(const uint8_t *p) { return Health{p[0], p[1]}; }
+};
+
+/**
+ * @brief Descriptor of one standard command
+ */
+template <uint8_t Command, uint32_t Field, typename Unit>
+struct Register {
+	using unit = Unit;
+	static constexpr uint8_t command = Command;
+	static constexpr uint32_t field = Field;  // bq27427_field_t bit
+
+	static_assert(Command >= BQ27427_SNAPSHOT_FIRST_REG && Command + 1 <= BQ27427_SNAPSHOT_LAST_REG,
+	              "register outside the standard command block");
+};
+
+namespace reg {
+
+struct Temperature : Register<BQ27427_COMMAND_TEMP, BQ27427_FIELD_TEMP, Decikelvin> {};
+struct Voltage : Register<BQ27427_COMMAND_VOLTAGE, BQ27427_FIELD_VOLTAGE, Millivolts> {};
+struct Flags : Register<BQ27427_COMMAND_FLAGS, BQ27427_FIELD_FLAGS, bq27427::Flags> {};
+struct NominalAvailableCapacity : Register<BQ27427_COMMAND_NOM_CAPACITY, BQ27427_FIELD_NOM_CAPACITY, MilliampHours> {};
+struct FullAvailableCapacity : Register<BQ27427_COMMAND_AVAIL_CAPACITY, BQ27427_FIELD_AVAIL_CAPACITY, MilliampHours> {};
+struct RemainingCapacity : Register<BQ27427_COMMAND_REM_CAPACITY, BQ27427_FIELD_REM_CAPACITY, MilliampHours> {};
+struct FullChargeCapacity : Register<BQ27427_COMMAND_FULL_CAPACITY, BQ27427_FIELD_FULL_CAPACITY, MilliampHours> {};
+struct AverageCurrent : Register<BQ27427_COMMAND_AVG_CURRENT, BQ27427_FIELD_AVG_CURRENT, Milliamps> {};
+struct StandbyCurrent : Register<BQ27427_COMMAND_STDBY_CURRENT, BQ27427_FIELD_STDBY_CURRENT, Milliamps> {};
+struct MaxLoadCurrent : Register<BQ27427_COMMAND_MAX_CURRENT, BQ27427_FIELD_MAX_CURRENT, Milliamps> {};
+struct AveragePower : Register<BQ27427_COMMAND_AVG_POWER, BQ27427_FIELD_AVG_POWER, Milliwatts> {};
+struct StateOfCharge : Register<BQ27427_COMMAND_SOC, BQ27427_FIELD_SOC, Percent> {};
+struct InternalTemperature : Register<BQ27427_COMMAND_INT_TEMP, BQ27427_FIELD_INT_TEMP, Decikelvin> {};
+struct StateOfHealth : Register<BQ27427_COMMAND_SOH, BQ27427_FIELD_SOH, Health> {};
+struct RemainingCapacityUnfiltered : Register<BQ27427_COMMAND_REM_CAP_UNFL, BQ27427_FIELD_REM_CAP_UNFL, MilliampHours> {};
+struct RemainingCapacityFiltered : Register<BQ27427_COMMAND_REM_CAP_FIL, BQ27427_FIELD_REM_CAP_FIL, MilliampHours> {};
+struct FullChargeCapacityUnfiltered : Register<BQ27427_COMMAND_FULL_CAP_UNFL, BQ27427_FIELD_FULL_CAP_UNFL, MilliampHours> {};
+struct FullChargeCapacityFiltered : Register<BQ27427_COMMAND_FULL_CAP_FIL, BQ27427_FIELD_FULL_CAP_FIL, MilliampHours> {};
+struct StateOfChargeUnfiltered : Register<BQ27427_COMMAND_SOC_UNFL, BQ27427_FIELD_SOC_UNFL, Percent> {};
+
+} // namespace reg
+
+/**
+ * @brief Bursts that read a set of registers, at most one per register
+ */
+template <size_t N>
+struct BurstPlan {
+	std::array<bq27427_burst_t, N> bursts;
+	size_t count;
+};
+
+/**
+    Merge registers into bursts: sorted by address, a register joins the
+    previous burst if at most BQ27427_SNAPSHOT_MAX_GAP unrequested bytes lie
+    in between. Same rule as bq27427_read_snapshot().
+*/
+template <uint8_t... Commands>
+constexpr BurstPlan<sizeof...(Commands)> plan_bursts()
+{
+	constexpr size_t n = sizeof...(Commands);
+	std::array<uint8_t, n> regs = {Commands...};
+	BurstPlan<n> plan{};
+
+	for (size_t i = 1; i < n; i++)
+		for (size_t j = i; j > 0 && regs[j - 1] > regs[j]; j--) {
+			uint8_t t = regs[j];
+			regs[j] = regs[j - 1];
+			regs[j - 1] = t;
+		}
+
+	int end = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (plan.count && regs[i] - end <= BQ27427_SNAPSHOT_MAX_GAP) {
+			if (regs[i] + 2 > end)
+				end = regs[i] + 2;
+		} else {
+			plan.bursts[plan.count].reg = regs[i];
+			plan.count++;
+			end = regs[i] + 2;
+		}
+		plan.bursts[plan.count - 1].len = static_cast<uint8_t>(end - plan.bursts[plan.count - 1].reg);
+	}
+
+	return plan;
+}
+
+// Burst plan of a register set, computed at compile time
+template <typename... Regs>
+inline constexpr auto burst_plan = plan_bursts<Regs::command...>();
+
+// bq27427_field_t mask of a register set
+template <typename... Regs>
+inline constexpr uint32_t field_mask = (Regs::field | ... | 0u);
+
+/**
+ * @brief Transport through the C driver, see bq27427_read_bursts()
+ */
+class Device {
+public:
+	constexpr explicit Device(bq27427_t *dev) : dev_(dev) {}
+
+	esp_err_t read(const bq27427_burst_t *bursts, size_t count, uint8_t *block)
+	{
+		return bq27427_read_bursts(dev_, bursts, count, block);
+	}
+
+	bq27427_t *get() const { return dev_; }
+
+private:
+	bq27427_t *dev_;
+};
+
+/**
+ * @brief Typed reads of the standard commands
+ */
+template <typename Transport = Device>
+class Gauge {
+public:
+	explicit Gauge(Transport transport) : transport_(transport) {}
+
+	/**
+	    Read a set of registers in the bursts of burst_plan<Regs...>
+
+	    @param out one value per register, in the order of Regs
+	    @return ESP_OK on success; out is untouched on failure
+	*/
+	template <typename... Regs>
+	esp_err_t read(typename Regs::unit &... out)
+	{
+		static_assert(sizeof...(Regs) > 0, "no register to read");
+		constexpr auto &plan = burst_plan<Regs...>;
+		uint8_t block[BQ27427_SNAPSHOT_SIZE];
+
+		esp_err_t err = transport_.read(plan.bursts.data(), plan.count, block);
+		if (err != ESP_OK)
+			return err;
+		((out = Regs::unit::decode(block + Regs::command - BQ27427_SNAPSHOT_FIRST_REG)), ...);
+
+		return ESP_OK;
+	}
+
+	esp_err_t voltage(Millivolts &out) { return read<reg::Voltage>(out); }
+	esp_err_t average_current(Milliamps &out) { return read<reg::AverageCurrent>(out); }
+	esp_err_t average_power(Milliwatts &out) { return read<reg::AveragePower>(out); }
+	esp_err_t state_of_charge(Percent &out) { return read<reg::StateOfCharge>(out); }
+	esp_err_t state_of_health(Health &out) { return read<reg::StateOfHealth>(out); }
+	esp_err_t temperature(Decikelvin &out) { return read<reg::Temperature>(out); }
+	esp_err_t remaining_capacity(MilliampHours &out) { return read<reg::RemainingCapacity>(out); }
+	esp_err_t full_charge_capacity(MilliampHours &out) { return read<reg::FullChargeCapacity>(out); }
+	esp_err_t flags(Flags &out) { return read<reg::Flags>(out); }
+
+	Transport &transport() { return transport_; }
+
+private:
+	Transport transport_;
+};
+
+} // namespace bq27427
@@ -0,0 +1,192 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Asynchronous requests.
+ *
+ * Callers fill a bq27427_request_t and submit it to the device's queue; a
+ * worker task runs the requests in order with the blocking driver API and
+ * completes each one exactly once, through its callback and/or a task
+ * notification. Submitting never waits for the bus.
+ *
+ * The request is owned by the driver from bq27427_async_submit() until it
+ * completes, and must stay valid until then. A request whose deadline has
+ * passed before it starts completes with ESP_ERR_TIMEOUT, a cancelled one
+ * with ESP_ERR_INVALID_STATE; neither touches the bus. A request that has
+ * started runs to the end.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Request types
+ */
+typedef enum {
+	BQ27427_REQUEST_SNAPSHOT,   // bq27427_read_snapshot()
+	BQ27427_REQUEST_CONTROL,    // bq27427_read_control()
+	BQ27427_REQUEST_DM_READ,    // bq27427_read_dm()
+	BQ27427_REQUEST_DM_WRITE,   // One parameter, in its own configuration transaction
+	BQ27427_REQUEST_CONFIG,     // bq27427_config_commit() of a staged transaction
+} bq27427_request_type_t;
+
+/**
+ * @brief Request life cycle
+ */
+typedef enum {
+	BQ27427_REQUEST_IDLE,
+	BQ27427_REQUEST_QUEUED,
+	BQ27427_REQUEST_RUNNING,
+	BQ27427_REQUEST_CANCELLED,  // Cancelled while queued, not completed yet
+	BQ27427_REQUEST_DONE,
+} bq27427_request_state_t;
+
+typedef struct bq27427_request_s bq27427_request_t;
+
+/**
+ * @brief Completion callback, called from the worker task
+ */
+typedef void (*bq27427_request_cb_t)(bq27427_request_t *req, void *ctx);
+
+/**
+ * @brief One request. Set type, the matching arguments, and optionally
+ * timeout, cb/ctx and notify before submitting.
+ */
+struct bq27427_request_s {
+	bq27427_request_type_t type;
+	union {
+		struct {
+			uint32_t fields;            // in
+			bq27427_snapshot_t result;  // out
+		} snapshot;
+		struct {
+			uint16_t subcommand;        // in
+			uint16_t result;            // out
+		} control;
+		struct {
+			uint8_t class_id;           // in
+			uint8_t offset;             // in
+			uint8_t len;                // in, 1..32 for reads, 1 or 2 for writes
+			uint8_t *data;              // out, len bytes (reads)
+			uint16_t value;             // in (writes)
+			uint16_t mask;              // in (writes)
+		} dm;
+		struct {
+			bq27427_config_t *config;   // in, staged transaction
+		} config;
+	};
+	TickType_t timeout;         // Longest wait in the queue, 0 for none
+	bq27427_request_cb_t cb;    // May be NULL
+	void *ctx;
+	TaskHandle_t notify;        // Task to notify on completion, may be NULL
+	esp_err_t err;              // Result, valid once state is BQ27427_REQUEST_DONE
+	uint32_t state;             // bq27427_request_state_t
+	TickType_t deadline;        // Set by bq27427_async_submit()
+};
+
+/**
+ * @brief Worker configuration
+ */
+typedef struct {
+	uint32_t queue_length;
+	UBaseType_t task_priority;
+	uint32_t task_stack_size;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StackType_t *task_stack;            // task_stack_size bytes, valid until bq27427_async_stop()
+	bq27427_request_t **queue_storage;  // queue_length entries, valid until bq27427_async_stop()
+#endif
+} bq27427_async_config_t;
+
+/**
+ * @brief Per-device request queue and worker, owned by the caller
+ */
+typedef struct {
+	bq27427_t *dev;
+	QueueHandle_t queue;
+	TaskHandle_t task;
+	SemaphoreHandle_t stopped;  // Given by the worker when it exits
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StaticTask_t task_buf;
+	StaticQueue_t queue_buf;
+	StaticSemaphore_t stopped_buf;
+#endif
+	volatile bool running;
+} bq27427_async_t;
+
+/**
+    Create the request queue and start the worker task
+
+    @param async caller-owned state, valid until bq27427_async_stop()
+    @param config worker configuration
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_async_start(bq27427_async_t *async, bq27427_t *dev, const bq27427_async_config_t *config);
+
+/**
+    Stop the worker. The request in progress is finished first, which for
+    a configuration session can take seconds; requests still queued
+    complete with ESP_ERR_INVALID_STATE.
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_async_stop(bq27427_async_t *async);
+
+/**
+    Queue a request. Never blocks.
+
+    @param req request, owned by the driver until it completes
+    @return ESP_OK if queued, ESP_ERR_NO_MEM if the queue is full
+*/
+esp_err_t bq27427_async_submit(bq27427_async_t *async, bq27427_request_t *req);
+
+/**
+    Cancel a queued request. It still completes, with ESP_ERR_INVALID_STATE,
+    when the worker reaches it.
+
+    @param req request passed to bq27427_async_submit()
+    @return ESP_OK if cancelled, ESP_ERR_INVALID_STATE if it already started
+*/
+esp_err_t bq27427_async_cancel(bq27427_async_t *async, bq27427_request_t *req);
+
+/**
+    Check whether a request has completed
+
+    @param req submitted request
+    @return true once req->err holds the result
+*/
+bool bq27427_async_done(const bq27427_request_t *req);
+
+#ifdef __cplusplus
+}
+#endif
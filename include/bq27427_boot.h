@@ -0,0 +1,114 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Fast boot.
+ *
+ * The gauge keeps its data memory as long as it stays powered, which is
+ * normally much longer than the MCU sleeps. bq27427_boot() takes the
+ * configuration the firmware wants, staged in a bq27427_config_t, and a state
+ * block that the application keeps in RTC memory (RTC_DATA_ATTR or
+ * RTC_NOINIT_ATTR):
+ *
+ *   - Flags() is read. If ITPOR is set, the gauge lost its configuration and
+ *     the staged one is written in a session that always ends with
+ *     SOFT_RESET, which clears ITPOR.
+ *   - Otherwise, if the state block is intact and holds the hash of the same
+ *     staged configuration, nothing else is done: one bus transaction.
+ *   - Otherwise the staged configuration is committed, which compares the
+ *     touched data memory blocks and only starts a CFGUPDATE session if a
+ *     value differs.
+ *
+ * bq27427_boot_save(), called before deep sleep, stores the data memory
+ * cache of the descriptor and the last sample in the state block. The cache
+ * is restored on wake, so later data memory reads only revalidate checksums.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BQ27427_BOOT_MAGIC 0x42373442 // "B47B"
+
+/**
+ * @brief How bq27427_boot() found the gauge
+ */
+typedef enum {
+	BQ27427_BOOT_FAST,     // Configuration known to be applied, only Flags() read
+	BQ27427_BOOT_CHECKED,  // Configuration compared with data memory, written where it differed
+	BQ27427_BOOT_POR,      // ITPOR set, configuration written
+} bq27427_boot_result_t;
+
+/**
+ * @brief State kept in RTC memory across deep sleep
+ */
+typedef struct {
+	uint32_t magic;                     // BQ27427_BOOT_MAGIC
+	uint32_t config_hash;               // Hash of the configuration known to be applied
+	bool has_snapshot;
+	bq27427_snapshot_t snapshot;        // Last sample before sleep
+	bq27427_dm_block_t dm_cache[CONFIG_BQ27427_DM_CACHE_BLOCKS];
+	uint32_t check;                     // Hash of all members above
+} bq27427_boot_state_t;
+
+/**
+    Bring the gauge to the staged configuration as cheaply as possible and
+    restore the descriptor state saved before deep sleep. The descriptor
+    must have been initialized with bq27427_init_desc().
+
+    @param cfg staged configuration, see bq27427_config_begin()
+    @param state state block in RTC memory; contents are checked, so it may
+    hold garbage after a cold boot
+    @param result receives the path taken, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_boot(bq27427_t *dev, bq27427_config_t *cfg, bq27427_boot_state_t *state,
+                       bq27427_boot_result_t *result);
+
+/**
+    Save the descriptor state and the last sample before deep sleep
+
+    @param state state block in RTC memory, previously passed to bq27427_boot()
+    @param snapshot last sample, may be NULL
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_boot_save(bq27427_t *dev, bq27427_boot_state_t *state, const bq27427_snapshot_t *snapshot);
+
+/**
+    Return the sample saved by bq27427_boot_save(), so that the application
+    has a reading right after wake without touching the bus
+
+    @param snapshot receives the sample
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND if none was saved
+*/
+esp_err_t bq27427_boot_last_snapshot(const bq27427_boot_state_t *state, bq27427_snapshot_t *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
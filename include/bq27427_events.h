@@ -0,0 +1,172 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * GPOUT event mode.
+ *
+ * Instead of polling Flags(), the driver installs a GPIO interrupt on the pin
+ * wired to GPOUT. The ISR only wakes a task, which reads Flags() and
+ * StateOfCharge() in one bq27427_read_snapshot() call, compares them with the
+ * previous reading and calls the subscribers with typed events.
+ *
+ * In SOC_INT mode the gauge pulses GPOUT when SOC changes by SOCI Delta, and
+ * on battery insertion or removal. In BAT_LOW mode GPOUT follows the SOC1 and
+ * SOCF flags and both edges are handled.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <driver/gpio.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_BQ27427_EVENTS_MAX_SUBSCRIBERS
+#define CONFIG_BQ27427_EVENTS_MAX_SUBSCRIBERS 4
+#endif
+
+/**
+ * @brief Event types
+ */
+typedef enum {
+	BQ27427_EVENT_SOC_DELTA,    // SOC_INT pulse: SOC moved by SOCI Delta
+	BQ27427_EVENT_SOC1_SET,     // SOC fell below SOC1 Set Threshold
+	BQ27427_EVENT_SOC1_CLEAR,   // SOC rose above SOC1 Clear Threshold
+	BQ27427_EVENT_SOCF_SET,     // SOC fell below SOCF Set Threshold
+	BQ27427_EVENT_SOCF_CLEAR,   // SOC rose above SOCF Clear Threshold
+	BQ27427_EVENT_BAT_INSERTED, // BAT_DET set
+	BQ27427_EVENT_BAT_REMOVED,  // BAT_DET cleared
+} bq27427_event_type_t;
+
+/**
+ * @brief Event passed to subscribers
+ */
+typedef struct {
+	bq27427_event_type_t type;
+	uint16_t flags;             // Flags() read after the interrupt
+	uint16_t soc;               // StateOfCharge() read after the interrupt, %
+	TickType_t timestamp;       // Tick count of the interrupt
+} bq27427_event_t;
+
+/**
+ * @brief Event callback, called from the event task without the subscriber
+ * lock held, so it may call bq27427_events_subscribe() and
+ * bq27427_events_unsubscribe()
+ */
+typedef void (*bq27427_event_cb_t)(bq27427_t *dev, const bq27427_event_t *event, void *ctx);
+
+/**
+ * @brief Registered callback
+ */
+typedef struct {
+	bq27427_event_cb_t cb;
+	void *ctx;
+} bq27427_events_subscriber_t;
+
+/**
+ * @brief Event mode configuration
+ */
+typedef struct {
+	gpio_num_t gpio;             // GPIO connected to GPOUT
+	gpout_function function;     // SOC_INT or BAT_LOW
+	bool active_high;            // GPOUT polarity
+	uint8_t soci_delta;          // SOC_INT interval in %, 0 to keep the gauge setting
+	bool configure_gauge;        // Write function, polarity and soci_delta to the gauge
+	UBaseType_t task_priority;
+	uint32_t task_stack_size;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StackType_t *task_stack;     // task_stack_size bytes, valid until bq27427_events_stop()
+#endif
+} bq27427_events_config_t;
+
+/**
+ * @brief Event mode state, owned by the caller
+ */
+typedef struct {
+	bq27427_t *dev;
+	bq27427_events_config_t config;
+	TaskHandle_t task;
+	SemaphoreHandle_t lock;      // Protects subscribers
+	SemaphoreHandle_t stopped;   // Given by the task when it exits
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StaticTask_t task_buf;
+	StaticSemaphore_t lock_buf;
+	StaticSemaphore_t stopped_buf;
+#endif
+	volatile bool running;
+	volatile TickType_t irq_tick;
+	uint16_t flags;              // Flags() at the previous event
+	uint16_t soc;                // StateOfCharge() at the previous event
+	bq27427_events_subscriber_t subscribers[CONFIG_BQ27427_EVENTS_MAX_SUBSCRIBERS];
+} bq27427_events_t;
+
+/**
+    Start event mode. Optionally configures GPOUT on the gauge in one
+    configuration transaction, then installs the GPIO interrupt and starts
+    the event task. The GPIO ISR service must not be installed with flags
+    that conflict with the default; it is installed if missing.
+
+    @param ev caller-owned state, valid until bq27427_events_stop()
+    @param config event mode configuration
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_events_start(bq27427_events_t *ev, bq27427_t *dev, const bq27427_events_config_t *config);
+
+/**
+    Stop event mode: removes the GPIO interrupt and waits for the event task
+    to exit, which can take as long as a configuration session that holds
+    the gauge. ev may be freed once this returns.
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_events_stop(bq27427_events_t *ev);
+
+/**
+    Register a callback for all events
+
+    @param cb callback, called from the event task
+    @param ctx passed to the callback
+    @return ESP_OK on success, ESP_ERR_NO_MEM if all slots are used
+*/
+esp_err_t bq27427_events_subscribe(bq27427_events_t *ev, bq27427_event_cb_t cb, void *ctx);
+
+/**
+    Remove a callback registered with the same cb and ctx. An event that the
+    event task is dispatching at that moment may still reach the callback,
+    so ctx must stay valid until bq27427_events_stop() if the call is made
+    from another task.
+
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND if not registered
+*/
+esp_err_t bq27427_events_unsubscribe(bq27427_events_t *ev, bq27427_event_cb_t cb, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,193 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Multi-gauge group.
+ *
+ * Every BQ27427 answers at BQ27427_I2C_ADDRESS, so several gauges on one port
+ * sit behind TCA9548 multiplexer channels. The group owns one descriptor per
+ * gauge and one worker task per I2C port. A fleet scan wakes all workers at
+ * once, so ports are read in parallel; each worker reads its gauges sorted by
+ * multiplexer and channel and only writes a multiplexer control register when
+ * the selection actually changes. Scans alternate direction so that the
+ * channel left selected by one scan is the first one read by the next.
+ *
+ * Members must only be accessed through the group: either by a scan or
+ * between bq27427_group_acquire() and bq27427_group_release(), which select
+ * the member's channel and keep other users off the port.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_BQ27427_GROUP_MAX_GAUGES
+#define CONFIG_BQ27427_GROUP_MAX_GAUGES 8
+#endif
+
+#define BQ27427_GROUP_MAX_BUSES 2  // I2C ports, each gets a worker task
+
+#define TCA9548_ADDR_BASE   0x70
+#define TCA9548_ADDR_COUNT  8
+#define TCA9548_CHANNELS    8
+
+/**
+ * @brief Where one gauge is connected
+ */
+typedef struct {
+	i2c_port_t port;
+	gpio_num_t sda_gpio;
+	gpio_num_t scl_gpio;
+	uint8_t mux_addr;           // TCA9548 address, 0 if the gauge is directly on the port
+	uint8_t mux_channel;        // TCA9548 channel, 0..7
+} bq27427_group_member_config_t;
+
+/**
+ * @brief Group configuration
+ */
+typedef struct {
+	UBaseType_t task_priority;
+	uint32_t task_stack_size;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StackType_t *task_stacks;   // task_stack_size bytes per I2C port of the group, valid until bq27427_group_free()
+#endif
+} bq27427_group_config_t;
+
+/**
+ * @brief One gauge of the group
+ */
+typedef struct {
+	bq27427_t dev;
+	uint8_t bus;                // Index into bq27427_group_t.buses
+	uint8_t mux_addr;
+	uint8_t mux_channel;
+} bq27427_group_member_t;
+
+struct bq27427_group_s;
+
+/**
+ * @brief One I2C port of the group and its worker
+ */
+typedef struct {
+	struct bq27427_group_s *group;
+	i2c_port_t port;
+	SemaphoreHandle_t lock;                  // Serializes channel selection and gauge access
+	TaskHandle_t task;
+	uint8_t count;
+	uint8_t order[CONFIG_BQ27427_GROUP_MAX_GAUGES];  // Members sorted by mux and channel
+	bool reverse;                            // Direction of the next scan
+	uint8_t mux_used;                        // Bit per TCA9548 address present on this port
+	uint8_t mux_sel[TCA9548_ADDR_COUNT];     // Last control register written, 0xff if unknown
+	i2c_dev_t mux[TCA9548_ADDR_COUNT];
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StaticTask_t task_buf;
+	StaticSemaphore_t lock_buf;
+	StaticSemaphore_t mux_lock_buf[TCA9548_ADDR_COUNT]; // Storage of mux[].mutex
+#endif
+} bq27427_group_bus_t;
+
+/**
+ * @brief Group state, owned by the caller
+ */
+typedef struct bq27427_group_s {
+	size_t count;
+	uint8_t bus_count;
+	volatile bool running;
+	SemaphoreHandle_t lock;     // Serializes scans
+	SemaphoreHandle_t done;     // Given by a worker when its part of a scan is done
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StaticSemaphore_t lock_buf;
+	StaticSemaphore_t done_buf;
+#endif
+	uint32_t job_fields;
+	bq27427_snapshot_t *job_snapshots;
+	esp_err_t *job_results;
+	bq27427_group_member_t members[CONFIG_BQ27427_GROUP_MAX_GAUGES];
+	bq27427_group_bus_t buses[BQ27427_GROUP_MAX_BUSES];
+} bq27427_group_t;
+
+/**
+    Initialize a group: one descriptor per gauge, one descriptor per
+    multiplexer and one worker task per I2C port
+
+    @param group caller-owned state
+    @param members connection of each gauge; the member index is the index
+    used by all other group functions
+    @param count number of gauges
+    @param config group configuration
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_group_init(bq27427_group_t *group, const bq27427_group_member_config_t *members, size_t count,
+                             const bq27427_group_config_t *config);
+
+/**
+    Stop the workers and free all descriptors. Waits for a scan in progress
+    and for members acquired with bq27427_group_acquire() to be released.
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_group_free(bq27427_group_t *group);
+
+/**
+    Read a snapshot of every gauge. Ports are scanned in parallel by their
+    workers; the call returns when all of them are done.
+
+    @param fields bq27427_field_t mask of the values to read
+    @param snapshots array of one snapshot per member
+    @param results array of one result per member, may be NULL
+    @return ESP_OK if every gauge was read, otherwise the first error
+*/
+esp_err_t bq27427_group_read_snapshot(bq27427_group_t *group, uint32_t fields, bq27427_snapshot_t *snapshots,
+                                      esp_err_t *results);
+
+/**
+    Select a member's channel and lock its port for direct use of the driver
+    API. Must be paired with bq27427_group_release().
+
+    @param index member index
+    @param dev receives the member's descriptor
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_group_acquire(bq27427_group_t *group, size_t index, bq27427_t **dev);
+
+/**
+    Unlock the port locked by bq27427_group_acquire()
+
+    @param index member index
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_group_release(bq27427_group_t *group, size_t index);
+
+#ifdef __cplusplus
+}
+#endif
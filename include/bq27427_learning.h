@@ -0,0 +1,180 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Impedance Track learning monitor.
+ *
+ * The gauge learns the cell as it ages: it updates Qmax in the State
+ * subclass and the resistance table in R_a RAM, and toggles QMAX_UP and
+ * RES_UP in CONTROL_STATUS when it does. The monitor keeps a copy of those
+ * data memory blocks and reports what changed as compact delta records.
+ *
+ * Each bq27427_learning_poll() reads CONTROL_STATUS only. The blocks are
+ * read when QMAX_UP or RES_UP rises, on the first poll, and every
+ * verify_interval_ms as a safety net. The bits stay set after an update, so
+ * while one is set the next updates cannot be seen in CONTROL_STATUS: the
+ * poll then reads the BlockDataCheckSum() of each watched block, at most
+ * every probe_interval_ms, and reads the blocks only if a checksum differs
+ * from the copy. Even when the blocks are read, only blocks whose
+ * BlockDataCheckSum() changed are transferred: bq27427_read_dm() serves the
+ * others from the driver's block cache after the checksum read, so the
+ * cache should have room for BQ27427_LEARNING_BLOCKS more blocks. A sealed
+ * gauge is unsealed once for all blocks and sealed again.
+ *
+ * A record holds the changed bytes of one block as runs of (offset, count,
+ * bytes). Applying the records in order to a copy of the blocks, starting
+ * from the baseline records of the first poll, reproduces the gauge's data
+ * memory, see bq27427_learning_apply().
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BQ27427_LEARNING_BLOCKS 3 // State blocks 0 and 1, R_a RAM block 0
+
+// Longest record payload: a whole block as one run
+#define BQ27427_LEARNING_RECORD_MAX (2 + BQ27427_DM_BLOCK_SIZE)
+
+/**
+ * @brief Why the blocks were read, bit mask
+ */
+typedef enum {
+	BQ27427_LEARNING_BASELINE = (1 << 0), // First poll: the record holds the whole block
+	BQ27427_LEARNING_QMAX     = (1 << 1), // QMAX_UP rose, or the State checksum moved
+	BQ27427_LEARNING_RES      = (1 << 2), // RES_UP rose, or the R_a RAM checksum moved
+	BQ27427_LEARNING_VERIFY   = (1 << 3), // verify_interval_ms elapsed
+	BQ27427_LEARNING_PROBE    = (1 << 4), // A checksum probe found a block changed
+} bq27427_learning_cause_t;
+
+/**
+ * @brief Changes of one block
+ *
+ * A learning event that changed no watched block is still reported, with
+ * class_id 0 and no payload.
+ */
+typedef struct {
+	int64_t timestamp_us;       // esp_timer time of the poll
+	uint16_t status;            // CONTROL_STATUS of the poll
+	uint8_t cause;              // bq27427_learning_cause_t mask
+	uint8_t class_id;           // Subclass ID, BQ27427_ID_STATE or BQ27427_ID_R_A_RAM
+	uint8_t block;              // Block index inside the subclass
+	uint8_t len;                // Bytes in data
+	uint8_t data[BQ27427_LEARNING_RECORD_MAX]; // Runs of offset, count, bytes
+} bq27427_learning_record_t;
+
+/**
+ * @brief Record callback. Runs in the task that calls bq27427_learning_poll().
+ */
+typedef void (*bq27427_learning_cb_t)(const bq27427_learning_record_t *record, void *ctx);
+
+/**
+ * @brief Monitor configuration
+ */
+typedef struct {
+	bq27427_learning_cb_t cb;
+	void *ctx;
+	uint32_t verify_interval_ms; // Read the blocks at least this often, 0 for only on learning events
+	uint32_t probe_interval_ms;  // Probe the checksums at most this often while an update bit is set, 0 for every poll
+} bq27427_learning_config_t;
+
+/**
+ * @brief Copy of one watched block
+ */
+typedef struct {
+	uint8_t class_id;
+	uint8_t block;
+	uint8_t checksum;           // BlockDataCheckSum() of data
+	uint8_t data[BQ27427_DM_BLOCK_SIZE];
+} bq27427_learning_block_t;
+
+/**
+ * @brief Monitor state, owned by the caller
+ */
+typedef struct {
+	bq27427_t *dev;
+	bq27427_learning_config_t config;
+	bool baseline;              // blocks hold the gauge's contents
+	uint16_t status;            // CONTROL_STATUS of the last poll
+	int64_t verified_us;        // esp_timer time the blocks were last read
+	int64_t probed_us;          // esp_timer time the checksums were last compared
+	uint32_t polls;
+	uint32_t block_reads;       // Polls that read the blocks
+	uint32_t probes;            // Polls that read the checksums only
+	uint32_t qmax_updates;      // State updates seen
+	uint32_t res_updates;       // R_a RAM updates seen
+	bq27427_learning_block_t blocks[BQ27427_LEARNING_BLOCKS];
+} bq27427_learning_t;
+
+/**
+    Initialize a monitor. Nothing is read until the first poll.
+
+    @param mon caller-owned state
+    @param config monitor configuration, cb must be set
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_learning_init(bq27427_learning_t *mon, bq27427_t *dev, const bq27427_learning_config_t *config);
+
+/**
+    Check for learning events and report the blocks that changed. Call it
+    periodically from one task; between events it costs one Control() read,
+    plus a checksum probe once QMAX_UP or RES_UP is set.
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_learning_poll(bq27427_learning_t *mon);
+
+/**
+    Apply a record to a copy of its block
+
+    @param block BQ27427_DM_BLOCK_SIZE bytes of the record's class and block
+    @param record record from the callback
+    @return ESP_OK on success, ESP_ERR_INVALID_RESPONSE if the record is malformed
+*/
+esp_err_t bq27427_learning_apply(uint8_t *block, const bq27427_learning_record_t *record);
+
+/**
+    Learned Qmax from the monitor's copy of the State subclass
+
+    @param qmax receives Qmax Cell 0, 16384 being Design Capacity
+    @return ESP_OK on success, ESP_ERR_INVALID_STATE before the first poll
+*/
+esp_err_t bq27427_learning_get_qmax(const bq27427_learning_t *mon, uint16_t *qmax);
+
+/**
+    Resistance table from the monitor's copy of R_a RAM
+
+    @param ra receives BQ27427_DM_RA_COUNT values, R_a0 first
+    @return ESP_OK on success, ESP_ERR_INVALID_STATE before the first poll
+*/
+esp_err_t bq27427_learning_get_ra(const bq27427_learning_t *mon, uint16_t *ra);
+
+#ifdef __cplusplus
+}
+#endif
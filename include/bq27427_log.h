@@ -0,0 +1,198 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Compact telemetry log.
+ *
+ * Samples are appended to a ring of pages in storage the application
+ * provides: a raw flash partition or a preallocated file on SPIFFS or
+ * LittleFS. A page is one erase unit. It starts with a header followed by a
+ * keyframe holding every field in full, so each page decodes on its own
+ * and a reader can seek by page. Every further sample on the page is a delta
+ * record:
+ *
+ *   - the change in sampling interval, zig-zag varint, in ms
+ *   - a varint bit mask of the fields that changed
+ *   - the change of each of those fields, zig-zag varint
+ *
+ * Slowly changing battery data mostly costs one byte per part, about 4 to 8
+ * times less than whole 16-bit values and a timestamp; a slow discharge of
+ * every field sampled at 1 s comes out at 7 times (host/bq27427_test.c,
+ * which fails below 4). Records are staged in
+ * a buffer of CONFIG_BQ27427_LOG_BUFFER_SIZE bytes and written when it is
+ * full, when a page ends and on bq27427_log_flush(); staged records are lost
+ * on reset. A record cut short by a reset ends its page for readers, and
+ * bq27427_log_open() continues on the next page.
+ *
+ * Timestamps are stored in ms. All multi-byte header values are little
+ * endian, so logs decode on any host (see host/bq27427_logdump.c).
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <esp_err.h>
+#include "bq27427.h"
+#include "bq27427_sampler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_BQ27427_LOG_BUFFER_SIZE
+#define CONFIG_BQ27427_LOG_BUFFER_SIZE 128
+#endif
+
+#define BQ27427_LOG_MAGIC		0x4c373442 // "B47L"
+#define BQ27427_LOG_HEADER_SIZE	20
+#define BQ27427_LOG_RECORD_MAX	80 // Largest record: a keyframe of all fields
+#define BQ27427_LOG_MIN_PAGE	256
+
+/**
+ * @brief Storage of a log
+ *
+ * A raw partition maps directly onto esp_partition_read(),
+ * esp_partition_write() and esp_partition_erase_range(), with the partition
+ * as ctx and its erase size as page_size. Writes only ever follow an erase
+ * of the same page, in increasing offsets.
+ */
+typedef struct {
+	esp_err_t (*read)(void *ctx, uint32_t offset, void *data, size_t len);
+	esp_err_t (*write)(void *ctx, uint32_t offset, const void *data, size_t len);
+	esp_err_t (*erase)(void *ctx, uint32_t offset, size_t len);  // Fill with 0xFF
+	void *ctx;
+	uint32_t size;       // Bytes, a multiple of page_size, at least two pages
+	uint32_t page_size;  // Erase unit, at least BQ27427_LOG_MIN_PAGE
+} bq27427_log_storage_t;
+
+/**
+ * @brief Log writer, owned by the caller
+ */
+typedef struct {
+	bq27427_log_storage_t storage;
+	uint32_t fields;                // bq27427_field_t mask logged
+	uint32_t page;                  // Offset of the current page
+	uint32_t page_seq;              // Sequence number of the current page
+	uint32_t pos;                   // Offset of the first staged byte
+	bool has_prev;                  // Next record may be a delta
+	uint32_t prev_seq;
+	int64_t prev_ms;
+	int64_t prev_interval;
+	uint16_t prev[BQ27427_FIELD_COUNT];
+	uint32_t samples;               // Samples appended since bq27427_log_open()
+	uint32_t bytes;                 // Bytes written since bq27427_log_open()
+	uint16_t fill;
+	uint8_t buf[CONFIG_BQ27427_LOG_BUFFER_SIZE];
+} bq27427_log_t;
+
+/**
+ * @brief Log reader, owned by the caller
+ */
+typedef struct {
+	bq27427_log_storage_t storage;
+	uint32_t fields;
+	uint32_t page;                  // Offset of the current page
+	uint32_t page_seq;
+	uint32_t pos;                   // Offset of the next record
+	bool has_prev;
+	bool done;
+	uint32_t prev_seq;
+	int64_t prev_ms;
+	int64_t prev_interval;
+	uint16_t prev[BQ27427_FIELD_COUNT];
+	uint32_t cache_pos;             // Offset of cache[0]
+	uint8_t cache_len;
+	uint8_t cache[64];
+} bq27427_log_reader_t;
+
+/**
+    Describe a preallocated file as log storage. The file must be opened
+    for reading and writing in binary mode ("r+b", or "w+b" to start a new
+    one) and stay open while the log is in use.
+
+    @param storage receives the description
+    @param file open file
+    @param size bytes of the file to use; the file is extended if shorter
+    @param page_size bytes per page
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_log_storage_file(bq27427_log_storage_t *storage, FILE *file, uint32_t size, uint32_t page_size);
+
+/**
+    Open a log for writing. If the storage holds a log, appending continues
+    after its newest record; otherwise the first page is erased.
+
+    @param storage log storage, copied
+    @param fields bq27427_field_t mask to log; pages of an existing log
+    with other fields are overwritten in turn
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_log_open(bq27427_log_t *log, const bq27427_log_storage_t *storage, uint32_t fields);
+
+/**
+    Append a sample, e.g. one read from bq27427_sampler_read()
+
+    @param sample must contain every logged field
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_log_append(bq27427_log_t *log, const bq27427_sample_t *sample);
+
+/**
+    Write the staged records to storage
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_log_flush(bq27427_log_t *log);
+
+/**
+    Position a reader on the oldest sample of a log
+
+    @param storage log storage, copied
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND if the storage holds no log
+*/
+esp_err_t bq27427_log_reader_init(bq27427_log_reader_t *reader, const bq27427_log_storage_t *storage);
+
+/**
+    Position a reader set up with bq27427_log_reader_init() on the first
+    sample at or after a time. Pages are
+    searched from the newest, so after a restart of esp_timer the most
+    recent occurrence of the time is found.
+
+    @param timestamp_us esp_timer time
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND if no page starts at or
+    before timestamp_us
+*/
+esp_err_t bq27427_log_reader_seek(bq27427_log_reader_t *reader, int64_t timestamp_us);
+
+/**
+    Decode the next sample
+
+    @param sample receives the sample; timestamps have ms resolution
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND after the newest sample
+*/
+esp_err_t bq27427_log_reader_next(bq27427_log_reader_t *reader, bq27427_sample_t *sample);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,169 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Streaming statistics over gauge samples.
+ *
+ * A metrics set follows up to CONFIG_BQ27427_METRICS_MAX fields of
+ * bq27427_snapshot_t. Each metric keeps, over a sliding window of its last
+ * `window` samples, the minimum, maximum and mean, plus an exponentially
+ * weighted moving average with a time constant. Every update is O(1)
+ * amortized and uses only the memory in the caller-owned set: the mean is a
+ * rolling integer sum, minimum and maximum come from monotonic deques of
+ * window positions, and the moving average is fixed point.
+ *
+ * Feed a set from bq27427_read_snapshot() results with
+ * bq27427_metrics_update(), or attach it to the background sampler, which
+ * then updates it with every sample it reads. Updates need no bus access.
+ * There is a single writer; any task may read results concurrently with
+ * bq27427_metrics_get().
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_BQ27427_METRICS_MAX
+#define CONFIG_BQ27427_METRICS_MAX 4
+#endif
+
+#ifndef CONFIG_BQ27427_METRICS_WINDOW_MAX
+#define CONFIG_BQ27427_METRICS_WINDOW_MAX 32
+#endif
+
+#define BQ27427_METRICS_FRAC_BITS 8 // Fraction bits of mean and ewma
+
+// Round a fixed-point mean or ewma to the field's unit
+#define BQ27427_METRICS_ROUND(v) \
+	(((v) + ((v) < 0 ? -(1 << (BQ27427_METRICS_FRAC_BITS - 1)) : (1 << (BQ27427_METRICS_FRAC_BITS - 1)))) / \
+	 (1 << BQ27427_METRICS_FRAC_BITS))
+
+/**
+ * @brief What to track for one field
+ */
+typedef struct {
+	bq27427_field_t field;      // One field; BQ27427_FIELD_FLAGS is not a quantity
+	uint16_t window;            // Samples in the sliding window, 1 to CONFIG_BQ27427_METRICS_WINDOW_MAX
+	uint32_t ewma_tau_ms;       // Time constant of the moving average, 0 to follow the last sample
+} bq27427_metric_config_t;
+
+/**
+ * @brief Results of one metric, in the field's unit (StateOfHealth() in %)
+ */
+typedef struct {
+	bq27427_field_t field;
+	uint32_t samples;           // Samples seen since bq27427_metrics_init()
+	uint16_t count;             // Samples in the window
+	int64_t timestamp_us;       // Time of the newest sample
+	int32_t last;
+	int32_t min;                // Over the window
+	int32_t max;                // Over the window
+	int32_t mean;               // Over the window, BQ27427_METRICS_FRAC_BITS fraction bits
+	int32_t ewma;               // BQ27427_METRICS_FRAC_BITS fraction bits
+} bq27427_metric_value_t;
+
+/**
+ * @brief Monotonic deque of window positions, see bq27427_metrics.c
+ */
+typedef struct {
+	uint16_t head;
+	uint16_t len;
+	uint16_t pos[CONFIG_BQ27427_METRICS_WINDOW_MAX];
+} bq27427_metric_deque_t;
+
+/**
+ * @brief State of one metric, see bq27427_metrics.c
+ */
+typedef struct {
+	bq27427_metric_config_t config;
+	bool is_signed;
+	uint32_t samples;
+	int64_t timestamp_us;
+	int32_t sum;                // Of the values in the window
+	int32_t ewma;
+	uint16_t pos;               // Window position the next sample goes to
+	uint16_t count;
+	uint16_t values[CONFIG_BQ27427_METRICS_WINDOW_MAX];
+	bq27427_metric_deque_t min;
+	bq27427_metric_deque_t max;
+} bq27427_metric_t;
+
+/**
+ * @brief Metrics set, owned by the caller
+ */
+typedef struct {
+	uint32_t seq;               // Odd while an update is in progress
+	uint8_t count;
+	bq27427_metric_t metric[CONFIG_BQ27427_METRICS_MAX];
+} bq27427_metrics_t;
+
+/**
+ * @brief Field that bq27427_get_current() reads for a current_measure
+ */
+static inline bq27427_field_t bq27427_metrics_current_field(current_measure type)
+{
+	return type == STBY ? BQ27427_FIELD_STDBY_CURRENT : type == MAX ? BQ27427_FIELD_MAX_CURRENT : BQ27427_FIELD_AVG_CURRENT;
+}
+
+/**
+    Initialize a metrics set. Several metrics may follow the same field with
+    different windows.
+
+    @param metrics caller-owned set
+    @param config one entry per metric
+    @param count number of entries, up to CONFIG_BQ27427_METRICS_MAX
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_metrics_init(bq27427_metrics_t *metrics, const bq27427_metric_config_t *config, size_t count);
+
+/**
+    Add a sample. Metrics whose field is not valid in the snapshot are left
+    alone. Must not be called from more than one task at a time.
+
+    @param snapshot values, as returned by bq27427_read_snapshot()
+    @param timestamp_us esp_timer time of the read
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_metrics_update(bq27427_metrics_t *metrics, const bq27427_snapshot_t *snapshot, int64_t timestamp_us);
+
+/**
+    Return the results of one metric. Never blocks the writer and never
+    waits for it.
+
+    @param index metric, in the order passed to bq27427_metrics_init()
+    @param value receives the results
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND if the metric has no sample
+    yet, ESP_ERR_INVALID_STATE if an update was in progress on every
+    attempt; call again later
+*/
+esp_err_t bq27427_metrics_get(bq27427_metrics_t *metrics, size_t index, bq27427_metric_value_t *value);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,161 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Background sampler.
+ *
+ * A driver-owned task reads a fixed set of fields with
+ * bq27427_read_snapshot() at a fixed period and publishes timestamped
+ * samples into a ring buffer. Any number of readers consume the ring, each
+ * with its own cursor, without taking the I2C mutex or blocking the sampler:
+ * the ring has a single producer and every slot carries a sequence number
+ * that readers check before and after copying the sample. A reader that
+ * falls more than the ring size behind skips to the oldest sample still
+ * available and is told how many it missed.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "bq27427.h"
+#include "bq27427_metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_BQ27427_SAMPLER_RING_SIZE
+#define CONFIG_BQ27427_SAMPLER_RING_SIZE 16
+#endif
+
+/**
+ * @brief One sample
+ */
+typedef struct {
+	uint32_t seq;               // Sample number, counting from 0 at start
+	int64_t timestamp_us;       // esp_timer time of the read
+	bq27427_snapshot_t snap;
+} bq27427_sample_t;
+
+/**
+ * @brief Ring slot, see the sequence protocol in bq27427_sampler.c
+ */
+typedef struct {
+	uint32_t seq;
+	bq27427_sample_t sample;
+} bq27427_sampler_slot_t;
+
+/**
+ * @brief Sampler configuration
+ */
+typedef struct {
+	uint32_t fields;            // bq27427_field_t mask to read
+	uint32_t period_ms;
+	UBaseType_t task_priority;
+	uint32_t task_stack_size;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StackType_t *task_stack;    // task_stack_size bytes, valid until bq27427_sampler_stop()
+#endif
+	bq27427_metrics_t *metrics; // Updated with every sample if not NULL, see bq27427_metrics.h
+} bq27427_sampler_config_t;
+
+/**
+ * @brief Sampler state, owned by the caller
+ */
+typedef struct {
+	bq27427_t *dev;
+	bq27427_sampler_config_t config;
+	TaskHandle_t task;
+	SemaphoreHandle_t stopped;  // Given by the task when it exits
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StaticTask_t task_buf;
+	StaticSemaphore_t stopped_buf;
+#endif
+	volatile bool running;
+	uint32_t head;              // Number of published samples
+	uint32_t errors;            // Failed reads
+	bq27427_sampler_slot_t ring[CONFIG_BQ27427_SAMPLER_RING_SIZE];
+} bq27427_sampler_t;
+
+/**
+ * @brief Read cursor of one consumer
+ */
+typedef struct {
+	uint32_t next;              // Next sample number to return
+	uint32_t dropped;           // Samples overwritten before they were read
+} bq27427_sampler_reader_t;
+
+/**
+    Start the sampler task. The first sample is read immediately.
+
+    @param sampler caller-owned state, valid until bq27427_sampler_stop()
+    @param config sampler configuration
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_sampler_start(bq27427_sampler_t *sampler, bq27427_t *dev, const bq27427_sampler_config_t *config);
+
+/**
+    Stop the sampler task and wait for it to exit, which can take as long as
+    a configuration session that holds the gauge. Samples already in the
+    ring stay readable.
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_sampler_stop(bq27427_sampler_t *sampler);
+
+/**
+    Initialize a read cursor
+
+    @param reader cursor to initialize
+    @param from_oldest true to start at the oldest sample in the ring, false
+    to receive only samples published from now on
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_sampler_reader_init(bq27427_sampler_t *sampler, bq27427_sampler_reader_t *reader, bool from_oldest);
+
+/**
+    Return the next unread sample of a cursor. Never touches the bus and
+    never blocks: a sample whose slot the sampler is rewriting at the time
+    is skipped and counted in dropped.
+
+    @param reader the consumer's cursor
+    @param sample receives the sample
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no new sample
+*/
+esp_err_t bq27427_sampler_read(bq27427_sampler_t *sampler, bq27427_sampler_reader_t *reader, bq27427_sample_t *sample);
+
+/**
+    Return the newest complete sample without a cursor. Never blocks.
+
+    @param sample receives the sample
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND if nothing has been sampled yet
+*/
+esp_err_t bq27427_sampler_latest(bq27427_sampler_t *sampler, bq27427_sample_t *sample);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,157 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Adaptive polling scheduler.
+ *
+ * A task polls the gauge at one of three periods, picked again after every
+ * poll from what the gauge reports:
+ *
+ *   fast    CHG or DSG flipped, SOC is within soc_margin of the SOC1 or SOCF
+ *           set threshold, or AverageCurrent() moved by at least
+ *           current_step_ma since the previous poll. Held for fast_hold polls.
+ *   idle    CONTROL_STATUS reports SLEEP, or |AverageCurrent()| is below the
+ *           standby threshold.
+ *   normal  anything else.
+ *
+ * Every poll reads Flags(), StateOfCharge() and AverageCurrent() plus the
+ * caller's fields in one snapshot. CONTROL_STATUS is only read when
+ * |AverageCurrent()| is at or above the standby threshold but below the
+ * gauge's Sleep Current, the only band where SLEEP can add anything; an
+ * active poll stays at one burst.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Polling rates
+ */
+typedef enum {
+	BQ27427_RATE_IDLE,
+	BQ27427_RATE_NORMAL,
+	BQ27427_RATE_FAST,
+} bq27427_rate_t;
+
+/**
+ * @brief Why the rate was chosen
+ */
+typedef enum {
+	BQ27427_RATE_REASON_START,          // First poll
+	BQ27427_RATE_REASON_SLEEP,          // CONTROL_STATUS SLEEP set
+	BQ27427_RATE_REASON_STANDBY,        // |current| below the standby threshold
+	BQ27427_RATE_REASON_ACTIVE,         // No fast or idle condition
+	BQ27427_RATE_REASON_CHG_DSG,        // CHG or DSG flipped
+	BQ27427_RATE_REASON_SOC_THRESHOLD,  // SOC near SOC1 or SOCF
+	BQ27427_RATE_REASON_CURRENT_STEP,   // |current| changed quickly
+	BQ27427_RATE_REASON_HOLD,           // Fast rate held after a trigger
+} bq27427_rate_reason_t;
+
+/**
+ * @brief Called from the scheduler task when the rate changes
+ */
+typedef void (*bq27427_rate_cb_t)(bq27427_t *dev, bq27427_rate_t rate, uint32_t period_ms,
+                                  bq27427_rate_reason_t reason, void *ctx);
+
+/**
+ * @brief Called from the scheduler task after every poll
+ */
+typedef void (*bq27427_poll_cb_t)(bq27427_t *dev, const bq27427_snapshot_t *snapshot, void *ctx);
+
+/**
+ * @brief Scheduler configuration
+ */
+typedef struct {
+	uint32_t fields;             // Extra bq27427_field_t to read on every poll
+	uint32_t idle_ms;            // Period when idle
+	uint32_t normal_ms;          // Period when active
+	uint32_t fast_ms;            // Period around transitions
+	uint16_t standby_current_ma; // 0 to derive it from the gauge's Dsg Current Threshold and Design Capacity
+	uint16_t current_step_ma;    // Current change per poll that selects the fast rate
+	uint8_t soc_margin;          // Distance to SOC1/SOCF set thresholds, %
+	uint8_t fast_hold;           // Polls to stay fast after the last trigger
+	bq27427_rate_cb_t on_rate;   // May be NULL
+	bq27427_poll_cb_t on_poll;   // May be NULL
+	void *ctx;
+	UBaseType_t task_priority;
+	uint32_t task_stack_size;
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StackType_t *task_stack;     // task_stack_size bytes, valid until bq27427_scheduler_stop()
+#endif
+} bq27427_scheduler_config_t;
+
+/**
+ * @brief Scheduler state, owned by the caller
+ */
+typedef struct {
+	bq27427_t *dev;
+	bq27427_scheduler_config_t config;
+	TaskHandle_t task;
+	SemaphoreHandle_t stopped;  // Given by the task when it exits
+#ifdef CONFIG_BQ27427_STATIC_ALLOC
+	StaticTask_t task_buf;
+	StaticSemaphore_t stopped_buf;
+#endif
+	volatile bool running;
+	bq27427_rate_t rate;
+	uint8_t hold;               // Fast polls left
+	bool primed;                // prev_* are valid
+	uint16_t prev_flags;
+	int16_t prev_current;
+	uint8_t soc1_set;           // Thresholds read from the gauge at start
+	uint8_t socf_set;
+	uint16_t sleep_current;     // Sleep Current, mA; SLEEP is never set above it
+	uint32_t polls;
+	uint32_t errors;
+} bq27427_scheduler_t;
+
+/**
+    Read the thresholds from the gauge and start the scheduler task
+
+    @param sched caller-owned state, valid until bq27427_scheduler_stop()
+    @param config scheduler configuration
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_scheduler_start(bq27427_scheduler_t *sched, bq27427_t *dev, const bq27427_scheduler_config_t *config);
+
+/**
+    Stop the scheduler task and wait for it to exit, which can take as long
+    as a configuration session that holds the gauge
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_scheduler_stop(bq27427_scheduler_t *sched);
+
+#ifdef __cplusplus
+}
+#endif
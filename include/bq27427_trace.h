@@ -0,0 +1,165 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2025 Tomoyuki Sakurai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Bus traces.
+ *
+ * With CONFIG_BQ27427_TRACE enabled, a descriptor that has a trace attached
+ * with bq27427_set_trace() records every transfer it makes, including
+ * retries and probes, into the trace's RAM ring. When the ring is full the
+ * oldest records are overwritten. bq27427_trace_flush() moves the records to
+ * any byte sink, e.g. a file or a flash partition, as a stream:
+ *
+ *   header   magic "B47T", version, I2C address, SCL frequency, and the
+ *            esp_timer time the first record counts from (little endian)
+ *   records  flags (write, result), register, length, time since the
+ *            previous record and duration as varints in us, then the bytes
+ *            written or, for successful reads, the bytes read
+ *
+ * A Control() subcommand appears as a write of its code to register 0x00.
+ * Streams can be concatenated; bq27427_trace_parse() decodes them, and the
+ * host tool host/bq27427_replay.c replays them against the current driver.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+#include "bq27427.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_BQ27427_TRACE_SIZE
+#define CONFIG_BQ27427_TRACE_SIZE 4096
+#endif
+
+#define BQ27427_TRACE_MAGIC			0x54373442 // "B47T"
+#define BQ27427_TRACE_VERSION		1
+#define BQ27427_TRACE_HEADER_SIZE	20
+#define BQ27427_TRACE_PAYLOAD_MAX	64 // Longer payloads are cut
+#define BQ27427_TRACE_RECORD_MAX	(3 + 10 + 5 + BQ27427_TRACE_PAYLOAD_MAX)
+
+/**
+ * @brief Outcome of a traced transfer
+ */
+typedef enum {
+	BQ27427_TRACE_OK,
+	BQ27427_TRACE_NACK,     // ESP_FAIL
+	BQ27427_TRACE_TIMEOUT,  // ESP_ERR_TIMEOUT
+	BQ27427_TRACE_ERROR,    // Any other error
+} bq27427_trace_result_t;
+
+/**
+ * @brief Trace ring, owned by the caller
+ */
+struct bq27427_trace {
+	uint32_t head;          // Offset of the next record
+	uint32_t tail;          // Offset of the oldest record
+	uint32_t used;          // Bytes in the ring
+	uint32_t records;       // Records in the ring
+	uint32_t dropped;       // Records overwritten before they were flushed
+	int64_t base_us;        // Time the oldest record counts from
+	int64_t last_us;        // Time of the newest record
+	uint8_t addr;           // I2C address of the traced device
+	uint32_t clk_hz;        // SCL frequency of the traced device, 0 if unknown (ESP8266)
+	uint8_t buf[CONFIG_BQ27427_TRACE_SIZE];
+};
+
+/**
+ * @brief Decoder position in a trace stream
+ */
+typedef struct {
+	uint8_t addr;           // From the last stream header
+	uint32_t clk_hz;        // From the last stream header
+	int64_t time_us;        // Time of the last decoded record
+} bq27427_trace_stream_t;
+
+/**
+ * @brief One decoded transfer
+ */
+typedef struct {
+	int64_t timestamp_us;   // esp_timer time at the start of the transfer
+	uint32_t duration_us;
+	uint8_t reg;            // Register addressed
+	uint8_t len;            // Bytes written or read
+	bool write;
+	bq27427_trace_result_t result;
+	uint8_t payload_len;    // Bytes in data, at most BQ27427_TRACE_PAYLOAD_MAX
+	const uint8_t *data;    // Points into the stream
+} bq27427_trace_record_t;
+
+/**
+ * @brief Byte sink for bq27427_trace_flush()
+ */
+typedef esp_err_t (*bq27427_trace_write_t)(void *ctx, const void *data, size_t len);
+
+/**
+    Empty a trace ring
+
+    @return ESP_OK on success
+*/
+esp_err_t bq27427_trace_init(bq27427_trace_t *trace);
+
+/**
+    Record one transfer. Called by the driver with the device mutex held.
+
+    @param data bytes written, or bytes read
+    @param err result of the transfer
+    @param start_us esp_timer time at the start of the transfer
+*/
+void bq27427_trace_record(bq27427_trace_t *trace, uint8_t reg, const void *data, size_t len, bool write, esp_err_t err,
+                          int64_t start_us, uint32_t duration_us);
+
+/**
+    Move the records of a trace to a sink, oldest first, and remove them
+    from the ring. The device mutex is held only while a few records are
+    copied, never during a write to the sink.
+
+    @param dev descriptor the trace is attached to
+    @param write sink, called with chunks of the stream
+    @param ctx passed to write
+    @return ESP_OK on success; on a sink error the records of the failed
+    chunk are lost
+*/
+esp_err_t bq27427_trace_flush(bq27427_t *dev, bq27427_trace_t *trace, bq27427_trace_write_t write, void *ctx);
+
+/**
+    Decode the next record of a trace stream
+
+    @param data stream, possibly several concatenated flushes
+    @param len bytes in data
+    @param pos offset of the next record, 0 to start; advanced past it
+    @param stream decoder state, zero-initialize before the first call
+    @param record receives the record; data points into the stream
+    @return ESP_OK on success, ESP_ERR_NOT_FOUND at the end,
+    ESP_ERR_INVALID_RESPONSE if the stream is malformed
+*/
+esp_err_t bq27427_trace_parse(const uint8_t *data, size_t len, size_t *pos, bq27427_trace_stream_t *stream,
+                              bq27427_trace_record_t *record);
+
+#ifdef __cplusplus
+}
+#endif